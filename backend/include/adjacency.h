@@ -0,0 +1,44 @@
+/*
+ * adjacency.h (header file for the next hop adjacencies)
+ *
+ * An adjacency is a neighbor the router sends to: an (interface, next hop
+ * IP) pair with the Ethernet header of the frames going to it, built once
+ * the MAC address is known. The routes through a gateway point to its
+ * adjacency, so a forwarded packet needs one FIB lookup and a header copy.
+ * ARP updates the adjacencies in place. Adjacencies are never freed.
+ */
+
+#ifndef __ADJACENCY_H__
+#define __ADJACENCY_H__
+
+#include <pthread.h>
+#include "grouter.h"
+#include "message.h"
+
+#define ADJ_BUCKETS                     4096            // a power of 2
+#define MAX_ADJACENCIES                 65536
+#define ADJ_HEADER_LEN                  14              // dst MAC, src MAC and type
+
+
+typedef struct _adjacency_t
+{
+	struct _adjacency_t *next;              // hash chain
+	uchar ip_addr[4];                       // next hop, host byte order
+	int interface;
+	int valid;                              // the header holds a resolved MAC
+	unsigned int seq;                       // odd while the header is rewritten
+	int used;                               // a packet went out through it; cleared by ARP aging
+	uchar header[ADJ_HEADER_LEN];
+} adjacency_t;
+
+
+adjacency_t *findAdjacency(int interface, uchar *ip_addr);
+adjacency_t *getAdjacency(int interface, uchar *ip_addr);
+void updateAdjacencies(uchar *ip_addr, uchar *mac_addr);
+void invalidateAdjacencies(uchar *ip_addr);
+void invalidateInterfaceAdjacencies(int interface);
+int testAdjacenciesUsed(uchar *ip_addr);
+int copyAdjacencyHeader(adjacency_t *adj, pkt_data_t *data);
+void printAdjacencies(void);
+
+#endif
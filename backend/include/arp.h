@@ -21,9 +21,13 @@
 /*
  * Private definitions: only used within the ARP module
  */
-#define MAX_ARP 			20      // max. number of ARP entries
-#define MAX_ARP_BUFFERS 		50	// max number of entries in message buffer
-#define ARP_CACHE_SIZE                  31      // ARP cache size
+#define MAX_ARP 			65536   // max. number of ARP entries
+#define ARP_BUCKETS 			16384	// hash buckets of the ARP table, a power of 2
+#define ARP_MAX_PENDING 		8	// packets held per neighbor waiting for its MAC
+#define ARP_REACHABLE_SECS 		30	// an entry is trusted this long after a reply
+#define ARP_STALE_SECS 			60	// a stale entry unused this long is removed
+#define ARP_RETRANS_MSECS 		1000	// first request retransmission, doubled each time
+#define ARP_MAX_PROBES 			3	// requests sent before a neighbor is given up
 
 /*
  * ARP protocol definitions.. used for ARP processing.
@@ -33,24 +37,35 @@
 
 
 /*
- * TODO: Expand this entry?? Should we not include other parameters such
- * as
+ * Neighbor states (after RFC 4861): INCOMPLETE is waiting for the reply to
+ * a request, REACHABLE was confirmed lately, STALE is used but not
+ * confirmed and PROBE is being confirmed again. PERMANENT entries come
+ * from "arp add" and never age.
  */
+#define ARP_INCOMPLETE 			0
+#define ARP_REACHABLE 			1
+#define ARP_STALE 			2
+#define ARP_PROBE 			3
+#define ARP_PERMANENT 			4
+
+
 typedef struct _arp_entry_t
 {
-	bool is_empty;                          // entry used or not
+	struct _arp_entry_t *next;              // hash chain
 	uchar ip_addr[4];
 	uchar mac_addr[6];
+	int state;
+	int interface;                          // where the requests go out
+	int probes;                             // requests sent in this state
+	uint64_t expires;                       // monotonicNanos() time of the next state change
+	bool armed;                             // its timer is pending
+	bool dead;                              // deleted, freed by its timer
+	bool used;                              // a packet went to it since the last check
+	int npending;
+	gpacket_t *pending[ARP_MAX_PENDING];    // packets waiting for the MAC, oldest first
 } arp_entry_t;
 
 
-typedef struct _arp_buffer_entry_t
-{
-	bool is_empty;                          // entry used or not
-	gpacket_t *wait_msg;                    // message that is waiting for ARP resolution
-} arp_buffer_entry_t;
-
-
 /*
  * structure of an ARP request.. taken from net/if_arp.h and modified
  */
@@ -71,6 +86,7 @@ typedef struct _arp_packet_t
 int ARPResolve(gpacket_t *in_pkt);
 void ARPProcess(gpacket_t *pkt);
 
+void ARPInit();
 void ARPInitTable();
 void ARPReInitTable();
 
@@ -78,12 +94,7 @@ int ARPFindEntry(uchar *ip_addr, uchar *mac_addr);
 void ARPAddEntry(uchar *ip_addr, uchar *mac_addr);
 void ARPPrintTable(void);
 void ARPDeleteEntry(char *ip_addr);
-void ARPSendRequest(gpacket_t *pkt);
-
-// ARP Buffer functions..
-void ARPInitBuffer();
-void ARPAddBuffer(gpacket_t *in_pkt);
-int ARPGetBuffer(gpacket_t **out_pkt, uchar *nexthop);
-void ARPFlushBuffer(char *next_hop, char *mac_addr);
+void ARPDeleteInterfaceEntries(int interface);
+void ARPRefreshAdjacencies(uchar *ip_addr);
 
 #endif
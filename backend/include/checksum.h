@@ -0,0 +1,62 @@
+/*
+ * checksum.h (Internet checksum library)
+ *
+ * The one's complement sum of a buffer (RFC 1071) and incremental updates
+ * of a checksum after some of the data it covers changed (RFC 1624, eqn.
+ * 3). The sum does not depend on byte order, so sums and checksums are
+ * taken as they sit in the packet, without byte swapping: a value stored
+ * as is into a header is correct.
+ *
+ * checksum.c has several routines for the sum; the fastest one the CPU
+ * supports is picked at startup.
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stdint.h>
+
+// names of the routines for checksumSelect()
+#define CHECKSUM_SCALAR                 "scalar64"
+#define CHECKSUM_SSE2                   "sse2"
+#define CHECKSUM_AVX2                   "avx2"
+
+
+// checksum after a 16 bit word went from oldw to neww
+static inline uint16_t checksumAdjust16(uint16_t cksum, uint16_t oldw, uint16_t neww)
+{
+	uint32_t sum;
+
+	sum = (uint16_t)~cksum + (uint16_t)~oldw + (uint32_t)neww;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+
+// checksum after a 32 bit field (e.g. an IP address) went from oldv to newv
+static inline uint16_t checksumAdjust32(uint16_t cksum, uint32_t oldv, uint32_t newv)
+{
+	uint32_t sum;
+
+	sum = (uint16_t)~cksum + (uint16_t)~(oldv >> 16) + (uint16_t)~(oldv & 0xffff) +
+		(newv >> 16) + (newv & 0xffff);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+
+// one's complement sum of len bytes at buf (any alignment), not inverted
+uint16_t checksumSum(const void *buf, int len);
+// checksum to store in a header: the inverted sum
+uint16_t checksumCompute(const void *buf, int len);
+// copy len bytes from src to dst and return their sum, as checksumSum()
+uint16_t checksumCopy(void *dst, const void *src, int len);
+// TCP/UDP checksum: sum is that of the len byte segment, addresses as in the IP header
+uint16_t checksumPseudo(const uint8_t *src, const uint8_t *dst, int prot, int len, uint16_t sum);
+
+int checksumSelect(const char *name);
+const char *checksumImplementation(void);
+
+#endif
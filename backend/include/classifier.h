@@ -7,7 +7,9 @@
 #ifndef __CLASSIFIER_H__
 #define __CLASSIFIER_H__
 
+#include <stdint.h>
 #include <slack/list.h>
+#include <slack/map.h>
 #include "grouter.h"
 #include "classspec.h"
 #include "message.h"
@@ -28,10 +30,39 @@ typedef struct _classdef_t
 typedef struct _classlist_t
 {
 	List *deftab;
+	Map *defmap;                            // name -> classdef_t, for getClassDef()
 	int defcnt;
+	unsigned int gen;                       // bumped whenever a definition changes
 } classlist_t;
 
 
+/*
+ * A class definition compiled for matching on the packet path: no names,
+ * no pointers, addresses and masks in network byte order, ports in host
+ * byte order. A port range of 0 - 65535 matches any port.
+ */
+typedef struct _classrule_t
+{
+	uint32_t srcaddr, srcmask;
+	uint32_t dstaddr, dstmask;
+	int prot;                               // 0 matches any protocol
+	int tos;                                // 0 matches any TOS
+	int sportlo, sporthi;
+	int dportlo, dporthi;
+	int needports;                          // a port range is set: TCP/UDP only
+	int classid;                            // cdefid of the definition
+} classrule_t;
+
+
+// Header fields a packet is classified on, extracted once per packet
+typedef struct _classkey_t
+{
+	uint32_t src, dst;                      // as they appear in the IP header
+	int prot, tos;
+	int sport, dport;                       // 0 unless hasports
+	int hasports;                           // TCP/UDP header present (first fragment)
+} classkey_t;
+
 
 // Function prototypes
 
@@ -49,5 +80,19 @@ int insertProtSpec(classlist_t *clas, char *cname, int prot);
 int insertTOSSpec(classlist_t *clas, char *cname, int tos);
 
 int isRuleMatching(classdef_t *cdef, gpacket_t *in_pkt);
+void compileClassRule(classdef_t *cdef, classrule_t *rule);
+unsigned int getClassifierGen(classlist_t *clas);
+
+void getClassKey(gpacket_t *in_pkt, classkey_t *key);
+
+
+static inline int matchClassRule(const classrule_t *rule, const classkey_t *key)
+{
+	return ((key->src & rule->srcmask) == rule->srcaddr) && ((key->dst & rule->dstmask) == rule->dstaddr) &&
+		((rule->prot == 0) || (rule->prot == key->prot)) && ((rule->tos == 0) || (rule->tos == key->tos)) &&
+		(!rule->needports || key->hasports) &&
+		(key->sport >= rule->sportlo) && (key->sport <= rule->sporthi) &&
+		(key->dport >= rule->dportlo) && (key->dport <= rule->dporthi);
+}
 
 #endif
@@ -70,8 +70,12 @@ void haltCmd();
 void queueCmd();
 void qdiscCmd();
 void spolicyCmd();
+void pktpoolCmd();
 void classCmd();
 void filterCmd();
+void conntrackCmd();
+void natCmd();
+void traceCmd();
 void openflowCmd();
 void gncCmd();
 void gncTerminate();
@@ -0,0 +1,87 @@
+/*
+ * codel.h (include file for the CoDel and FQ-CoDel queueing disciplines)
+ *
+ */
+
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+#include <stdint.h>
+
+#include "message.h"
+#include "simplequeue.h"
+#include "packetcore.h"
+#include "qdisc.h"
+
+
+#define CODEL_TARGET_US             5000           // acceptable standing queue delay
+#define CODEL_INTERVAL_US           100000         // sliding window (about a worst case RTT)
+#define FQ_CODEL_FLOWS              1024
+#define FQ_CODEL_MAX_FLOWS          65536
+
+
+// CoDel control state (RFC 8289); one per queue, or one per flow for FQ-CoDel
+typedef struct _codel_t
+{
+	uint64_t target, interval;              // ns
+	int ecn;                                // mark ECN capable packets instead of dropping
+	int dropping;
+	uint64_t first_above_time;              // when the sojourn time stays above target
+	uint64_t drop_next;                     // time of the next drop while dropping
+	uint32_t count, lastcount;              // drops since entering the dropping state
+	unsigned long drops, marks;
+} codel_t;
+
+
+typedef struct _fqflow_t
+{
+	gpacket_t *head, *tail;                 // packets linked by frame.qnext
+	int qlen, backlog;                      // packets and bytes held
+	long deficit;
+	int onlist;                             // FQ_LIST_NONE, FQ_LIST_NEW or FQ_LIST_OLD
+	struct _fqflow_t *next;
+	codel_t cv;
+} fqflow_t;
+
+#define FQ_LIST_NONE                0
+#define FQ_LIST_NEW                 1
+#define FQ_LIST_OLD                 2
+
+
+typedef struct _fqlist_t
+{
+	fqflow_t *head, *tail;
+} fqlist_t;
+
+
+/*
+ * Dequeue side state of a core queue with the "codel" or "fq_codel"
+ * discipline. Only the scheduler thread touches it. For "codel" the packets
+ * stay in the simplequeue ring; for "fq_codel" the scheduler moves them
+ * from the ring into the flow sub-queues and serves those with DRR.
+ */
+typedef struct _codelqdisc_t
+{
+	int fq;
+	codel_t cv;                             // "codel": state of the queue
+	int headready;                          // "codel": ring head already passed CoDel
+	// "fq_codel" only
+	int nflows;
+	long quantum;
+	int limit, qlen;
+	fqflow_t *flows;
+	fqlist_t newflows, oldflows;
+	fqflow_t *curflow;                      // flow whose head goes next
+	unsigned long overlimit;
+} codelqdisc_t;
+
+
+// Function prototypes
+codelqdisc_t *createCoDelQdisc(qentrytype_t *qentry, int limit);
+void destroyCoDelQdisc(codelqdisc_t *cq);
+int codelQueueHead(pktcore_t *pcore, simplequeue_t *thisq, uint64_t now);
+int codelQueuePop(simplequeue_t *thisq, void **pkt, int *size);
+int codelBacklog(simplequeue_t *thisq);
+void printCoDelQdisc(codelqdisc_t *cq);
+
+#endif
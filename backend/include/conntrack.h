@@ -0,0 +1,82 @@
+/*
+ * conntrack.h (include file for the connection tracker)
+ *
+ * Tracks TCP, UDP and ICMP echo flows by their 5-tuple. The first packet
+ * of a flow goes through the filter and the classifier; later packets of
+ * the flow, in either direction, reuse the verdict and the queue tag
+ * cached in its entry. Replies of a tracked flow are let through even if
+ * the filter would drop them ("allow return traffic").
+ */
+
+#ifndef __CONNTRACK_H__
+#define __CONNTRACK_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "message.h"
+#include "simplequeue.h"
+#include "packetcore.h"
+#include "timerwheel.h"
+
+
+#define CT_DEFAULT_MAX              65536          // default limit on the number of entries
+#define CT_BUCKETS                  65536          // hash buckets, a power of 2
+#define CT_LOCKS                    1024           // bucket lock stripes, a power of 2
+#define CT_RECHECK_SECS             60             // longest a timer waits before rechecking its entry
+
+// TCP states; UDP and ICMP entries use CT_UNREPLIED and CT_REPLIED
+#define CT_TCP_SYN_SENT             0
+#define CT_TCP_SYN_RECV             1
+#define CT_TCP_ESTABLISHED          2
+#define CT_TCP_FIN_WAIT             3
+#define CT_TCP_TIME_WAIT            4
+#define CT_TCP_CLOSE                5
+#define CT_UNREPLIED                6
+#define CT_REPLIED                  7
+#define CT_NSTATES                  8
+
+#define CT_ORIGINAL                 0              // direction of the packet that created the entry
+#define CT_REPLY                    1
+
+
+typedef struct _ctentry_t
+{
+	struct _ctentry_t *next;                // hash chain
+	uint32_t src, dst;                      // original direction, network byte order
+	uint16_t sport, dport;                  // host byte order; the ICMP echo id in both
+	uint8_t prot;
+	uint8_t state;                          // CT_xx
+	uint8_t finseen;                        // bit per direction that sent a FIN
+	uint8_t dead;                           // unlinked, freed when its timer fires
+	uint64_t expires;                       // monotonicNanos() time
+	simplequeue_t *tag[2];                  // cached queue per direction, NULL if none yet
+	unsigned int taggen[2];                 // class index generation of the tag
+	unsigned long pkts[2], bytes[2];
+} ctentry_t;
+
+
+typedef struct _conntrack_t
+{
+	int enabled;
+	int maxentries;
+	int count;                              // linked entries
+	int dying;                              // unlinked entries waiting for their timer
+	ctentry_t *buckets[CT_BUCKETS];
+	pthread_mutex_t locks[CT_LOCKS];        // lock i guards the buckets b with b % CT_LOCKS == i
+	timerwheel_t *timers;                   // one pending timer per entry
+	// statistics
+	unsigned long inserts, expires, insertfails;
+	uint64_t lastshow;                      // for the rates shown by printConntrack()
+	unsigned long lastinserts, lastexpires;
+} conntrack_t;
+
+
+// Function prototypes
+conntrack_t *createConntrack(int maxentries);
+int trackPacket(conntrack_t *ct, pktcore_t *pcore, gpacket_t *in_pkt, simplequeue_t **thisq);
+void flushConntrack(conntrack_t *ct);
+void printConntrack(conntrack_t *ct);
+void printConntrackEntries(conntrack_t *ct, int max);
+
+#endif
@@ -10,28 +10,44 @@
 #define __FILTER_H__
 
 #include <slack/list.h>
+#include <pthread.h>
 #include "grouter.h"
 #include "classspec.h"
 #include "message.h"
 #include "classifier.h"
 
-#define MAX_FILTER_RULES                   64
+#define MAX_FILTER_RULES                   4096
 
 typedef struct _filterrule_t
 {
 	int type;                           // deny or allow
 	char cname[MAX_NAME_LEN];
-	int passes;
-	int failures;
+	int slot;                           // hit counter slot, fixed for the life of the rule
+	unsigned long hitbase;              // slot count when the rule was added
+	unsigned long passes;               // packets let through (allow), as of "filter stats"
+	unsigned long failures;             // packets dropped (deny), as of "filter stats"
 } filterrule_t;
 
 
+// Hit counters of one packet thread, written by that thread only
+typedef struct _filtercounters_t
+{
+	unsigned long hits[MAX_FILTER_RULES];   // by filterrule_t.slot
+	unsigned long nomatch;                  // packets no rule matched
+	struct _filtercounters_t *next;
+} filtercounters_t;
+
+
 typedef struct _filtertab_t
 {
 	filterrule_t *ruletab[MAX_FILTER_RULES];
 	int rulecnt;
 	int filteron;
 	classlist_t *clist;
+	pthread_mutex_t lock;               // rule table changes and compilation
+	unsigned int gen;                   // bumped when the rule table changes
+	char slotused[MAX_FILTER_RULES];
+	filtercounters_t *counters;         // one per packet thread
 } filtertab_t;
 
 
@@ -48,7 +64,9 @@ void moveRule(filtertab_t *ft, int rulenum, char *dir);
 void delFilterRule(filtertab_t *ft, int rulenum);
 int addFilterRule(filtertab_t *ft, int type, char *cname);
 
-int filteredPacket(filtertab_t *ft, gpacket_t *in_pkt);
+unsigned int getFilterGen(filtertab_t *ft);
+int compileFilterRules(filtertab_t *ft, classrule_t *rules, int *types, int *slots, unsigned int *fgen);
+void countFilterHit(filtertab_t *ft, int slot);
 
 void flushFilter(filtertab_t *ft);
 #endif
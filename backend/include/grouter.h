@@ -36,11 +36,12 @@
 #define MAX_QDISC_TYPES             16
 #define MAX_SPOLICIES               16
 #define MAX_TMPBUF_LEN              256
-#define MAX_FRAGMENTS               16
+#define MAX_FRAGMENTS               64          // a 9000 byte packet takes 17 for an MTU of 576
 
 #define BIG_PACKET_LEN              2500
 
 #define MAX_QUEUE_SIZE              256
+#define MAX_WORKERS                 16
 #define MAX_QUEUE_NUM				32
 
 #define MAX_PORT_TRIES              20
@@ -98,6 +99,9 @@ typedef struct _router_config
 	pthread_t openflow_controller_iface;
 	pthread_t openflow_flowtable_timeout;
 	int schedcycle;
+	int workers;
+	int pktbufs;
+	int hugepages;
 } router_config;
 
 
@@ -127,6 +131,8 @@ void redefineSignalHandler(int sigid, void (*my_func)());
 void wait4thread(pthread_t threadid);
 
 // function prototypes for code in console.c
+struct _gpacket_t;
 void consoleInit(char *rpath, char *rname);
+void consoleCapture(struct _gpacket_t *pkt);
 
 #endif
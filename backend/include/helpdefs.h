@@ -18,8 +18,12 @@
 #define USAGE_QUEUE   	    "queue action [action specific options]"
 #define USAGE_QDISC			"qdisc qname tspec"
 #define USAGE_SPOLICY		"spolicy action [action specific options]"
+#define USAGE_PKTPOOL		"pktpool [show]"
 #define USAGE_CLASS		    "class cname [-src ip_spec [<min_port--max_port>]] [-dst ip_spec [<min_port--max_port>]] [-prot num] [-tos tos_spec]"
 #define USAGE_FILTER     	"filter action [action specific options]"
+#define USAGE_CONNTRACK     "conntrack [show | list [count] | on | off | flush | max entries]"
+#define USAGE_NAT           "nat [show | mappings [count] | masq interface (on|off) | dnat (add|del) ... | flush]"
+#define USAGE_TRACE         "trace [show | ring (on|off) | dump [count] [file] | clear]"
 #define USAGE_OPENFLOW      "openflow action [action specific options]"
 #define USAGE_GNC           "gnc [-u] [-l <port>] <destination> <port>"
 
@@ -39,8 +43,12 @@
 #define SHELP_QUEUE			"create, add, del, and view queues with given names"
 #define SHELP_QDISC			"create a queuing discipline"
 #define SHELP_SPOLICY		"set the inter queue scheduler"
+#define SHELP_PKTPOOL		"show the packet buffer pool occupancy and allocation failures"
 #define SHELP_CLASS		    "create add, del, and view classifier information"
 #define SHELP_FILTER		"create add, del, and view filtering rules; this uses class rules to group packets"
+#define SHELP_CONNTRACK		"track connections so that their packets bypass the filter and the classifier"
+#define SHELP_NAT			"translate addresses and ports of packets leaving or entering an interface"
+#define SHELP_TRACE			"record packet path traces in per thread rings and dump them"
 #define SHELP_OPENFLOW      "view OpenFlow switch information or force the OpenFlow switch to reconnect to the controller"
 #define SHELP_GNC           "use gRouter netcat (gnc) to create udp and tcp connections"
 
@@ -78,8 +86,12 @@ absolute path (e.g., /sbin/ifconfig). \n"
 #define LHELP_QUEUE			"queue.hlp"
 #define LHELP_QDISC			"qdisc.hlp"
 #define LHELP_SPOLICY		"spolicy.hlp"
+#define LHELP_PKTPOOL		"pktpool.hlp"
 #define LHELP_CLASS			"class.hlp"
 #define LHELP_FILTER		"filter.hlp"
+#define LHELP_CONNTRACK		"conntrack.hlp"
+#define LHELP_NAT			"nat.hlp"
+#define LHELP_TRACE			"trace.hlp"
 #define LHELP_OPENFLOW      "openflow.hlp"
 #define LHELP_GNC           "gnc.hlp"
 
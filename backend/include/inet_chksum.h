@@ -35,6 +35,13 @@
 #include "opt.h"
 #include "pbuf.h"
 #include <netinet/in.h>
+#include "checksum.h"
+
+/* lwIP uses the checksum library of gRouter (checksum.c), which picks the
+   fastest routine the CPU supports */
+#define LWIP_CHKSUM                     checksumSum
+#define LWIP_CHKSUM_COPY(dst, src, len) checksumCopy(dst, src, len)
+
 typedef unsigned char uchar;
 typedef unsigned long   mem_ptr_t;
 
@@ -21,7 +21,7 @@
 
 #define IP_HLEN 20
 
-route_entry_t route_tbl[MAX_ROUTES];       	// routing table
+routetable_t *route_tbl;       	        // routing table
 mtu_entry_t MTU_tbl[MAX_MTU];		        // MTU table
 
 /** Gets an IP pcb option (SOF_* flags) */
@@ -115,14 +115,22 @@ typedef struct _ip_packet_t
 
 #define IPH_HL(hdr) ((hdr)->ip_hdr_len & 0x0f)
 
+// IP options (RFC 791)
+#define IP_OPT_EOL                      0       // end of option list
+#define IP_OPT_NOP                      1       // no operation
+#define IP_OPT_COPIED                   0x80    // option is copied into all fragments
+#define MAX_IPOPTLEN                    40
+
 // function prototypes...
 
 void IPInit();
 void IPIncomingPacket(gpacket_t *in_pkt);
 int IPCheckPacket4Me(gpacket_t *in_pkt);
+int IPCheckPacket4Bcast(gpacket_t *in_pkt);
 int IPProcessBcastPacket(gpacket_t *in_pkt);
 int IPProcessForwardingPacket(gpacket_t *in_pkt);
 int IPCheck4Errors(gpacket_t *in_pkt);
+void IPDecrementTTL(ip_packet_t *ip_pkt);
 int IPCheck4Fragmentation(gpacket_t *in_pkt);
 int IPCheck4Redirection(gpacket_t *in_pkt);
 int IPProcessMyPacket(gpacket_t *in_pkt);
@@ -130,10 +138,11 @@ int UDPProcess(gpacket_t *in_pkt);
 int TCPProcess(gpacket_t *in_pkt);
 int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int src_prot);
 int send2Output(gpacket_t *pkt);
-int IPVerifyPacket(ip_packet_t *ip_pkt);
+int IPVerifyPacket(ip_packet_t *ip_pkt, int len);
 int isInSameNetwork(uchar *ip_addr1, uchar *ip_addr2);
 
 int IPSend2Output(gpacket_t *pkt);
+int IPSend2OutputBurst(gpacket_t **pkts, int count);
 
 uchar ip_addr_isany(uchar *addr);
 uchar ip_addr_cmp(uchar *addr1, uchar *addr2);
@@ -0,0 +1,30 @@
+/*
+ * localaddr.h (header file for the local address table)
+ *
+ * The addresses the router receives packets on: the address of each
+ * interface that is up, the broadcast address of each directly connected
+ * network and the limited broadcast address. IP looks the destination of
+ * every incoming packet up here to decide whether it is for the router.
+ */
+
+#ifndef __LOCAL_ADDR_H__
+#define __LOCAL_ADDR_H__
+
+#include <stdint.h>
+#include "grouter.h"
+
+#define LOCAL_ADDR_SLOTS                4096            // a power of 2, kept at most half full
+#define MAX_LOCAL_ADDRS                 (LOCAL_ADDR_SLOTS / 2)
+
+// kinds of local addresses
+#define LOCAL_NONE                      0               // not a local address
+#define LOCAL_UNICAST                   1
+#define LOCAL_BCAST                     2
+
+
+int findLocalAddress(uchar *ip_addr, int *interface);
+int addLocalAddress(uchar *ip_addr, int interface, int kind);
+void deleteLocalAddress(uchar *ip_addr, int interface, int kind);
+void printLocalAddresses(void);
+
+#endif
@@ -17,7 +17,11 @@
 #define MAX_IPREVLENGTH_ICMP            50       // maximum previous header sent back
 
 
-#define MAX_MESSAGE_SIZE                sizeof(gpacket_t)
+#define MAX_JUMBO_MTU                   9000     // largest interface MTU (jumbo frames)
+#define PKT_HEADROOM                    64       // free bytes in front of a received frame
+#define PKT_FRAME_SIZE(mtu)             ((mtu) + 18)    // Ethernet header, payload and a VLAN tag
+
+#define MAX_MESSAGE_SIZE                (PKT_HEADROOM + sizeof(pkt_data_t))
 
 
 
@@ -32,7 +36,7 @@ typedef struct _pkt_data_t
 		uchar src[6];                // source host's MAC address (filled by gnet)
 		ushort prot;                // protocol field
 	} header;
-	uchar data[DEFAULT_MTU];             // payload (limited to maximum MTU)
+	uchar data[MAX_JUMBO_MTU];           // payload; the buffer holds as much as its size class
 	int8_t pad[4];					// VLAN padding
 } pkt_data_t;
 
@@ -49,7 +53,7 @@ typedef struct
 		uint16_t tci;
 		uint16_t prot;
 	} header;
-	uint8_t data[DEFAULT_MTU];
+	uint8_t data[MAX_JUMBO_MTU];
 } pkt_data_vlan_t;
 
 // frame wrapping every packet... GINI specific (GINI metadata)
@@ -63,17 +67,44 @@ typedef struct _pkt_frame_t
 	int arp_valid;
 	int arp_bcast;
 	int openflow;
+	uint64_t qtime;                  // time the packet entered its core queue (ns); used by CoDel
+	void *qnext;                     // link in an FQ-CoDel flow sub-queue
+	struct _adjacency_t *adj;        // adjacency of the next hop if IP found it; checked by gnet
 } pkt_frame_t;
 
 
+/*
+ * Packet descriptor. The frame starts at data, somewhere in buf after some
+ * headroom, so headers can be pushed and pulled in place; len is the
+ * number of valid bytes there. Only these bytes are copied. bufsize is the
+ * size of buf, which depends on the size class of the buffer (see pktpool.h).
+ *
+ * A clone (duplicatePacket) is a descriptor without a buffer (bufsize 0):
+ * it has a private frame but its data points into the buffer of owner.
+ * refcnt counts the references to a buffer, the packet itself included.
+ * Whoever changes the bytes at data calls makePacketWritable() first.
+ */
 typedef struct _gpacket_t
 {
 	pkt_frame_t frame;
-	pkt_data_t data;
+	pkt_data_t *data;
+	int len;
+	int bufsize;
+	int refcnt;
+	struct _gpacket_t *owner;               // packet whose buffer holds the data, NULL if it is ours
+	uchar buf[];
 } gpacket_t;
 
+#define PKT_HOLDER(pkt)                 (((pkt)->owner != NULL) ? (pkt)->owner : (pkt))
+
 
 gpacket_t *duplicatePacket(gpacket_t *inpkt);
+gpacket_t *duplicatePacketHead(gpacket_t *inpkt, int len);
+void copyPacket(gpacket_t *dst, gpacket_t *src);
+int packetLength(gpacket_t *pkt);
+int packetCapacity(gpacket_t *pkt);
+pkt_data_t *pushPacketHeader(gpacket_t *pkt, int len);
+pkt_data_t *pullPacketHeader(gpacket_t *pkt, int len);
 void printSepLine(char *start, char *end, int count, char sep);
 void printGPktFrame(gpacket_t *msg, char *routine);
 void printGPacket(gpacket_t *msg, int level, char *routine);
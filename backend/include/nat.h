@@ -0,0 +1,122 @@
+/*
+ * nat.h (include file for the network address and port translator)
+ *
+ * Packets leaving an interface with masquerading on get the interface
+ * address as source and a port (ICMP echo id) of the interface; the
+ * replies coming back on that interface are translated back. Static
+ * mappings (dnat) forward a port of the interface address to an inside
+ * host. A mapping is in two hash tables: one keyed by the inside endpoint
+ * for outgoing packets and one keyed by the outside endpoint for incoming
+ * packets.
+ */
+
+#ifndef __NAT_H__
+#define __NAT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "grouter.h"
+#include "message.h"
+#include "gnet.h"
+#include "timerwheel.h"
+
+
+#define NAT_BUCKETS                 (1 << 18)      // hash buckets of each table, a power of 2
+#define NAT_LOCKS                   1024           // bucket lock stripes, a power of 2
+#define NAT_PORT_MIN                1024           // ports given to dynamic mappings
+#define NAT_PORT_MAX                65535
+#define NAT_PORT_BATCH              64             // ports moved between a thread cache and its pool
+#define NAT_MAX_THREADS             (MAX_WORKERS + 4)
+#define NAT_SWEEP_SECS              5              // aging period
+
+// idle seconds before a dynamic mapping is removed
+#define NAT_TCP_TIMEOUT             7440           // RFC 5382
+#define NAT_TCP_CLOSING_TIMEOUT     240            // after a FIN or a RST
+#define NAT_UDP_TIMEOUT             300            // RFC 4787
+#define NAT_ICMP_TIMEOUT            60             // RFC 5508
+
+// protocols with a port pool
+#define NAT_TCP                     0
+#define NAT_UDP                     1
+#define NAT_ICMP                    2
+#define NAT_PROTS                   3
+
+// states of a port of the dynamic range
+#define NAT_PORT_FREE               0              // in the pool or a thread cache
+#define NAT_PORT_MAPPED             1              // held by a dynamic mapping
+#define NAT_PORT_CLAIMED            2              // taken by a static mapping while in the pool
+#define NAT_PORT_STATIC             3              // held by a static mapping, out of the pool
+
+
+typedef struct _natentry_t
+{
+	struct _natentry_t *innext;             // chain of the inside table
+	struct _natentry_t *outnext;            // chain of the outside table
+	struct _natentry_t *gcnext;             // list of the mappings being removed
+	uint32_t inaddr, outaddr;               // network byte order
+	uint16_t inport, outport;               // host byte order; the echo id for ICMP
+	uint8_t prot;                           // IP protocol number
+	uint8_t isstatic;                       // dnat mapping, never ages
+	uint8_t closing;                        // TCP FIN or RST seen
+	uint8_t dead;                           // being removed, lookups skip it
+	int iface;
+	uint32_t lastused;                      // natClock() seconds
+	unsigned long pkts[2];                  // outgoing and incoming packets
+} natentry_t;
+
+
+typedef struct _natportcache_t
+{
+	uint16_t ports[2 * NAT_PORT_BATCH];
+	int count;
+} natportcache_t;
+
+
+// Ports of one protocol on one interface
+typedef struct _natportpool_t
+{
+	pthread_mutex_t lock;
+	uint16_t free[NAT_PORT_MAX - NAT_PORT_MIN + 1];
+	int nfree;
+	uint8_t state[NAT_PORT_MAX + 1];        // NAT_PORT_xx, dynamic range only
+	natportcache_t caches[NAT_MAX_THREADS]; // each used by one thread only
+} natportpool_t;
+
+
+typedef struct _natiface_t
+{
+	int masq;                               // translate packets leaving the interface
+	uint32_t addr;                          // outside address, network byte order
+	natportpool_t pools[NAT_PROTS];
+	int nstatic;
+	unsigned long noport;                   // packets dropped for want of a port
+} natiface_t;
+
+
+typedef struct _nat_t
+{
+	natentry_t *inside[NAT_BUCKETS];
+	natentry_t *outside[NAT_BUCKETS];
+	pthread_mutex_t locks[NAT_LOCKS];       // lock i guards the buckets b of both tables with b % NAT_LOCKS == i
+	natiface_t *ifaces[MAX_INTERFACES];     // NULL until the interface is configured
+	int count;
+	timerwheel_t *ager;
+	int nthreads;                           // thread cache slots handed out
+	// statistics
+	unsigned long created, expired;
+} nat_t;
+
+
+// Function prototypes
+nat_t *createNAT(void);
+int setNATMasquerade(nat_t *nat, int iface, int on);
+int addNATStatic(nat_t *nat, int iface, int prot, uint16_t port, uchar *inaddr, uint16_t inport);
+int delNATStatic(nat_t *nat, int iface, int prot, uint16_t port);
+void flushNAT(nat_t *nat);
+int natIncoming(nat_t *nat, gpacket_t *in_pkt);
+int natOutgoing(nat_t *nat, gpacket_t *in_pkt);
+void printNAT(nat_t *nat);
+void printNATMappings(nat_t *nat, int max);
+
+#endif
@@ -17,7 +17,11 @@
 #include "message.h"
 #include "grouter.h"
 #include "simplequeue.h"
+#include "classifier.h"
+#include "tuplespace.h"
+#include "filter.h"
 #include "qdisc.h"
+#include "timerwheel.h"
 
 
 typedef struct _pktcorecnamecache_t
@@ -27,22 +31,86 @@ typedef struct _pktcorecnamecache_t
 } pktcorecnamecache_t;
 
 
+/*
+ * The filter rules and the class definitions of the existing queues,
+ * compiled into one tuple space so that a single lookup gives both the
+ * filter verdict and the queue tag. The first list holds the filter rules
+ * in table order (none while filtering is off), filter rule i having
+ * verdict ftype[i] and counter slot fslot[i]; the second list holds the
+ * queue classes in queue creation order, class i feeding queue q[i].
+ * Rebuilt once any of the recorded generations moves on.
+ */
+typedef struct _pktcoreclassindex_t
+{
+	unsigned int gen;                     // number of this index, from pktcore_t.classgen
+	unsigned int cgen, qgen, fgen;        // classifier, queue and filter generations
+	int filteron;
+	simplequeue_t *defaultq;              // queue of packets no class matches
+	tuplespace_t *ts;
+	int ftype[MAX_FILTER_RULES];
+	int fslot[MAX_FILTER_RULES];
+	simplequeue_t *q[MAX_QUEUE_SIZE];
+} pktcoreclassindex_t;
+
+
+// Scheduling policies selectable with "spolicy activate"
+#define SPOLICY_RR                  0
+#define SPOLICY_DRR                 1
+#define SPOLICY_WFQ                 2
+
+// DRR quantum (bytes per round) for a queue of weight 1.0
+#define DRR_QUANTUM                 1514
+
+
+// Queues known to the scheduler, indexed by simplequeue_t.qid. The array is
+// never modified in place: add/del build a new one and swap the pointer.
+typedef struct _pktcoreqarray_t
+{
+	int nslots;                           // highest used slot + 1
+	simplequeue_t *q[MAX_QUEUE_NUM];
+} pktcoreqarray_t;
+
+
+// One packet worker: owns a work queue and the counters shown by "get workers"
+typedef struct _pktcoreworker_t
+{
+	int id;
+	pthread_t threadid;
+	simplequeue_t *workQ;
+	struct _pktcore_t *pcore;
+	unsigned long pkts, bytes, bursts;
+	unsigned long ippkts, arppkts, otherpkts;
+} pktcoreworker_t;
+
+
 typedef struct _pktcore_t
 {
 	char name[MAX_NAME_LEN];
 	char spolicy[MAX_NAME_LEN];
+	int spolicyid;                        // SPOLICY_xx in use by the scheduler
 	pthread_cond_t schwaiting;
 	pthread_mutex_t qlock;                // lock for the main queue
 	pthread_mutex_t wqlock;               // lock for work queue
 	simplequeue_t *outputQ;
-	simplequeue_t *workQ;
+	simplequeue_t *workQ;                 // work queue of worker 0
 	simplequeue_t *openflowWorkQ;
+	int nworkers;
+	pktcoreworker_t workers[MAX_WORKERS];
 	Map *queues;
+	pktcoreqarray_t *qarray;              // current queue array
+	pktcoreqarray_t *qinuse;              // array the scheduler is walking (NULL when parked)
+	unsigned int activemap;               // bit qid is set when queue qid has packets
+	int schedparked;
+	timerwheel_t *delayline;              // holds packets of queues with delay_us > 0
 	int lastqid;
 	int packetcnt;
 	int maxqsize;
 	double vclock;
 	pktcorecnamecache_t *pcache;
+	unsigned int qgen;                    // bumped when a queue is added or deleted
+	pktcoreclassindex_t *classindex;      // current class index (NULL until first use)
+	pktcoreclassindex_t *classretired;    // previous index, freed by the next rebuild
+	unsigned int classgen;                // number of class indexes published
 	qdisctable_t *qdiscs;
 } pktcore_t;
 
@@ -57,21 +125,44 @@ void printQueueStats(pktcore_t *pcore);
 void printOneQueue(pktcore_t *pcore, char *qname);
 void modifyQueueWeight(pktcore_t *pcore, char *qname, double weight);
 void modifyQueueDiscipline(pktcore_t *pcore, char *qname, char *qdisc);
+void modifyQueueDelay(pktcore_t *pcore, char *qname, double delay_us);
+int setQueueRate(pktcore_t *pcore, char *qname, double rate_kbps, int burst, double ceil_kbps);
+int shapeQueue(pktcore_t *pcore, simplequeue_t *thisq, int len, uint64_t now);
+void releaseDelayedPackets(void *pc, twentry_t *list);
 int delPktCoreQueue(pktcore_t *pcore, char *qname);
 
 pthread_t PktCoreSchedulerInit(pktcore_t *pcore);
-int PktCoreWorkerInit(pktcore_t *pcore);
+pthread_t PktCoreWorkerInit(pktcore_t *pcore);
+int PktCoreSetWorkers(pktcore_t *pcore, int nworkers);
+void PktCoreWorkerHalt(pktcore_t *pcore);
+void printWorkerStats(pktcore_t *pcore);
+uint pktFlowHash(gpacket_t *pkt);
+void dispatchPackets(pktcore_t *pcore, void **pkts, int *sizes, int npkts);
 int PktCoreOpenflowWorkerInit(pktcore_t *pcore);
 void *openflowPacketProcessor(void *pc);
 void *packetProcessor(void *pc);
 
+int classifyPacket(pktcore_t *pcore, gpacket_t *in_pkt, simplequeue_t **thisq, int nofilter);
+unsigned int getClassIndexGen(pktcore_t *pcore);
 int enqueuePacket(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize, uint8_t openflow);
+void markQueueActive(pktcore_t *pcore, simplequeue_t *thisq);
+int clearQueueActive(pktcore_t *pcore, simplequeue_t *thisq, int qid);
+int waitForActiveQueues(pktcore_t *pcore);
+
+void *packetScheduler(void *pc);
+int setSchedulingPolicy(pktcore_t *pcore, char *pname);
+void printSchedulingPolicy(pktcore_t *pcore);
+int getPacketLength(pktcore_t *pcore, simplequeue_t *thisq, uint64_t now);
+int dequeueCorePacket(simplequeue_t *thisq, void **pkt, int *size);
+int isCoreQueueEmpty(simplequeue_t *thisq);
 
-// Function prototypes from roundrobin.c and wfq.c??
-void *weightedFairScheduler(void *pc);
-int weightedFairQueuer(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize, char *qkey);
-int roundRobinQueuer(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize, char *qkey);
-void *roundRobinScheduler(void *pc);
+// Function prototypes from roundrobin.c, drr.c and wfq.c
+pktcoreqarray_t *pinQueueArray(pktcore_t *pcore);
+int serviceQueue(pktcore_t *pcore, pktcoreqarray_t *qarray, int qid, int max);
+void roundRobinSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap);
+void deficitRoundRobinSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap);
+void weightedFairSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap);
+void resetSchedulerState(pktcore_t *pcore, pktcoreqarray_t *qarray);
 
 int redDiscard(simplequeue_t *thisq, gpacket_t *ipkt);
 #endif
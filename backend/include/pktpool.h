@@ -0,0 +1,90 @@
+/*
+ * pktpool.h (include file for the packet buffer pool)
+ *
+ */
+
+#ifndef __PKT_POOL_H__
+#define __PKT_POOL_H__
+
+#include <pthread.h>
+
+#include "message.h"
+
+
+// buffer size of a size class: descriptor, headroom and the largest frame of the class
+#define PKTPOOL_BUF_SIZE(mtu)       ((sizeof(gpacket_t) + PKT_HEADROOM + PKT_FRAME_SIZE(mtu) + 63) & ~63UL)
+#define PKTPOOL_CLONE_SIZE          ((sizeof(gpacket_t) + 63) & ~63UL)
+#define PKTPOOL_STD                 0              // standard (DEFAULT_MTU) buffers
+#define PKTPOOL_JUMBO               1              // jumbo (MAX_JUMBO_MTU) buffers
+#define PKTPOOL_CLONE               2              // descriptors of clones, no data
+#define PKTPOOL_NCLASSES            3
+#define PKTPOOL_BATCH               32             // buffers moved to/from the global pool at a time
+#define PKTPOOL_CACHE_SIZE          (2 * PKTPOOL_BATCH)
+#define PKTPOOL_SLAB_BUFS           2048           // buffers carved from one slab
+#define PKTPOOL_MAX_BUFS            65536          // default limit on the number of buffers
+#define PKTPOOL_JUMBO_SHARE         8              // jumbo limit is maxbufs / PKTPOOL_JUMBO_SHARE
+#define PKTPOOL_HUGE_PAGE           (2 * 1024 * 1024)
+
+
+// a free buffer; the first buffer of a batch also links the batches
+typedef struct _pktfree_t
+{
+	struct _pktfree_t *next;
+	struct _pktfree_t *nextbatch;
+	int count;                              // buffers in the batch
+} pktfree_t;
+
+
+// per thread buffer cache, one stack per size class, no locking
+typedef struct _pktcache_t
+{
+	void *bufs[PKTPOOL_NCLASSES][PKTPOOL_CACHE_SIZE];
+	int count[PKTPOOL_NCLASSES];
+	unsigned long allocs, frees;
+	pthread_t thread;
+	struct _pktcache_t *next;               // all caches, for the statistics
+} pktcache_t;
+
+
+typedef struct _pktslab_t
+{
+	void *base;
+	size_t len;
+	int huge;
+	struct _pktslab_t *next;
+} pktslab_t;
+
+
+typedef struct _pktclass_t
+{
+	char *name;
+	int mtu;                                // largest MTU served by the class
+	size_t bufsize;                         // PKTPOOL_BUF_SIZE(mtu), PKTPOOL_CLONE_SIZE for clones
+	pktfree_t *batches;
+	int nbatches, nfree;
+	int maxbufs, totalbufs;
+	int nslabs, hugeslabs;
+	unsigned long failures;
+} pktclass_t;
+
+
+typedef struct _pktpool_t
+{
+	pthread_mutex_t lock;                   // slow path only: batches, slabs and caches
+	pktclass_t classes[PKTPOOL_NCLASSES];
+	int hugepages;
+	pktslab_t *slabs;
+	pktcache_t *caches;
+	unsigned long clones, cowcopies;        // clones made, shared payloads copied on write
+} pktpool_t;
+
+
+// Function prototypes
+void initPacketPool(int maxbufs, int hugepages);
+gpacket_t *allocPacket(int mtu);
+gpacket_t *clonePacket(gpacket_t *pkt);
+pkt_data_t *makePacketWritable(gpacket_t *pkt);
+void freePacket(gpacket_t *pkt);
+void printPacketPoolStats(void);
+
+#endif
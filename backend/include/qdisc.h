@@ -16,6 +16,10 @@ typedef struct _qentrytype_t
 	char name[MAX_NAME_LEN];
 	double pmaxval;
 	double minval, maxval;
+	// CoDel and FQ-CoDel parameters
+	double target, interval;          // microseconds
+	int ecn;
+	int flows, quantum;
 
 } qentrytype_t;
 
@@ -34,5 +38,7 @@ int lookupQDisc(qdisctable_t *qdiscs, char *name);
 qentrytype_t *getqdiscEntry(qdisctable_t *qdiscs, char *name);
 void addSimplePolicy(qdisctable_t *qdiscs, char *name);
 void addRED(qdisctable_t *qdiscs, double minl, double maxl, double pmax);
+void addCoDel(qdisctable_t *qdiscs, double target, double interval, int ecn);
+void addFQCoDel(qdisctable_t *qdiscs, double target, double interval, int ecn, int flows, int quantum);
 
 #endif /* QDISC_H_ */
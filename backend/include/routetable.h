@@ -14,29 +14,141 @@
  * Private definitions: only used within the IP module
  */
 
+#include <stdint.h>
+#include <pthread.h>
 #include "grouter.h"
+#include "adjacency.h"
 
-#define MAX_ROUTES                      20	// maximum route table size
+#define MAX_ROUTES                      (1 << 22)	// maximum route table size
+
+/*
+ * The forwarding table (FIB) is a DIR-24-8 table: tbl24 has an entry for
+ * every /24, and a /24 covered by a prefix longer than 24 bits points to a
+ * group of 256 tbl8 entries instead. A lookup reads one or two entries.
+ * An entry holds the length of the prefix that set it, so routes can be
+ * added and deleted in place while workers keep looking up.
+ */
+#define FIB_TBL24_SIZE                  (1 << 24)
+#define FIB_TBL8_GROUPS                 (1 << 16)	// groups available to prefixes longer than /24
+#define FIB_MAX_NEXTHOPS                (1 << 16)
+#define FIB_RIB_BUCKETS                 (1 << 20)	// hash buckets of the route list, a power of 2
+#define FIB_GRACE_SECS                  2		// before a freed group or next hop is reused
+#define FIB_MAX_PATHS                   8		// equal-cost next hops of a route
+#define FIB_MAX_GROUPS                  (1 << 16)	// routes with more than one next hop
+#define FIB_PATH_BUCKETS                64		// flow hash buckets of a multipath group, a power of 2
+
+// FIB entry: ext | valid | prefix length (6 bits) | next hop or tbl8 group (24 bits)
+#define FIB_EXT                         0x80000000
+#define FIB_VALID                       0x40000000
+#define FIB_DEPTH(e)                    (((e) >> 24) & 0x3f)
+#define FIB_INDEX(e)                    ((e) & 0x00ffffff)
+#define FIB_ENTRY(nh, depth)            (FIB_VALID | ((uint32_t)(depth) << 24) | (uint32_t)(nh))
+#define FIB_GROUP                       0x00800000	// in the index: a multipath group, not a next hop
+
+/*
+ * A route with several equal-cost next hops points to a multipath group.
+ * The flow hash of a packet picks one of the group's buckets, and the
+ * bucket names the next hop. When a next hop goes away or comes back only
+ * the buckets it loses or gains change hands (resilient hashing), so the
+ * flows on the other next hops keep their path.
+ */
 
 
 /*
  * route table entry
  */
-typedef struct _route_entry_t 
+typedef struct _route_entry_t
 {
 	bool is_empty;			        // indicates whether entry is used or not
 	uchar network[4];			// Network IP address
 	uchar netmask[4];			// Netmask
-	uchar nexthop[4];			// Nexthop IP address
-	int  interface;			        // output interface
+	int preflen;				// netmask length
+	int npaths;				// equal-cost next hops
+	int nhindex;				// entry of the next hop table, if only one
+	int group;				// multipath group, if more
+	int next;				// hash chain (index + 1) or free list
 } route_entry_t;
 
+
+// next hop shared by the routes that use it
+typedef struct _fib_nexthop_t
+{
+	uchar nexthop[4];			// 0.0.0.0 for directly connected networks
+	int interface;
+	int refcnt;				// routes using it, 0 when free
+	adjacency_t *adj;			// of the gateway; NULL for connected networks or if none was left
+	bool down;				// its interface is down: multipath groups skip it
+	unsigned long pktbase, bytebase;	// counts left over by an earlier next hop in this slot
+} fib_nexthop_t;
+
+
+typedef struct _fib_group_t
+{
+	int buckets[FIB_PATH_BUCKETS];		// next hop of each flow hash bucket
+	int home[FIB_PATH_BUCKETS];		// where it goes back to when that next hop is up again
+	int members[FIB_MAX_PATHS];		// next hops, in the order they were added
+	int nmembers;
+	bool inuse;
+} fib_group_t;
+
+
+// packets and bytes sent to each next hop by one thread
+typedef struct _fib_counters_t
+{
+	unsigned long packets[FIB_MAX_NEXTHOPS];
+	unsigned long bytes[FIB_MAX_NEXTHOPS];
+	struct _fib_counters_t *next;
+} fib_counters_t;
+
+
+// slots freed at 'when', reused in the order they were freed
+typedef struct _fib_freelist_t
+{
+	int *slots;
+	uint32_t *when;
+	int head, count, size;
+} fib_freelist_t;
+
+
+typedef struct _routetable_t
+{
+	uint32_t *tbl24;
+	uint32_t *tbl8;				// FIB_TBL8_GROUPS groups of 256 entries
+	int tbl8used;				// groups handed out so far
+	int tbl8groups;				// groups in use
+	fib_freelist_t tbl8free;
+	fib_nexthop_t *nexthops;
+	int nhused, nhcount;
+	fib_freelist_t nhfree;
+	fib_group_t *groups;
+	int grpused, grpcount;
+	fib_freelist_t grpfree;
+	uint32_t seed;				// of the flow hash, so routers do not all pick alike
+	fib_counters_t *counters;		// one block per forwarding thread
+
+	// the routes as configured (RIB)
+	route_entry_t *routes;
+	int size, used, count;
+	int freeroute;				// free list of the routes array (index + 1)
+	int *buckets;				// route index + 1, keyed by network and length
+
+	pthread_mutex_t lock;			// serializes the writers; lookups take no lock
+} routetable_t;
+
+
 // prototypes of the functions provided for the route table handling..
 
-void RouteTableInit(route_entry_t route_tbl[]);
-void addRouteEntry(route_entry_t route_tbl[], uchar* nwork, uchar* nmask, uchar* nhop, int interface);
-void deleteRouteEntryByIndex(route_entry_t route_tbl[], int i);
+routetable_t *RouteTableInit(void);
+int addRouteEntry(routetable_t *rtbl, uchar* nwork, uchar* nmask, uchar* nhop, int interface);
+int deleteRouteEntry(routetable_t *rtbl, uchar* nwork, uchar* nmask, uchar *nhop, int interface);
+void deleteRouteEntryByIndex(routetable_t *rtbl, int i);
+void deleteRouteEntryByInterface(routetable_t *rtbl, int interface);
+void setRouteInterfaceState(routetable_t *rtbl, int interface, bool up);
+void printRouteTable(routetable_t *rtbl, int max);
+void printRouteNexthops(routetable_t *rtbl);
 
-int findRouteEntry(route_entry_t route_tbl[], uchar *ip_addr, uchar *nhop, int *ixface);
+int findRouteEntry(routetable_t *rtbl, uchar *ip_addr, uchar *nhop, int *ixface);
+int findRoutePacket(routetable_t *rtbl, gpacket_t *pkt);
+int findRouteNetwork(routetable_t *rtbl, uchar *ip_addr, uchar *network, uchar *netmask, bool *connected);
 
 #endif
@@ -14,6 +14,17 @@
 #include <slack/list.h>
 
 #include "grouter.h"
+#include "tokenbucket.h"
+
+
+// Largest ring we build for a queue. Queues created with a larger maxsize
+// (e.g., INFINITE_Q_SIZE) get a ring of SQ_RING_UNBOUNDED_SLOTS and spill
+// into the overflow list when the ring fills up.
+#define SQ_RING_MAX_SLOTS           65536
+#define SQ_RING_UNBOUNDED_SLOTS     4096
+#define SQ_CACHE_LINE               64
+// Maximum number of packets moved by one burst read/write in the pipeline
+#define QUEUE_BURST_SIZE            32
 
 
 typedef struct _simplewrapper_t
@@ -23,12 +34,40 @@ typedef struct _simplewrapper_t
 } simplewrapper_t;
 
 
+// One slot of the ring. The sequence number tells producers and consumers
+// whether the slot is free or holds a packet for the current lap.
+typedef struct _sqslot_t
+{
+	unsigned int seq;
+	int size;
+	void *data;
+} sqslot_t;
+
+
+// Event count used to park a reader (or writer) on a futex. Wakers only
+// make the system call when waiters is non zero.
+typedef struct _sqevent_t
+{
+	int seq;
+	int waiters;
+} sqevent_t;
+
 
 typedef struct _simplequeue_t
 {
 	char name[MAX_NAME_LEN];
+	// ring buffer: producers advance tail, consumers advance head
+	sqslot_t *ring;
+	unsigned int rmask;
+	char pad0[SQ_CACHE_LINE];
+	unsigned int tail;
+	char pad1[SQ_CACHE_LINE];
+	unsigned int head;
+	char pad2[SQ_CACHE_LINE];
+	sqevent_t notempty, notfull;
+	// overflow list for unbounded queues (NULL for bounded queues)
 	List *queue;
-	pthread_cond_t qfull, qempty;
+	int spilled;
 	pthread_mutex_t qlock;
 	int maxsize, cursize, bytesleft;
 	int blockonwrite;
@@ -39,9 +78,16 @@ typedef struct _simplequeue_t
 	// following parameters are useful for queueing discipline
 	char qdisc[MAX_NAME_LEN];
 	double delay_us;
+	struct _codelqdisc_t *codel;          // CoDel/FQ-CoDel state (NULL for other disciplines)
 	// following parameters are useful for scheduling algorithms
+	int qid;                              // slot in the packet core queue array
 	double weight;
 	double stime, ftime;
+	long deficit;                         // DRR byte deficit
+	// following parameters are useful for rate limiting
+	tokenbucket_t shaper;                 // -rate: dequeue waits for tokens
+	tokenbucket_t policer;                // -ceil: enqueue drops over the rate
+	int throttled;                        // shaper is waiting for tokens
 	// following parameters are useful for RED
 	double minval, maxval, pmaxval;
 	double avgqsize, idlestart;
@@ -59,6 +105,9 @@ void computeAvgByteRate(simplequeue_t *sq, int size);
 double getAvgByteRate(simplequeue_t *sq);
 
 int readQueue(simplequeue_t *msgqueue, void **data, int *size);
+int readQueueBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int max);
+int writeQueueBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int count);
 int peekQueue(simplequeue_t *msgqueue, void **data, int *size);
+int isQueueEmpty(simplequeue_t *msgqueue);
 
 #endif
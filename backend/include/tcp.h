@@ -100,7 +100,8 @@ typedef struct {
  *
  * @param ip_packet The IP packet containing the TCP packet.
  *
- * @return The TCP checksum for the specified TCP packet.
+ * @return The TCP checksum for the specified TCP packet, in network byte
+ *         order, ready to be stored in its header.
  */
 uint16_t tcp_checksum(ip_packet_t *ip_packet);
 
@@ -0,0 +1,72 @@
+/*
+ * timerwheel.h (include file for the hierarchical timer wheel)
+ *
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "grouter.h"
+
+
+#define TW_TICK_US                  100            // wheel granularity (microseconds)
+#define TW_LEVEL_BITS               6
+#define TW_LEVEL_SLOTS              (1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK               (TW_LEVEL_SLOTS - 1)
+#define TW_LEVELS                   4              // 64^4 ticks = ~28 minutes at 100us
+#define TW_MAX_TICKS                ((1UL << (TW_LEVEL_BITS * TW_LEVELS)) - 1)
+#define TW_POOL_CHUNK               1024           // entries allocated at a time
+
+
+typedef struct _twentry_t
+{
+	struct _twentry_t *next;
+	uint64_t expires;                      // tick at which the entry fires
+	void *data;
+	int size;
+	void *owner;
+} twentry_t;
+
+
+typedef struct _twslot_t
+{
+	twentry_t *head, *tail;
+} twslot_t;
+
+
+// called by the wheel thread with the entries that expired at one tick,
+// in insertion order. The wheel reclaims the entries after it returns.
+typedef void (*twexpire_t)(void *arg, twentry_t *list);
+
+
+typedef struct _timerwheel_t
+{
+	char name[MAX_NAME_LEN];
+	pthread_mutex_t twlock;
+	pthread_cond_t twcond;
+	twslot_t slots[TW_LEVELS][TW_LEVEL_SLOTS];
+	uint64_t occupied[TW_LEVELS];           // bit per non empty slot
+	uint64_t curtick;                       // last tick processed
+	uint64_t wakeat;                        // tick the thread sleeps until
+	struct timespec start;
+	int count;
+	twentry_t *freelist;
+	twexpire_t expirefn;
+	void *expirearg;
+	pthread_t threadid;
+	// statistics
+	unsigned long added, expired, cascaded, maxcount;
+} timerwheel_t;
+
+
+// Function prototypes
+timerwheel_t *createTimerWheel(char *name, twexpire_t expirefn, void *expirearg);
+int addTimerWheelEntry(timerwheel_t *twheel, uint64_t delay_us, void *data, int size, void *owner);
+void printTimerWheel(timerwheel_t *twheel);
+void *timerWheelHandler(void *arg);
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * tokenbucket.h (include file for the token bucket rate limiter)
+ *
+ */
+
+#ifndef __TOKEN_BUCKET_H__
+#define __TOKEN_BUCKET_H__
+
+#include <stdint.h>
+
+
+#define TB_MIN_BURST                PKT_FRAME_SIZE(MAX_JUMBO_MTU)  // the largest frame (bytes), see message.h
+#define TB_DEFAULT_BURST_NS         1000000ULL     // default burst: 1 ms worth of tokens
+
+
+typedef struct _tokenbucket_t
+{
+	double rate;                            // bytes per second (0 = disabled)
+	double depth;                           // bucket size in bytes
+	double tokens;
+	uint64_t last;                          // time of last refill (ns)
+	unsigned long conform, exceed;          // packets within/over the rate
+} tokenbucket_t;
+
+
+// Function prototypes
+uint64_t monotonicNanos(void);
+void initTokenBucket(tokenbucket_t *tb, double rate, double depth);
+int tokenBucketConsume(tokenbucket_t *tb, int len, uint64_t now);
+uint64_t tokenBucketDelay(tokenbucket_t *tb, int len, uint64_t now);
+
+#endif
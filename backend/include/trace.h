@@ -0,0 +1,88 @@
+/*
+ * trace.h (packet path tracing)
+ *
+ * TRACE() stands in for verbose() on the packet path. The level is tested
+ * before any argument is evaluated, against a copy of the verbosity level
+ * kept in an int, and a trace above TRACE_LEVEL_MAX is not compiled at all.
+ *
+ * A trace takes a format and up to TRACE_ARGS integer arguments. The
+ * format is kept by reference, so it must be a string literal; besides
+ * %d, %u and %x it has %I for an address in gRouter byte order (as taken
+ * by IP2Dot), %N for one in network byte order (as in a packet header),
+ * %M for a MAC address and %s for a string literal. TRACE_IP() and
+ * TRACE_MAC() pack the addresses into an argument.
+ * A message that needs more, such as a name it does not own, tests
+ * TRACE_ON() and calls verbose() itself.
+ *
+ * With the trace ring off a trace is printed like verbose(). With it on,
+ * it is only written in binary to a ring of the calling thread, without
+ * formatting or locks, and read back by "trace dump".
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef TRACE_LEVEL_MAX
+#define TRACE_LEVEL_MAX                 6       // build with e.g. -DTRACE_LEVEL_MAX=1 to drop the level 2 traces
+#endif
+
+#define TRACE_ARGS                      5
+#define TRACE_RING_RECORDS              8192    // per thread, a power of 2
+#define TRACE_MAX_THREADS               64
+
+
+typedef struct _trace_record_t
+{
+	uint64_t seq;                           // position in the ring's history plus 1, 0 while written
+	uint64_t nanos;
+	const char *fmt;
+	uint64_t args[TRACE_ARGS];
+} trace_record_t;
+
+
+extern int trace_level;
+extern int trace_ring;
+
+
+#define TRACE_ON(level)                 (((level) <= TRACE_LEVEL_MAX) && __builtin_expect((level) <= trace_level, 0))
+
+#define TRACE(level, ...) \
+	do { \
+		if (TRACE_ON(level)) \
+			traceEvent(level, TRACE_PAD(__VA_ARGS__, 0, 0, 0, 0, 0)); \
+	} while (0)
+
+#define TRACE_PAD(fmt, a, b, c, d, e, ...) \
+	fmt, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d), (uint64_t)(e)
+
+
+static inline uint64_t TRACE_IP(const void *ip_addr)
+{
+	uint32_t v;
+
+	memcpy(&v, ip_addr, 4);
+	return v;
+}
+
+
+static inline uint64_t TRACE_MAC(const void *mac_addr)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, mac_addr, 6);
+	return v;
+}
+
+
+void traceEvent(int level, const char *fmt, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e);
+void traceSetLevel(int level);
+void traceSetRing(int on);
+void traceClear(void);
+int traceDump(FILE *fp, int count);
+void printTraceStats(void);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * tuplespace.h (include file for the tuple space classifier)
+ *
+ * Compiled class rules are grouped into tuples: rules with the same source
+ * and destination prefix lengths and the same set of exactly matched fields
+ * (protocol, TOS, single source and destination ports) share a tuple. A
+ * lookup masks the packet key once per tuple and probes one hash table, so
+ * its cost follows the number of tuples instead of the number of rules.
+ * Port ranges that are not a single port are checked on the hashed
+ * candidates.
+ *
+ * The rules form TSS_LISTS independent ordered lists, so that one lookup
+ * can answer several first-match questions (e.g. the filter verdict and
+ * the queue tag) in a single pass over the tuples.
+ */
+
+#ifndef __TUPLE_SPACE_H__
+#define __TUPLE_SPACE_H__
+
+#include <stdint.h>
+
+#include "classifier.h"
+
+
+#define TSS_USE_PROT                0x01
+#define TSS_USE_TOS                 0x02
+#define TSS_USE_SPORT               0x04
+#define TSS_USE_DPORT               0x08
+
+// a tuple probe costs about as much as comparing this many rules; smaller
+// rule sets are scanned linearly
+#define TSS_LINEAR_FACTOR           8
+#define TSS_LISTS                   2
+
+
+typedef struct _tsstuple_t
+{
+	uint32_t srcmask, dstmask;
+	uint32_t protmask;                      // over (prot << 8) | tos
+	uint32_t portmask;                      // over (sport << 16) | dport
+	int fields;                             // TSS_USE_xx
+	int bestrule[TSS_LISTS];                // smallest rule index of each list, nrules if none
+	int nrules;
+} tsstuple_t;
+
+
+// hash chain link of a rule; the full hash spares most rule compares
+typedef struct _tsslink_t
+{
+	uint32_t hash;
+	int next;                               // next rule in the chain, -1 ends it
+} tsslink_t;
+
+
+/*
+ * Rule i is the i-th rule given to createTupleSpace(). Rules below nfirst
+ * form the first list, the others the second; within a list the matching
+ * rule with the smallest index wins.
+ */
+typedef struct _tuplespace_t
+{
+	int nrules, nfirst;
+	int linear;                             // few rules per tuple: scan the rules
+	classrule_t *rules;
+	int *ruletuple;                         // tuple of each rule
+	tsslink_t *links;                       // hash chain link of each rule
+	int ntuples;
+	tsstuple_t *tuples;
+	int *buckets;                           // first rule of each chain, -1 if empty
+	uint32_t hashmask;
+} tuplespace_t;
+
+
+// Function prototypes
+tuplespace_t *createTupleSpace(classrule_t *rules, int nrules, int nfirst);
+void destroyTupleSpace(tuplespace_t *ts);
+void lookupTupleSpace(tuplespace_t *ts, const classkey_t *key, int match[TSS_LISTS]);
+
+#endif
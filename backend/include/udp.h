@@ -86,7 +86,8 @@ typedef struct {
  *
  * @param ip_packet The IP packet containing the UDP packet.
  *
- * @return The UDP checksum for the specified UDP packet.
+ * @return The UDP checksum for the specified UDP packet, in network byte
+ *         order, ready to be stored in its header.
  */
 uint16_t udp_checksum(ip_packet_t *ip_packet);
 
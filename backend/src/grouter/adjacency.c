@@ -0,0 +1,213 @@
+/*
+ * adjacency.c (next hop adjacencies)
+ *
+ * The adjacencies are in a hash table on the next hop IP address, so ARP
+ * can update all the adjacencies of an address with one chain walk. Lookups
+ * take no lock: entries are only added, at the head of a chain, and never
+ * freed. The prebuilt header is rewritten under a sequence count, which
+ * readers check to make sure they did not copy half of an update.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <slack/err.h>
+
+#include "protocols.h"
+#include "gnet.h"
+#include "arp.h"
+#include "adjacency.h"
+#include "trace.h"
+
+
+static adjacency_t *adjtable[ADJ_BUCKETS];
+static int adjcount;
+static pthread_mutex_t adjlock = PTHREAD_MUTEX_INITIALIZER;      // serializes the writers
+
+
+static inline uint32_t adjHash(uchar *ip_addr)
+{
+	uint32_t h;
+
+	memcpy(&h, ip_addr, 4);
+	h *= 0x9e3779b1u;
+	return (h ^ (h >> 16)) & (ADJ_BUCKETS - 1);
+}
+
+
+adjacency_t *findAdjacency(int interface, uchar *ip_addr)
+{
+	adjacency_t *adj;
+
+	for (adj = __atomic_load_n(&(adjtable[adjHash(ip_addr)]), __ATOMIC_ACQUIRE); adj != NULL; adj = adj->next)
+		if ((adj->interface == interface) && (COMPARE_IP(adj->ip_addr, ip_addr) == 0))
+			return adj;
+	return NULL;
+}
+
+
+/*
+ * Build the header of adj for the MAC address mac_addr, or mark it
+ * unresolved if mac_addr is NULL or its interface is gone. Called with
+ * adjlock held.
+ */
+static void setAdjacencyHeader(adjacency_t *adj, uchar *mac_addr)
+{
+	interface_t *iface = findInterface(adj->interface);
+	uint16_t prot = htons(IP_PROTOCOL);
+	unsigned int seq = adj->seq;
+
+	__atomic_store_n(&(adj->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if ((mac_addr != NULL) && (iface != NULL))
+	{
+		COPY_MAC(adj->header, mac_addr);
+		COPY_MAC(adj->header + 6, iface->mac_addr);
+		memcpy(adj->header + 12, &prot, 2);
+		adj->valid = TRUE;
+	} else
+		adj->valid = FALSE;
+	__atomic_store_n(&(adj->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Find the adjacency of (interface, ip_addr) or create it, resolved if the
+ * ARP table knows the address. Returns NULL when the table is full. The
+ * ARP table lock comes before adjlock, so the new adjacency asks ARP for
+ * its MAC address once it is in the table and adjlock is released.
+ */
+adjacency_t *getAdjacency(int interface, uchar *ip_addr)
+{
+	adjacency_t *adj;
+	uint32_t b;
+
+	if ((adj = findAdjacency(interface, ip_addr)) != NULL)
+		return adj;
+
+	pthread_mutex_lock(&adjlock);
+	if (((adj = findAdjacency(interface, ip_addr)) == NULL) && (adjcount < MAX_ADJACENCIES) &&
+	    ((adj = (adjacency_t *)calloc(1, sizeof(adjacency_t))) != NULL))
+	{
+		COPY_IP(adj->ip_addr, ip_addr);
+		adj->interface = interface;
+		b = adjHash(ip_addr);
+		adj->next = adjtable[b];
+		__atomic_store_n(&(adjtable[b]), adj, __ATOMIC_RELEASE);
+		adjcount++;
+	}
+	pthread_mutex_unlock(&adjlock);
+
+	if (adj == NULL)
+		TRACE(2, "[getAdjacency]:: no adjacency for interface %d ", interface);
+	else if (!adj->valid)
+		ARPRefreshAdjacencies(ip_addr);
+	return adj;
+}
+
+
+// ip_addr is now at mac_addr (NULL: unknown) on whatever interface it is adjacent
+static void setAdjacencies(uchar *ip_addr, uchar *mac_addr)
+{
+	adjacency_t *adj;
+
+	pthread_mutex_lock(&adjlock);
+	for (adj = adjtable[adjHash(ip_addr)]; adj != NULL; adj = adj->next)
+		if (COMPARE_IP(adj->ip_addr, ip_addr) == 0)
+			setAdjacencyHeader(adj, mac_addr);
+	pthread_mutex_unlock(&adjlock);
+}
+
+
+void updateAdjacencies(uchar *ip_addr, uchar *mac_addr)
+{
+	setAdjacencies(ip_addr, mac_addr);
+}
+
+
+void invalidateAdjacencies(uchar *ip_addr)
+{
+	setAdjacencies(ip_addr, NULL);
+}
+
+
+/*
+ * Were packets sent through an adjacency of ip_addr since the last call?
+ * ARP asks before it lets a stale entry go.
+ */
+int testAdjacenciesUsed(uchar *ip_addr)
+{
+	adjacency_t *adj;
+	int used = 0;
+
+	for (adj = __atomic_load_n(&(adjtable[adjHash(ip_addr)]), __ATOMIC_ACQUIRE); adj != NULL; adj = adj->next)
+		if ((COMPARE_IP(adj->ip_addr, ip_addr) == 0) && __atomic_load_n(&(adj->used), __ATOMIC_RELAXED))
+		{
+			__atomic_store_n(&(adj->used), 0, __ATOMIC_RELAXED);
+			used = 1;
+		}
+	return used;
+}
+
+
+void invalidateInterfaceAdjacencies(int interface)
+{
+	adjacency_t *adj;
+	int i;
+
+	pthread_mutex_lock(&adjlock);
+	for (i = 0; i < ADJ_BUCKETS; i++)
+		for (adj = adjtable[i]; adj != NULL; adj = adj->next)
+			if (adj->interface == interface)
+				setAdjacencyHeader(adj, NULL);
+	pthread_mutex_unlock(&adjlock);
+}
+
+
+/*
+ * Put the Ethernet header of adj on the frame. Returns EXIT_FAILURE if the
+ * adjacency is not resolved.
+ */
+int copyAdjacencyHeader(adjacency_t *adj, pkt_data_t *data)
+{
+	unsigned int seq;
+
+	do
+	{
+		seq = __atomic_load_n(&(adj->seq), __ATOMIC_ACQUIRE);
+		if (!adj->valid)
+			return EXIT_FAILURE;
+		memcpy(&(data->header), adj->header, ADJ_HEADER_LEN);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (__atomic_load_n(&(adj->seq), __ATOMIC_RELAXED) != seq));
+	// written only when it changes, so the line is not dirtied per packet
+	if (!__atomic_load_n(&(adj->used), __ATOMIC_RELAXED))
+		__atomic_store_n(&(adj->used), 1, __ATOMIC_RELAXED);
+	return EXIT_SUCCESS;
+}
+
+
+void printAdjacencies(void)
+{
+	adjacency_t *adj;
+	interface_t *iface;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	int i;
+
+	printf("-----------------------------------------------------------\n");
+	printf("      A D J A C E N C I E S  (%d)\n", adjcount);
+	printf("-----------------------------------------------------------\n");
+	printf("Interface\tNext hop\tMAC address \n");
+
+	pthread_mutex_lock(&adjlock);
+	for (i = 0; i < ADJ_BUCKETS; i++)
+		for (adj = adjtable[i]; adj != NULL; adj = adj->next)
+		{
+			iface = findInterface(adj->interface);
+			printf("%s\t\t%s\t%s\n", (iface != NULL) ? iface->device_name : "?", IP2Dot(tmpbuf, adj->ip_addr),
+			       adj->valid ? MAC2Colon((tmpbuf+20), adj->header) : "(unresolved)");
+		}
+	pthread_mutex_unlock(&adjlock);
+	printf("-----------------------------------------------------------\n");
+}
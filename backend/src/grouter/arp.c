@@ -5,6 +5,12 @@
  *         Revised by Muthucumaru Maheswaran
  * DATE:   Last revision on June 22, 2008
  *
+ * The ARP table is a hash table of neighbors that age through the states
+ * in arp.h. Each entry has at most one pending timer in the ARP timer
+ * wheel, which retransmits requests, ages the entry and finally frees it;
+ * the other paths only move its expiry time or mark it dead. Packets to a
+ * neighbor being resolved wait in a short queue of the entry, and only
+ * the first of them sends a request.
  */
 
 #include <slack/std.h>
@@ -18,27 +24,36 @@
 #include "moduledefs.h"
 #include "grouter.h"
 #include "packetcore.h"
+#include "pktpool.h"
+#include "adjacency.h"
+#include "timerwheel.h"
+#include "tokenbucket.h"
+#include "trace.h"
 
 
-int tbl_replace_indx;            // overwrite this element if no free space in ARP table
-int buf_replace_indx;            // overwrite this element if no free space in ARP buffer
-arp_entry_t ARPtable[MAX_ARP];		                // ARP table
-arp_buffer_entry_t ARPbuffer[MAX_ARP_BUFFERS];   	// ARP buffer for unresolved packets
+#define ARP_SEC                         1000000000ULL
+#define ARP_MSEC                        1000000ULL
+
+static arp_entry_t *ARPtable[ARP_BUCKETS];		// ARP table
+static int ARPcount;
+static pthread_mutex_t ARPlock = PTHREAD_MUTEX_INITIALIZER;	// taken before the adjacency lock
+static timerwheel_t *ARPtimers;
+
+static char *ARPstatenames[] = {"INCOMPLETE", "REACHABLE", "STALE", "PROBE", "PERMANENT"};
 
 
 extern pktcore_t *pcore;
 
+static void expireARP(void *arg, twentry_t *list);
+
 
 void ARPInit()
 {
-  gpacket_t in_pkt;
-  char tmpbuf[MAX_NAME_LEN];
-
-  verbose(2, "[initARP]:: Initializing the ARP table and buffer ");
+  verbose(2, "[initARP]:: Initializing the ARP table ");
 
   ARPInitTable();                    // initialize APR table
-  ARPInitBuffer();                   // initialize ARP buffer
-
+  if ((ARPtimers = createTimerWheel("arp", expireARP, NULL)) == NULL)
+    fatal("[initARP]:: Could not create the ARP timer wheel ");
 }
 
 
@@ -52,51 +67,367 @@ void ARPInit()
 
 int ARPSend2Output(gpacket_t *pkt)
 {
-  int vlevel;
-
   if (pkt == NULL)
   {
     verbose(1, "[ARPSend2Output]:: NULL pointer error... nothing sent");
     return EXIT_FAILURE;
   }
 
-  vlevel = prog_verbosity_level();
-  if (vlevel >= 3)
-    printGPacket(pkt, vlevel, "ARP_ROUTINE");
+  if (TRACE_ON(3))
+    printGPacket(pkt, trace_level, "ARP_ROUTINE");
 
   return writeQueue(pcore->outputQ, (void *)pkt, sizeof(gpacket_t));
 }
 
 
+/*-------------------------------------------------------------------------
+ *                   A R P  E N T R Y  F U N C T I O N S
+ *-------------------------------------------------------------------------*/
+
+/*
+ * These are called with ARPlock held, except learnARPEntry and expireARP,
+ * which take it.
+ */
+
+static inline uint32_t ARPHash(uchar *ip_addr)
+{
+  uint32_t h;
+
+  memcpy(&h, ip_addr, 4);
+  h *= 0x9e3779b1u;
+  return (h ^ (h >> 16)) & (ARP_BUCKETS - 1);
+}
+
+
+static arp_entry_t *findARPEntry(uchar *ip_addr)
+{
+  arp_entry_t *e;
+
+  for (e = ARPtable[ARPHash(ip_addr)]; e != NULL; e = e->next)
+    if (COMPARE_IP(e->ip_addr, ip_addr) == 0)
+      return e;
+  return NULL;
+}
+
+
+// a new entry in the given state, or NULL if the table is full
+static arp_entry_t *newARPEntry(uchar *ip_addr, int interface, int state)
+{
+  arp_entry_t *e;
+  uint32_t b;
+
+  if ((ARPcount >= MAX_ARP) || ((e = (arp_entry_t *)calloc(1, sizeof(arp_entry_t))) == NULL))
+    return NULL;
+  COPY_IP(e->ip_addr, ip_addr);
+  e->interface = interface;
+  e->state = state;
+  b = ARPHash(ip_addr);
+  e->next = ARPtable[b];
+  ARPtable[b] = e;
+  ARPcount++;
+  return e;
+}
+
+
+/*
+ * Move the next state change of e to delay ns from now, arming its timer
+ * if it has none. A timer that is already pending re-arms itself when it
+ * fires early.
+ */
+static void armARPEntry(arp_entry_t *e, uint64_t now, uint64_t delay)
+{
+  e->expires = now + delay;
+  if (!e->armed && (addTimerWheelEntry(ARPtimers, delay / 1000, e, 0, NULL) == EXIT_SUCCESS))
+    e->armed = TRUE;
+}
+
+
+/*
+ * send an ARP request for the neighbor of e: broadcast, or to its
+ * known MAC address when a stale entry is being confirmed
+ */
+static void ARPSendRequest(arp_entry_t *e, bool unicast)
+{
+  gpacket_t *pkt;
+  arp_packet_t *apkt;
+  uchar bcast_addr[6];
+  char tmpbuf[MAX_TMPBUF_LEN];
+
+  if ((pkt = allocPacket(DEFAULT_MTU)) == NULL)
+  {
+    verbose(2, "[sendARPRequest]:: no packet buffer for the request");
+    return;
+  }
+  apkt = (arp_packet_t *) pkt->data->data;
+  memset(bcast_addr, 0xFF, 6);
+
+  /*
+   * Create ARP REQUEST packet
+   * ether header will be set in GNET_ADAPTER
+   * arp header
+   */
+  apkt->hw_addr_type = htons(ETHERNET_PROTOCOL);      // set hw type
+  apkt->arp_prot = htons(IP_PROTOCOL);                // set prtotocol address format
+
+  apkt->hw_addr_len = 6;                              // address length
+  apkt->arp_prot_len = 4;                             // protocol address length
+  apkt->arp_opcode = htons(ARP_REQUEST);              // set ARP request opcode
+
+  // source hw addr will be set in GNET_ADAPTER
+  // source ip addr will be set in GNET_ADAPTER
+  COPY_MAC(apkt->dst_hw_addr, bcast_addr);            // target hw addr
+
+  COPY_IP(apkt->dst_ip_addr, gHtonl((uchar *)tmpbuf, e->ip_addr));    // target ip addr
+
+  // send the ARP request packet
+  TRACE(2, "[sendARPRequest]:: sending ARP request for %I", TRACE_IP(e->ip_addr));
+
+  // prepare sending.. to GNET adapter..
+  pkt->frame.dst_interface = e->interface;
+  COPY_IP(pkt->frame.nxth_ip_addr, e->ip_addr);
+  pkt->frame.arp_bcast = TRUE;                        // tell gnet this is bcast to prevent recursive ARP lookup!
+  COPY_MAC(pkt->data->header.dst, unicast ? e->mac_addr : bcast_addr);
+  pkt->data->header.prot = htons(ARP_PROTOCOL);
+  // actually send the message to the other module..
+  ARPSend2Output(pkt);
+
+  return;
+}
+
+
+// send the packets waiting for e to its MAC address
+static void flushARPEntry(arp_entry_t *e)
+{
+  gpacket_t *pkt;
+  int i;
+
+  for (i = 0; i < e->npending; i++)
+  {
+    pkt = e->pending[i];
+    TRACE(2, "[ARPFlushBuffer]:: flushing the entry with next_hop %I ", TRACE_IP(e->ip_addr));
+    if (makePacketWritable(pkt) == NULL)
+    {
+      freePacket(pkt);
+      continue;
+    }
+    COPY_MAC(pkt->data->header.dst, e->mac_addr);
+    pkt->frame.arp_valid = TRUE;
+    ARPSend2Output(pkt);
+  }
+  e->npending = 0;
+}
+
+
+/*
+ * Take e out of the table: its waiting packets are dropped and its
+ * adjacencies can no longer be used. The timer frees it if it has one.
+ */
+static void removeARPEntry(arp_entry_t *e)
+{
+  arp_entry_t **pe;
+  int i;
+
+  for (pe = &(ARPtable[ARPHash(e->ip_addr)]); *pe != e; pe = &((*pe)->next))
+    ;
+  *pe = e->next;
+  ARPcount--;
+  for (i = 0; i < e->npending; i++)
+    freePacket(e->pending[i]);
+  e->npending = 0;
+  if (e->state != ARP_INCOMPLETE)
+    invalidateAdjacencies(e->ip_addr);
+
+  if (e->armed)
+    e->dead = TRUE;
+  else
+    free(e);
+}
+
+
+/*
+ * ip_addr is at mac_addr on interface. reply tells whether this comes
+ * from a reply, which confirms the neighbor; other packets make a new or
+ * changed entry stale. A neighbor not yet in the table is only added
+ * if create is set.
+ */
+static void learnARPEntry(uchar *ip_addr, uchar *mac_addr, int interface, bool create, bool reply)
+{
+  arp_entry_t *e;
+  uint64_t now = monotonicNanos();
+  bool changed;
+
+  pthread_mutex_lock(&ARPlock);
+  if (((e = findARPEntry(ip_addr)) == NULL) &&
+      (!create || ((e = newARPEntry(ip_addr, interface, ARP_INCOMPLETE)) == NULL)))
+  {
+    pthread_mutex_unlock(&ARPlock);
+    return;
+  }
+  if (e->state == ARP_PERMANENT)
+  {
+    pthread_mutex_unlock(&ARPlock);
+    return;
+  }
+
+  changed = (e->state == ARP_INCOMPLETE) || (COMPARE_MAC(e->mac_addr, mac_addr) != 0);
+  COPY_MAC(e->mac_addr, mac_addr);
+  e->interface = interface;
+  if (reply)
+  {
+    e->state = ARP_REACHABLE;
+    e->probes = 0;
+    armARPEntry(e, now, ARP_REACHABLE_SECS * ARP_SEC);
+  } else if (changed)
+  {
+    e->state = ARP_STALE;
+    e->probes = 0;
+    armARPEntry(e, now, ARP_STALE_SECS * ARP_SEC);
+  }
+  if (changed)
+    updateAdjacencies(ip_addr, mac_addr);
+  flushARPEntry(e);
+  pthread_mutex_unlock(&ARPlock);
+
+  TRACE(2, "[learnARPEntry]:: IP %I = MAC %M is %s", TRACE_IP(ip_addr), TRACE_MAC(mac_addr), ARPstatenames[e->state]);
+}
+
+
+/*
+ * The timer of an entry: retransmits the request of an entry being
+ * resolved or confirmed, with the interval doubling each time, and gives
+ * the neighbor up after ARP_MAX_PROBES requests. A reachable entry turns
+ * stale; a stale entry is confirmed again if packets went to it, or
+ * removed if none did.
+ */
+static void expireARP(void *arg, twentry_t *list)
+{
+  arp_entry_t *e;
+  uint64_t now;
+  bool used, removed;
+
+  for (; list != NULL; list = list->next)
+  {
+    e = (arp_entry_t *)list->data;
+    pthread_mutex_lock(&ARPlock);
+    e->armed = FALSE;
+    removed = FALSE;
+    now = monotonicNanos();
+    if (e->dead)
+    {
+      pthread_mutex_unlock(&ARPlock);
+      free(e);
+      continue;
+    }
+    if (e->state == ARP_PERMANENT)
+    {
+      pthread_mutex_unlock(&ARPlock);
+      continue;
+    }
+    if (e->expires > now)
+    {
+      armARPEntry(e, now, e->expires - now);
+      pthread_mutex_unlock(&ARPlock);
+      continue;
+    }
+
+    switch (e->state)
+    {
+    case ARP_INCOMPLETE:
+    case ARP_PROBE:
+      if (e->probes < ARP_MAX_PROBES)
+      {
+        ARPSendRequest(e, (e->state == ARP_PROBE));
+        armARPEntry(e, now, (ARP_RETRANS_MSECS * ARP_MSEC) << e->probes);
+        e->probes++;
+      } else
+      {
+        verbose(2, "[expireARP]:: no reply from neighbor, entry removed");
+        removeARPEntry(e);
+        removed = TRUE;
+      }
+      break;
+    case ARP_REACHABLE:
+      e->state = ARP_STALE;
+      testAdjacenciesUsed(e->ip_addr);
+      e->used = FALSE;
+      armARPEntry(e, now, ARP_STALE_SECS * ARP_SEC);
+      break;
+    case ARP_STALE:
+      used = testAdjacenciesUsed(e->ip_addr) || e->used;
+      e->used = FALSE;
+      if (used)
+      {
+        e->state = ARP_PROBE;
+        ARPSendRequest(e, TRUE);
+        e->probes = 1;
+        armARPEntry(e, now, ARP_RETRANS_MSECS * ARP_MSEC);
+      } else
+      {
+        removeARPEntry(e);
+        removed = TRUE;
+      }
+      break;
+    }
+    // a timer that could not be re-armed takes the entry with it
+    if (!removed && !e->armed)
+      removeARPEntry(e);
+    pthread_mutex_unlock(&ARPlock);
+  }
+}
+
+
 /*
  * ARPResolve: this routine is responsible for local ARP resolution.
  * It consults the local ARP cache to determine whether a valid ARP entry
- * is present. If a valid entry is not present, a remote request is sent out
- * and the packet that caused the request is buffered. The buffer is flushed
- * when the reply comes in.
+ * is present. If a valid entry is not present, the packet waits in the
+ * entry of the next hop, which sends a request if it is new. The packets
+ * are sent when the reply comes in, or dropped if none does.
  */
 int ARPResolve(gpacket_t *in_pkt)
 {
-  uchar mac_addr[6];
-  char tmpbuf[MAX_TMPBUF_LEN];
+  arp_entry_t *e;
 
-  in_pkt->data.header.prot = htons(IP_PROTOCOL);
-  // lookup the ARP table for the MAC for next hop
-  if (ARPFindEntry(in_pkt->frame.nxth_ip_addr, mac_addr) == EXIT_FAILURE)
+  in_pkt->data->header.prot = htons(IP_PROTOCOL);
+  pthread_mutex_lock(&ARPlock);
+  if (((e = findARPEntry(in_pkt->frame.nxth_ip_addr)) != NULL) && (e->state != ARP_INCOMPLETE))
   {
-    // no ARP match, buffer and send ARP request for next
-    verbose(2, "[ARPResolve]:: buffering packet, sending ARP request");
-    ARPAddBuffer(in_pkt);
-    in_pkt->frame.arp_bcast = TRUE;                        // tell gnet this is bcast to prevent recursive ARP lookup!
-    // create a new message for ARP request
-    ARPSendRequest(in_pkt);
-    return EXIT_SUCCESS;;
+    TRACE(2, "[ARPResolve]:: sent packet to MAC %M", TRACE_MAC(e->mac_addr));
+    e->used = TRUE;
+    // the adjacency went stale (its interface was reconfigured): rebuild it
+    updateAdjacencies(e->ip_addr, e->mac_addr);
+    COPY_MAC(in_pkt->data->header.dst, e->mac_addr);
+    pthread_mutex_unlock(&ARPlock);
+    in_pkt->frame.arp_valid = TRUE;
+    ARPSend2Output(in_pkt);
+    return EXIT_SUCCESS;
   }
 
-  verbose(2, "[ARPResolve]:: sent packet to MAC %s", MAC2Colon(tmpbuf, mac_addr));
-  COPY_MAC(in_pkt->data.header.dst, mac_addr);
-  in_pkt->frame.arp_valid = TRUE;
-  ARPSend2Output(in_pkt);
+  if ((e == NULL) && ((e = newARPEntry(in_pkt->frame.nxth_ip_addr, in_pkt->frame.dst_interface, ARP_INCOMPLETE)) != NULL))
+  {
+    // no ARP match, send the one request for the next hop
+    TRACE(2, "[ARPResolve]:: sending ARP request for %I", TRACE_IP(e->ip_addr));
+    ARPSendRequest(e, FALSE);
+    e->probes = 1;
+    armARPEntry(e, monotonicNanos(), ARP_RETRANS_MSECS * ARP_MSEC);
+  }
+  if (e == NULL)
+  {
+    pthread_mutex_unlock(&ARPlock);
+    TRACE(2, "[ARPResolve]:: ARP table full, packet dropped");
+    freePacket(in_pkt);
+    return EXIT_FAILURE;
+  }
+
+  TRACE(2, "[ARPResolve]:: buffering packet for %I", TRACE_IP(e->ip_addr));
+  if (e->npending == ARP_MAX_PENDING)
+  {
+    // drop the oldest one: its sender has been waiting the longest
+    freePacket(e->pending[0]);
+    memmove(&(e->pending[0]), &(e->pending[1]), (ARP_MAX_PENDING - 1) * sizeof(gpacket_t *));
+    e->npending--;
+  }
+  e->pending[e->npending++] = in_pkt;
+  pthread_mutex_unlock(&ARPlock);
 
   return EXIT_SUCCESS;
 }
@@ -105,36 +436,41 @@ int ARPResolve(gpacket_t *in_pkt)
 /*
  * ARPProcess: Process a received ARP packet... from remote nodes. If it is
  * a reply for a ARP request sent from the local node, use it
- * to update the local ARP cache. Flush (dequeue, process, and send) any packets
- * that are buffered for ARP processing that match the ARP reply.
+ * to update the local ARP cache, which sends the packets that were
+ * waiting for the sender.
 
  * If it a request, send a reply.. no need to record any state here.
  */
 void ARPProcess(gpacket_t *pkt)
 {
   char tmpbuf[MAX_TMPBUF_LEN];
+  bool forus;
 
-  arp_packet_t *apkt = (arp_packet_t *) pkt->data.data;
+  arp_packet_t *apkt = (arp_packet_t *) pkt->data->data;
 
   // check packet is ethernet and addresses of IP type.. otherwise throw away
   if ((ntohs(apkt->hw_addr_type) != ETHERNET_PROTOCOL) || (ntohs(apkt->arp_prot) != IP_PROTOCOL))
   {
-    verbose(2, "[ARPProcess]:: unknown hwtype or protocol, dropping ARP packet");
+    TRACE(2, "[ARPProcess]:: unknown hwtype or protocol, dropping ARP packet");
+    freePacket(pkt);
     return;
   }
 
 
-  verbose(2, "[ARPProcess]:: adding sender of received packet to ARP table");
-  ARPAddEntry(gNtohl((uchar *)tmpbuf, apkt->src_ip_addr), apkt->src_hw_addr);
+  // Check it's actually destined to us; the sender is only learned if it
+  // is, or if it is already in the table (RFC 826), so the table does not
+  // fill up with every host that talks on the segment
+  forus = (COMPARE_IP(apkt->dst_ip_addr, gHtonl((uchar *)tmpbuf, pkt->frame.src_ip_addr)) == 0);
+  TRACE(2, "[ARPProcess]:: updating sender of received packet in ARP table");
+  learnARPEntry(gNtohl((uchar *)tmpbuf, apkt->src_ip_addr), apkt->src_hw_addr, pkt->frame.src_interface,
+                forus, (ntohs(apkt->arp_opcode) == ARP_REPLY));
 
-  // Check it's actually destined to us,if not throw packet
-  if (COMPARE_IP(apkt->dst_ip_addr, gHtonl((uchar *)tmpbuf, pkt->frame.src_ip_addr)) != 0)
+  if (!forus)
   {
-    verbose(2, "[APRProcess]:: packet has a frame source (after ntohl) %s ...",
-        IP2Dot(tmpbuf, gNtohl((uchar *)tmpbuf, pkt->frame.src_ip_addr)));
+    TRACE(2, "[APRProcess]:: packet has a frame source %I ...", TRACE_IP(pkt->frame.src_ip_addr));
 
-    verbose(2, "[APRProcess]:: packet destined for %s, dropping",
-        IP2Dot(tmpbuf, gNtohl((uchar *)tmpbuf, apkt->dst_ip_addr)));
+    TRACE(2, "[APRProcess]:: packet destined for %N, dropping", TRACE_IP(apkt->dst_ip_addr));
+    freePacket(pkt);
     return;
   }
 
@@ -144,35 +480,35 @@ void ARPProcess(gpacket_t *pkt)
   {
     apkt->arp_opcode = htons(ARP_REPLY);
     COPY_MAC(apkt->src_hw_addr, pkt->frame.src_hw_addr);
-    COPY_MAC(apkt->dst_hw_addr, pkt->data.header.src);
+    COPY_MAC(apkt->dst_hw_addr, pkt->data->header.src);
     COPY_IP(apkt->dst_ip_addr, apkt->src_ip_addr);
     COPY_IP(apkt->src_ip_addr, gHtonl((uchar *)tmpbuf, pkt->frame.src_ip_addr));
 
-    verbose(2, "[ARPProcess]:: packet was ARP REQUEST, sending ARP REPLY packet");
+    TRACE(2, "[ARPProcess]:: packet was ARP REQUEST, sending ARP REPLY packet");
 
     // prepare for sending. Set some parameters that is going to be used
     // by the GNET adapter...
 
     pkt->frame.dst_interface = pkt->frame.src_interface;
 
-    COPY_MAC(pkt->data.header.dst, pkt->data.header.src);
-    COPY_MAC(pkt->data.header.src,  pkt->frame.src_hw_addr);
+    COPY_MAC(pkt->data->header.dst, pkt->data->header.src);
+    COPY_MAC(pkt->data->header.src,  pkt->frame.src_hw_addr);
     COPY_IP(pkt->frame.nxth_ip_addr, gNtohl((uchar *)tmpbuf, apkt->dst_ip_addr));
     pkt->frame.arp_valid = TRUE;
 
-    pkt->data.header.prot = htons(ARP_PROTOCOL);
+    pkt->data->header.prot = htons(ARP_PROTOCOL);
 
     ARPSend2Output(pkt);
   }
-  else if (ntohs(apkt->arp_opcode) == ARP_REPLY)
+  else
   {
-    // Flush buffer of any packets waiting for the incoming ARP..
-    verbose(2, "[ARPProcess]:: packet was ARP REPLY... ");
-    ARPFlushBuffer(gNtohl((uchar *)tmpbuf, apkt->src_ip_addr), apkt->src_hw_addr);
-    verbose(2, "[ARPProcess]:: flushed the ARP buffer ... ");
+    // a reply: the packets waiting for the sender went out when it was learned
+    if (ntohs(apkt->arp_opcode) == ARP_REPLY)
+      TRACE(2, "[ARPProcess]:: packet was ARP REPLY... ");
+    else
+      TRACE(2, "[ARPProcess]:: unknown ARP type");
+    freePacket(pkt);
   }
-  else
-    verbose(2, "[ARPProcess]:: unknown ARP type");
 
   return;
 }
@@ -189,10 +525,11 @@ void ARPInitTable()
 {
   int i;
 
-  tbl_replace_indx = 0;
-
-  for (i = 0; i < MAX_ARP; i++)
-    ARPtable[i].is_empty = TRUE;
+  pthread_mutex_lock(&ARPlock);
+  for (i = 0; i < ARP_BUCKETS; i++)
+    while (ARPtable[i] != NULL)
+      removeARPEntry(ARPtable[i]);
+  pthread_mutex_unlock(&ARPlock);
 
   verbose(2, "[ARPInitTable]:: ARP table initialized.. ");
   return;
@@ -213,71 +550,51 @@ void ARPReInitTable()
  */
 int ARPFindEntry(uchar *ip_addr, uchar *mac_addr)
 {
-  int i;
-  char tmpbuf[MAX_TMPBUF_LEN];
+  arp_entry_t *e;
 
-  for (i = 0; i < MAX_ARP; i++)
+  pthread_mutex_lock(&ARPlock);
+  if (((e = findARPEntry(ip_addr)) != NULL) && (e->state != ARP_INCOMPLETE))
   {
-    if(ARPtable[i].is_empty == FALSE &&
-        COMPARE_IP(ARPtable[i].ip_addr, ip_addr) == 0)
-    {
-      // found IP address - copy the MAC address
-      COPY_MAC(mac_addr, ARPtable[i].mac_addr);
-      verbose(2, "[ARPFindEntry]:: found ARP entry #%d for IP %s", i, IP2Dot(tmpbuf, ip_addr));
-      return EXIT_SUCCESS;
-    }
+    // found IP address - copy the MAC address
+    COPY_MAC(mac_addr, e->mac_addr);
+    pthread_mutex_unlock(&ARPlock);
+    TRACE(2, "[ARPFindEntry]:: found ARP entry for IP %I", TRACE_IP(ip_addr));
+    return EXIT_SUCCESS;
   }
+  pthread_mutex_unlock(&ARPlock);
 
-  verbose(2, "[ARPFindEntry]:: failed to find ARP entry for IP %s", IP2Dot(tmpbuf, ip_addr));
+  TRACE(2, "[ARPFindEntry]:: failed to find ARP entry for IP %I", TRACE_IP(ip_addr));
   return EXIT_FAILURE;
 }
 
 
 
 /*
- * add an entry to the ARP table
+ * add a permanent entry to the ARP table
  * ARGUMENTS: uchar *ip_addr - the IP address (4 bytes)
  *            uchar *mac_addr - the MAC address (6 bytes)
  * RETURNS: Nothing
  */
 void ARPAddEntry(uchar *ip_addr, uchar *mac_addr)
 {
-  int i;
-  int empty_slot = MAX_ARP;
+  arp_entry_t *e;
   char tmpbuf[MAX_TMPBUF_LEN];
-  for (i = 0; i < MAX_ARP; i++)
-  {
-    if ((ARPtable[i].is_empty == FALSE) &&
-        (COMPARE_IP(ARPtable[i].ip_addr, ip_addr) == 0))
-    {
-      // update entry
-      COPY_IP(ARPtable[i].ip_addr, ip_addr);
-      COPY_MAC(ARPtable[i].mac_addr, mac_addr);
 
-      verbose(2, "[ARPAddEntry]:: updated ARP table entry #%d: IP %s = MAC %s", i,
-          IP2Dot(tmpbuf, ip_addr), MAC2Colon(tmpbuf+20, mac_addr));
-      return;
-    }
-    if (ARPtable[i].is_empty == TRUE) {
-      empty_slot = i;
-      break;
-    }
-  }
-
-  if (empty_slot == MAX_ARP)
+  pthread_mutex_lock(&ARPlock);
+  if (((e = findARPEntry(ip_addr)) == NULL) && ((e = newARPEntry(ip_addr, -1, ARP_PERMANENT)) == NULL))
   {
-    // ARP table full.. do the replacement
-    // use the FIFO strategy: table replace index is the FIFO pointer
-    empty_slot = tbl_replace_indx;
-    tbl_replace_indx = (tbl_replace_indx + 1) % MAX_ARP;
+    pthread_mutex_unlock(&ARPlock);
+    error("[ARPAddEntry]:: ARP table full ");
+    return;
   }
-
-  // add new entry or overwrite the replaced entry
-  ARPtable[empty_slot].is_empty = FALSE;
-  COPY_IP(ARPtable[empty_slot].ip_addr, ip_addr);
-  COPY_MAC(ARPtable[empty_slot].mac_addr, mac_addr);
-
-  verbose(2, "[ARPAddEntry]:: updated ARP table entry #%d: IP %s = MAC %s", empty_slot,
+  // a timer still pending finds the entry permanent and leaves it
+  e->state = ARP_PERMANENT;
+  COPY_MAC(e->mac_addr, mac_addr);
+  updateAdjacencies(ip_addr, mac_addr);
+  flushARPEntry(e);
+  pthread_mutex_unlock(&ARPlock);
+
+  verbose(2, "[ARPAddEntry]:: updated ARP table entry: IP %s = MAC %s",
       IP2Dot(tmpbuf, ip_addr), MAC2Colon(tmpbuf+20, mac_addr));
 
   return;
@@ -289,18 +606,27 @@ void ARPAddEntry(uchar *ip_addr, uchar *mac_addr)
  */
 void ARPPrintTable(void)
 {
-  int i;
+  arp_entry_t *e;
+  interface_t *iface;
   char tmpbuf[MAX_TMPBUF_LEN];
+  int i;
 
   printf("-----------------------------------------------------------\n");
-  printf("      A R P  T A B L E \n");
+  printf("      A R P  T A B L E  (%d)\n", ARPcount);
   printf("-----------------------------------------------------------\n");
-  printf("Index\tIP address\tMAC address \n");
+  printf("IP address\tMAC address\t\tState\t\tInterface\tWaiting \n");
 
-  for (i = 0; i < MAX_ARP; i++)
-    if (ARPtable[i].is_empty == FALSE)
-      printf("%d\t%s\t%s\n", i, IP2Dot(tmpbuf, ARPtable[i].ip_addr), MAC2Colon((tmpbuf+20), ARPtable[i].mac_addr));
-  printf("-----------------------------------------------------------\n");
+  pthread_mutex_lock(&ARPlock);
+  for (i = 0; i < ARP_BUCKETS; i++)
+    for (e = ARPtable[i]; e != NULL; e = e->next)
+    {
+      iface = findInterface(e->interface);
+      printf("%s\t%s\t%-10s\t%s\t\t%d\n", IP2Dot(tmpbuf, e->ip_addr),
+          (e->state == ARP_INCOMPLETE) ? "(incomplete)     " : MAC2Colon((tmpbuf+20), e->mac_addr),
+          ARPstatenames[e->state], (iface != NULL) ? iface->device_name : "-", e->npending);
+    }
+  pthread_mutex_unlock(&ARPlock);
+  printAdjacencies();
   return;
 }
 
@@ -309,176 +635,51 @@ void ARPPrintTable(void)
  */
 void ARPDeleteEntry(char *ip_addr)
 {
-  int i;
+  arp_entry_t *e;
 
-  for (i = 0; i < MAX_ARP; i++)
+  pthread_mutex_lock(&ARPlock);
+  if ((e = findARPEntry((uchar *)ip_addr)) != NULL)
   {
-    if ( (ARPtable[i].is_empty == FALSE) &&
-        (COMPARE_IP(ARPtable[i].ip_addr, ip_addr)) == 0)
-    {
-      ARPtable[i].is_empty = TRUE;
-      verbose(2, "[ARPDeleteEntry]:: arp entry #%d deleted", i);
-    }
+    removeARPEntry(e);
+    verbose(2, "[ARPDeleteEntry]:: arp entry deleted");
   }
+  pthread_mutex_unlock(&ARPlock);
   return;
 }
 
 
 /*
- * send an ARP request to eventually process message,
- * a copy of which is now in the buffer
+ * Delete the ARP entries learned on an interface
  */
-void ARPSendRequest(gpacket_t *pkt)
-{
-  arp_packet_t *apkt = (arp_packet_t *) pkt->data.data;
-  uchar bcast_addr[6];
-  char tmpbuf[MAX_TMPBUF_LEN];
-
-  memset(bcast_addr, 0xFF, 6);
-
-  /*
-   * Create ARP REQUEST packet
-   * ether header will be set in GNET_ADAPTER
-   * arp header
-   */
-  apkt->hw_addr_type = htons(ETHERNET_PROTOCOL);      // set hw type
-  apkt->arp_prot = htons(IP_PROTOCOL);                // set prtotocol address format
-
-  apkt->hw_addr_len = 6;                              // address length
-  apkt->arp_prot_len = 4;                             // protocol address length
-  apkt->arp_opcode = htons(ARP_REQUEST);              // set ARP request opcode
-
-  // source hw addr will be set in GNET_ADAPTER
-  // source ip addr will be set in GNET_ADAPTER
-  COPY_MAC(apkt->dst_hw_addr, bcast_addr);            // target hw addr
-
-  COPY_IP(apkt->dst_ip_addr, gHtonl((uchar *)tmpbuf, pkt->frame.nxth_ip_addr));    // target ip addr
-
-  // send the ARP request packet
-  verbose(2, "[sendARPRequest]:: sending ARP request for %s",
-      IP2Dot(tmpbuf, pkt->frame.nxth_ip_addr));
-
-  // prepare sending.. to GNET adapter..
-
-  COPY_MAC(pkt->data.header.dst, bcast_addr);
-  pkt->data.header.prot = htons(ARP_PROTOCOL);
-  // actually send the message to the other module..
-  ARPSend2Output(pkt);
-
-  return;
-}
-
-
-/*-------------------------------------------------------------------------
- *                   A R P  B U F F E R  F U N C T I O N S
- *-------------------------------------------------------------------------*/
-
-
-/*
- * initialize buffer
- */
-void ARPInitBuffer()
-{
-  int i;
-
-  buf_replace_indx = 0;
-
-  for (i = 0; i < MAX_ARP_BUFFERS; i++)
-    ARPbuffer[i].is_empty = TRUE;
-
-  verbose(2, "[initARPBuffer]:: packet buffer initialized");
-  return;
-}
-
-
-/*
- * Add a packet to ARP buffer: This packet is waiting resolution
- * ARGUMENTS: in_pkt - pointer to message that is to be copied into buffer
- * RETURNS: none
- */
-void ARPAddBuffer(gpacket_t *in_pkt)
-{
-  int i;
-  gpacket_t *cppkt;
-
-  // duplicate the packet..
-  cppkt = duplicatePacket(in_pkt);
-
-  // Find an empty slot
-  for (i = 0; i < MAX_ARP_BUFFERS; i++){
-    if (ARPbuffer[i].is_empty == TRUE)
-    {
-      ARPbuffer[i].is_empty = FALSE;
-      ARPbuffer[i].wait_msg = cppkt;
-      verbose(2, "[addARPBuffer]:: packet stored in entry %d", i);
-      return;
-    }
-  }
-
-  // No empty spot? Replace a packet, we need to deallocate the old packet
-  free(ARPbuffer[i].wait_msg);
-  ARPbuffer[i].wait_msg = cppkt;
-  verbose(2, "[addARPBuffer]:: buffer full, packet buffered to replaced entry %d",
-      buf_replace_indx);
-  buf_replace_indx = (buf_replace_indx + 1) % MAX_ARP_BUFFERS; // adjust for FIFO
-
-  return;
-}
-
-
-/*
- * get a packet from the ARP buffer
- * ARGUMENTS: out_pkt - pointer at which packet matching message is to be copied
- *              nexthop - pointer to dest. IP address to search for
- * RETURNS: The function returns EXIT_SUCCESS if packet was found and copied,
- * or EXIT_FAILURE if it was not found.
- */
-int ARPGetBuffer(gpacket_t **out_pkt, uchar *nexthop)
+void ARPDeleteInterfaceEntries(int interface)
 {
+  arp_entry_t *e, *next;
   int i;
-  char tmpbuf[MAX_TMPBUF_LEN];
 
-  // Search for packet in buffer
-  for (i = 0; i < MAX_ARP_BUFFERS; i++)
-  {
-    if (ARPbuffer[i].is_empty == TRUE) continue;
-    if (COMPARE_IP(ARPbuffer[i].wait_msg->frame.nxth_ip_addr, nexthop) == 0)
+  pthread_mutex_lock(&ARPlock);
+  for (i = 0; i < ARP_BUCKETS; i++)
+    for (e = ARPtable[i]; e != NULL; e = next)
     {
-      // match found
-      *out_pkt =  ARPbuffer[i].wait_msg;
-      ARPbuffer[i].is_empty = TRUE;
-      verbose(2, "[ARPGetBuffer]:: found packet matching nexthop %s at entry %d",
-          IP2Dot(tmpbuf, nexthop), i);
-      return EXIT_SUCCESS;
+      next = e->next;
+      if ((e->interface == interface) && (e->state != ARP_PERMANENT))
+        removeARPEntry(e);
     }
-  }
-  verbose(2, "[ARPGetBuffer]:: no match for nexthop %s", IP2Dot(tmpbuf, nexthop));
-  return EXIT_FAILURE;
+  pthread_mutex_unlock(&ARPlock);
+  verbose(2, "[ARPDeleteInterfaceEntries]:: arp entries of interface %d deleted", interface);
 }
 
 
 /*
- * flush all packets from buffer matching the nexthop
- * for which we now have an ARP entry
+ * Set the adjacencies of ip_addr from its ARP entry. A new adjacency
+ * calls this once it is in the adjacency table, so it cannot miss an
+ * update of the entry: both happen under the ARP table lock.
  */
-void ARPFlushBuffer(char *next_hop, char *mac_addr)
+void ARPRefreshAdjacencies(uchar *ip_addr)
 {
-  gpacket_t *bfrd_msg;
-  char tmpbuf[MAX_TMPBUF_LEN];
-
-  verbose(2, "[ARPFlushBuffer]:: Entering the function.. ");
-  while (ARPGetBuffer(&bfrd_msg, next_hop) == EXIT_SUCCESS)
-  {
-    // a message is already buffered.. send it out..
-    // TODO: include QoS routines.. for now they are removed!
-
-    // send to gnetAdapter
-    // no need to set dst_int_num -- why?
+  arp_entry_t *e;
 
-    verbose(2, "[ARPFlushBuffer]:: flushing the entry with next_hop %s ", IP2Dot(tmpbuf, next_hop));
-    COPY_MAC(bfrd_msg->data.header.dst, mac_addr);
-    ARPSend2Output(bfrd_msg);
-  }
-
-  return;
+  pthread_mutex_lock(&ARPlock);
+  if (((e = findARPEntry(ip_addr)) != NULL) && (e->state != ARP_INCOMPLETE))
+    updateAdjacencies(ip_addr, e->mac_addr);
+  pthread_mutex_unlock(&ARPlock);
 }
@@ -0,0 +1,327 @@
+/*
+ * checksum.c (Internet checksum library)
+ *
+ * Routines for the one's complement sum of a buffer. Each one adds the
+ * buffer into accumulators wide enough that no carry is lost and folds
+ * them down to 16 bits at the end (RFC 1071 sect. 2). The 64 bit routine
+ * runs anywhere; the SSE2 and AVX2 ones are compiled for those units
+ * alone and used only when the CPU has them, so the build needs no
+ * special flags. The best routine is picked once at startup.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+
+
+typedef struct _checksum_impl_t
+{
+	const char *name;
+	uint64_t (*sum)(const uint8_t *buf, int len, uint64_t sum);
+	uint64_t (*copy)(uint8_t *dst, const uint8_t *src, int len, uint64_t sum);
+} checksum_impl_t;
+
+
+// fold a sum of 16 bit words (with their carries) down to 16 bits
+static inline uint16_t checksumFold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+
+/*
+ * 64 bits at a time: each word goes in as two 32 bit halves, so the 64
+ * bit accumulators take 2^32 words before they could carry out. A last
+ * odd byte counts as a word padded with a zero byte.
+ */
+static uint64_t sumScalar64(const uint8_t *buf, int len, uint64_t sum)
+{
+	uint64_t w, lo = 0, hi = 0;
+	uint16_t t = 0;
+
+	for (; len >= 8; buf += 8, len -= 8)
+	{
+		memcpy(&w, buf, 8);
+		lo += (uint32_t)w;
+		hi += w >> 32;
+	}
+	for (; len >= 2; buf += 2, len -= 2)
+	{
+		memcpy(&t, buf, 2);
+		lo += t;
+	}
+	if (len > 0)
+	{
+		t = 0;
+		memcpy(&t, buf, 1);
+		lo += t;
+	}
+	return sum + checksumFold(lo) + checksumFold(hi);
+}
+
+
+static uint64_t copyScalar64(uint8_t *dst, const uint8_t *src, int len, uint64_t sum)
+{
+	uint64_t w, lo = 0, hi = 0;
+
+	for (; len >= 8; src += 8, dst += 8, len -= 8)
+	{
+		memcpy(&w, src, 8);
+		memcpy(dst, &w, 8);
+		lo += (uint32_t)w;
+		hi += w >> 32;
+	}
+	memcpy(dst, src, len);
+	return sumScalar64(src, len, sum + checksumFold(lo) + checksumFold(hi));
+}
+
+
+#ifdef CHECKSUM_X86
+
+/*
+ * The vector routines widen the 16 bit words of a block to 32 bit lanes.
+ * A lane takes at most two words per block and accumulator, so it cannot
+ * overflow within CHECKSUM_VEC_ROUNDS rounds; the lanes are then added
+ * into the 64 bit sum. What is left under a round goes to the 64 bit
+ * routine.
+ */
+#define CHECKSUM_VEC_ROUNDS             32768
+
+__attribute__((target("sse2")))
+static inline __m128i sumBlockSSE2(__m128i acc, __m128i v)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+	return _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+}
+
+
+__attribute__((target("sse2")))
+static inline uint64_t sumLanesSSE2(__m128i acc)
+{
+	uint32_t lanes[4];
+
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+
+__attribute__((target("sse2")))
+static uint64_t sumSSE2(const uint8_t *buf, int len, uint64_t sum)
+{
+	__m128i acc0, acc1;
+	int n;
+
+	while (len >= 32)
+	{
+		acc0 = acc1 = _mm_setzero_si128();
+		for (n = 0; (n < CHECKSUM_VEC_ROUNDS) && (len >= 32); n++, buf += 32, len -= 32)
+		{
+			acc0 = sumBlockSSE2(acc0, _mm_loadu_si128((const __m128i *)buf));
+			acc1 = sumBlockSSE2(acc1, _mm_loadu_si128((const __m128i *)(buf + 16)));
+		}
+		sum += sumLanesSSE2(acc0) + sumLanesSSE2(acc1);
+	}
+	return sumScalar64(buf, len, sum);
+}
+
+
+__attribute__((target("sse2")))
+static uint64_t copySSE2(uint8_t *dst, const uint8_t *src, int len, uint64_t sum)
+{
+	__m128i acc0, acc1, v0, v1;
+	int n;
+
+	while (len >= 32)
+	{
+		acc0 = acc1 = _mm_setzero_si128();
+		for (n = 0; (n < CHECKSUM_VEC_ROUNDS) && (len >= 32); n++, src += 32, dst += 32, len -= 32)
+		{
+			v0 = _mm_loadu_si128((const __m128i *)src);
+			v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+			_mm_storeu_si128((__m128i *)dst, v0);
+			_mm_storeu_si128((__m128i *)(dst + 16), v1);
+			acc0 = sumBlockSSE2(acc0, v0);
+			acc1 = sumBlockSSE2(acc1, v1);
+		}
+		sum += sumLanesSSE2(acc0) + sumLanesSSE2(acc1);
+	}
+	return copyScalar64(dst, src, len, sum);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i sumBlockAVX2(__m256i acc, __m256i v)
+{
+	__m256i zero = _mm256_setzero_si256();
+
+	// the unpacks work within each 128 bit half, which does not matter to a sum
+	acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+	return _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+}
+
+
+__attribute__((target("avx2")))
+static inline uint64_t sumLanesAVX2(__m256i acc)
+{
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	int i;
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	for (i = 0; i < 8; i++)
+		sum += lanes[i];
+	return sum;
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t sumAVX2(const uint8_t *buf, int len, uint64_t sum)
+{
+	__m256i acc0, acc1;
+	int n;
+
+	while (len >= 64)
+	{
+		acc0 = acc1 = _mm256_setzero_si256();
+		for (n = 0; (n < CHECKSUM_VEC_ROUNDS) && (len >= 64); n++, buf += 64, len -= 64)
+		{
+			acc0 = sumBlockAVX2(acc0, _mm256_loadu_si256((const __m256i *)buf));
+			acc1 = sumBlockAVX2(acc1, _mm256_loadu_si256((const __m256i *)(buf + 32)));
+		}
+		sum += sumLanesAVX2(acc0) + sumLanesAVX2(acc1);
+	}
+	return sumScalar64(buf, len, sum);
+}
+
+
+__attribute__((target("avx2")))
+static uint64_t copyAVX2(uint8_t *dst, const uint8_t *src, int len, uint64_t sum)
+{
+	__m256i acc0, acc1, v0, v1;
+	int n;
+
+	while (len >= 64)
+	{
+		acc0 = acc1 = _mm256_setzero_si256();
+		for (n = 0; (n < CHECKSUM_VEC_ROUNDS) && (len >= 64); n++, src += 64, dst += 64, len -= 64)
+		{
+			v0 = _mm256_loadu_si256((const __m256i *)src);
+			v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+			_mm256_storeu_si256((__m256i *)dst, v0);
+			_mm256_storeu_si256((__m256i *)(dst + 32), v1);
+			acc0 = sumBlockAVX2(acc0, v0);
+			acc1 = sumBlockAVX2(acc1, v1);
+		}
+		sum += sumLanesAVX2(acc0) + sumLanesAVX2(acc1);
+	}
+	return copyScalar64(dst, src, len, sum);
+}
+
+#endif
+
+
+// best first
+static const checksum_impl_t checksum_impls[] =
+{
+#ifdef CHECKSUM_X86
+	{CHECKSUM_AVX2, sumAVX2, copyAVX2},
+	{CHECKSUM_SSE2, sumSSE2, copySSE2},
+#endif
+	{CHECKSUM_SCALAR, sumScalar64, copyScalar64}
+};
+#define CHECKSUM_IMPLS                  ((int)(sizeof(checksum_impls) / sizeof(checksum_impl_t)))
+
+static const checksum_impl_t *checksum_impl = &checksum_impls[CHECKSUM_IMPLS - 1];
+
+
+static int checksumSupported(const checksum_impl_t *ci)
+{
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (!strcmp(ci->name, CHECKSUM_AVX2))
+		return __builtin_cpu_supports("avx2");
+	if (!strcmp(ci->name, CHECKSUM_SSE2))
+		return __builtin_cpu_supports("sse2");
+#endif
+	return 1;
+}
+
+
+// pick the best routine the CPU supports, before main() runs
+__attribute__((constructor))
+static void checksumInit(void)
+{
+	int i;
+
+	for (i = 0; !checksumSupported(&checksum_impls[i]); i++)
+		;
+	checksum_impl = &checksum_impls[i];
+}
+
+
+/*
+ * Use the named routine from now on, e.g. to compare them. Returns
+ * EXIT_FAILURE if there is no such routine or the CPU lacks its unit.
+ */
+int checksumSelect(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CHECKSUM_IMPLS; i++)
+		if (!strcmp(checksum_impls[i].name, name))
+		{
+			if (!checksumSupported(&checksum_impls[i]))
+				return EXIT_FAILURE;
+			checksum_impl = &checksum_impls[i];
+			return EXIT_SUCCESS;
+		}
+	return EXIT_FAILURE;
+}
+
+
+const char *checksumImplementation(void)
+{
+	return checksum_impl->name;
+}
+
+
+uint16_t checksumSum(const void *buf, int len)
+{
+	return checksumFold(checksum_impl->sum(buf, len, 0));
+}
+
+
+uint16_t checksumCompute(const void *buf, int len)
+{
+	return (uint16_t)~checksumSum(buf, len);
+}
+
+
+uint16_t checksumCopy(void *dst, const void *src, int len)
+{
+	return checksumFold(checksum_impl->copy(dst, src, len, 0));
+}
+
+
+uint16_t checksumPseudo(const uint8_t *src, const uint8_t *dst, int prot, int len, uint16_t sum)
+{
+	uint32_t s, d;
+
+	memcpy(&s, src, 4);
+	memcpy(&d, dst, 4);
+	return (uint16_t)~checksumFold((uint64_t)sum + (s & 0xffff) + (s >> 16) + (d & 0xffff) + (d >> 16) +
+				      htons(prot) + htons(len));
+}
@@ -11,10 +11,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include <slack/list.h>
 #include "classspec.h"
 #include "classifier.h"
 #include "ip.h"
+#include "protocols.h"
 
 #include <slack/std.h>
 #include <slack/err.h>
@@ -37,7 +39,14 @@ classlist_t *createClassifier()
 		return NULL;
 	}
 
+	if (!(cl->defmap = map_create(NULL)))
+	{
+		fatal("[createClassifier]:: Could not create the class name map..");
+		return NULL;
+	}
+
 	cl->defcnt = 0;
+	cl->gen = 0;
 	// the list owns the elements.. memory is managed by the list
 	list_own(cl->deftab, free);
 
@@ -69,6 +78,8 @@ int addClassDef(classlist_t *clas, char *cname)
 	strcpy(cdef->cname, cname);
 	cdef->cdefid = ++(clas->defcnt);
 	list_prepend(clas->deftab, cdef);
+	map_add(clas->defmap, cdef->cname, cdef);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 
 	return 1;
 }
@@ -83,11 +94,13 @@ int delClassDef(classlist_t *clas, char *cname)
 		ptr = (classdef_t *)lister_next(lster);
 		if (strcmp(cname, ptr->cname) == 0)
 		{
+			map_remove(clas->defmap, cname);
 			lister_remove(lster);
 			break;
 		}
 	}
 	lister_release(lster);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 
 	return 1;
 }
@@ -96,31 +109,10 @@ int delClassDef(classlist_t *clas, char *cname)
 // returns NULL if the class definition is not present
 classdef_t *getClassDef(classlist_t *clas, char *cname)
 {
-	classdef_t *ptr, *saveptr;
-	Lister *lster;
-	int found = 0;
-
-	for (lster = lister_create(clas->deftab); lister_has_next(lster) == 1; )
-	{
-		ptr = (classdef_t *)lister_next(lster);
-		if (strcmp(cname, ptr->cname) == 0)
-		{
-			saveptr = ptr;
-			found = 1;
-			break;
-		}
-	}
-	lister_release(lster);
-
-	if (found)
-		return saveptr;
-	else
-		return NULL;
+	return (classdef_t *)map_get(clas->defmap, cname);
 }
 
 
-
-
 // RuleID  RuleTag  SRC IP Src Port  Dst IP Dst Port Prot TOS
 void printClassDef(classdef_t *cr)
 {
@@ -183,6 +175,7 @@ int insertIPSpec(classlist_t *clas, char *cname, int srcside, ip_spec_t *ipspec)
 		}
 	}
 	lister_release(lstr);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 	return 1;
 }
 
@@ -204,6 +197,7 @@ int insertPortRangeSpec(classlist_t *clas, char *cname, int srcside, port_range_
 		}
 	}
 	lister_release(lstr);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 	return 1;
 }
 
@@ -222,6 +216,7 @@ int insertProtSpec(classlist_t *clas, char *cname, int prot)
 		}
 	}
 	lister_release(lstr);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 	return 1;
 }
 
@@ -240,76 +235,103 @@ int insertTOSSpec(classlist_t *clas, char *cname, int tos)
 		}
 	}
 	lister_release(lstr);
+	__atomic_add_fetch(&(clas->gen), 1, __ATOMIC_RELEASE);
 	return 1;
 
 }
 
 
-int compareIP2Spec(uchar ip[], ip_spec_t *ips)
+/*
+ * Returns 1 if the rule given by cdef matches the packet and 0 otherwise.
+ * The packet path uses compiled rules (see compileClassRule()); this is
+ * for one-off checks.
+ */
+int isRuleMatching(classdef_t *cdef, gpacket_t *in_pkt)
 {
-	int preflen;
-	uchar spec[4];
-	char tmpbuf[MAX_TMPBUF_LEN];
-	uchar temp[4] = {0,0,0,0}, mask, tbyte = 0;
-	int prefbytes;
-	int i, j, rembits;
-
-	if (ips == NULL) return 1;
+	classrule_t rule;
+	classkey_t key;
 
-	preflen = ips->preflen;
-	prefbytes = preflen/8;
-
-	bcopy(gHtonl(tmpbuf, ips->ip_addr), spec, 4);
+	compileClassRule(cdef, &rule);
+	getClassKey(in_pkt, &key);
+	return matchClassRule(&rule, &key);
+}
 
-	for (i = 0; i < prefbytes; i++)
-		temp[i] = ip[i];
 
-	if (prefbytes < 4)
+/*
+ * Extract the fields matched by the classifier. The ports are only taken
+ * from TCP and UDP headers, which non-initial fragments do not carry.
+ */
+void getClassKey(gpacket_t *in_pkt, classkey_t *key)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
+	uchar *l4hdr;
+
+	memcpy(&(key->src), ip_pkt->ip_src, 4);
+	memcpy(&(key->dst), ip_pkt->ip_dst, 4);
+	key->prot = ip_pkt->ip_prot;
+	key->tos = ip_pkt->ip_tos;
+	key->sport = key->dport = 0;
+	key->hasports = 0;
+	if (((key->prot == TCP_PROTOCOL) || (key->prot == UDP_PROTOCOL)) &&
+	    ((ntohs(ip_pkt->ip_frag_off) & IP_OFFMASK) == 0))
 	{
-		rembits = preflen - (prefbytes * 8);
-		mask = 0x80;
-
-		for (j = 0; j < rembits; j++)
-		{
-			tbyte = tbyte | mask;
-			mask = mask >> 1;
-		}
-
-		temp[prefbytes] = ip[prefbytes] & tbyte;
+		l4hdr = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+		key->sport = (l4hdr[0] << 8) | l4hdr[1];
+		key->dport = (l4hdr[2] << 8) | l4hdr[3];
+		key->hasports = 1;
 	}
-	return COMPARE_IP(temp, spec) == 0;
 }
 
 
-int compareProt2Spec(int prot, int pspec)
+unsigned int getClassifierGen(classlist_t *clas)
 {
-	if (pspec == 0) return 1;
-	if (prot == pspec) return 1;
-	return 0;
+	return __atomic_load_n(&(clas->gen), __ATOMIC_ACQUIRE);
 }
 
 
-int compareTos2Spec(int tos, int tspec)
+static void compileIPSpec(ip_spec_t *ips, uint32_t *addr, uint32_t *mask)
 {
-	if (tspec == 0) return 1;
-	if (tos == tspec) return 1;
-	return 0;
+	uchar spec[4];
+	int preflen;
+
+	if (ips == NULL)
+	{
+		*addr = *mask = 0;
+		return;
+	}
+	preflen = min(max(ips->preflen, 0), 32);
+	gHtonl(spec, ips->ip_addr);
+	memcpy(addr, spec, 4);
+	// the address keeps its host bits: a spec with bits set beyond the
+	// prefix matches nothing
+	*mask = (preflen == 0) ? 0 : htonl(0xFFFFFFFFu << (32 - preflen));
 }
 
 
-/*
- * TODO: What happened to the port range check? Not implemented?
- * Returns 1 if the rule given by cdef matches the packet and 0 otherwise.
- */
-int isRuleMatching(classdef_t *cdef, gpacket_t *in_pkt)
+// a missing range or 0 - 0 matches all ports; an upper port below the lower one means a single port
+static void compilePortSpec(port_range_t *prs, int *lo, int *hi)
 {
-
-	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data.data;
-
-	return compareIP2Spec(ip_pkt->ip_src, cdef->srcspec) *
-		compareIP2Spec(ip_pkt->ip_dst, cdef->dstspec) *
-		compareProt2Spec(ip_pkt->ip_prot, cdef->prot) *
-		compareTos2Spec(ip_pkt->ip_tos, cdef->tos);
+	if ((prs == NULL) || ((prs->minport == 0) && (prs->maxport == 0)))
+	{
+		*lo = 0;
+		*hi = 65535;
+		return;
+	}
+	*lo = min(max(prs->minport, 0), 65535);
+	*hi = min(max(prs->maxport, *lo), 65535);
 }
 
 
+// compile cdef for matchClassRule()
+void compileClassRule(classdef_t *cdef, classrule_t *rule)
+{
+	compileIPSpec(cdef->srcspec, &(rule->srcaddr), &(rule->srcmask));
+	compileIPSpec(cdef->dstspec, &(rule->dstaddr), &(rule->dstmask));
+	compilePortSpec(cdef->srcports, &(rule->sportlo), &(rule->sporthi));
+	compilePortSpec(cdef->dstports, &(rule->dportlo), &(rule->dporthi));
+	rule->needports = (rule->sportlo != 0) || (rule->sporthi != 65535) ||
+		(rule->dportlo != 0) || (rule->dporthi != 65535);
+	rule->prot = cdef->prot;
+	rule->tos = cdef->tos;
+	rule->classid = cdef->cdefid;
+}
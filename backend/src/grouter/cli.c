@@ -26,11 +26,18 @@
 #include "grouter.h"
 #include "routetable.h"
 #include "mtu.h"
+#include "localaddr.h"
 #include "message.h"
 #include "classifier.h"
 #include "filter.h"
+#include "conntrack.h"
+#include "nat.h"
+#include "trace.h"
+#include "protocols.h"
 #include "classspec.h"
 #include "packetcore.h"
+#include "codel.h"
+#include "pktpool.h"
 #include <slack/err.h>
 #include <slack/std.h>
 #include <slack/prog.h>
@@ -51,10 +58,12 @@ static char *cur_line = (char *)NULL;       // static variable for holding the l
 extern FILE *rl_instream;
 extern router_config rconfig;
 
-extern route_entry_t route_tbl[MAX_ROUTES];
+extern routetable_t *route_tbl;
 extern mtu_entry_t MTU_tbl[MAX_MTU];
 extern classlist_t *classifier;
 extern filtertab_t *filter;
+extern conntrack_t *conntrack;
+extern nat_t *nat;
 extern pktcore_t *pcore;
 
 /*
@@ -98,8 +107,12 @@ int CLIInit(router_config *rarg)
     registerCLI("queue", queueCmd, SHELP_QUEUE, USAGE_QUEUE, LHELP_QUEUE); // Check
     registerCLI("qdisc", qdiscCmd, SHELP_QDISC, USAGE_QDISC, LHELP_QDISC); // Check
     registerCLI("spolicy", spolicyCmd, SHELP_SPOLICY, USAGE_SPOLICY, LHELP_SPOLICY); // Check
+    registerCLI("pktpool", pktpoolCmd, SHELP_PKTPOOL, USAGE_PKTPOOL, LHELP_PKTPOOL);
     registerCLI("class", classCmd, SHELP_CLASS, USAGE_CLASS, LHELP_CLASS);
     registerCLI("filter", filterCmd, SHELP_FILTER, USAGE_FILTER, LHELP_FILTER);
+    registerCLI("conntrack", conntrackCmd, SHELP_CONNTRACK, USAGE_CONNTRACK, LHELP_CONNTRACK);
+    registerCLI("nat", natCmd, SHELP_NAT, USAGE_NAT, LHELP_NAT);
+    registerCLI("trace", traceCmd, SHELP_TRACE, USAGE_TRACE, LHELP_TRACE);
     registerCLI("openflow", openflowCmd, SHELP_OPENFLOW, USAGE_OPENFLOW, LHELP_OPENFLOW);
     registerCLI("gnc", gncCmd, SHELP_GNC, USAGE_GNC, LHELP_GNC);
 
@@ -362,7 +375,7 @@ int getDevType(char *str)
  * ifconfig add tap0 -device dev_location -addr IP_addr -hwaddr MAC
  * ifconfig add tun0 -dstip dst_ip -dstport portnum -addr IP_addr -hwaddr MAC
  * ifconfig del eth0|tap0
- * ifconfig show [brief|verbose]
+ * ifconfig show [brief|verbose|addr]
  * ifconfig up eth0|tap0
  * ifconfig down eth0|tap0
  * ifconfig mod eth0 (-gateway GW | -mtu N)
@@ -517,6 +530,11 @@ void ifconfigCmd()
                 mode = BRIEF_LISTING;
             else if (strstr(next_tok, "verb") != NULL)
                 mode = VERBOSE_LISTING;
+            else if (strstr(next_tok, "addr") != NULL)
+            {
+                printLocalAddresses();
+                return;
+            }
         } else
             mode = NORMAL_LISTING;
 
@@ -528,9 +546,10 @@ void ifconfigCmd()
 
 /*
  * Handler for the connection "route" command
- * route show
+ * route show [count]
+ * route nexthops
  * route add -dev eth0|tap0 -net nw_addr -netmask mask [-gw gw_addr]
- * route del route_number
+ * route del route_number | -net nw_addr -netmask mask [-gw gw_addr [-dev eth0|tap0]]
  */
 void routeCmd()
 {
@@ -573,11 +592,54 @@ void routeCmd()
         else if (!strcmp(next_tok, "del"))
         {
             next_tok = strtok(NULL, " \n");
-            del_route = gAtoi(next_tok);
-            deleteRouteEntryByIndex(route_tbl, del_route);
+            if (next_tok == NULL)
+                error("route:: missing route number ..");
+            else if (!strcmp(next_tok, "-net"))
+            {
+                if ((next_tok = strtok(NULL, " \n")) == NULL)
+                {
+                    error("route:: missing network address ..");
+                    return;
+                }
+                Dot2IP(next_tok, net_addr);
+                GET_NEXT_PARAMETER("-netmask", "route:: missing netmask ..");
+                Dot2IP(next_tok, net_mask);
+                if (((next_tok = strtok(NULL, " \n")) != NULL) &&
+                        (!strcmp("-gw", next_tok)))
+                {
+                    if ((next_tok = strtok(NULL, " \n")) == NULL)
+                    {
+                        error("route:: missing gateway address ..");
+                        return;
+                    }
+                    Dot2IP(next_tok, nxth_addr);
+                    interface = -1;
+                    if (((next_tok = strtok(NULL, " \n")) != NULL) &&
+                            (!strcmp("-dev", next_tok)))
+                    {
+                        if ((next_tok = strtok(NULL, " \n")) == NULL)
+                        {
+                            error("route:: missing device name ..");
+                            return;
+                        }
+                        interface = gAtoi(next_tok);
+                    }
+                    deleteRouteEntry(route_tbl, net_addr, net_mask, nxth_addr, interface);
+                } else
+                    deleteRouteEntry(route_tbl, net_addr, net_mask, NULL, -1);
+            } else
+            {
+                del_route = gAtoi(next_tok);
+                deleteRouteEntryByIndex(route_tbl, del_route);
+            }
         }
         else if (!strcmp(next_tok, "show"))
-            printRouteTable(route_tbl);
+        {
+            next_tok = strtok(NULL, " \n");
+            printRouteTable(route_tbl, (next_tok != NULL) ? atoi(next_tok) : -1);
+        }
+        else if (!strcmp(next_tok, "nexthops"))
+            printRouteNexthops(route_tbl);
     }
     return;
 }
@@ -910,8 +972,11 @@ port_range_t *parsePortRangeSpec(char *instr)
     port = strtok_r(instr, "-", &savestr);
     prs->minport = atoi(port);
 
-    port = strtok_r(NULL, "-", &savestr);
-    prs->maxport = atoi(port);
+    // a single port number is a range of one port
+    if ((port = strtok_r(NULL, "-", &savestr)) != NULL)
+        prs->maxport = atoi(port);
+    else
+        prs->maxport = prs->minport;
 
     return prs;
 }
@@ -1067,6 +1132,174 @@ void filterCmd()
 }
 
 
+/*
+ * conntrack [show]
+ * conntrack list [count]
+ * conntrack [on|off]
+ * conntrack flush
+ * conntrack max entries
+ */
+void conntrackCmd()
+{
+    char *next_tok;
+    int num;
+
+    next_tok = strtok(NULL, " \n");
+    if ((next_tok == NULL) || !strcmp(next_tok, "show"))
+        printConntrack(conntrack);
+    else if (!strcmp(next_tok, "on"))
+        conntrack->enabled = 1;
+    else if (!strcmp(next_tok, "off"))
+    {
+        // entries left behind would carry stale state when tracking resumes
+        conntrack->enabled = 0;
+        flushConntrack(conntrack);
+    }
+    else if (!strcmp(next_tok, "flush"))
+        flushConntrack(conntrack);
+    else if (!strcmp(next_tok, "list"))
+    {
+        next_tok = strtok(NULL, " \n");
+        printConntrackEntries(conntrack, (next_tok != NULL) ? atoi(next_tok) : 50);
+    }
+    else if (!strcmp(next_tok, "max"))
+    {
+        if (((next_tok = strtok(NULL, " \n")) == NULL) || ((num = atoi(next_tok)) <= 0))
+        {
+            printf("Maximum number of entries: %d \n", conntrack->maxentries);
+            return;
+        }
+        conntrack->maxentries = num;
+    }
+    else
+        printf("Unknown conntrack command %s \n", next_tok);
+}
+
+
+/*
+ * nat [show]
+ * nat mappings [count]
+ * nat masq eth1 (on|off)
+ * nat dnat add eth1 (tcp|udp) port ip_addr[:port]
+ * nat dnat del eth1 (tcp|udp) port
+ * nat flush
+ */
+void natCmd()
+{
+    char *next_tok, *portstr;
+    uchar ip_addr[4];
+    int add, interface, prot, port, inport;
+
+    next_tok = strtok(NULL, " \n");
+    if ((next_tok == NULL) || !strcmp(next_tok, "show"))
+        printNAT(nat);
+    else if (!strcmp(next_tok, "mappings"))
+    {
+        next_tok = strtok(NULL, " \n");
+        printNATMappings(nat, (next_tok != NULL) ? atoi(next_tok) : 50);
+    }
+    else if (!strcmp(next_tok, "flush"))
+        flushNAT(nat);
+    else if (!strcmp(next_tok, "masq"))
+    {
+        if ((next_tok = strtok(NULL, " \n")) == NULL)
+        {
+            printf("nat:: missing interface spec .. \n");
+            return;
+        }
+        interface = gAtoi(next_tok);
+        GET_THIS_OR_THIS_PARAMETER("on", "off", "nat:: on | off expected ");
+        setNATMasquerade(nat, interface, !strcmp(next_tok, "on"));
+    }
+    else if (!strcmp(next_tok, "dnat"))
+    {
+        GET_THIS_OR_THIS_PARAMETER("add", "del", "nat:: add | del expected ");
+        add = !strcmp(next_tok, "add");
+        if ((next_tok = strtok(NULL, " \n")) == NULL)
+        {
+            printf("nat:: missing interface spec .. \n");
+            return;
+        }
+        interface = gAtoi(next_tok);
+        GET_THIS_OR_THIS_PARAMETER("tcp", "udp", "nat:: tcp | udp expected ");
+        prot = !strcmp(next_tok, "tcp") ? TCP_PROTOCOL : UDP_PROTOCOL;
+        if (((next_tok = strtok(NULL, " \n")) == NULL) || ((port = atoi(next_tok)) <= 0) || (port > 65535))
+        {
+            printf("nat:: missing or invalid port .. \n");
+            return;
+        }
+        if (!add)
+        {
+            delNATStatic(nat, interface, prot, port);
+            return;
+        }
+        if ((next_tok = strtok(NULL, " \n")) == NULL)
+        {
+            printf("nat:: missing inside address .. \n");
+            return;
+        }
+        inport = port;
+        if ((portstr = strchr(next_tok, ':')) != NULL)
+        {
+            *portstr++ = '\0';
+            if (((inport = atoi(portstr)) <= 0) || (inport > 65535))
+            {
+                printf("nat:: invalid inside port %s \n", portstr);
+                return;
+            }
+        }
+        Dot2IP(next_tok, ip_addr);
+        addNATStatic(nat, interface, prot, port, ip_addr, inport);
+    }
+    else
+        printf("Unknown nat command %s \n", next_tok);
+}
+
+
+/*
+ * trace [show]
+ * trace ring (on|off)
+ * trace dump [count] [file]
+ * trace clear
+ */
+void traceCmd()
+{
+    char *next_tok;
+    FILE *fp;
+    int count = 0, n;
+
+    next_tok = strtok(NULL, " \n");
+    if ((next_tok == NULL) || !strcmp(next_tok, "show"))
+        printTraceStats();
+    else if (!strcmp(next_tok, "ring"))
+    {
+        GET_THIS_OR_THIS_PARAMETER("on", "off", "trace:: on | off expected ");
+        traceSetRing(!strcmp(next_tok, "on"));
+    }
+    else if (!strcmp(next_tok, "clear"))
+        traceClear();
+    else if (!strcmp(next_tok, "dump"))
+    {
+        fp = stdout;
+        if (((next_tok = strtok(NULL, " \n")) != NULL) && (sscanf(next_tok, "%d", &count) == 1))
+            next_tok = strtok(NULL, " \n");
+        if ((next_tok != NULL) && ((fp = fopen(next_tok, "w")) == NULL))
+        {
+            printf("trace:: cannot open %s \n", next_tok);
+            return;
+        }
+        n = traceDump(fp, count);
+        if (fp != stdout)
+        {
+            fclose(fp);
+            printf("%d traces written to %s \n", n, next_tok);
+        }
+    }
+    else
+        printf("Unknown trace command %s \n", next_tok);
+}
+
+
 
 /*
  * prints the version number of the gRouter.
@@ -1139,6 +1372,7 @@ void pingCmd()
  * set raw-time [true | false ]
  * set update-delay value
  * set sched-cycle value
+ * set workers value
  */
 void setCmd()
 {
@@ -1158,13 +1392,19 @@ void setCmd()
                 verbose(1, "ERROR!! schedule cycle length should be positive \n");
         } else
             printf("\nSchedule cycle length: %d (microseconds) \n", rconfig.schedcycle);
+    } else if (!strcmp(next_tok, "workers"))
+    {
+        if ((next_tok = strtok(NULL, " \n")) != NULL)
+            PktCoreSetWorkers(pcore, atoi(next_tok));
+        else
+            printWorkerStats(pcore);
     } else if (!strcmp(next_tok, "verbose"))
     {
         if ((next_tok = strtok(NULL, " \n")) != NULL)
         {
             level = atoi(next_tok);
             if ((level >= 0) && (level <= 6))
-                prog_set_verbosity_level(level);
+                traceSetLevel(level);
             else
                 verbose(1, "[setCmd]:: ERROR!! level should be in [0..6] \n");
         } else
@@ -1283,6 +1523,8 @@ void getCmd()
         error("[getCmd]:: ERROR!! missing get-parameter");
     else if (!strcmp(next_tok, "sched-cycle"))
         printf("\nSchedule cycle length: %d (microseconds) \n", rconfig.schedcycle);
+    else if (!strcmp(next_tok, "workers"))
+        printWorkerStats(pcore);
     else if (!strcmp(next_tok, "verbose"))
         printf("\nVerbose level: %ld \n", prog_verbosity_level());
     else if (!strcmp(next_tok, "raw-times"))
@@ -1295,9 +1537,11 @@ void getCmd()
 
 /*
  * queue add class_name qdisc_name [-size num_slots] [-weight value] [-delay delay_microsec]
+ *           [-rate kbps] [-burst bytes] [-ceil kbps]
  * queue show
  * queue del queue_number
  * queue mod queue_number [-weight value] [-delay delay_microsec]
+ * queue mod queue_number -rate kbps [-burst bytes] [-ceil kbps]
  * queue stats [queue_number]
  */
 void queueCmd()
@@ -1306,7 +1550,9 @@ void queueCmd()
     char cname[MAX_DNAME_LEN], qdisc[MAX_DNAME_LEN];
     // the following parameters are set to default values which are sometimes overwritten
     int num_slots = 0;   // means, set to default
-    double weight = 1.0, delay = 2.0;
+    double weight = 1.0, delay = 0.0;
+    double rate = 0.0, ceilrate = 0.0;    // kbps, 0 means no limit
+    int burst = 0;
 
 
     if ((next_tok = strtok(NULL, " \n")) != NULL)
@@ -1345,8 +1591,25 @@ void queueCmd()
                     next_tok = strtok(NULL, " \n");
                     delay = atof(next_tok);
                 }
+                else if (!strcmp(next_tok, "-rate"))
+                {
+                    next_tok = strtok(NULL, " \n");
+                    rate = atof(next_tok);
+                }
+                else if (!strcmp(next_tok, "-burst"))
+                {
+                    next_tok = strtok(NULL, " \n");
+                    burst = atoi(next_tok);
+                }
+                else if (!strcmp(next_tok, "-ceil"))
+                {
+                    next_tok = strtok(NULL, " \n");
+                    ceilrate = atof(next_tok);
+                }
             }
-            addPktCoreQueue(pcore, cname, qdisc, weight, delay, num_slots);
+            if ((addPktCoreQueue(pcore, cname, qdisc, weight, delay, num_slots) == EXIT_SUCCESS) &&
+                ((rate > 0.0) || (ceilrate > 0.0)))
+                setQueueRate(pcore, cname, rate, burst, ceilrate);
         }
         else if (!strcmp(next_tok, "show"))
             printAllQueues(pcore);
@@ -1373,11 +1636,39 @@ void queueCmd()
                         next_tok = strtok(NULL, " \n");
                         modifyQueueDiscipline(pcore, cname, next_tok);
                     }
+                    else if (!strcmp(next_tok, "-delay"))
+                    {
+                        next_tok = strtok(NULL, " \n");
+                        delay = atof(next_tok);
+                        modifyQueueDelay(pcore, cname, delay);
+                    }
+                    else if (!strcmp(next_tok, "-rate"))
+                    {
+                        next_tok = strtok(NULL, " \n");
+                        rate = atof(next_tok);
+                        while ((next_tok = strtok(NULL, " \n")) != NULL)
+                        {
+                            if (!strcmp(next_tok, "-burst"))
+                            {
+                                next_tok = strtok(NULL, " \n");
+                                burst = atoi(next_tok);
+                            }
+                            else if (!strcmp(next_tok, "-ceil"))
+                            {
+                                next_tok = strtok(NULL, " \n");
+                                ceilrate = atof(next_tok);
+                            }
+                        }
+                        setQueueRate(pcore, cname, rate, burst, ceilrate);
+                    }
                 }
             }
         }
         else if (!strcmp(next_tok, "stats"))
+        {
             printQueueStats(pcore);
+            printTimerWheel(pcore->delayline);
+        }
     }
 }
 
@@ -1395,13 +1686,22 @@ void qdiscCmd()
     char *next_tok = strtok(NULL, " \n");
     double pmax = 0.9;
     double minval = 0.0, maxval = 1.0;
+    double target = CODEL_TARGET_US, interval = CODEL_INTERVAL_US;
+    int ecn = 0, flows = FQ_CODEL_FLOWS, quantum = DRR_QUANTUM;
+    char *qdisc;
 
-    if (!strcmp(next_tok, "show"))
+    if (next_tok == NULL)
+        printf("[qdiscCmd]:: missing arguments.. type help qdisc for syntax \n");
+    else if (!strcmp(next_tok, "show"))
         printQdiscs(pcore->qdiscs);
     else if (!strcmp(next_tok, "add"))
     {
-        next_tok = strtok(NULL, " \n");
-        if (!strcmp(next_tok, "red"))
+        if ((qdisc = strtok(NULL, " \n")) == NULL)
+        {
+            printf("[qdiscCmd]:: missing queueing discipline name.. \n");
+            return;
+        }
+        if (!strcmp(qdisc, "red"))
         {
             while ((next_tok = strtok(NULL, " \n")) != NULL)
             {
@@ -1422,7 +1722,39 @@ void qdiscCmd()
                 }
             }
             addRED(pcore->qdiscs, minval, maxval, pmax);
-        }
+        } else if (!strcmp(qdisc, "codel") || !strcmp(qdisc, "fq_codel"))
+        {
+            while ((next_tok = strtok(NULL, " \n")) != NULL)
+            {
+                if (!strcmp(next_tok, "-ecn"))
+                    ecn = 1;
+                else if (!strcmp(next_tok, "-target") && ((next_tok = strtok(NULL, " \n")) != NULL))
+                    target = atof(next_tok);
+                else if (!strcmp(next_tok, "-interval") && ((next_tok = strtok(NULL, " \n")) != NULL))
+                    interval = atof(next_tok);
+                else if (!strcmp(next_tok, "-flows") && ((next_tok = strtok(NULL, " \n")) != NULL))
+                    flows = atoi(next_tok);
+                else if (!strcmp(next_tok, "-quantum") && ((next_tok = strtok(NULL, " \n")) != NULL))
+                    quantum = atoi(next_tok);
+                else
+                {
+                    printf("[qdiscCmd]:: unknown or incomplete option %s.. \n", next_tok);
+                    return;
+                }
+            }
+            if ((target <= 0.0) || (interval < target))
+            {
+                printf("[qdiscCmd]:: need 0 < target <= interval (microseconds).. \n");
+                return;
+            }
+            if (!strcmp(qdisc, "codel"))
+                addCoDel(pcore->qdiscs, target, interval, ecn);
+            else if ((flows < 1) || (flows > FQ_CODEL_MAX_FLOWS) || (quantum < 1))
+                printf("[qdiscCmd]:: flows must be in 1..%d and quantum positive.. \n", FQ_CODEL_MAX_FLOWS);
+            else
+                addFQCoDel(pcore->qdiscs, target, interval, ecn, flows, quantum);
+        } else if (lookupQDisc(pcore->qdiscs, qdisc) < 0)
+            printf("[qdiscCmd]:: unknown queueing discipline %s.. \n", qdisc);
     }
 }
 
@@ -1430,13 +1762,35 @@ void qdiscCmd()
 
 /*
  * spolicy show
+ * spolicy activate [rr | drr | wfq]
  */
 void spolicyCmd()
 {
     char *next_tok = strtok(NULL, " \n");
 
-    if (!strcmp(next_tok, "show"))
-        printf("Scheduling policy: rr (round robin)\n");
+    if ((next_tok == NULL) || !strcmp(next_tok, "show"))
+        printSchedulingPolicy(pcore);
+    else if (!strcmp(next_tok, "activate"))
+    {
+        if ((next_tok = strtok(NULL, " \n")) != NULL)
+            setSchedulingPolicy(pcore, next_tok);
+        else
+            error("[spolicyCmd]:: ERROR!! missing policy name (rr, drr, or wfq)");
+    }
+}
+
+
+/*
+ * pktpool [show]
+ */
+void pktpoolCmd()
+{
+    char *next_tok = strtok(NULL, " \n");
+
+    if ((next_tok == NULL) || !strcmp(next_tok, "show"))
+        printPacketPoolStats();
+    else
+        error("[pktpoolCmd]:: ERROR!! unknown pktpool action %s", next_tok);
 }
 
 void openflowCmd()
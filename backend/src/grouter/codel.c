@@ -0,0 +1,483 @@
+/*
+ * codel.c (CoDel and FQ-CoDel queueing disciplines for the core queues)
+ *
+ * CoDel (RFC 8289) looks at how long the packet at the head of the queue
+ * has been waiting. Once the sojourn time stays above the target for a
+ * whole interval, it drops (or ECN marks) packets at the head at a rate
+ * that grows with the square root of the drop count until the delay comes
+ * back under the target. All decisions are taken at dequeue time by the
+ * scheduler thread, so there is no locking here.
+ *
+ * FQ-CoDel (RFC 8290) hashes the packets into flow sub-queues, serves them
+ * with byte based DRR (new flows first) and runs CoDel on each flow.
+ */
+
+#include <slack/std.h>
+#include <slack/err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "protocols.h"
+#include "message.h"
+#include "pktpool.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "codel.h"
+
+
+static void initCoDel(codel_t *cv, qentrytype_t *qentry)
+{
+	memset(cv, 0, sizeof(codel_t));
+	cv->target = (uint64_t)(qentry->target * 1000);
+	cv->interval = (uint64_t)(qentry->interval * 1000);
+	cv->ecn = qentry->ecn;
+}
+
+
+codelqdisc_t *createCoDelQdisc(qentrytype_t *qentry, int limit)
+{
+	codelqdisc_t *cq;
+	int j;
+
+	if ((cq = (codelqdisc_t *)calloc(1, sizeof(codelqdisc_t))) == NULL)
+	{
+		error("[createCoDelQdisc]:: unable to allocate the CoDel state.. ");
+		return NULL;
+	}
+
+	initCoDel(&(cq->cv), qentry);
+	if (strcmp(qentry->name, "fq_codel"))
+		return cq;
+
+	cq->fq = 1;
+	cq->nflows = qentry->flows;
+	cq->quantum = qentry->quantum;
+	cq->limit = limit;
+	if ((cq->flows = (fqflow_t *)calloc(cq->nflows, sizeof(fqflow_t))) == NULL)
+	{
+		error("[createCoDelQdisc]:: unable to allocate %d flows.. ", cq->nflows);
+		free(cq);
+		return NULL;
+	}
+	for (j = 0; j < cq->nflows; j++)
+		initCoDel(&(cq->flows[j].cv), qentry);
+	return cq;
+}
+
+
+void destroyCoDelQdisc(codelqdisc_t *cq)
+{
+	gpacket_t *pkt;
+	int j;
+
+	for (j = 0; j < cq->nflows; j++)
+		while ((pkt = cq->flows[j].head) != NULL)
+		{
+			cq->flows[j].head = pkt->frame.qnext;
+			freePacket(pkt);
+		}
+	free(cq->flows);
+	free(cq);
+}
+
+
+/*
+ * Set CE on an ECN capable IP packet. The TOS byte shares a 16 bit word
+ * with the version and header length, so the header checksum is patched
+ * incrementally (RFC 1624). Returns 0 if the packet is not ECN capable.
+ */
+static int codelMarkCE(codel_t *cv, gpacket_t *pkt)
+{
+	ip_packet_t *ip_pkt;
+	uint8_t *hdr;
+	uint16_t oldw, neww;
+	uint32_t sum;
+
+	if (!cv->ecn || (ntohs(pkt->data->header.prot) != IP_PROTOCOL))
+		return 0;
+	ip_pkt = (ip_packet_t *)pkt->data->data;
+	if ((ip_pkt->ip_tos & 0x3) == 0)
+		return 0;
+
+	if ((ip_pkt->ip_tos & 0x3) != 0x3)
+	{
+		hdr = (uint8_t *)ip_pkt;
+		oldw = (hdr[0] << 8) | hdr[1];
+		ip_pkt->ip_tos |= 0x3;
+		neww = (hdr[0] << 8) | hdr[1];
+		sum = (~ntohs(ip_pkt->ip_cksum) & 0xFFFF) + (~oldw & 0xFFFF) + neww;
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		ip_pkt->ip_cksum = htons(~sum & 0xFFFF);
+	}
+	cv->marks++;
+	return 1;
+}
+
+
+static uint64_t codelControlLaw(codel_t *cv, uint64_t t)
+{
+	return t + (uint64_t)(cv->interval / sqrt((double)cv->count));
+}
+
+
+/*
+ * Where the packets of one CoDel instance live: the ring of the queue for
+ * "codel", one flow for "fq_codel".
+ */
+typedef struct _codelsrc_t
+{
+	simplequeue_t *thisq;
+	codelqdisc_t *cq;
+	fqflow_t *flow;
+} codelsrc_t;
+
+
+static gpacket_t *codelSrcPeek(codelsrc_t *src, int *qlen)
+{
+	gpacket_t **hpkt;
+	int size;
+
+	if (src->flow != NULL)
+	{
+		*qlen = src->flow->qlen;
+		return src->flow->head;
+	}
+	*qlen = src->thisq->cursize;
+	if (peekQueue(src->thisq, (void **)&hpkt, &size) == EXIT_FAILURE)
+		return NULL;
+	return *hpkt;
+}
+
+
+static gpacket_t *codelSrcPop(codelsrc_t *src)
+{
+	fqflow_t *flow = src->flow;
+	gpacket_t *pkt;
+	int size;
+
+	if (flow == NULL)
+		return (readQueue(src->thisq, (void **)&pkt, &size) == EXIT_SUCCESS) ? pkt : NULL;
+
+	if ((pkt = flow->head) == NULL)
+		return NULL;
+	if ((flow->head = pkt->frame.qnext) == NULL)
+		flow->tail = NULL;
+	flow->qlen--;
+	flow->backlog -= packetLength(pkt);
+	src->cq->qlen--;
+	return pkt;
+}
+
+
+static void codelDrop(pktcore_t *pcore, codel_t *cv, codelsrc_t *src)
+{
+	gpacket_t *pkt;
+
+	if ((pkt = codelSrcPop(src)) == NULL)
+		return;
+	verbose(2, "[codelDrop]:: CoDel dropped packet from queue [%s].. ", src->thisq->name);
+	freePacket(pkt);
+	cv->drops++;
+	__atomic_sub_fetch(&(pcore->packetcnt), 1, __ATOMIC_RELAXED);
+}
+
+
+// the dodequeue() step of RFC 8289: may we drop the packet at the head?
+static gpacket_t *codelPeek(codel_t *cv, codelsrc_t *src, uint64_t now, int *okdrop)
+{
+	gpacket_t *pkt;
+	uint64_t sojourn;
+	int qlen;
+
+	*okdrop = 0;
+	if ((pkt = codelSrcPeek(src, &qlen)) == NULL)
+	{
+		cv->first_above_time = 0;
+		return NULL;
+	}
+
+	sojourn = (now > pkt->frame.qtime) ? now - pkt->frame.qtime : 0;
+	if ((sojourn < cv->target) || (qlen <= 1))
+		// below target, or too little queued to build a standing queue
+		cv->first_above_time = 0;
+	else if (cv->first_above_time == 0)
+		cv->first_above_time = now + cv->interval;
+	else if (now >= cv->first_above_time)
+		*okdrop = 1;
+	return pkt;
+}
+
+
+/*
+ * Run the CoDel state machine on the source and return the packet that
+ * goes next, leaving it at the head. Dropped packets are freed here.
+ */
+static gpacket_t *codelHead(pktcore_t *pcore, codel_t *cv, codelsrc_t *src, uint64_t now)
+{
+	gpacket_t *pkt;
+	uint32_t delta;
+	int okdrop;
+
+	pkt = codelPeek(cv, src, now, &okdrop);
+	if (cv->dropping)
+	{
+		if (!okdrop)
+			cv->dropping = 0;
+		while (cv->dropping && (now >= cv->drop_next))
+		{
+			cv->count++;
+			if (codelMarkCE(cv, pkt))
+			{
+				cv->drop_next = codelControlLaw(cv, cv->drop_next);
+				break;
+			}
+			codelDrop(pcore, cv, src);
+			pkt = codelPeek(cv, src, now, &okdrop);
+			if (!okdrop)
+				cv->dropping = 0;
+			else
+				cv->drop_next = codelControlLaw(cv, cv->drop_next);
+		}
+	} else if (okdrop)
+	{
+		if (!codelMarkCE(cv, pkt))
+		{
+			codelDrop(pcore, cv, src);
+			pkt = codelPeek(cv, src, now, &okdrop);
+		}
+		cv->dropping = 1;
+		// start near the drop rate that controlled the queue last time
+		delta = cv->count - cv->lastcount;
+		if ((delta > 1) && (now - cv->drop_next < 16 * cv->interval))
+			cv->count = delta;
+		else
+			cv->count = 1;
+		cv->drop_next = codelControlLaw(cv, now);
+		cv->lastcount = cv->count;
+	}
+	return pkt;
+}
+
+
+static void fqListAppend(fqlist_t *list, fqflow_t *flow, int which)
+{
+	flow->next = NULL;
+	flow->onlist = which;
+	if (list->tail == NULL)
+		list->head = flow;
+	else
+		list->tail->next = flow;
+	list->tail = flow;
+}
+
+
+static fqflow_t *fqListPop(fqlist_t *list)
+{
+	fqflow_t *flow;
+
+	if ((flow = list->head) != NULL)
+	{
+		if ((list->head = flow->next) == NULL)
+			list->tail = NULL;
+		flow->next = NULL;
+		flow->onlist = FQ_LIST_NONE;
+	}
+	return flow;
+}
+
+
+// over the limit: drop at the head of the flow holding the most bytes
+static void fqDropFattest(pktcore_t *pcore, simplequeue_t *thisq, codelqdisc_t *cq)
+{
+	codelsrc_t src;
+	fqflow_t *fat;
+	int j;
+
+	fat = &(cq->flows[0]);
+	for (j = 1; j < cq->nflows; j++)
+		if (cq->flows[j].backlog > fat->backlog)
+			fat = &(cq->flows[j]);
+
+	if (fat == cq->curflow)
+		cq->curflow = NULL;
+	src.thisq = thisq;
+	src.cq = cq;
+	src.flow = fat;
+	codelDrop(pcore, &(fat->cv), &src);
+	cq->overlimit++;
+}
+
+
+// move everything waiting in the ring into the flow sub-queues
+static void fqDrainRing(pktcore_t *pcore, simplequeue_t *thisq, codelqdisc_t *cq)
+{
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	gpacket_t *pkt;
+	fqflow_t *flow;
+	int npkts, j;
+
+	while ((npkts = readQueueBurst(thisq, pkts, sizes, QUEUE_BURST_SIZE)) > 0)
+		for (j = 0; j < npkts; j++)
+		{
+			pkt = (gpacket_t *)pkts[j];
+			flow = &(cq->flows[pktFlowHash(pkt) % cq->nflows]);
+			pkt->frame.qnext = NULL;
+			if (flow->tail == NULL)
+				flow->head = pkt;
+			else
+				flow->tail->frame.qnext = pkt;
+			flow->tail = pkt;
+			flow->qlen++;
+			flow->backlog += packetLength(pkt);
+			if (flow->onlist == FQ_LIST_NONE)
+			{
+				flow->deficit = cq->quantum;
+				fqListAppend(&(cq->newflows), flow, FQ_LIST_NEW);
+			}
+			if (++cq->qlen > cq->limit)
+				fqDropFattest(pcore, thisq, cq);
+		}
+}
+
+
+static int fqCoDelHead(pktcore_t *pcore, simplequeue_t *thisq, codelqdisc_t *cq, uint64_t now)
+{
+	codelsrc_t src;
+	fqlist_t *list;
+	fqflow_t *flow;
+	gpacket_t *pkt;
+
+	fqDrainRing(pcore, thisq, cq);
+	if ((cq->curflow != NULL) && (cq->curflow->head != NULL))
+		return packetLength(cq->curflow->head);
+
+	src.thisq = thisq;
+	src.cq = cq;
+	for (;;)
+	{
+		list = (cq->newflows.head != NULL) ? &(cq->newflows) : &(cq->oldflows);
+		if ((flow = list->head) == NULL)
+		{
+			cq->curflow = NULL;
+			return -1;
+		}
+
+		if (flow->deficit <= 0)
+		{
+			flow->deficit += cq->quantum;
+			fqListAppend(&(cq->oldflows), fqListPop(list), FQ_LIST_OLD);
+			continue;
+		}
+
+		src.flow = flow;
+		if ((pkt = codelHead(pcore, &(flow->cv), &src, now)) == NULL)
+		{
+			// an emptied new flow takes one turn on the old list first
+			fqListPop(list);
+			if ((list == &(cq->newflows)) && (cq->oldflows.head != NULL))
+				fqListAppend(&(cq->oldflows), flow, FQ_LIST_OLD);
+			continue;
+		}
+
+		cq->curflow = flow;
+		return packetLength(pkt);
+	}
+}
+
+
+/*
+ * Length of the packet the queue releases next, or -1 if there is none.
+ * Packets that CoDel drops on the way are freed and taken off packetcnt.
+ */
+int codelQueueHead(pktcore_t *pcore, simplequeue_t *thisq, uint64_t now)
+{
+	codelqdisc_t *cq = thisq->codel;
+	codelsrc_t src;
+	gpacket_t *pkt;
+	int qlen;
+
+	if (cq->fq)
+		return fqCoDelHead(pcore, thisq, cq, now);
+
+	src.thisq = thisq;
+	src.cq = cq;
+	src.flow = NULL;
+	// the head already went through CoDel but did not fit the scheduler
+	if (cq->headready && ((pkt = codelSrcPeek(&src, &qlen)) != NULL))
+		return packetLength(pkt);
+
+	if ((pkt = codelHead(pcore, &(cq->cv), &src, now)) == NULL)
+		return -1;
+	cq->headready = 1;
+	return packetLength(pkt);
+}
+
+
+// take the packet chosen by codelQueueHead()
+int codelQueuePop(simplequeue_t *thisq, void **pkt, int *size)
+{
+	codelqdisc_t *cq = thisq->codel;
+	codelsrc_t src;
+	gpacket_t *gpkt;
+	fqflow_t *flow;
+
+	if (!cq->fq)
+	{
+		cq->headready = 0;
+		return readQueue(thisq, pkt, size);
+	}
+
+	if ((flow = cq->curflow) == NULL)
+		return EXIT_FAILURE;
+	src.thisq = thisq;
+	src.cq = cq;
+	src.flow = flow;
+	if ((gpkt = codelSrcPop(&src)) == NULL)
+		return EXIT_FAILURE;
+	flow->deficit -= packetLength(gpkt);
+	cq->curflow = NULL;
+	*pkt = gpkt;
+	*size = sizeof(gpacket_t);
+	return EXIT_SUCCESS;
+}
+
+
+// packets held outside the ring (in the FQ-CoDel flows)
+int codelBacklog(simplequeue_t *thisq)
+{
+	codelqdisc_t *cq = thisq->codel;
+
+	return ((cq != NULL) && cq->fq) ? __atomic_load_n(&(cq->qlen), __ATOMIC_RELAXED) : 0;
+}
+
+
+void printCoDelQdisc(codelqdisc_t *cq)
+{
+	unsigned long drops, marks;
+	int j, active;
+
+	if (!cq->fq)
+	{
+		printf("CoDel: target %llu us interval %llu us ecn %s dropping %d count %u drops %lu marks %lu\n",
+		       (unsigned long long)(cq->cv.target / 1000), (unsigned long long)(cq->cv.interval / 1000),
+		       cq->cv.ecn ? "on" : "off", cq->cv.dropping, cq->cv.count, cq->cv.drops, cq->cv.marks);
+		return;
+	}
+
+	drops = marks = 0;
+	active = 0;
+	for (j = 0; j < cq->nflows; j++)
+	{
+		drops += cq->flows[j].cv.drops;
+		marks += cq->flows[j].cv.marks;
+		if (cq->flows[j].qlen > 0)
+			active++;
+	}
+	printf("FQ-CoDel: flows %d (%d backlogged) quantum %ld limit %d ecn %s queued %d drops %lu marks %lu overlimit %lu\n",
+	       cq->nflows, active, cq->quantum, cq->limit, cq->flows[0].cv.ecn ? "on" : "off",
+	       cq->qlen, drops, marks, cq->overlimit);
+}
@@ -0,0 +1,509 @@
+/*
+ * conntrack.c (connection tracker)
+ *
+ * Entries live in a chained hash table whose hash is symmetric in the two
+ * endpoints, so both directions of a flow land in the same bucket. The
+ * buckets are guarded by striped locks. Each entry has exactly one pending
+ * timer in the conntrack timer wheel; packets only push the expiry time
+ * forward, and the timer either re-arms itself or frees the entry. An
+ * entry is therefore only freed by its timer, which lets the packet and
+ * CLI paths unlink entries without racing the wheel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <slack/std.h>
+#include <slack/err.h>
+
+#include "protocols.h"
+#include "ip.h"
+#include "icmp.h"
+#include "tokenbucket.h"
+#include "conntrack.h"
+
+
+#define CT_TCP_FIN                  0x01
+#define CT_TCP_SYN                  0x02
+#define CT_TCP_RST                  0x04
+#define CT_TCP_ACK                  0x10
+
+#define CT_SEC                      1000000000ULL
+
+
+// Flow fields of one packet, in the packet's direction
+typedef struct _ctkey_t
+{
+	uint32_t src, dst;
+	uint16_t sport, dport;
+	uint8_t prot;
+	uint8_t flags;                          // TCP flags
+	uint8_t cancreate;                      // the packet may open an entry
+} ctkey_t;
+
+
+static char *ctstatenames[CT_NSTATES] = {"SYN_SENT", "SYN_RECV", "ESTABLISHED", "FIN_WAIT",
+					 "TIME_WAIT", "CLOSE", "UNREPLIED", "REPLIED"};
+
+// seconds an entry stays without traffic in each state
+static const uint64_t cttimeouts[CT_NSTATES] = {120, 60, 5 * 24 * 3600, 120, 120, 10, 30, 180};
+
+#define CT_ICMP_TIMEOUT             30
+
+
+static void expireConntrack(void *arg, twentry_t *list);
+
+
+conntrack_t *createConntrack(int maxentries)
+{
+	conntrack_t *ct;
+	int i;
+
+	if ((ct = (conntrack_t *)calloc(1, sizeof(conntrack_t))) == NULL)
+	{
+		fatal("[createConntrack]:: Could not allocate memory for the connection tracker ");
+		return NULL;
+	}
+	ct->maxentries = maxentries;
+	for (i = 0; i < CT_LOCKS; i++)
+		pthread_mutex_init(&(ct->locks[i]), NULL);
+	if ((ct->timers = createTimerWheel("conntrack", expireConntrack, ct)) == NULL)
+	{
+		fatal("[createConntrack]:: Could not create the conntrack timer wheel ");
+		return NULL;
+	}
+	ct->lastshow = monotonicNanos();
+	return ct;
+}
+
+
+/*
+ * Symmetric in the (address, port) endpoints: a flow and its reply hash
+ * to the same bucket.
+ */
+static inline uint32_t ctHash(uint32_t a, uint16_t aport, uint32_t b, uint16_t bport, uint8_t prot)
+{
+	uint32_t h;
+
+	h = ((a ^ b) * 0x9e3779b1u) ^
+		(((a + b) ^ ((uint32_t)(aport + bport) << 16) ^ (uint32_t)(aport ^ bport) ^ prot) * 0x85ebca77u);
+	return (h ^ (h >> 16)) & (CT_BUCKETS - 1);
+}
+
+
+static inline pthread_mutex_t *ctLock(conntrack_t *ct, uint32_t b)
+{
+	return &(ct->locks[b & (CT_LOCKS - 1)]);
+}
+
+
+/*
+ * Extract the flow of an IP packet. Returns 0 for packets that are not
+ * tracked: non-initial fragments (no ports), protocols other than TCP,
+ * UDP and ICMP, and ICMP messages other than echo request and reply.
+ */
+static int getConntrackKey(gpacket_t *in_pkt, ctkey_t *key)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
+	uchar *l4hdr = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+	icmphdr_t *icmphdr;
+
+	if ((ntohs(ip_pkt->ip_frag_off) & IP_OFFMASK) != 0)
+		return 0;
+
+	memcpy(&(key->src), ip_pkt->ip_src, 4);
+	memcpy(&(key->dst), ip_pkt->ip_dst, 4);
+	key->prot = ip_pkt->ip_prot;
+	key->flags = 0;
+	key->cancreate = 1;
+	switch (key->prot)
+	{
+	case TCP_PROTOCOL:
+		key->sport = (l4hdr[0] << 8) | l4hdr[1];
+		key->dport = (l4hdr[2] << 8) | l4hdr[3];
+		key->flags = l4hdr[13];
+		// a reset never opens a connection
+		key->cancreate = !(key->flags & CT_TCP_RST);
+		return 1;
+	case UDP_PROTOCOL:
+		key->sport = (l4hdr[0] << 8) | l4hdr[1];
+		key->dport = (l4hdr[2] << 8) | l4hdr[3];
+		return 1;
+	case ICMP_PROTOCOL:
+		icmphdr = (icmphdr_t *)l4hdr;
+		if ((icmphdr->type != ICMP_ECHO_REQUEST) && (icmphdr->type != ICMP_ECHO_REPLY))
+			return 0;
+		key->sport = key->dport = ntohs(icmphdr->un.echo.id);
+		key->cancreate = (icmphdr->type == ICMP_ECHO_REQUEST);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Find the entry of the flow in bucket b and set *dir to the direction of
+ * the key. Called with the bucket lock held.
+ */
+static ctentry_t *findConntrackEntry(conntrack_t *ct, uint32_t b, ctkey_t *key, int *dir)
+{
+	ctentry_t *e;
+
+	for (e = ct->buckets[b]; e != NULL; e = e->next)
+	{
+		if (e->prot != key->prot)
+			continue;
+		if ((e->src == key->src) && (e->dst == key->dst) && (e->sport == key->sport) && (e->dport == key->dport))
+		{
+			*dir = CT_ORIGINAL;
+			return e;
+		}
+		if ((e->src == key->dst) && (e->dst == key->src) && (e->sport == key->dport) && (e->dport == key->sport))
+		{
+			*dir = CT_REPLY;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+static inline uint64_t conntrackTimeout(ctentry_t *e)
+{
+	return ((e->prot == ICMP_PROTOCOL) ? CT_ICMP_TIMEOUT : cttimeouts[e->state]) * CT_SEC;
+}
+
+
+// Move the entry to its next state on a packet of the given direction
+static void updateConntrackState(ctentry_t *e, ctkey_t *key, int dir)
+{
+	int flags = key->flags;
+
+	if (e->prot != TCP_PROTOCOL)
+	{
+		if (dir == CT_REPLY)
+			e->state = CT_REPLIED;
+		return;
+	}
+
+	if (flags & CT_TCP_RST)
+	{
+		e->state = CT_TCP_CLOSE;
+		return;
+	}
+	switch (e->state)
+	{
+	case CT_TCP_SYN_SENT:
+		if ((dir == CT_REPLY) && (flags & CT_TCP_SYN) && (flags & CT_TCP_ACK))
+			e->state = CT_TCP_SYN_RECV;
+		break;
+	case CT_TCP_SYN_RECV:
+		if ((dir == CT_ORIGINAL) && (flags & CT_TCP_ACK) && !(flags & CT_TCP_SYN))
+			e->state = CT_TCP_ESTABLISHED;
+		break;
+	case CT_TCP_TIME_WAIT:
+	case CT_TCP_CLOSE:
+		// the ports are being reused for a new connection
+		if ((dir == CT_ORIGINAL) && (flags & CT_TCP_SYN) && !(flags & CT_TCP_ACK))
+		{
+			e->state = CT_TCP_SYN_SENT;
+			e->finseen = 0;
+		}
+		return;
+	}
+	if (flags & CT_TCP_FIN)
+	{
+		e->finseen |= 1 << dir;
+		e->state = (e->finseen == 3) ? CT_TCP_TIME_WAIT : CT_TCP_FIN_WAIT;
+	}
+}
+
+
+static void updateConntrackEntry(ctentry_t *e, ctkey_t *key, int dir, int len, uint64_t now)
+{
+	updateConntrackState(e, key, dir);
+	e->pkts[dir]++;
+	e->bytes[dir] += len;
+	e->expires = now + conntrackTimeout(e);
+}
+
+
+// Arm the timer of the entry for its expiry time, waiting at most CT_RECHECK_SECS
+static int armConntrackTimer(conntrack_t *ct, ctentry_t *e, uint64_t now)
+{
+	uint64_t delay_us;
+
+	delay_us = (e->expires > now) ? (e->expires - now) / 1000 : 0;
+	delay_us = min(delay_us, (uint64_t)CT_RECHECK_SECS * 1000000);
+	return addTimerWheelEntry(ct->timers, delay_us, e, 0, ct);
+}
+
+
+static void unlinkConntrackEntry(conntrack_t *ct, uint32_t b, ctentry_t *e)
+{
+	ctentry_t **pe;
+
+	for (pe = &(ct->buckets[b]); *pe != NULL; pe = &((*pe)->next))
+		if (*pe == e)
+		{
+			*pe = e->next;
+			__atomic_sub_fetch(&(ct->count), 1, __ATOMIC_RELAXED);
+			return;
+		}
+}
+
+
+// Unlink a live entry; its timer frees it. Called with the bucket lock held.
+static void killConntrackEntry(conntrack_t *ct, uint32_t b, ctentry_t *e)
+{
+	unlinkConntrackEntry(ct, b, e);
+	e->dead = 1;
+	__atomic_add_fetch(&(ct->dying), 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Open an entry for the flow of key in bucket b, with key giving the
+ * original direction. Called with the bucket lock held. Returns NULL if
+ * the table is full or memory runs out.
+ */
+static ctentry_t *insertConntrackEntry(conntrack_t *ct, uint32_t b, ctkey_t *key, int len, uint64_t now)
+{
+	ctentry_t *e;
+
+	if ((__atomic_load_n(&(ct->count), __ATOMIC_RELAXED) >= ct->maxentries) ||
+	    ((e = (ctentry_t *)calloc(1, sizeof(ctentry_t))) == NULL))
+	{
+		__atomic_add_fetch(&(ct->insertfails), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	e->src = key->src;
+	e->dst = key->dst;
+	e->sport = key->sport;
+	e->dport = key->dport;
+	e->prot = key->prot;
+	if (e->prot == TCP_PROTOCOL)
+		// without a SYN we pick the connection up in the middle
+		e->state = ((key->flags & (CT_TCP_SYN | CT_TCP_ACK)) == CT_TCP_SYN) ? CT_TCP_SYN_SENT : CT_TCP_ESTABLISHED;
+	else
+		e->state = CT_UNREPLIED;
+	updateConntrackEntry(e, key, CT_ORIGINAL, len, now);
+
+	if (armConntrackTimer(ct, e, now) == EXIT_FAILURE)
+	{
+		free(e);
+		__atomic_add_fetch(&(ct->insertfails), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	e->next = ct->buckets[b];
+	ct->buckets[b] = e;
+	__atomic_add_fetch(&(ct->count), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ct->inserts), 1, __ATOMIC_RELAXED);
+	return e;
+}
+
+
+/*
+ * Expiry function of the conntrack timer wheel. Entries that saw traffic
+ * since their timer was armed get a new timer; the others are unlinked
+ * and freed, as are the entries killed since.
+ */
+static void expireConntrack(void *arg, twentry_t *list)
+{
+	conntrack_t *ct = (conntrack_t *)arg;
+	ctentry_t *e;
+	uint64_t now = monotonicNanos();
+	uint32_t b;
+
+	for (; list != NULL; list = list->next)
+	{
+		e = (ctentry_t *)list->data;
+		b = ctHash(e->src, e->sport, e->dst, e->dport, e->prot);
+		pthread_mutex_lock(ctLock(ct, b));
+		if (e->dead)
+			__atomic_sub_fetch(&(ct->dying), 1, __ATOMIC_RELAXED);
+		else if ((e->expires > now) && (armConntrackTimer(ct, e, now) == EXIT_SUCCESS))
+		{
+			pthread_mutex_unlock(ctLock(ct, b));
+			continue;
+		}
+		else
+		{
+			unlinkConntrackEntry(ct, b, e);
+			__atomic_add_fetch(&(ct->expires), 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(ctLock(ct, b));
+		free(e);
+	}
+}
+
+
+/*
+ * Filter and tag an IP packet through the connection tracker. Packets of
+ * a known flow reuse the queue tag cached for their direction as long as
+ * the class index has not been rebuilt since; replies are never filtered.
+ * The first packet of a flow is classified as usual and, if allowed,
+ * opens an entry. Packets that cannot be tracked are classified without
+ * state. Returns EXIT_FAILURE if the packet is to be dropped, like
+ * classifyPacket().
+ */
+int trackPacket(conntrack_t *ct, pktcore_t *pcore, gpacket_t *in_pkt, simplequeue_t **thisq)
+{
+	ctkey_t key;
+	ctentry_t *e;
+	unsigned int gen;
+	uint64_t now;
+	uint32_t b;
+	int dir, len, filtered;
+
+	if ((ntohs(in_pkt->data->header.prot) != IP_PROTOCOL) || !getConntrackKey(in_pkt, &key))
+		return classifyPacket(pcore, in_pkt, thisq, 0);
+
+	len = packetLength(in_pkt);
+	gen = getClassIndexGen(pcore);
+	now = monotonicNanos();
+	b = ctHash(key.src, key.sport, key.dst, key.dport, key.prot);
+
+	pthread_mutex_lock(ctLock(ct, b));
+	if ((e = findConntrackEntry(ct, b, &key, &dir)) != NULL)
+	{
+		updateConntrackEntry(e, &key, dir, len, now);
+		if ((e->tag[dir] != NULL) && (e->taggen[dir] == gen))
+		{
+			*thisq = e->tag[dir];
+			pthread_mutex_unlock(ctLock(ct, b));
+			return EXIT_SUCCESS;
+		}
+		pthread_mutex_unlock(ctLock(ct, b));
+
+		// first packet of this direction, or the rules changed: the
+		// original direction is filtered again, the reply is only tagged
+		filtered = (dir == CT_ORIGINAL);
+		if (classifyPacket(pcore, in_pkt, thisq, !filtered) == EXIT_FAILURE)
+		{
+			pthread_mutex_lock(ctLock(ct, b));
+			if ((e = findConntrackEntry(ct, b, &key, &dir)) != NULL)
+				killConntrackEntry(ct, b, e);
+			pthread_mutex_unlock(ctLock(ct, b));
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		pthread_mutex_unlock(ctLock(ct, b));
+		if (classifyPacket(pcore, in_pkt, thisq, 0) == EXIT_FAILURE)
+			return EXIT_FAILURE;
+		filtered = 1;
+		if (!key.cancreate)
+			return EXIT_SUCCESS;
+	}
+
+	// store the tag, opening the entry unless another packet of the flow
+	// got there first; only a packet that passed the filter opens one
+	pthread_mutex_lock(ctLock(ct, b));
+	if ((e = findConntrackEntry(ct, b, &key, &dir)) == NULL)
+	{
+		dir = CT_ORIGINAL;
+		e = (key.cancreate && filtered) ? insertConntrackEntry(ct, b, &key, len, now) : NULL;
+	}
+	if (e != NULL)
+	{
+		e->tag[dir] = *thisq;
+		e->taggen[dir] = gen;
+	}
+	pthread_mutex_unlock(ctLock(ct, b));
+	return EXIT_SUCCESS;
+}
+
+
+// Drop all entries; their timers free them
+void flushConntrack(conntrack_t *ct)
+{
+	ctentry_t *e;
+	uint32_t b;
+
+	for (b = 0; b < CT_BUCKETS; b++)
+	{
+		pthread_mutex_lock(ctLock(ct, b));
+		while ((e = ct->buckets[b]) != NULL)
+			killConntrackEntry(ct, b, e);
+		pthread_mutex_unlock(ctLock(ct, b));
+	}
+}
+
+
+void printConntrack(conntrack_t *ct)
+{
+	ctentry_t *e;
+	unsigned long states[CT_NSTATES], inserts, expires;
+	uint64_t now = monotonicNanos();
+	double secs;
+	uint32_t b;
+	int i;
+
+	memset(states, 0, sizeof(states));
+	for (b = 0; b < CT_BUCKETS; b++)
+	{
+		if (ct->buckets[b] == NULL)
+			continue;
+		pthread_mutex_lock(ctLock(ct, b));
+		for (e = ct->buckets[b]; e != NULL; e = e->next)
+			states[e->state]++;
+		pthread_mutex_unlock(ctLock(ct, b));
+	}
+
+	inserts = __atomic_load_n(&(ct->inserts), __ATOMIC_RELAXED);
+	expires = __atomic_load_n(&(ct->expires), __ATOMIC_RELAXED);
+	secs = (double)(now - ct->lastshow) / CT_SEC;
+
+	printf("Connection tracking is %s\n", ct->enabled ? "on" : "off");
+	printf("Entries: %d of %d (%d waiting to be freed)\n", ct->count, ct->maxentries, ct->dying);
+	printf("TCP: ");
+	for (i = CT_TCP_SYN_SENT; i <= CT_TCP_CLOSE; i++)
+		printf("%s %lu  ", ctstatenames[i], states[i]);
+	printf("\nUDP/ICMP: %s %lu  %s %lu\n", ctstatenames[CT_UNREPLIED], states[CT_UNREPLIED],
+	       ctstatenames[CT_REPLIED], states[CT_REPLIED]);
+	printf("Inserted: %lu (%.1f/s)  Expired: %lu (%.1f/s)  Insert failures: %lu\n",
+	       inserts, (secs > 0.0) ? (inserts - ct->lastinserts) / secs : 0.0,
+	       expires, (secs > 0.0) ? (expires - ct->lastexpires) / secs : 0.0, ct->insertfails);
+	printTimerWheel(ct->timers);
+
+	ct->lastshow = now;
+	ct->lastinserts = inserts;
+	ct->lastexpires = expires;
+}
+
+
+void printConntrackEntries(conntrack_t *ct, int max)
+{
+	ctentry_t *e;
+	char srcbuf[MAX_TMPBUF_LEN], dstbuf[MAX_TMPBUF_LEN];
+	uchar addr[4];
+	uint64_t now = monotonicNanos();
+	uint32_t b;
+	int n = 0;
+
+	printf("Prot  Source                 Destination            State        Expires  Packets (orig/reply)\n");
+	for (b = 0; (b < CT_BUCKETS) && (n < max); b++)
+	{
+		if (ct->buckets[b] == NULL)
+			continue;
+		pthread_mutex_lock(ctLock(ct, b));
+		for (e = ct->buckets[b]; (e != NULL) && (n < max); e = e->next, n++)
+		{
+			IP2Dot(srcbuf, gNtohl(addr, (uchar *)&(e->src)));
+			sprintf(srcbuf + strlen(srcbuf), ":%d", e->sport);
+			IP2Dot(dstbuf, gNtohl(addr, (uchar *)&(e->dst)));
+			sprintf(dstbuf + strlen(dstbuf), ":%d", e->dport);
+			printf("%-5s %-22s %-22s %-12s %6lus  %lu/%lu\n",
+			       (e->prot == TCP_PROTOCOL) ? "tcp" : ((e->prot == UDP_PROTOCOL) ? "udp" : "icmp"),
+			       srcbuf, dstbuf, ctstatenames[e->state],
+			       (unsigned long)((e->expires > now) ? (e->expires - now) / CT_SEC : 0),
+			       e->pkts[CT_ORIGINAL], e->pkts[CT_REPLY]);
+		}
+		pthread_mutex_unlock(ctLock(ct, b));
+	}
+	if (n < ct->count)
+		printf("... %d more entries\n", ct->count - n);
+}
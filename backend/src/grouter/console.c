@@ -5,11 +5,14 @@
 
 #include "grouter.h"
 #include "simplequeue.h"
+#include "message.h"
+#include "pktpool.h"
 #include "gpcap.h"
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <slack/std.h>
 #include <slack/err.h>
 #include <slack/fio.h>
@@ -70,29 +73,45 @@ int write_pcapheader(int fid)
 int write_pcappacket(int fid, void *buf, int len)
 {
 	pcaprec_hdr_t pchdr = {.ts_sec = 0, .ts_usec = 0};
-	int bytes;
-	void *lbuf;
+	struct iovec iov[2];
 
 	pchdr.incl_len = pchdr.orig_len = len;
-	lbuf = malloc(sizeof(pcaprec_hdr_t) + len);
-	bcopy(&pchdr, lbuf, sizeof(pcaprec_hdr_t));
-	bcopy(buf, (lbuf + sizeof(pcaprec_hdr_t)), len);
+	iov[0].iov_base = &pchdr;
+	iov[0].iov_len = sizeof(pcaprec_hdr_t);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
 
-	if (bytes = write(fid, lbuf, len + sizeof(pcaprec_hdr_t)) == -1)
+	if (writev(fid, iov, 2) == -1)
 	{
 		error("[write_pcapheader]:: error writing the pcap header ");
  		return -1; 
 	}
-	free(lbuf);
 	return 0;
 }
 
 
+/*
+ * Hand a copy of the packet to the console (wireshark) thread. The copy is
+ * a clone, so the frame is not copied; if the router changes the packet
+ * before the console has written it out, makePacketWritable() gives the
+ * router its own copy.
+ */
+void consoleCapture(gpacket_t *pkt)
+{
+	gpacket_t *cpkt;
+
+	if ((consoleq == NULL) || ((cpkt = clonePacket(pkt)) == NULL))
+		return;
+	if (writeQueue(consoleq, cpkt, sizeof(gpacket_t)) == EXIT_FAILURE)
+		freePacket(cpkt);
+}
+
+
 
 
 void consoleHandler(void *ptr)
 {
-	unsigned char *data;
+	gpacket_t *pkt;
 	int len;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
@@ -101,11 +120,11 @@ void consoleHandler(void *ptr)
 	{
 		pthread_testcancel();
 		// read a packet from the queue, wait if no packet
-		readQueue(consoleq, (void **)&data, &len);
+		readQueue(consoleq, (void **)&pkt, &len);
 		pthread_testcancel();
 		// write the fifo, block if FIFO not read (i.e., full)
-		write_pcappacket(consoleid, data, len);
-		free(data);
+		write_pcappacket(consoleid, pkt->data, packetLength(pkt));
+		freePacket(pkt);
 	}
 }
 
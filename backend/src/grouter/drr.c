@@ -0,0 +1,73 @@
+#include <slack/std.h>
+#include <slack/err.h>
+#include <pthread.h>
+
+#include "protocols.h"
+#include "packetcore.h"
+#include "message.h"
+#include "grouter.h"
+
+/*
+ * Deficit round robin (Shreedhar and Varghese) -- each active queue gets a
+ * quantum of weight * DRR_QUANTUM bytes per round and sends packets while
+ * its deficit covers the packet at the head. The quantum is at least one
+ * full size frame for weight 1.0, so the cost per packet is O(1).
+ */
+
+static long drrQuantum(simplequeue_t *thisq)
+{
+	long quantum;
+
+	quantum = (long)(thisq->weight * DRR_QUANTUM);
+	return (quantum > 0) ? quantum : 1;
+}
+
+
+void deficitRoundRobinSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap)
+{
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	simplequeue_t *thisq;
+	uint64_t now;
+	int qid, npkts, len;
+
+	verbose(2, "[deficitRoundRobinSchedule]:: Deficit round robin scheduler processing... ");
+	now = monotonicNanos();
+	while (amap != 0)
+	{
+		qid = __builtin_ctz(amap);
+		amap &= amap - 1;
+
+		if ((thisq = qarray->q[qid]) == NULL)
+		{
+			clearQueueActive(pcore, NULL, qid);
+			continue;
+		}
+
+		thisq->deficit += drrQuantum(thisq);
+		npkts = 0;
+		while (((len = getPacketLength(pcore, thisq, now)) > 0) && (len <= thisq->deficit) &&
+		       shapeQueue(pcore, thisq, len, now))
+		{
+			if (dequeueCorePacket(thisq, &(pkts[npkts]), &(sizes[npkts])) == EXIT_FAILURE)
+				break;
+			thisq->deficit -= len;
+			if (++npkts == QUEUE_BURST_SIZE)
+			{
+				dispatchPackets(pcore, pkts, sizes, npkts);
+				__atomic_sub_fetch(&(pcore->packetcnt), npkts, __ATOMIC_RELAXED);
+				npkts = 0;
+			}
+		}
+		if (npkts > 0)
+		{
+			dispatchPackets(pcore, pkts, sizes, npkts);
+			__atomic_sub_fetch(&(pcore->packetcnt), npkts, __ATOMIC_RELAXED);
+		}
+
+		// an idle queue does not keep its credit
+		if (isCoreQueueEmpty(thisq))
+			thisq->deficit = 0;
+		clearQueueActive(pcore, thisq, qid);
+	}
+}
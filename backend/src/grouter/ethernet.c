@@ -11,9 +11,11 @@
 #include "classifier.h"
 #include "protocols.h"
 #include "message.h"
+#include "pktpool.h"
 #include "gnet.h"
 #include "arp.h"
 #include "ip.h"
+#include "trace.h"
 #include <netinet/in.h>
 #include <stdlib.h>
 
@@ -49,21 +51,23 @@ void *toEthernetDev(void *arg)
 	char tmpbuf[MAX_TMPBUF_LEN];
 	int pkt_size;
 
-	verbose(2, "[toEthernetDev]:: entering the function.. ");
+	TRACE(2, "[toEthernetDev]:: entering the function.. ");
 	// find the outgoing interface and device...
 	if ((iface = findInterface(inpkt->frame.dst_interface)) != NULL)
 	{
 		/* send IP packet or ARP reply */
-		if (!inpkt->frame.openflow && inpkt->data.header.prot == htons(ARP_PROTOCOL))
+		if (!inpkt->frame.openflow && inpkt->data->header.prot == htons(ARP_PROTOCOL) &&
+		    (makePacketWritable(inpkt) != NULL))
 		{
-			apkt = (arp_packet_t *) inpkt->data.data;
+			apkt = (arp_packet_t *) inpkt->data->data;
 			COPY_MAC(apkt->src_hw_addr, iface->mac_addr);
 			COPY_IP(apkt->src_ip_addr, gHtonl(tmpbuf, iface->ip_addr));
 		}
-		pkt_size = findPacketSize(&(inpkt->data));
-		verbose(2, "[toEthernetDev]:: vpl_sendto called for interface %d..%d bytes written ", iface->interface_id, pkt_size);
-		vpl_sendto(iface->vpl_data, &(inpkt->data), pkt_size);
-		free(inpkt);          // finally destroy the memory allocated to the packet..
+		pkt_size = packetLength(inpkt);
+		TRACE(2, "[toEthernetDev]:: vpl_sendto called for interface %d..%d bytes written ", iface->interface_id, pkt_size);
+		consoleCapture(inpkt);
+		vpl_sendto(iface->vpl_data, inpkt->data, pkt_size);
+		freePacket(inpkt);          // finally destroy the memory allocated to the packet..
 	} else
 		error("[toEthernetDev]:: ERROR!! Could not find outgoing interface ...");
 
@@ -84,29 +88,35 @@ void* fromEthernetDev(void *arg)
 	uchar bcast_mac[] = MAC_BCAST_ADDR;
 
 	gpacket_t *in_pkt;
+	pkt_data_t scratch;
+	int pktsize;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);		// die as soon as cancelled
 	while (1)
 	{
-		verbose(2, "[fromEthernetDev]:: Receiving a packet ...");
-		if ((in_pkt = (gpacket_t *)malloc(sizeof(gpacket_t))) == NULL)
+		TRACE(2, "[fromEthernetDev]:: Receiving a packet ...");
+		if ((in_pkt = allocPacket(iface->device_mtu)) == NULL)
 		{
-			fatal("[fromEthernetDev]:: unable to allocate memory for packet.. ");
-			return NULL;
+			// out of packet buffers: take the frame off the device and drop it
+			vpl_recvfrom(iface->vpl_data, &scratch, sizeof(pkt_data_t));
+			TRACE(1, "[fromEthernetDev]:: Packet dropped .. no packet buffers ");
+			continue;
 		}
 
-		bzero(in_pkt, sizeof(gpacket_t));
-		vpl_recvfrom(iface->vpl_data, &(in_pkt->data), sizeof(pkt_data_t));
+		pktsize = vpl_recvfrom(iface->vpl_data, in_pkt->data, packetCapacity(in_pkt));
+		in_pkt->len = max(pktsize, 0);
+		if (pktsize > 0)
+			consoleCapture(in_pkt);
 		pthread_testcancel();
 		// check whether the incoming packet is a layer 2 broadcast or
 		// meant for this node... otherwise should be thrown..
 		// TODO: fix for promiscuous mode packet snooping.
 		if (!rconfig.openflow &&
-			(COMPARE_MAC(in_pkt->data.header.dst, iface->mac_addr) != 0) &&
-			(COMPARE_MAC(in_pkt->data.header.dst, bcast_mac) != 0))
+			(COMPARE_MAC(in_pkt->data->header.dst, iface->mac_addr) != 0) &&
+			(COMPARE_MAC(in_pkt->data->header.dst, bcast_mac) != 0))
 		{
-			verbose(1, "[fromEthernetDev]:: Packet dropped .. not for this router!? ");
-			free(in_pkt);
+			TRACE(1, "[fromEthernetDev]:: Packet dropped .. not for this router!? ");
+			freePacket(in_pkt);
 			continue;
 		}
 
@@ -115,7 +125,7 @@ void* fromEthernetDev(void *arg)
 		COPY_MAC(in_pkt->frame.src_hw_addr, iface->mac_addr);
 		COPY_IP(in_pkt->frame.src_ip_addr, iface->ip_addr);
 
-		verbose(2, "[fromEthernetDev]:: Packet is sent for enqueuing..");
+		TRACE(2, "[fromEthernetDev]:: Packet is sent for enqueuing..");
 		enqueuePacket(pcore, in_pkt, sizeof(gpacket_t), rconfig.openflow);
 	}
 }
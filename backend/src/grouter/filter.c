@@ -31,11 +31,70 @@ filtertab_t *createFilter(classlist_t *cl, int state)
 	ft->filteron = state;
 	ft->clist = cl;
 	ft->rulecnt = 0;
+	pthread_mutex_init(&(ft->lock), NULL);
+	ft->gen = 0;
+	bzero(ft->slotused, sizeof(ft->slotused));
+	ft->counters = NULL;
 
 	return ft;
 }
 
 
+// called with ft->lock held after every change to the rule table
+static void filterChanged(filtertab_t *ft)
+{
+	__atomic_add_fetch(&(ft->gen), 1, __ATOMIC_RELEASE);
+}
+
+
+unsigned int getFilterGen(filtertab_t *ft)
+{
+	return __atomic_load_n(&(ft->gen), __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Per thread hit counters. Each packet thread bumps its own counters
+ * without locks or atomic read-modify-writes; "filter stats" adds them up.
+ * There is a single filter table per router, so one thread local pointer
+ * is enough.
+ */
+static __thread filtercounters_t *mycounters = NULL;
+
+
+void countFilterHit(filtertab_t *ft, int slot)
+{
+	filtercounters_t *fc;
+
+	if ((fc = mycounters) == NULL)
+	{
+		if ((fc = (filtercounters_t *)calloc(1, sizeof(filtercounters_t))) == NULL)
+			return;
+		pthread_mutex_lock(&(ft->lock));
+		fc->next = ft->counters;
+		__atomic_store_n(&(ft->counters), fc, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&(ft->lock));
+		mycounters = fc;
+	}
+	if (slot >= 0)
+		__atomic_store_n(&(fc->hits[slot]), fc->hits[slot] + 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&(fc->nomatch), fc->nomatch + 1, __ATOMIC_RELAXED);
+}
+
+
+// sum of the slot counters over all threads; a slot < 0 sums the misses
+static unsigned long sumFilterHits(filtertab_t *ft, int slot)
+{
+	filtercounters_t *fc;
+	unsigned long sum = 0;
+
+	for (fc = __atomic_load_n(&(ft->counters), __ATOMIC_ACQUIRE); fc != NULL; fc = fc->next)
+		sum += __atomic_load_n((slot >= 0) ? &(fc->hits[slot]) : &(fc->nomatch), __ATOMIC_RELAXED);
+	return sum;
+}
+
+
 void moveRuleDown(filtertab_t *ft, int rulenum)
 {
 	filterrule_t *fr;
@@ -91,6 +150,7 @@ void moveRuleBottom(filtertab_t *ft, int rulenum)
 
 void moveRule(filtertab_t *ft, int rulenum, char *dir)
 {
+	pthread_mutex_lock(&(ft->lock));
 	if (!strcmp(dir, "up"))
 			moveRuleUp(ft, rulenum);
 	else if (!strcmp(dir, "down"))
@@ -101,6 +161,8 @@ void moveRule(filtertab_t *ft, int rulenum, char *dir)
 		moveRuleBottom(ft, rulenum);
 	else
 		printf("Invalid direction %s\n", dir);
+	filterChanged(ft);
+	pthread_mutex_unlock(&(ft->lock));
 }
 
 
@@ -108,35 +170,51 @@ void delFilterRule(filtertab_t *ft, int rulenum)
 {
 	int j;
 
+	pthread_mutex_lock(&(ft->lock));
+	ft->slotused[ft->ruletab[rulenum]->slot] = 0;
 	free(ft->ruletab[rulenum]);
 	for (j = rulenum; j <(ft->rulecnt-1); j++)
 		ft->ruletab[j] = ft->ruletab[j+1];
 	ft->rulecnt--;
 	if (ft->rulecnt <= 0)
 		ft->filteron = 0;
+	filterChanged(ft);
+	pthread_mutex_unlock(&(ft->lock));
 }
 
 void flushFilter(filtertab_t *ft)
 {
 	int j;
 
+	pthread_mutex_lock(&(ft->lock));
 	for (j = 0; j < ft->rulecnt; j++)
+	{
+		ft->slotused[ft->ruletab[j]->slot] = 0;
 		free(ft->ruletab[j]);
+	}
 	ft->rulecnt = 0;
 	ft->filteron = 0;
+	filterChanged(ft);
+	pthread_mutex_unlock(&(ft->lock));
 }
 
 
 /*
  * Returns 1 if successful in adding the filter or 0 otherwise.
- * Fails if another rule is present with the given classifier or
- * the classifier is not present.
+ * Fails if another rule is present with the given classifier, the
+ * classifier is not present or the table is full.
  */
 int addFilterRule(filtertab_t *ft, int type, char *cname)
 {
 	int j;
 	filterrule_t *fr;
 
+	if (ft->rulecnt >= MAX_FILTER_RULES)
+	{
+		verbose(2, "[addFilterRule]:: filter table is full..denied addition of [%s]", cname);
+		return 0;
+	}
+
 	for (j = 0; j < ft->rulecnt; j++)
 	{
 		if (!strcmp(ft->ruletab[j]->cname, cname))
@@ -156,53 +234,77 @@ int addFilterRule(filtertab_t *ft, int type, char *cname)
 	fr->type = type;
 	strcpy(fr->cname, cname);
 	fr->failures = fr->passes = 0;
+	pthread_mutex_lock(&(ft->lock));
+	// a free slot exists since rulecnt < MAX_FILTER_RULES; its counters
+	// keep running, so the rule counts from their current value
+	for (fr->slot = 0; ft->slotused[fr->slot]; fr->slot++)
+		;
+	ft->slotused[fr->slot] = 1;
+	fr->hitbase = sumFilterHits(ft, fr->slot);
 	ft->ruletab[ft->rulecnt] = fr;
 	ft->rulecnt++;
 	ft->filteron = 1;
+	filterChanged(ft);
+	pthread_mutex_unlock(&(ft->lock));
 
 	return 1;
 }
 
 
-// returns 1 if the packet is filtered.. otherwise returns 0
-int filteredPacket(filtertab_t *ft, gpacket_t *in_pkt)
+/*
+ * Compile the rule table, in table order, into rules[]; types[] and
+ * slots[] get the verdict and the counter slot of each compiled rule.
+ * Rules whose class is gone are left out. Returns the number of rules and
+ * sets *fgen to the rule table generation they reflect.
+ */
+int compileFilterRules(filtertab_t *ft, classrule_t *rules, int *types, int *slots, unsigned int *fgen)
 {
-	int j, matched = 0;
 	classdef_t *cdef;
+	int j, nrules = 0;
 
-	// if filtering is OFF, then return 0
-	if (!ft->filteron)
-		return 0;
-
+	pthread_mutex_lock(&(ft->lock));
+	*fgen = ft->gen;
 	for (j = 0; j < ft->rulecnt; j++)
 	{
-		cdef = getClassDef(ft->clist, ft->ruletab[j]->cname);
-		if (cdef == NULL)
+		if ((cdef = getClassDef(ft->clist, ft->ruletab[j]->cname)) == NULL)
 			continue;
-		if (isRuleMatching(cdef, in_pkt) && (ft->ruletab[j]->type == 0))
-		{
-			matched = 1;
-			break;
-		}
+		compileClassRule(cdef, &(rules[nrules]));
+		types[nrules] = ft->ruletab[j]->type;
+		slots[nrules++] = ft->ruletab[j]->slot;
 	}
+	pthread_mutex_unlock(&(ft->lock));
 
-	return matched;
+	return nrules;
 }
 
 
 void printFilterStats(filtertab_t *ft)
 {
+	filterrule_t *fr;
+	unsigned long hits;
 	int j;
 
+	pthread_mutex_lock(&(ft->lock));
+	printf("Rule\tClass\tPassed\tDropped\n");
 	for (j =0; j < ft->rulecnt; j++)
 	{
-		if (ft->ruletab[j]->type)
+		fr = ft->ruletab[j];
+		hits = sumFilterHits(ft, fr->slot) - fr->hitbase;
+		if (fr->type)
+		{
+			fr->passes = hits;
 			printf("Allow\t");
+		}
 		else
+		{
+			fr->failures = hits;
 			printf("Deny\t");
-		printf("%s\t", ft->ruletab[j]->cname);
-		printf("%d\t%d\n", ft->ruletab[j]->passes, ft->ruletab[j]->failures);
+		}
+		printf("%s\t", fr->cname);
+		printf("%lu\t%lu\n", fr->passes, fr->failures);
 	}
+	printf("No rule matched %lu packets\n", sumFilterHits(ft, -1));
+	pthread_mutex_unlock(&(ft->lock));
 }
 
 
@@ -8,6 +8,7 @@
 
 #include <math.h>
 #include "message.h"
+#include "pktpool.h"
 #include "grouter.h"
 #include "moduledefs.h"
 #include "routetable.h"
@@ -15,6 +16,7 @@
 #include "protocols.h"
 #include "ip.h"
 #include "fragment.h"
+#include "checksum.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,7 +33,7 @@ extern mtu_entry_t MTU_tbl[MAX_MTU];
  */
 int needFragmentation(gpacket_t *pkt)
 {
-	ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data.data;	
+	ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data->data;	
 	int link_mtu;
 
 	verbose(2, "[needFragmentation]:: Checking whether the packet needs fragmentation.. ");
@@ -44,59 +46,144 @@ int needFragmentation(gpacket_t *pkt)
 
 
 /*
- * with the current data structures, fragmentation is a hypothetical
- * requirement! the gpacket_t datastructure has a hardcoded limit for
- * IP packets. therefore, we cannot have larger frames to require
- * fragmentation. may be we can remove this hardcoding and dynamically
- * create the payload -- this will require dynamic memory allocations and
- * deallocations. 
+ * Options go into later fragments only if their copied flag is set (RFC
+ * 791). Writes the options of hdr meant for them to opts, padded with
+ * end-of-list to a multiple of 4 bytes, and returns their length.
+ */
+static int fragmentOptions(ip_packet_t *ip_pkt, uchar *opts)
+{
+	uchar *opt = (uchar *)ip_pkt + sizeof(ip_packet_t);
+	int optlen = (ip_pkt->ip_hdr_len << 2) - sizeof(ip_packet_t);
+	int i = 0, n = 0, len;
+
+	while ((i < optlen) && (opt[i] != IP_OPT_EOL))
+	{
+		if (opt[i] == IP_OPT_NOP)
+		{
+			i++;
+			continue;
+		}
+		if ((i + 1 >= optlen) || ((len = opt[i + 1]) < 2) || (i + len > optlen))
+			break;                              // malformed: copy no more
+		if (opt[i] & IP_OPT_COPIED)
+		{
+			memcpy(opts + n, opt + i, len);
+			n += len;
+		}
+		i += len;
+	}
+	for (; n & 3; n++)
+		opts[n] = IP_OPT_EOL;
+	return n;
+}
+
+
+// fill in the IP header of a fragment: len bytes of payload at offset off
+static void fragmentHeader(ip_packet_t *frag, int hdr_len, int off, int len, int more)
+{
+	uint16_t frag_off = ntohs(frag->ip_frag_off);
+
+	// a fragment of a fragment: the offsets add up
+	frag_off = ((frag_off & IP_OFFMASK) + (off >> 3)) | (more ? IP_MF : 0);
+	frag->ip_hdr_len = hdr_len >> 2;
+	frag->ip_frag_off = htons(frag_off);
+	frag->ip_pkt_len = htons(hdr_len + len);
+	frag->ip_cksum = 0;
+	frag->ip_cksum = checksumCompute(frag, hdr_len);
+}
+
+
+/*
+ * Split pkt into fragments that fit the MTU of its output interface.
+ * Every fragment but the last carries a multiple of 8 bytes of payload.
+ *
+ * pkt becomes the first fragment, cut short in place. When there are at
+ * least three, the last fragment is a clone that shares the buffer of pkt:
+ * its headers are written over the end of the payload of the fragment
+ * before it, which is copied out by then. The fragments in between are
+ * copied into buffers of their own.
+ *
+ * Returns the number of fragments in frags, the first being pkt, and the
+ * caller owns them all. Returns 0, with pkt left as it was and still owned
+ * by the caller, if the packet cannot be fragmented.
  */
 int fragmentIPPacket(gpacket_t *pkt, gpacket_t **frags)
 {
-	ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data.data;	
-	int link_mtu, num_frags, i;
-	int frag_offset, frag_len;
-	ip_packet_t *this_ippkt;
+	ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data->data;
+	int link_mtu, num_frags, hdr_len, frag_hdr_len, first_len, frag_len, data_len, off, len, i, eth_len;
+	uchar opts[MAX_IPOPTLEN];
 	uchar *ipdata_ptr;
+	pkt_data_t *data;
+
+	eth_len = sizeof(pkt->data->header);
+	hdr_len = ip_pkt->ip_hdr_len << 2;
+	data_len = ntohs(ip_pkt->ip_pkt_len) - hdr_len;
+	// the lengths in the header are copied by; they must not reach past the frame
+	if ((hdr_len < (int)sizeof(ip_packet_t)) || (data_len < 0) ||
+	    (eth_len + hdr_len + data_len > ((pkt->len > 0) ? pkt->len : packetCapacity(pkt))))
+	{
+		error("[fragmentIPPacket]:: packet lengths do not fit the frame ");
+		return 0;
+	}
+	frag_hdr_len = sizeof(ip_packet_t) + fragmentOptions(ip_pkt, opts);
 
 	link_mtu = findMTU(MTU_tbl, pkt->frame.dst_interface);
-	
-	num_frags = (int) ceil(((double) ntohs(ip_pkt->ip_pkt_len))/((double) link_mtu));
-	frag_len = ntohs(ip_pkt->ip_pkt_len)/num_frags;
-
-	*frags = (gpacket_t *) malloc(sizeof(gpacket_t) * num_frags);
-	if (*frags == NULL)
-		verbose(1, "[fragmentIPPacket]:: unable to allocate memory ");
-
-	frag_offset = 0;
-	ipdata_ptr = (uchar *)ip_pkt + (ip_pkt->ip_hdr_len << 2);
+	first_len = (link_mtu - hdr_len) & ~7;
+	frag_len = (link_mtu - frag_hdr_len) & ~7;
+	if ((first_len <= 0) || (frag_len <= 0) || (data_len <= first_len))
+	{
+		error("[fragmentIPPacket]:: cannot fragment a %d byte packet for MTU %d ", hdr_len + data_len, link_mtu);
+		return 0;
+	}
+	num_frags = 1 + (data_len - first_len + frag_len - 1) / frag_len;
+	if (num_frags > MAX_FRAGMENTS)
+	{
+		error("[fragmentIPPacket]:: %d fragments needed for MTU %d, at most %d allowed ",
+		      num_frags, link_mtu, MAX_FRAGMENTS);
+		return 0;
+	}
+	if (makePacketWritable(pkt) == NULL)
+		return 0;
+	ip_pkt = (ip_packet_t *)pkt->data->data;
+	ipdata_ptr = (uchar *)ip_pkt + hdr_len;
 
-	for (i = 0; i < (num_frags -1); i++)
+	frags[0] = pkt;
+	for (i = 1; i < num_frags; i++)
 	{
-		memcpy(frags[i], pkt, sizeof(gpacket_t));
-		this_ippkt = (ip_packet_t *)frags[i]->data.data;
-		this_ippkt->ip_frag_off = frag_offset;
-		memcpy(((uchar *)this_ippkt + (this_ippkt->ip_hdr_len << 2)), 
-		       (ipdata_ptr + frag_offset), frag_len);
-		SET_MF_BITS(this_ippkt->ip_frag_off);
-		SET_DF_BITS(this_ippkt->ip_frag_off);
-		this_ippkt->ip_pkt_len = htons((ip_pkt->ip_hdr_len << 2) + frag_len);
-		this_ippkt->ip_cksum = 0;
-		this_ippkt->ip_cksum = htons(checksum((uchar *)this_ippkt, this_ippkt->ip_hdr_len *2));
-		frag_offset += frag_len;
+		off = first_len + (i - 1) * frag_len;
+		len = min(frag_len, data_len - off);
+		if ((i == num_frags - 1) && (i >= 2) && (frag_len >= eth_len + frag_hdr_len))
+		{
+			// the payload before is copied out, so the headers can go over its end
+			if ((frags[i] = clonePacket(pkt)) == NULL)
+				break;
+			frags[i]->data = (pkt_data_t *)(ipdata_ptr + off - frag_hdr_len - eth_len);
+		} else
+		{
+			if ((frags[i] = allocPacket(link_mtu)) == NULL)
+				break;
+			memcpy(&(frags[i]->frame), &(pkt->frame), sizeof(pkt_frame_t));
+			memcpy(frags[i]->data->data + frag_hdr_len, ipdata_ptr + off, len);
+		}
+		data = frags[i]->data;
+		memcpy(&(data->header), &(pkt->data->header), eth_len);
+		memcpy(data->data, ip_pkt, sizeof(ip_packet_t));
+		memcpy(data->data + sizeof(ip_packet_t), opts, frag_hdr_len - sizeof(ip_packet_t));
+		// the last fragment has more to come only if the packet itself had
+		fragmentHeader((ip_packet_t *)data->data, frag_hdr_len, off, len,
+			       (i < num_frags - 1) || TEST_MF_BITS(ntohs(ip_pkt->ip_frag_off)));
+		frags[i]->len = eth_len + frag_hdr_len + len;
+	}
+	if (i < num_frags)
+	{
+		verbose(1, "[fragmentIPPacket]:: no packet buffers for the fragments ");
+		deallocateFragments(frags + 1, i - 1);
+		return 0;
 	}
-	frag_len = ntohs(ip_pkt->ip_pkt_len) - frag_offset;
-	memcpy(frags[i], pkt, sizeof(gpacket_t));
-	this_ippkt = (ip_packet_t *)frags[i]->data.data;
-	this_ippkt->ip_frag_off = frag_offset;
-	memcpy(((uchar *)this_ippkt + (this_ippkt->ip_hdr_len << 2)), 
-	       (ipdata_ptr + frag_offset), frag_len);
-	RESET_MF_BITS(this_ippkt->ip_frag_off);
-	RESET_DF_BITS(this_ippkt->ip_frag_off);
-	this_ippkt->ip_pkt_len = htons((ip_pkt->ip_hdr_len << 2) + frag_len);
-	this_ippkt->ip_cksum = 0;
-	this_ippkt->ip_cksum = htons(checksum((uchar *)this_ippkt, this_ippkt->ip_hdr_len *2));
 
+	// the first fragment last: the others took their headers from it
+	fragmentHeader(ip_pkt, hdr_len, 0, first_len, 1);
+	pkt->len = eth_len + hdr_len + first_len;
 	return num_frags;
 }
 
@@ -107,6 +194,6 @@ void deallocateFragments(gpacket_t **pkt_frags, int num_frags)
 
 	verbose(2, "[deallocateFragments]:: Deallocating fragment table memory ");
 	for (i = 0; i < num_frags; i++)
-		free(pkt_frags[i]);
+		freePacket(pkt_frags[i]);
 }
 
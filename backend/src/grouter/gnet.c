@@ -24,17 +24,19 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include "routetable.h"
+#include "adjacency.h"
+#include "localaddr.h"
 #include "openflow_config.h"
+#include "trace.h"
 
 #define MAX_MTU 1500
 #define BASEPORTNUM 60000
 
-extern route_entry_t route_tbl[MAX_ROUTES];
+extern routetable_t *route_tbl;
 extern router_config rconfig;
 
 interface_array_t netarray;
 devicearray_t devarray;
-arp_entry_t arp_cache[ARP_CACHE_SIZE];
 
 
 /*----------------------------------------------------------------------------------
@@ -618,6 +620,8 @@ int destroyInterface(interface_t *iface)
 
 	// remove the ARP table entries
 	ARPDeleteEntry(iface->ip_addr);
+	ARPDeleteInterfaceEntries(iface->interface_id);
+	invalidateInterfaceAdjacencies(iface->interface_id);
 
 	verbose(2, "[destroyInterface]:: cancelling the fromdev handler.. ");
 	if (iface->state == INTERFACE_UP)
@@ -655,7 +659,14 @@ int changeInterfaceMTU(int index, int new_mtu)
 		error("[changeInterface]:: Interface %d not found.. unable to change MTU ", index);
 		return EXIT_FAILURE;
 	}
+	if ((new_mtu <= 0) || (new_mtu > MAX_JUMBO_MTU))
+	{
+		error("[changeInterface]:: MTU %d out of range (1-%d).. ", new_mtu, MAX_JUMBO_MTU);
+		return EXIT_FAILURE;
+	}
+	// receive buffers are sized from device_mtu, fragmentation uses the MTU table
 	iface->device_mtu = new_mtu;
+	addMTUEntry(MTU_tbl, index, new_mtu, iface->ip_addr);
 	return EXIT_SUCCESS;
 }
 
@@ -667,7 +678,11 @@ int upThisInterface(interface_t *iface)
 {
 	int thread_stat;
 
+	if (iface->state != INTERFACE_UP)
+		addLocalAddress(iface->ip_addr, iface->interface_id, LOCAL_UNICAST);
 	iface->state = INTERFACE_UP;
+	if (route_tbl != NULL)
+		setRouteInterfaceState(route_tbl, iface->interface_id, TRUE);
 	thread_stat = pthread_create(&(iface->threadid), NULL,
 				     (void *)iface->devdriver->fromdev, (void *)iface);
 	if (thread_stat != 0)
@@ -686,7 +701,11 @@ int downThisInterface(interface_t *iface)
 	int status;
 
 	status = pthread_cancel(iface->threadid);
+	if (iface->state == INTERFACE_UP)
+		deleteLocalAddress(iface->ip_addr, iface->interface_id, LOCAL_UNICAST);
 	iface->state = INTERFACE_DOWN;
+	if (route_tbl != NULL)
+		setRouteInterfaceState(route_tbl, iface->interface_id, FALSE);
 
 	if (status == 0)
 		return EXIT_SUCCESS;
@@ -746,88 +765,6 @@ int downInterface(int index)
 
 
 
-/*----------------------------------------------------------------------------------
- *             A R P  C A C H E  M A N A G E M E N T  F U N C T I O N S
- *---------------------------------------------------------------------------------*/
-
-/*
- * return the ARP cache key. This value is used to
- * index into the direct mapped ARP cache. Direct mapped cache
- * is used for simplicity.. Should we use more complex organizations??
- */
-
-int getARPCacheKey(uchar *ip)
-{
-	unsigned int sum = 0;
-
-	sum = ip[0] + ip[1] + ip[2] + ip[3];
-	return sum % ARP_CACHE_SIZE;
-}
-
-
-void GNETInitARPCache(void)
-{
-	int i;
-
-	for (i = 0; i < ARP_CACHE_SIZE; i++)
-		arp_cache[i].is_empty = TRUE;
-}
-
-
-/*
- * lookup the given ip_addr in the ARP cache.
- * copy the MAC address in mac_addr and return TRUE
- * otherwise return FALSE -- mac_addr is undefined in this case.
- */
-int lookupARPCache(uchar *ip_addr, uchar *mac_addr)
-{
-	int key;
-
-	key = getARPCacheKey(ip_addr);
-	if ((arp_cache[key].is_empty == FALSE) &&
-	    (COMPARE_IP(arp_cache[key].ip_addr, ip_addr) == 0))
-	{
-		COPY_MAC(mac_addr, arp_cache[key].mac_addr);
-		return TRUE;
-	}
-
-	return FALSE;
-}
-
-
-void putARPCache(uchar *ip_addr, uchar *mac_addr)
-{
-	int key;
-
-	key = getARPCacheKey(ip_addr);
-	arp_cache[key].is_empty = FALSE;
-	COPY_IP(arp_cache[key].ip_addr, ip_addr);
-	COPY_MAC(arp_cache[key].mac_addr, mac_addr);
-}
-
-
-
-void printARPCache(void)
-{
-	int i;
-	char tmpbuf[MAX_TMPBUF_LEN];
-
-	printf("\n-----------------------------------------------------------\n");
-	printf("      A R P  C A C H E \n");
-	printf("-----------------------------------------------------------\n");
-	printf("Index\tIP address\tMAC address \n");
-
-	for (i = 0; i < MAX_ARP; i++)
-		if (arp_cache[i].is_empty == FALSE)
-			printf("%d\t%s\t%s\n", i, IP2Dot(tmpbuf, arp_cache[i].ip_addr),
-			       MAC2Colon((tmpbuf+20), arp_cache[i].mac_addr));
-	printf("-----------------------------------------------------------\n");
-	return;
-}
-
-
-
-
 /*----------------------------------------------------------------------------------
  *                         M A I N  F U N C T I O N S
  *---------------------------------------------------------------------------------*/
@@ -857,7 +794,6 @@ int GNETInit(pthread_t *ghandler, char *config_dir, char *rname, simplequeue_t *
 	// do the initializations...
 	vpl_init(config_dir, rname);
 	GNETInitInterfaces();
- 	GNETInitARPCache();
 
 	thread_stat = pthread_create((pthread_t *)ghandler, NULL, GNETHandler, (void *)sq);
 	if (thread_stat != 0)
@@ -871,51 +807,58 @@ void *GNETHandler(void *outq)
 {
 	char tmpbuf[MAX_NAME_LEN];
 	interface_t *iface;
-	uchar mac_addr[6];
+	adjacency_t *adj;
 	simplequeue_t *outputQ = (simplequeue_t *)outq;
 	gpacket_t *in_pkt;
-	int inbytes, cached;
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	int i, npkts;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);       // die as soon as cancelled
 	while (1)
 	{
-		verbose(2, "[gnetHandler]:: Reading message from output Queue..");
-		if (readQueue(outputQ, (void **)&in_pkt, &inbytes) == EXIT_FAILURE)
+		TRACE(2, "[gnetHandler]:: Reading message from output Queue..");
+		if ((npkts = readQueueBurst(outputQ, pkts, sizes, QUEUE_BURST_SIZE)) == 0)
 			return NULL;
-		verbose(2, "[gnetHandler]:: Recvd message pkt ");
+		TRACE(2, "[gnetHandler]:: Recvd %d message pkts ", npkts);
 		pthread_testcancel();
 
-		if ((iface = findInterface(in_pkt->frame.dst_interface)) == NULL)
-		{
-			error("[gnetHandler]:: Packet dropped, interface [%d] is invalid ", in_pkt->frame.dst_interface);
-			continue;
-		} else if (iface->state == INTERFACE_DOWN)
-		{
-			error("[gnetHandler]:: Packet dropped! Interface not up");
-			continue;
-		}
-
-		if (!in_pkt->frame.openflow)
+		for (i = 0; i < npkts; i++)
 		{
-			// we have a valid interface handle -- iface.
-			COPY_MAC(in_pkt->data.header.src, iface->mac_addr);
+			in_pkt = (gpacket_t *)pkts[i];
+			if ((iface = findInterface(in_pkt->frame.dst_interface)) == NULL)
+			{
+				error("[gnetHandler]:: Packet dropped, interface [%d] is invalid ", in_pkt->frame.dst_interface);
+				continue;
+			} else if (iface->state == INTERFACE_DOWN)
+			{
+				error("[gnetHandler]:: Packet dropped! Interface not up");
+				continue;
+			}
 
-			if (in_pkt->frame.arp_valid == TRUE)
-				putARPCache(in_pkt->frame.nxth_ip_addr, in_pkt->data.header.dst);
-			else if (in_pkt->frame.arp_bcast != TRUE)
+			if (!in_pkt->frame.openflow)
 			{
-				if ((cached = lookupARPCache(in_pkt->frame.nxth_ip_addr,
-							     mac_addr)) == TRUE)
-					COPY_MAC(in_pkt->data.header.dst, mac_addr);
-				else
+				// a forwarded packet carries its adjacency: one header copy if it still applies
+				adj = in_pkt->frame.adj;
+				if ((adj == NULL) || (in_pkt->frame.arp_valid == TRUE) || (in_pkt->frame.arp_bcast == TRUE) ||
+				    (adj->interface != in_pkt->frame.dst_interface) ||
+				    (COMPARE_IP(adj->ip_addr, in_pkt->frame.nxth_ip_addr) != 0) ||
+				    (copyAdjacencyHeader(adj, in_pkt->data) == EXIT_FAILURE))
 				{
-					ARPResolve(in_pkt);
-					continue;
+					// we have a valid interface handle -- iface.
+					COPY_MAC(in_pkt->data->header.src, iface->mac_addr);
+
+					if ((in_pkt->frame.arp_valid != TRUE) && (in_pkt->frame.arp_bcast != TRUE) &&
+					    (((adj = getAdjacency(in_pkt->frame.dst_interface, in_pkt->frame.nxth_ip_addr)) == NULL) ||
+					     (copyAdjacencyHeader(adj, in_pkt->data) == EXIT_FAILURE)))
+					{
+						ARPResolve(in_pkt);
+						continue;
+					}
 				}
 			}
-		}
-
-		iface->devdriver->todev((void *)in_pkt);
 
+			iface->devdriver->todev((void *)in_pkt);
+		}
 	}
 }
@@ -19,15 +19,21 @@
 #include "cli.h"
 #include "gnet.h"
 #include "packetcore.h"
+#include "pktpool.h"
 #include "classifier.h"
 #include "filter.h"
+#include "conntrack.h"
+#include "nat.h"
+#include "trace.h"
 #include "openflow_ctrl_iface.h"
 #include "openflow_pkt_proc.h"
 
-router_config rconfig = {.router_name=NULL, .gini_home=NULL, .cli_flag=0, .config_file=NULL, .config_dir=NULL, .openflow=0, .ghandler=0, .clihandler= 0, .scheduler=0, .worker=0, .openflow_worker=0, .openflow_controller_iface=0, .openflow_flowtable_timeout=0, .schedcycle=0};
+router_config rconfig = {.router_name=NULL, .gini_home=NULL, .cli_flag=0, .config_file=NULL, .config_dir=NULL, .openflow=0, .ghandler=0, .clihandler= 0, .scheduler=0, .worker=0, .openflow_worker=0, .openflow_controller_iface=0, .openflow_flowtable_timeout=0, .schedcycle=0, .workers=1, .pktbufs=0, .hugepages=0};
 pktcore_t *pcore;
 classlist_t *classifier;
 filtertab_t *filter;
+conntrack_t *conntrack;
+nat_t *nat;
 
 
 Option grouter_optab[] =
@@ -49,6 +55,18 @@ Option grouter_optab[] =
 		" when specified, grouter functions as an OpenFlow 1.0 switch",
 		optional_argument, OPT_INTEGER, OPT_VARIABLE, &(rconfig.openflow)
 	},
+	{
+		"workers", 'w', "count", "Number of packet worker threads (default 1)",
+		required_argument, OPT_INTEGER, OPT_VARIABLE, &(rconfig.workers)
+	},
+	{
+		"pktbufs", 'b', "count", "Maximum number of packet buffers (default 65536)",
+		required_argument, OPT_INTEGER, OPT_VARIABLE, &(rconfig.pktbufs)
+	},
+	{
+		"hugepages", 'g', "0 or 1", "Allocate the packet buffers on huge pages",
+		required_argument, OPT_INTEGER, OPT_VARIABLE, &(rconfig.hugepages)
+	},
 	{
 		NULL, '\0', NULL, NULL, 0, 0, 0, NULL
 	}
@@ -77,6 +95,7 @@ int main(int ac, char *av[])
 	redefineSignalHandler(SIGUSR1, shutdownRouter);
 	redefineSignalHandler(SIGUSR2, shutdownRouter);
 
+	initPacketPool(rconfig.pktbufs, rconfig.hugepages);
 	outputQ = createSimpleQueue("outputQueue", INFINITE_Q_SIZE, 0, 1);
 	workQ = createSimpleQueue("work Queue", INFINITE_Q_SIZE, 0, 1);
 	if (rconfig.openflow) {
@@ -90,6 +109,8 @@ int main(int ac, char *av[])
 
 	classifier = createClassifier();
 	filter = createFilter(classifier, 0);
+	conntrack = createConntrack(CT_DEFAULT_MAX);
+	nat = createNAT();
 
 	pcore = createPacketCore(rconfig.router_name, outputQ, workQ,
 							 openflowWorkQ);
@@ -149,7 +170,7 @@ void shutdownRouter()
 	GNETHalt(rconfig.ghandler);
 	verbose(1, "[main]:: shutting down the packet core... "); fflush(stdout);
 	pthread_cancel(rconfig.scheduler);
-	pthread_cancel(rconfig.worker);
+	PktCoreWorkerHalt(pcore);
 	if (rconfig.openflow) {
 		pthread_cancel(rconfig.openflow_worker);
 	}
@@ -176,9 +197,11 @@ void setupProgram(int ac, char *av[])
 	prog_set_url("http://www.cs.mcgill.ca/~anrl/gini/");
 	prog_set_desc("GINI router provides a user-space IP router for teaching and learning purposes.");
 
-	prog_set_verbosity_level(2);
+	traceSetLevel(2);
 
 	indx = prog_opt_process(ac, av);
+	// -v sets the verbosity level behind the back of the traces
+	traceSetLevel(prog_verbosity_level());
 
 	if (indx < ac)
 		rconfig.router_name = strdup(av[indx]);
@@ -11,6 +11,7 @@
 #include "icmp.h"
 #include "ip.h"
 #include "message.h"
+#include "pktpool.h"
 #include "grouter.h"
 #include <slack/err.h>
 #include <netinet/in.h>
@@ -36,7 +37,7 @@ static int curr_retries = 0;
  */
 void ICMPProcessPacket(gpacket_t *in_pkt)
 {
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ip_pkt->ip_hdr_len *4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ip_pkt + iphdrlen);
 
@@ -113,8 +114,8 @@ void ICMPDoPing(uchar *ipaddr, int pkt_size, int retries)
 
 void ICMPSendPingPacket(uchar *dst_ip, int size, int seq)
 {
-	gpacket_t *out_pkt = (gpacket_t *) malloc(sizeof(gpacket_t));
-	ip_packet_t *ipkt = (ip_packet_t *)(out_pkt->data.data);
+	gpacket_t *out_pkt = allocPacket(size + 20);                // size covers the ICMP header
+	ip_packet_t *ipkt = (ip_packet_t *)(out_pkt->data->data);
 	ipkt->ip_hdr_len = 5;                                  // no IP header options!!
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + ipkt->ip_hdr_len*4);
 	ushort cksum;
@@ -158,7 +159,7 @@ void ICMPSendPingPacket(uchar *dst_ip, int size, int seq)
  */
 void ICMPProcessTTLExpired(gpacket_t *in_pkt)
 {
-	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ipkt->ip_hdr_len *4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + iphdrlen);
 	ushort cksum;
@@ -195,7 +196,7 @@ void ICMPProcessTTLExpired(gpacket_t *in_pkt)
  */
 void ICMPProcessEchoRequest(gpacket_t *in_pkt)
 {
-	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ipkt->ip_hdr_len *4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + iphdrlen);
 	uchar *icmppkt_b = (uchar *)icmphdr;
@@ -232,7 +233,7 @@ void ICMPProcessEchoRequest(gpacket_t *in_pkt)
  */
 void ICMPProcessEchoReply(gpacket_t *in_pkt)
 {
-	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ipkt->ip_hdr_len *4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + iphdrlen);
 	uchar *icmppkt_b = (uchar *)icmphdr;
@@ -267,7 +268,7 @@ void ICMPProcessEchoReply(gpacket_t *in_pkt)
  */
 void ICMPProcessRedirect(gpacket_t *in_pkt, uchar *gw_addr)
 {
-	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ipkt->ip_hdr_len * 4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + iphdrlen);
 	int iprevlen = iphdrlen + 8;  // IP header + 64 bits
@@ -301,7 +302,7 @@ void ICMPProcessRedirect(gpacket_t *in_pkt, uchar *gw_addr)
  */
 void ICMPProcessFragNeeded(gpacket_t *in_pkt, int interface_mtu)
 {
-	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ipkt = (ip_packet_t *)in_pkt->data->data;
 	int iphdrlen = ipkt->ip_hdr_len *4;
 	icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + iphdrlen);
 	int iprevlen = iphdrlen + 8;  // IP header + 64 bits
@@ -314,7 +315,7 @@ void ICMPProcessFragNeeded(gpacket_t *in_pkt, int interface_mtu)
 	icmphdr->type = ICMP_DEST_UNREACH;
 	icmphdr->code = ICMP_FRAG_NEEDED; 
 	icmphdr->checksum = 0;
-	icmphdr->un.frag.mtu = interface_mtu;
+	icmphdr->un.frag.mtu = htons(interface_mtu);
 	memcpy(((uchar *)icmphdr + 8), prevbytes, iprevlen);    // OLD ip header + 64 bits of original pkt 
 	cksum = checksum((uchar *)icmphdr, (8 + iprevlen)/2 );
 	icmphdr->checksum = htons(cksum);
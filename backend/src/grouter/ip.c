@@ -6,9 +6,11 @@
  */
 
 #include "message.h"
+#include "pktpool.h"
 #include "grouter.h"
 #include "routetable.h"
 #include "mtu.h"
+#include "localaddr.h"
 #include "protocols.h"
 #include "ip.h"
 #include "tcp.h"
@@ -17,6 +19,9 @@
 #include "icmp.h"
 #include "fragment.h"
 #include "packetcore.h"
+#include "nat.h"
+#include "checksum.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <slack/err.h>
 #include <netinet/in.h>
@@ -26,11 +31,20 @@
 #include <slack/prog.h>
 
 extern pktcore_t *pcore;
+extern nat_t *nat;
+
+// The local stack (ICMP echo state, lwIP UDP/TCP) is not thread safe, so the
+// packet workers take turns delivering packets addressed to the router.
+static pthread_mutex_t ip_local_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void IPInit()
 {
-	RouteTableInit(route_tbl);
+	uchar bcast_ip[] = IP_BCAST_ADDR;
+
+	route_tbl = RouteTableInit();
 	MTUTableInit(MTU_tbl);
+	addLocalAddress(bcast_ip, -1, LOCAL_BCAST);
+	verbose(2, "[IPInit]:: checksums computed with the %s routine", checksumImplementation());
 }
 
 
@@ -46,24 +60,38 @@ void IPIncomingPacket(gpacket_t *in_pkt)
 	char tmpbuf[MAX_TMPBUF_LEN];
 
 	// get a pointer to the IP packet
-    ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data.data;
-	uchar bcast_ip[] = IP_BCAST_ADDR;
+    ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
 
-	// Is this IP packet for me??
-	if (IPCheckPacket4Me(in_pkt))
+	// the header checksum is verified once, here; every later rewrite of the
+	// header updates it incrementally
+	if (IPVerifyPacket(ip_pkt, ((in_pkt->len > 0) ? in_pkt->len : packetCapacity(in_pkt)) -
+			   (int)sizeof(in_pkt->data->header)) == EXIT_FAILURE)
 	{
-		verbose(2, "[IPIncomingPacket]:: got IP packet destined to this router");
-		IPProcessMyPacket(in_pkt);
-	} else if (COMPARE_IP(gNtohl(tmpbuf, ip_pkt->ip_dst), bcast_ip) == 0)
+		freePacket(in_pkt);
+		return;
+	}
+
+	// replies to translated packets go back to their inside host
+	natIncoming(nat, in_pkt);
+
+	// one probe of the local address table decides where the packet goes
+	switch (findLocalAddress(gNtohl(tmpbuf, ip_pkt->ip_dst), NULL))
 	{
-		// TODO: rudimentary 'broadcast IP address' check
-		verbose(2, "[IPIncomingPacket]:: not repeat broadcast (final destination %s), packet thrown",
-		       IP2Dot(tmpbuf, gNtohl((tmpbuf+20), ip_pkt->ip_dst)));
+	case LOCAL_UNICAST:
+		TRACE(2, "[IPIncomingPacket]:: got IP packet destined to this router");
+		pthread_mutex_lock(&ip_local_lock);
+		IPProcessMyPacket(in_pkt);
+		pthread_mutex_unlock(&ip_local_lock);
+		break;
+
+	case LOCAL_BCAST:
+		TRACE(2, "[IPIncomingPacket]:: got IP packet broadcast to %N", TRACE_IP(ip_pkt->ip_dst));
 		IPProcessBcastPacket(in_pkt);
-	} else
-	{
+		break;
+
+	default:
 		// Destinated to someone else
-		verbose(2, "[IPIncomingPacket]:: got IP packet destined to someone else");
+		TRACE(2, "[IPIncomingPacket]:: got IP packet destined to someone else");
 		IPProcessForwardingPacket(in_pkt);
 	}
 }
@@ -72,43 +100,57 @@ void IPIncomingPacket(gpacket_t *in_pkt)
 
 /*
  * IPCheckPacket4Me: Return TRUE if the packet is meant for me. Otherwise return FALSE.
- * Check against all possible IPs I have to determine whether this packet
- * is meant for me.
+ * The addresses of the interfaces that are up are in the local address table.
  */
 int IPCheckPacket4Me(gpacket_t *in_pkt)
 {
-	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
 	char tmpbuf[MAX_TMPBUF_LEN];
-	int count, i;
-	uchar iface_ip[MAX_MTU][4];
-	uchar pkt_ip[4];
 
-	COPY_IP(pkt_ip, gNtohl(tmpbuf, ip_pkt->ip_dst));
-	verbose(2, "[IPCheckPacket4Me]:: looking for IP %s ", IP2Dot(tmpbuf, pkt_ip));
-	if ((count = findAllInterfaceIPs(MTU_tbl, iface_ip)) > 0)
-	{
-		for (i = 0; i < count; i++)
-		{
-			if (COMPARE_IP(iface_ip[i], pkt_ip) == 0)
-			{
-				verbose(2, "[IPCheckPacket4Me]:: found a matching IP.. for %s ", IP2Dot(tmpbuf, pkt_ip));
-				return TRUE;
-			}
-		}
-		return FALSE;
-	} else
-		return FALSE;
+	return (findLocalAddress(gNtohl(tmpbuf, ip_pkt->ip_dst), NULL) == LOCAL_UNICAST);
 }
 
 
 
 /*
- * TODO: broadcast not yet implemented.. should be simple to implement.
- * read RFC 1812 and 922 ...
+ * IPCheckPacket4Bcast: Return TRUE if the packet is a broadcast the router
+ * receives: to the limited broadcast address or to the broadcast address of
+ * a directly connected network. Otherwise return FALSE.
+ */
+int IPCheckPacket4Bcast(gpacket_t *in_pkt)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
+	char tmpbuf[MAX_TMPBUF_LEN];
+
+	return (findLocalAddress(gNtohl(tmpbuf, ip_pkt->ip_dst), NULL) == LOCAL_BCAST);
+}
+
+
+
+/*
+ * Process a broadcast received by the router (RFC 1812 5.3.5, RFC 922).
+ * It is delivered to the local stack like a packet to the router, but is
+ * never forwarded: directed broadcasts stay on the network they were sent
+ * on (RFC 2644). ICMP to a broadcast address is dropped, so the router
+ * does not answer broadcast pings and cannot be used to amplify an attack
+ * (RFC 1122 3.2.2.6).
  */
 int IPProcessBcastPacket(gpacket_t *in_pkt)
 {
-	return EXIT_SUCCESS;
+	ip_packet_t *ip_pkt = (ip_packet_t *)&in_pkt->data->data;
+	int status;
+
+	if (ip_pkt->ip_prot == ICMP_PROTOCOL)
+	{
+		TRACE(2, "[IPProcessBcastPacket]:: ICMP to a broadcast address, packet dropped");
+		freePacket(in_pkt);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&ip_local_lock);
+	status = IPProcessMyPacket(in_pkt);
+	pthread_mutex_unlock(&ip_local_lock);
+	return status;
 }
 
 
@@ -128,11 +170,10 @@ int IPProcessBcastPacket(gpacket_t *in_pkt)
 int IPProcessForwardingPacket(gpacket_t *in_pkt)
 {
 	gpacket_t *pkt_frags[MAX_FRAGMENTS];
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
-	int num_frags, i, need_frag;
-	char tmpbuf[MAX_TMPBUF_LEN];
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
+	int num_frags, need_frag;
 
-	verbose(2, "[IPProcessForwardingPacket]:: checking for any IP errors..");
+	TRACE(2, "[IPProcessForwardingPacket]:: checking for any IP errors..");
 	// all the validation and ICMP generation, processing is
 	// done in this function...
 	if (IPCheck4Errors(in_pkt) == EXIT_FAILURE)
@@ -141,9 +182,7 @@ int IPProcessForwardingPacket(gpacket_t *in_pkt)
 
 	// find the route... if it does not exist, should we send a
 	// ICMP network/host unreachable message -- CHECK??
-	if (findRouteEntry(route_tbl, gNtohl(tmpbuf, ip_pkt->ip_dst),
-			   in_pkt->frame.nxth_ip_addr,
-			   &(in_pkt->frame.dst_interface)) == EXIT_FAILURE)
+	if (findRoutePacket(route_tbl, in_pkt) == EXIT_FAILURE)
 		return EXIT_FAILURE;
 
 	// check for redirection?? -- the output interface is already found
@@ -156,13 +195,18 @@ int IPProcessForwardingPacket(gpacket_t *in_pkt)
 	// FRAGS_NONE, FRAGS_ERROR, MORE_FRAGS
 	need_frag = IPCheck4Fragmentation(in_pkt);
 
+	// translate once the errors above went back to the real source
+	if ((need_frag != FRAGS_ERROR) && (natOutgoing(nat, in_pkt) == EXIT_FAILURE))
+	{
+		freePacket(in_pkt);
+		return EXIT_FAILURE;
+	}
+
 	switch (need_frag)
 	{
 	case FRAGS_NONE:
-		verbose(2, "[IPProcessForwardingPacket]:: sending packet to GNET..");
-		// compute the checksum before sending out.. the fragmentation routine does this inside it.
-		ip_pkt->ip_cksum = 0;
-		ip_pkt->ip_cksum = htons(checksum((uchar *)ip_pkt, ip_pkt->ip_hdr_len *2));
+		TRACE(2, "[IPProcessForwardingPacket]:: sending packet to GNET..");
+		// the checksum is already up to date.. the fragmentation routine computes it for each fragment.
 		if (IPSend2Output(in_pkt) == EXIT_FAILURE)
 		{
 			verbose(1, "[IPProcessForwardingPacket]:: WARNING: IPProcessForwardingPacket(): Could not forward packets ");
@@ -171,29 +215,27 @@ int IPProcessForwardingPacket(gpacket_t *in_pkt)
 		break;
 
 	case FRAGS_ERROR:
-		verbose(2, "[IPProcessForwardingPacket]:: unreachable on packet from %s",
-			IP2Dot(tmpbuf, gNtohl((tmpbuf+20), ip_pkt->ip_src)));
+		TRACE(2, "[IPProcessForwardingPacket]:: unreachable on packet from %N", TRACE_IP(ip_pkt->ip_src));
 		int int_mtu = findMTU(MTU_tbl, in_pkt->frame.dst_interface);
 		ICMPProcessFragNeeded(in_pkt, int_mtu);
 		break;
 
 	case MORE_FRAGS:
-		// fragment processing...
-		num_frags = fragmentIPPacket(in_pkt, pkt_frags);
-
-		verbose(2, "[IPProcessForwardingPacket]:: IP packet needs fragmentation");
-		// forward each fragment
-		for (i = 0; i < num_frags; i++)
+		// the first fragment is in_pkt itself, the train goes out in one batch
+		if ((num_frags = fragmentIPPacket(in_pkt, pkt_frags)) == 0)
 		{
-			if (IPSend2Output(pkt_frags[i]) == EXIT_FAILURE)
-			{
-				verbose(1, "[IPProcessForwardingPacket]:: processForwardIPPacket(): Could not forward packets ");
-				return EXIT_FAILURE;
-			}
+			freePacket(in_pkt);
+			return EXIT_FAILURE;
+		}
+		TRACE(2, "[IPProcessForwardingPacket]:: IP packet sent as %d fragments", num_frags);
+		if (IPSend2OutputBurst(pkt_frags, num_frags) == EXIT_FAILURE)
+		{
+			verbose(1, "[IPProcessForwardingPacket]:: WARNING: output queue took only part of the fragments ");
+			return EXIT_FAILURE;
 		}
-		deallocateFragments(pkt_frags, num_frags);
 		break;
 	default:
+		freePacket(in_pkt);
 		return EXIT_FAILURE;
 	}
 	return EXIT_SUCCESS;
@@ -202,29 +244,41 @@ int IPProcessForwardingPacket(gpacket_t *in_pkt)
 
 int IPCheck4Errors(gpacket_t *in_pkt)
 {
-	char tmpbuf[MAX_TMPBUF_LEN];
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
 
-	// check for valid version and checksum.. silently drop the packet if not.
-	if (IPVerifyPacket(ip_pkt) == EXIT_FAILURE)
-		return EXIT_FAILURE;
-
-	// Decrement TTL, if TTL <= 0, send to ICMP module with TTL-expired command
-	// return EXIT_FAILURE
-	if (--ip_pkt->ip_ttl <= 0)
+	// If the TTL would drop to 0, send the packet as it arrived to the ICMP
+	// module with TTL-expired command and return EXIT_FAILURE
+	if (ip_pkt->ip_ttl <= 1)
 	{
-		verbose(2, "[processIPErrors]:: TTL expired on packet from %s",
-		       IP2Dot(tmpbuf, gNtohl((tmpbuf+20), ip_pkt->ip_src)));
+		TRACE(2, "[processIPErrors]:: TTL expired on packet from %N", TRACE_IP(ip_pkt->ip_src));
 
 		ICMPProcessTTLExpired(in_pkt);
 		return EXIT_FAILURE;
 	}
+	IPDecrementTTL(ip_pkt);
 
 	return EXIT_SUCCESS;
 }
 
 
 
+/*
+ * Decrement the TTL, updating the header checksum for the one word that
+ * changed (RFC 1624) rather than summing the whole header again.
+ */
+void IPDecrementTTL(ip_packet_t *ip_pkt)
+{
+	uint16_t oldw, neww;
+
+	// the TTL shares its 16 bit word of the header with the protocol
+	memcpy(&oldw, &(ip_pkt->ip_ttl), 2);
+	ip_pkt->ip_ttl--;
+	memcpy(&neww, &(ip_pkt->ip_ttl), 2);
+	ip_pkt->ip_cksum = checksumAdjust16(ip_pkt->ip_cksum, oldw, neww);
+}
+
+
+
 /*
  * check for MTU sizes and DF flag..
  * first get the MTU value for the next hop interface.
@@ -239,18 +293,17 @@ int IPCheck4Errors(gpacket_t *in_pkt)
 int IPCheck4Fragmentation(gpacket_t *in_pkt)
 {
 	int link_mtu;
-	char tmpbuf[MAX_TMPBUF_LEN];
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
 
-	verbose(2, "[IPCheck4Fragmentation]:: .. checking mtu for next hop %s and interface %d ",
-		IP2Dot(tmpbuf, in_pkt->frame.nxth_ip_addr), in_pkt->frame.dst_interface);
+	TRACE(2, "[IPCheck4Fragmentation]:: .. checking mtu for next hop %I and interface %d ",
+	      TRACE_IP(in_pkt->frame.nxth_ip_addr), in_pkt->frame.dst_interface);
 
 	if ((link_mtu = findMTU(MTU_tbl, in_pkt->frame.dst_interface)) < 0)
 		return GENERAL_ERROR;
 
 	if (link_mtu < ntohs(ip_pkt->ip_pkt_len))                 // need fragmentation
 	{
-		if (TEST_DF_BITS(ip_pkt->ip_frag_off))    // DF is set: destination unreachable
+		if (TEST_DF_BITS(ntohs(ip_pkt->ip_frag_off)))    // DF is set: destination unreachable
 			return FRAGS_ERROR;
 		return MORE_FRAGS;
 	} else
@@ -268,18 +321,18 @@ int IPCheck4Redirection(gpacket_t *in_pkt)
 {
 	char tmpbuf[MAX_TMPBUF_LEN];
 	gpacket_t *cp_pkt;
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
 
 	// check for redirect condition and send an ICMP back... let the current packet
 	// go as well (check the specification??)
 	if (isInSameNetwork(gNtohl(tmpbuf, ip_pkt->ip_src), in_pkt->frame.nxth_ip_addr) == EXIT_SUCCESS)
 	{
-		verbose(2, "[processIPErrors]:: redirect message sent on packet from %s",
-		       IP2Dot(tmpbuf, gNtohl((tmpbuf+20), ip_pkt->ip_src)));
-
-		cp_pkt = duplicatePacket(in_pkt);
+		TRACE(2, "[processIPErrors]:: redirect message sent on packet from %N", TRACE_IP(ip_pkt->ip_src));
 
-		ICMPProcessRedirect(cp_pkt, cp_pkt->frame.nxth_ip_addr);
+		// the redirect quotes only the IP header and 64 bits of the payload
+		cp_pkt = duplicatePacketHead(in_pkt, sizeof(in_pkt->data->header) + (ip_pkt->ip_hdr_len << 2) + 8);
+		if (cp_pkt != NULL)
+			ICMPProcessRedirect(cp_pkt, cp_pkt->frame.nxth_ip_addr);
 	}
 
 	// IP packet is verified to be good. This packet should be
@@ -295,7 +348,7 @@ int IPCheck4Redirection(gpacket_t *in_pkt)
  * RETURNS: EXIT_FAILURE or EXIT_SUCCESS;
  *
  * Processing flow is as follows:
- *      Error processing: A similar routine as the "forwarding mode"
+ *      Error processing: the header was verified on ingress
  *      Control packet processing: ICMP processing.. send it to the
  *                                 ICMP module which is going to decode the
  *                                 packet further.
@@ -305,29 +358,29 @@ int IPCheck4Redirection(gpacket_t *in_pkt)
  */
 int IPProcessMyPacket(gpacket_t *in_pkt)
 {
-	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data.data;
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
 
-	if (IPVerifyPacket(ip_pkt) == EXIT_SUCCESS)
-	{
-		// Is packet ICMP? send it to the ICMP module
-		// further processing with appropriate type code
-
-		if (ip_pkt->ip_prot == ICMP_PROTOCOL) {
-			ICMPProcessPacket(in_pkt);
-		  return EXIT_SUCCESS;
-        }
+	// the header was verified on the way in by IPIncomingPacket()
 
-		// Is packet UDP/TCP
-		// May be we can deal with other connectionless protocols as well.
-		if (ip_pkt->ip_prot == UDP_PROTOCOL){
-			UDPProcess(in_pkt);
-		  return EXIT_SUCCESS;
-        }
-		if (ip_pkt->ip_prot == TCP_PROTOCOL){
-			TCPProcess(in_pkt);
-		  return EXIT_SUCCESS;
-        }
+	// Is packet ICMP? send it to the ICMP module
+	// further processing with appropriate type code
+	if (ip_pkt->ip_prot == ICMP_PROTOCOL)
+	{
+		ICMPProcessPacket(in_pkt);
+		return EXIT_SUCCESS;
+	}
 
+	// Is packet UDP/TCP
+	// May be we can deal with other connectionless protocols as well.
+	if (ip_pkt->ip_prot == UDP_PROTOCOL)
+	{
+		UDPProcess(in_pkt);
+		return EXIT_SUCCESS;
+	}
+	if (ip_pkt->ip_prot == TCP_PROTOCOL)
+	{
+		TCPProcess(in_pkt);
+		return EXIT_SUCCESS;
 	}
 	return EXIT_FAILURE;
 }
@@ -338,15 +391,25 @@ int IPProcessMyPacket(gpacket_t *in_pkt)
  */
 int UDPProcess(gpacket_t *in_pkt)
 {
-	verbose(2, "[UDPProcess]:: packet received for processing...");
+	uchar dst[4], hnet[4], hmask[4], network[4], netmask[4];
+
+	TRACE(2, "[UDPProcess]:: packet received for processing...");
 
     struct pbuf *p = malloc(sizeof(struct pbuf)); // can also be done with pbuf_alloc()
-    p->payload = in_pkt->data.data;
-    p->len = ((ip_packet_t *)(in_pkt->data.data))->ip_hdr_len * 4 + UDP_HLEN;
+    p->payload = in_pkt->data->data;
+    p->len = ((ip_packet_t *)(in_pkt->data->data))->ip_hdr_len * 4 + UDP_HLEN;
     p->tot_len = p->len;
     p->type = PBUF_REF;
 
-    udp_input(p, in_pkt, route_tbl[in_pkt->frame.src_interface].netmask,route_tbl[in_pkt->frame.src_interface].network);
+    // network and netmask of the route to the destination, in network byte order like the header
+    bzero(network, 4);
+    bzero(netmask, 4);
+    if (findRouteNetwork(route_tbl, gNtohl(dst, ((ip_packet_t *)(in_pkt->data->data))->ip_dst), hnet, hmask, NULL) == EXIT_SUCCESS)
+    {
+        gHtonl(network, hnet);
+        gHtonl(netmask, hmask);
+    }
+    udp_input(p, in_pkt, netmask, network);
 	return EXIT_SUCCESS;
 }
 
@@ -355,11 +418,11 @@ int UDPProcess(gpacket_t *in_pkt)
  */
 int TCPProcess(gpacket_t *in_pkt)
 {
-	verbose(2, "[TCPProcess]:: packet received for processing...");
+	TRACE(2, "[TCPProcess]:: packet received for processing...");
 
     struct pbuf *p = malloc(sizeof(struct pbuf)); // can also be done with pbuf_alloc()
-    p->payload = in_pkt->data.data;
-    p->len = ntohs(((ip_packet_t *)(in_pkt->data.data))->ip_pkt_len);
+    p->payload = in_pkt->data->data;
+    p->len = ntohs(((ip_packet_t *)(in_pkt->data->data))->ip_pkt_len);
     p->tot_len = p->len;
     p->type = PBUF_REF;
 
@@ -378,7 +441,7 @@ int TCPProcess(gpacket_t *in_pkt)
  */
 int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int src_prot)
 {
-    ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data.data;
+    ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data->data;
 	ushort cksum;
 	char tmpbuf[MAX_TMPBUF_LEN];
 	uchar iface_ip_addr[4];
@@ -396,8 +459,7 @@ int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int s
 
 		// find the nexthop and interface and fill them in the "meta" frame
 		// NOTE: the packet itself is not modified by this lookup!
-		if (findRouteEntry(route_tbl, gNtohl(tmpbuf, ip_pkt->ip_dst),
-				   pkt->frame.nxth_ip_addr, &(pkt->frame.dst_interface)) == EXIT_FAILURE)
+		if (findRoutePacket(route_tbl, pkt) == EXIT_FAILURE)
 				   return EXIT_FAILURE;
 
 	} else if (newflag == 1)
@@ -414,21 +476,21 @@ int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int s
 		COPY_IP(ip_pkt->ip_dst, gHtonl(tmpbuf, dst_ip));
 		ip_pkt->ip_pkt_len = htons(size + ip_pkt->ip_hdr_len * 4);
 
-		verbose(2, "[IPOutgoingPacket]:: lookup next hop ");
+		TRACE(2, "[IPOutgoingPacket]:: lookup next hop ");
 		// find the nexthop and interface and fill them in the "meta" frame
 		// NOTE: the packet itself is not modified by this lookup!
-		if (findRouteEntry(route_tbl, gNtohl(tmpbuf, ip_pkt->ip_dst), pkt->frame.nxth_ip_addr, &(pkt->frame.dst_interface)) == EXIT_FAILURE) {
+		if (findRoutePacket(route_tbl, pkt) == EXIT_FAILURE) {
             return EXIT_FAILURE;
         }
 
-		verbose(2, "[IPOutgoingPacket]:: lookup MTU of nexthop");
+		TRACE(2, "[IPOutgoingPacket]:: lookup MTU of nexthop");
 		// lookup the IP address of the destination interface..
 		if ((status = findInterfaceIP(MTU_tbl, pkt->frame.dst_interface,
 					      iface_ip_addr)) == EXIT_FAILURE)
 					      return EXIT_FAILURE;
 		// the outgoing packet should have the interface IP as source
 		COPY_IP(ip_pkt->ip_src, gHtonl(tmpbuf, iface_ip_addr));
-		verbose(2, "[IPOutgoingPacket]:: almost one processing the IP header.");
+		TRACE(2, "[IPOutgoingPacket]:: almost one processing the IP header.");
 	} else
 	{
 		error("[IPOutgoingPacket]:: unknown outgoing packet action.. packet discarded ");
@@ -438,10 +500,10 @@ int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int s
 	//	compute the new checksum
 	cksum = checksum((uchar *)ip_pkt, ip_pkt->ip_hdr_len*2);
 	ip_pkt->ip_cksum = htons(cksum);
-	pkt->data.header.prot = htons(IP_PROTOCOL);
+	pkt->data->header.prot = htons(IP_PROTOCOL);
 
 	IPSend2Output(pkt);
-	verbose(2, "[IPOutgoingPacket]:: IP packet sent to output queue.. ");
+	TRACE(2, "[IPOutgoingPacket]:: IP packet sent to output queue.. ");
 	return EXIT_SUCCESS;
 }
 
@@ -452,23 +514,46 @@ int IPOutgoingPacket(gpacket_t *pkt, uchar *dst_ip, int size, int newflag, int s
  */
 int IPSend2Output(gpacket_t *pkt)
 {
-	int vlevel;
-
 	if (pkt == NULL)
 	{
 		verbose(1, "[IPSend2Output]:: NULL pointer error... nothing sent");
 		return EXIT_FAILURE;
 	}
 
-	vlevel = prog_verbosity_level();
-	if (vlevel >= 3)
-		printGPacket(pkt, vlevel, "IP_ROUTINE");
+	if (TRACE_ON(3))
+		printGPacket(pkt, trace_level, "IP_ROUTINE");
 
 	return writeQueue(pcore->outputQ, (void *)pkt, sizeof(gpacket_t));
 }
 
 
 
+/*
+ * Write a train of at most MAX_FRAGMENTS packets, such as the fragments of
+ * one packet, to the output queue in one batch. Packets the queue does not
+ * take are freed.
+ */
+int IPSend2OutputBurst(gpacket_t **pkts, int count)
+{
+	int sizes[MAX_FRAGMENTS];
+	int i, n;
+
+	for (i = 0; i < count; i++)
+	{
+		sizes[i] = sizeof(gpacket_t);
+		if (TRACE_ON(3))
+			printGPacket(pkts[i], trace_level, "IP_ROUTINE");
+	}
+
+	if ((n = writeQueueBurst(pcore->outputQ, (void **)pkts, sizes, count)) == count)
+		return EXIT_SUCCESS;
+	for (i = n; i < count; i++)
+		freePacket(pkts[i]);
+	return EXIT_FAILURE;
+}
+
+
+
 /*
  * check whether the IP packet has correct checksum and
  * version number... this router is hard coded for IP version 4!
@@ -476,25 +561,31 @@ int IPSend2Output(gpacket_t *pkt)
  * we silently drop the packet. It seems (should check carefully) that
  * ICMP does not have a facility to report this kind of condition.
  * May be this condition is not likely to happen???
+ * len is the number of bytes of the packet the frame holds: the header and
+ * the total length must both fit in it.
  */
-int IPVerifyPacket(ip_packet_t *ip_pkt)
+int IPVerifyPacket(ip_packet_t *ip_pkt, int len)
 {
-	char tmpbuf[MAX_TMPBUF_LEN];
 	int hdr_len = ip_pkt->ip_hdr_len;
+	int pkt_len = ntohs(ip_pkt->ip_pkt_len);
+
+	if ((hdr_len < 5) || ((hdr_len << 2) > len) || (pkt_len < (hdr_len << 2)) || (pkt_len > len))
+	{
+		TRACE(2, "[IPVerifyPacket]:: packet from %N has bad lengths, packet thrown", TRACE_IP(ip_pkt->ip_src));
+		return EXIT_FAILURE;
+	}
 
 	// verify the header checksum
 	if (checksum((void *)ip_pkt, hdr_len *2) != 0)
 	{
-		verbose(2, "[IPVerifyPacket]:: packet from %s failed checksum, packet thrown",
-		       IP2Dot(tmpbuf, gNtohl((tmpbuf+20), ip_pkt->ip_src)));
+		TRACE(2, "[IPVerifyPacket]:: packet from %N failed checksum, packet thrown", TRACE_IP(ip_pkt->ip_src));
 		return EXIT_FAILURE;
 	}
 
 	// Check correct IP version
 	if (ip_pkt->ip_version != 4)
 	{
-		verbose(2, "[IPVerifyPacket]:: from %s failed checksum, packet thrown",
-		       IP2Dot(tmpbuf, gNtohl((tmpbuf + 20), ip_pkt->ip_src)));
+		TRACE(2, "[IPVerifyPacket]:: from %N failed checksum, packet thrown", TRACE_IP(ip_pkt->ip_src));
 		return EXIT_FAILURE;
 	}
 
@@ -508,30 +599,20 @@ int IPVerifyPacket(ip_packet_t *ip_pkt)
  */
 int isInSameNetwork(uchar *ip_addr1, uchar *ip_addr2)
 {
-	char tmpbuf[MAX_TMPBUF_LEN];
-	int i, j;
-	uchar net1[4], net2[4];
+	uchar network[4], netmask[4];
+	bool connected;
 
-	for (i = 0; i < MAX_ROUTES; i++)
+	// only a directly connected network counts: a default route would put everything on one network
+	if ((findRouteNetwork(route_tbl, ip_addr1, network, netmask, &connected) == EXIT_SUCCESS) && connected &&
+	    (compareIPUsingMask(ip_addr2, network, netmask) == 0))
 	{
-		if (route_tbl[i].is_empty == TRUE) continue;
-		// TODO: Could there be a bug here? What about default routes with 0.0.0.0??
-		for (j = 0; j < 4; j++)
-		{
-			net1[j] = ip_addr1[j] & route_tbl[i].netmask[j];
-			net2[j] = ip_addr2[j] & route_tbl[i].netmask[j];
-		}
-		if (COMPARE_IP(net1, net2) == 0)
-		{
-			verbose(2, "[isInSameNetwork]:: IPs %s and %s are on the same network %s",
-			       IP2Dot(tmpbuf, ip_addr1), IP2Dot((tmpbuf+20), ip_addr2), IP2Dot((tmpbuf+40), route_tbl[i].network));
+		TRACE(2, "[isInSameNetwork]:: IPs %I and %I are on the same network %I",
+		      TRACE_IP(ip_addr1), TRACE_IP(ip_addr2), TRACE_IP(network));
 
-			return EXIT_SUCCESS;
-		}
+		return EXIT_SUCCESS;
 	}
 
-	verbose(2, "[isInSameNetwork]:: IPs %s and %s are not on the same network",
-	       IP2Dot(tmpbuf, ip_addr1), IP2Dot((tmpbuf+20), ip_addr2));
+	TRACE(2, "[isInSameNetwork]:: IPs %I and %I are not on the same network", TRACE_IP(ip_addr1), TRACE_IP(ip_addr2));
 
 	return EXIT_FAILURE;
 }
@@ -584,7 +665,7 @@ u32_t ip4_addr_get_u32(uchar *src) {
 err_t
 ip_output(struct pbuf *p, uchar *src_ip, uchar *dst_ip, u8_t ttl, u8_t tos, int src_prot) {
     // create GINI's gpacket_t
-	gpacket_t *out_pkt = (gpacket_t *) malloc(sizeof(gpacket_t));
+	gpacket_t *out_pkt = allocPacket(sizeof(ip_packet_t) + p->len);
     if (out_pkt == NULL) {
         printf("could not allocate gpacket_t\n");
         return ERR_MEM;
@@ -592,7 +673,7 @@ ip_output(struct pbuf *p, uchar *src_ip, uchar *dst_ip, u8_t ttl, u8_t tos, int
 
     // write pbuf's payload to GINI's gpacket_t, at the correct offset
     int offset = sizeof(ip_packet_t);
-    memcpy((void*)((uchar*)out_pkt->data.data + offset), p->payload, p->len);
+    memcpy((void*)((uchar*)out_pkt->data->data + offset), p->payload, p->len);
 
     // call IP function
     int res = IPOutgoingPacket(out_pkt, dst_ip, p->len, 1, src_prot);
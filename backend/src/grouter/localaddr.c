@@ -0,0 +1,172 @@
+/*
+ * localaddr.c (local address table)
+ *
+ * An open addressing hash set with linear probing. A slot holds the
+ * address, interface and kind in one 64 bit word, so a lookup takes no
+ * lock and reads one slot per probe, usually just one. A deleted slot
+ * becomes a tombstone rather than empty, so it never cuts the probe
+ * sequence of another address; tombstones are reused by later inserts.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <slack/err.h>
+
+#include "gnet.h"
+#include "localaddr.h"
+
+
+#define LOCAL_EMPTY                     0ULL
+#define LOCAL_TOMB                      (0xffULL << 48)
+#define LOCAL_SLOT(addr, iface, kind)   ((uint64_t)(addr) | ((uint64_t)((iface) + 1) << 32) | ((uint64_t)(kind) << 48))
+#define LOCAL_SLOT_ADDR(v)              ((uint32_t)(v))
+#define LOCAL_SLOT_IFACE(v)             ((int)(((v) >> 32) & 0xffff) - 1)
+#define LOCAL_SLOT_KIND(v)              ((int)(((v) >> 48) & 0xff))
+
+static uint64_t localslots[LOCAL_ADDR_SLOTS];
+static int localrefs[LOCAL_ADDR_SLOTS];         // adds of the address in a slot, for the writers
+static int localcount;
+static pthread_mutex_t locallock = PTHREAD_MUTEX_INITIALIZER;       // serializes the writers
+
+
+static inline uint32_t localKey(uchar *ip_addr)
+{
+	uint32_t addr;
+
+	memcpy(&addr, ip_addr, 4);
+	return addr;
+}
+
+
+static inline uint32_t localHash(uint32_t addr)
+{
+	return (addr * 0x9e3779b1u) >> (32 - __builtin_ctz(LOCAL_ADDR_SLOTS));
+}
+
+
+/*
+ * Is ip_addr an address of the router? Returns its kind (LOCAL_NONE if it
+ * is not one) and, if interface is not NULL, its interface (-1 for the
+ * limited broadcast).
+ */
+int findLocalAddress(uchar *ip_addr, int *interface)
+{
+	uint32_t addr = localKey(ip_addr), i = localHash(addr);
+	uint64_t v;
+	int n;
+
+	for (n = 0; n < LOCAL_ADDR_SLOTS; n++, i = (i + 1) & (LOCAL_ADDR_SLOTS - 1))
+	{
+		v = __atomic_load_n(&(localslots[i]), __ATOMIC_ACQUIRE);
+		if (v == LOCAL_EMPTY)
+			break;
+		if ((v != LOCAL_TOMB) && (LOCAL_SLOT_ADDR(v) == addr))
+		{
+			if (interface != NULL)
+				*interface = LOCAL_SLOT_IFACE(v);
+			return LOCAL_SLOT_KIND(v);
+		}
+	}
+	return LOCAL_NONE;
+}
+
+
+// slot of (addr, interface, kind), or -1; called with locallock held
+static int findLocalSlot(uint64_t slot)
+{
+	uint32_t i = localHash(LOCAL_SLOT_ADDR(slot));
+	int n;
+
+	for (n = 0; (n < LOCAL_ADDR_SLOTS) && (localslots[i] != LOCAL_EMPTY); n++, i = (i + 1) & (LOCAL_ADDR_SLOTS - 1))
+		if (localslots[i] == slot)
+			return i;
+	return -1;
+}
+
+
+/*
+ * Add a local address. Adding the same address, interface and kind again
+ * only counts it: it goes when it has been deleted as many times.
+ */
+int addLocalAddress(uchar *ip_addr, int interface, int kind)
+{
+	uint64_t slot = LOCAL_SLOT(localKey(ip_addr), interface, kind);
+	char tmpbuf[MAX_TMPBUF_LEN];
+	uint32_t i;
+	int s;
+
+	pthread_mutex_lock(&locallock);
+	if ((s = findLocalSlot(slot)) >= 0)
+	{
+		localrefs[s]++;
+		pthread_mutex_unlock(&locallock);
+		return EXIT_SUCCESS;
+	}
+	if (localcount >= MAX_LOCAL_ADDRS)
+	{
+		pthread_mutex_unlock(&locallock);
+		error("[addLocalAddress]:: local address table full, %s not added ", IP2Dot(tmpbuf, ip_addr));
+		return EXIT_FAILURE;
+	}
+	// the table is at most half full, so there is a free slot
+	for (i = localHash(LOCAL_SLOT_ADDR(slot)); (localslots[i] != LOCAL_EMPTY) && (localslots[i] != LOCAL_TOMB);
+	     i = (i + 1) & (LOCAL_ADDR_SLOTS - 1))
+		;
+	localrefs[i] = 1;
+	__atomic_store_n(&(localslots[i]), slot, __ATOMIC_RELEASE);
+	localcount++;
+	pthread_mutex_unlock(&locallock);
+
+	verbose(2, "[addLocalAddress]:: %s added for interface %d", IP2Dot(tmpbuf, ip_addr), interface);
+	return EXIT_SUCCESS;
+}
+
+
+void deleteLocalAddress(uchar *ip_addr, int interface, int kind)
+{
+	char tmpbuf[MAX_TMPBUF_LEN];
+	int s;
+
+	pthread_mutex_lock(&locallock);
+	if (((s = findLocalSlot(LOCAL_SLOT(localKey(ip_addr), interface, kind))) >= 0) && (--localrefs[s] == 0))
+	{
+		__atomic_store_n(&(localslots[s]), LOCAL_TOMB, __ATOMIC_RELEASE);
+		localcount--;
+		// tombstones just before an empty slot end no probe sequence
+		if (localslots[(s + 1) & (LOCAL_ADDR_SLOTS - 1)] == LOCAL_EMPTY)
+			for (; localslots[s] == LOCAL_TOMB; s = (s - 1) & (LOCAL_ADDR_SLOTS - 1))
+				__atomic_store_n(&(localslots[s]), LOCAL_EMPTY, __ATOMIC_RELEASE);
+		verbose(2, "[deleteLocalAddress]:: %s deleted for interface %d", IP2Dot(tmpbuf, ip_addr), interface);
+	}
+	pthread_mutex_unlock(&locallock);
+}
+
+
+void printLocalAddresses(void)
+{
+	interface_t *iface;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	uchar ip_addr[4];
+	uint32_t addr;
+	int i;
+
+	printf("-----------------------------------------------------------\n");
+	printf("      L O C A L  A D D R E S S E S  (%d)\n", localcount);
+	printf("-----------------------------------------------------------\n");
+	printf("Address\t\tKind\t\tInterface \n");
+
+	pthread_mutex_lock(&locallock);
+	for (i = 0; i < LOCAL_ADDR_SLOTS; i++)
+		if ((localslots[i] != LOCAL_EMPTY) && (localslots[i] != LOCAL_TOMB))
+		{
+			addr = LOCAL_SLOT_ADDR(localslots[i]);
+			memcpy(ip_addr, &addr, 4);
+			iface = (LOCAL_SLOT_IFACE(localslots[i]) >= 0) ? findInterface(LOCAL_SLOT_IFACE(localslots[i])) : NULL;
+			printf("%s\t%s\t%s\n", IP2Dot(tmpbuf, ip_addr),
+			       (LOCAL_SLOT_KIND(localslots[i]) == LOCAL_UNICAST) ? "unicast  " : "broadcast",
+			       (iface != NULL) ? iface->device_name : "-");
+		}
+	pthread_mutex_unlock(&locallock);
+	printf("-----------------------------------------------------------\n");
+}
@@ -1,28 +1,145 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include "grouter.h"
 #include "message.h"
+#include "pktpool.h"
 #include "protocols.h"
 #include "ip.h"
 #include "arp.h"
+#include "ethernet.h"
 
 #include <slack/std.h>
 #include <slack/err.h>
 
 
+/*
+ * Number of bytes the frame can span: from data to the end of the buffer.
+ */
+int packetCapacity(gpacket_t *pkt)
+{
+	gpacket_t *holder = PKT_HOLDER(pkt);
+
+	return holder->bufsize - (int)((uchar *)pkt->data - holder->buf);
+}
+
+
+/*
+ * Number of valid bytes in the frame. The IP and ARP code writes packets in
+ * place without keeping len, so for those the length is taken from the
+ * headers; other frames (VLAN tagged ones, say) rely on len, which the
+ * devices set on receive.
+ */
+int packetLength(gpacket_t *pkt)
+{
+	int len;
+
+	if ((pkt->data->header.prot == htons(IP_PROTOCOL)) || (pkt->data->header.prot == htons(ARP_PROTOCOL)))
+		len = findPacketSize(pkt->data);
+	else if (pkt->len > 0)
+		len = pkt->len;
+	else
+		len = packetCapacity(pkt);
+	return min(len, packetCapacity(pkt));
+}
+
+
+/*
+ * Grow the frame by len bytes at the front, taken from the headroom. The new
+ * bytes are not initialized. Returns the new start of the frame or NULL if
+ * there is not enough headroom. The headroom of a shared buffer is shared
+ * too, so the data is made private first.
+ */
+pkt_data_t *pushPacketHeader(gpacket_t *pkt, int len)
+{
+	int plen;
+
+	if (makePacketWritable(pkt) == NULL)
+		return NULL;
+	if ((uchar *)pkt->data - PKT_HOLDER(pkt)->buf < len)
+	{
+		error("[pushPacketHeader]:: no headroom left for %d bytes.. ", len);
+		return NULL;
+	}
+	plen = packetLength(pkt);
+	pkt->data = (pkt_data_t *)((uchar *)pkt->data - len);
+	pkt->len = plen + len;
+	return pkt->data;
+}
+
+
+/*
+ * Remove len bytes from the front of the frame, giving them to the headroom.
+ */
+pkt_data_t *pullPacketHeader(gpacket_t *pkt, int len)
+{
+	int plen;
+
+	if ((plen = packetLength(pkt)) < len)
+	{
+		error("[pullPacketHeader]:: frame shorter than %d bytes.. ", len);
+		return NULL;
+	}
+	pkt->data = (pkt_data_t *)((uchar *)pkt->data + len);
+	pkt->len = plen - len;
+	return pkt->data;
+}
+
+
+/*
+ * Copy the GINI metadata and the valid bytes of src into dst. The copy
+ * starts after the full headroom of dst; bytes that do not fit into dst
+ * are cut.
+ */
+void copyPacket(gpacket_t *dst, gpacket_t *src)
+{
+	int len;
+
+	memcpy(&(dst->frame), &(src->frame), sizeof(pkt_frame_t));
+	dst->data = (pkt_data_t *)(dst->buf + PKT_HEADROOM);
+	len = min(packetLength(src), packetCapacity(dst));
+	memcpy(dst->data, src->data, len);
+	dst->len = len;
+}
+
+
+/*
+ * The duplicate shares the data with inpkt (see clonePacket); only its
+ * GINI frame is private until one of them calls makePacketWritable().
+ */
 gpacket_t *duplicatePacket(gpacket_t *inpkt)
 {
-	gpacket_t *cpptr = (gpacket_t *) malloc(sizeof(gpacket_t));
+	gpacket_t *cpptr;
 
-	if (cpptr == NULL)
+	if ((cpptr = clonePacket(inpkt)) == NULL)
 	{
 		error("[duplicatePacket]:: error allocating memory for duplication.. ");
 		return NULL;
 	}
-	memcpy(cpptr, inpkt, sizeof(gpacket_t));
+	return cpptr;
+}
+
+
+/*
+ * A private packet holding the GINI frame and the first len bytes of
+ * inpkt; for replies (ICMP errors) that quote only the headers.
+ */
+gpacket_t *duplicatePacketHead(gpacket_t *inpkt, int len)
+{
+	gpacket_t *cpptr;
+
+	if ((cpptr = allocPacket(DEFAULT_MTU)) == NULL)
+	{
+		error("[duplicatePacketHead]:: error allocating memory for duplication.. ");
+		return NULL;
+	}
+	memcpy(&(cpptr->frame), &(inpkt->frame), sizeof(pkt_frame_t));
+	len = min(min(len, packetLength(inpkt)), packetCapacity(cpptr));
+	memcpy(cpptr->data, inpkt->data, len);
+	cpptr->len = len;
 	return cpptr;
 }
 
@@ -100,9 +217,9 @@ int printEthernetHeader(gpacket_t *msg)
 	int prot;
 
 	printf("\n    P A C K E T  D A T A  S E C T I O N of GMESSAGE \n");
-	printf(" DST MAC addr : \t %s\n", MAC2Colon(tmpbuf, msg->data.header.dst));
-	printf(" SRC MAC addr : \t %s\n", MAC2Colon(tmpbuf, msg->data.header.src));
-	prot = ntohs(msg->data.header.prot);
+	printf(" DST MAC addr : \t %s\n", MAC2Colon(tmpbuf, msg->data->header.dst));
+	printf(" SRC MAC addr : \t %s\n", MAC2Colon(tmpbuf, msg->data->header.src));
+	prot = ntohs(msg->data->header.prot);
 	printf(" Protocol : \t %x\n", prot);
 
 	return prot;
@@ -115,7 +232,7 @@ int printIPPacket(gpacket_t *msg)
 	char tmpbuf[MAX_TMPBUF_LEN];
 	int tos;
 
-	ip_pkt = (ip_packet_t *)msg->data.data;
+	ip_pkt = (ip_packet_t *)msg->data->data;
 	printf("IP: ----- IP Header -----\n");
 	printf("IP: Version        : %d\n", ip_pkt->ip_version);
 	printf("IP: Header Length  : %d Bytes\n", ip_pkt->ip_hdr_len*4);
@@ -166,7 +283,7 @@ void printARPPacket(gpacket_t *msg)
 	arp_packet_t *apkt;
 	char tmpbuf[MAX_TMPBUF_LEN];
 
-	apkt = (arp_packet_t *) msg->data.data;
+	apkt = (arp_packet_t *) msg->data->data;
 
 	printf(" ARP hardware addr type %x \n", ntohs(apkt->hw_addr_type));
 	printf(" ARP protocol %x \n", ntohs(apkt->arp_prot));
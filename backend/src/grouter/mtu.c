@@ -5,6 +5,7 @@
  */
 
 #include "mtu.h"
+#include "message.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -140,6 +141,10 @@ void addMTUEntry(mtu_entry_t mtable[], int index,
 	{
 		verbose(2, "[addMTUEntry]:: mtu<0 or no value set for mtu, MTU set to default value");
 		mtu=DEFAULT_MTU;
+	} else if (mtu > MAX_JUMBO_MTU)
+	{
+		verbose(1, "[addMTUEntry]:: mtu %d above the jumbo frame limit, MTU set to %d", mtu, MAX_JUMBO_MTU);
+		mtu = MAX_JUMBO_MTU;
 	}
 
 	mtable[index].is_empty = FALSE;
@@ -0,0 +1,894 @@
+/*
+ * nat.c (network address and port translator)
+ *
+ * Mappings are endpoint independent (RFC 4787): an inside (address, port)
+ * keeps its outside port whatever the remote end. Packet threads look a
+ * mapping up under the lock stripe of its bucket and copy it out, so the
+ * ager can free a mapping as soon as it is unlinked from both tables.
+ * Dynamic ports come from per interface and per protocol pools, through
+ * a small cache in each thread. Checksums are fixed up incrementally.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <slack/std.h>
+#include <slack/err.h>
+
+#include "protocols.h"
+#include "ip.h"
+#include "icmp.h"
+#include "checksum.h"
+#include "tokenbucket.h"
+#include "nat.h"
+
+
+#define NAT_TCP_FIN                 0x01
+#define NAT_TCP_RST                 0x04
+
+// thread cache slot of this thread in every pool, -1 until assigned
+static __thread int myslot = -1;
+
+static void ageNAT(void *arg, twentry_t *list);
+
+
+nat_t *createNAT(void)
+{
+	nat_t *nat;
+	int i;
+
+	if ((nat = (nat_t *)calloc(1, sizeof(nat_t))) == NULL)
+	{
+		fatal("[createNAT]:: Could not allocate memory for the NAT tables ");
+		return NULL;
+	}
+	for (i = 0; i < NAT_LOCKS; i++)
+		pthread_mutex_init(&(nat->locks[i]), NULL);
+	if ((nat->ager = createTimerWheel("nat aging", ageNAT, nat)) == NULL)
+	{
+		fatal("[createNAT]:: Could not create the NAT aging timer ");
+		return NULL;
+	}
+	addTimerWheelEntry(nat->ager, NAT_SWEEP_SECS * 1000000ULL, NULL, 0, nat);
+	return nat;
+}
+
+
+static inline uint32_t natClock(void)
+{
+	return (uint32_t)(monotonicNanos() / 1000000000ULL);
+}
+
+
+static inline uint32_t natHash(uint32_t addr, uint16_t port, int prot, int iface)
+{
+	uint32_t h;
+
+	h = (addr * 0x9e3779b1u) ^ (((uint32_t)port | ((uint32_t)prot << 16) | ((uint32_t)iface << 24)) * 0x85ebca77u);
+	return (h ^ (h >> 15)) & (NAT_BUCKETS - 1);
+}
+
+
+// The outside address of a mapping is always the address of its interface
+#define natInsideBucket(iface, prot, addr, port)     natHash(addr, port, prot, iface)
+#define natOutsideBucket(iface, prot, port)          natHash(0x5bd1e995u, port, prot, iface)
+
+
+static inline pthread_mutex_t *natLock(nat_t *nat, uint32_t b)
+{
+	return &(nat->locks[b & (NAT_LOCKS - 1)]);
+}
+
+
+// Lock the stripes of an inside and an outside bucket, in stripe order
+static void lockNATBuckets(nat_t *nat, uint32_t bi, uint32_t bo)
+{
+	uint32_t li = bi & (NAT_LOCKS - 1), lo = bo & (NAT_LOCKS - 1);
+
+	pthread_mutex_lock(&(nat->locks[min(li, lo)]));
+	if (li != lo)
+		pthread_mutex_lock(&(nat->locks[max(li, lo)]));
+}
+
+
+static void unlockNATBuckets(nat_t *nat, uint32_t bi, uint32_t bo)
+{
+	uint32_t li = bi & (NAT_LOCKS - 1), lo = bo & (NAT_LOCKS - 1);
+
+	if (li != lo)
+		pthread_mutex_unlock(&(nat->locks[max(li, lo)]));
+	pthread_mutex_unlock(&(nat->locks[min(li, lo)]));
+}
+
+
+static inline int natProtIndex(int prot)
+{
+	return (prot == TCP_PROTOCOL) ? NAT_TCP : ((prot == UDP_PROTOCOL) ? NAT_UDP : NAT_ICMP);
+}
+
+
+static int natThreadSlot(nat_t *nat)
+{
+	if (myslot == -1)
+		myslot = __atomic_fetch_add(&(nat->nthreads), 1, __ATOMIC_RELAXED);
+	return (myslot < NAT_MAX_THREADS) ? myslot : -1;
+}
+
+
+/*
+ * Take a free port from the pool through the cache of thread slot (the
+ * pool itself if slot is -1). Returns -1 if the pool is empty.
+ */
+static int allocNATPort(natportpool_t *pool, int slot)
+{
+	natportcache_t *cache;
+	uint8_t expected;
+	int port, n;
+
+	while (1)
+	{
+		if (slot < 0)
+		{
+			pthread_mutex_lock(&(pool->lock));
+			port = (pool->nfree > 0) ? pool->free[--pool->nfree] : -1;
+			pthread_mutex_unlock(&(pool->lock));
+			if (port < 0)
+				return -1;
+		} else
+		{
+			cache = &(pool->caches[slot]);
+			if (cache->count == 0)
+			{
+				pthread_mutex_lock(&(pool->lock));
+				n = min(NAT_PORT_BATCH, pool->nfree);
+				pool->nfree -= n;
+				memcpy(cache->ports, &(pool->free[pool->nfree]), n * sizeof(uint16_t));
+				pthread_mutex_unlock(&(pool->lock));
+				if ((cache->count = n) == 0)
+					return -1;
+			}
+			port = cache->ports[--cache->count];
+		}
+
+		// a static mapping may have claimed the port while it was free;
+		// the port then leaves the pool until the mapping is deleted
+		while (1)
+		{
+			expected = NAT_PORT_FREE;
+			if (__atomic_compare_exchange_n(&(pool->state[port]), &expected, NAT_PORT_MAPPED, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return port;
+			expected = NAT_PORT_CLAIMED;
+			if (__atomic_compare_exchange_n(&(pool->state[port]), &expected, NAT_PORT_STATIC, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
+		}
+	}
+}
+
+
+// Push free ports back into the pool
+static void releaseNATPorts(natportpool_t *pool, uint16_t *ports, int n)
+{
+	pthread_mutex_lock(&(pool->lock));
+	memcpy(&(pool->free[pool->nfree]), ports, n * sizeof(uint16_t));
+	pool->nfree += n;
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+
+static void freeNATPort(natportpool_t *pool, int port, int slot)
+{
+	natportcache_t *cache;
+	uint16_t p = port;
+
+	__atomic_store_n(&(pool->state[port]), NAT_PORT_FREE, __ATOMIC_RELEASE);
+	if (slot < 0)
+	{
+		releaseNATPorts(pool, &p, 1);
+		return;
+	}
+	cache = &(pool->caches[slot]);
+	if (cache->count == 2 * NAT_PORT_BATCH)
+	{
+		cache->count -= NAT_PORT_BATCH;
+		releaseNATPorts(pool, &(cache->ports[cache->count]), NAT_PORT_BATCH);
+	}
+	cache->ports[cache->count++] = port;
+}
+
+
+// Empty the caches of thread slot into their pools
+static void flushNATPortCaches(nat_t *nat, int slot)
+{
+	natiface_t *nif;
+	natportcache_t *cache;
+	int i, j;
+
+	if (slot < 0)
+		return;
+	for (i = 0; i < MAX_INTERFACES; i++)
+	{
+		if ((nif = nat->ifaces[i]) == NULL)
+			continue;
+		for (j = 0; j < NAT_PROTS; j++)
+		{
+			cache = &(nif->pools[j].caches[slot]);
+			if (cache->count > 0)
+			{
+				releaseNATPorts(&(nif->pools[j]), cache->ports, cache->count);
+				cache->count = 0;
+			}
+		}
+	}
+}
+
+
+/*
+ * The translation state of interface iface, set up on first use. Every
+ * port of the dynamic range starts in the pool, in random order (RFC 6056).
+ * Called from the CLI only.
+ */
+static natiface_t *getNATIface(nat_t *nat, int iface)
+{
+	interface_t *ifptr;
+	natiface_t *nif;
+	natportpool_t *pool;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	uint16_t tmp;
+	int i, j, k;
+
+	if ((iface < 0) || (iface >= MAX_INTERFACES) || ((ifptr = findInterface(iface)) == NULL))
+	{
+		error("[getNATIface]:: no interface %d ", iface);
+		return NULL;
+	}
+	if ((nif = nat->ifaces[iface]) == NULL)
+	{
+		if ((nif = (natiface_t *)calloc(1, sizeof(natiface_t))) == NULL)
+		{
+			error("[getNATIface]:: Could not allocate memory for the NAT state of interface %d ", iface);
+			return NULL;
+		}
+		for (j = 0; j < NAT_PROTS; j++)
+		{
+			pool = &(nif->pools[j]);
+			pthread_mutex_init(&(pool->lock), NULL);
+			pool->nfree = NAT_PORT_MAX - NAT_PORT_MIN + 1;
+			for (i = 0; i < pool->nfree; i++)
+				pool->free[i] = NAT_PORT_MIN + i;
+			for (i = pool->nfree - 1; i > 0; i--)
+			{
+				k = random() % (i + 1);
+				tmp = pool->free[i];
+				pool->free[i] = pool->free[k];
+				pool->free[k] = tmp;
+			}
+		}
+		memcpy(&(nif->addr), gHtonl((uchar *)tmpbuf, ifptr->ip_addr), 4);
+		__atomic_store_n(&(nat->ifaces[iface]), nif, __ATOMIC_RELEASE);
+	} else
+		// pick up a change of the interface address
+		memcpy(&(nif->addr), gHtonl((uchar *)tmpbuf, ifptr->ip_addr), 4);
+	return nif;
+}
+
+
+int setNATMasquerade(nat_t *nat, int iface, int on)
+{
+	natiface_t *nif;
+
+	if ((nif = getNATIface(nat, iface)) == NULL)
+		return EXIT_FAILURE;
+	nif->masq = on;
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Find the live mapping of an inside or an outside endpoint and copy it
+ * to *copy, noting the packet. The outside address is implied by iface.
+ */
+static int lookupNAT(nat_t *nat, int outside, int iface, int prot, uint32_t addr, uint16_t port,
+		     int tcpflags, natentry_t *copy)
+{
+	natentry_t *e;
+	uint32_t b, now = natClock();
+
+	b = outside ? natOutsideBucket(iface, prot, port) : natInsideBucket(iface, prot, addr, port);
+	pthread_mutex_lock(natLock(nat, b));
+	for (e = outside ? nat->outside[b] : nat->inside[b]; e != NULL; e = outside ? e->outnext : e->innext)
+	{
+		if ((e->iface != iface) || (e->prot != prot) || __atomic_load_n(&(e->dead), __ATOMIC_RELAXED))
+			continue;
+		if (outside ? (e->outport != port) : ((e->inport != port) || (e->inaddr != addr)))
+			continue;
+		if (e->lastused != now)
+			e->lastused = now;
+		if (tcpflags & (NAT_TCP_FIN | NAT_TCP_RST))
+			e->closing = 1;
+		e->pkts[outside]++;
+		*copy = *e;
+		pthread_mutex_unlock(natLock(nat, b));
+		return 1;
+	}
+	pthread_mutex_unlock(natLock(nat, b));
+	return 0;
+}
+
+
+/*
+ * Map the inside endpoint (addr, port) to a new port of the interface.
+ * Returns 0 if the interface has no port left.
+ */
+static int createNATMapping(nat_t *nat, natiface_t *nif, int iface, int prot, uint32_t addr, uint16_t port,
+			    int tcpflags, natentry_t *copy)
+{
+	natportpool_t *pool = &(nif->pools[natProtIndex(prot)]);
+	natentry_t *e, *o;
+	uint32_t bi, bo;
+	int slot = natThreadSlot(nat), outport;
+
+	if (((outport = allocNATPort(pool, slot)) < 0) || ((e = (natentry_t *)calloc(1, sizeof(natentry_t))) == NULL))
+	{
+		if (outport >= 0)
+			freeNATPort(pool, outport, slot);
+		__atomic_add_fetch(&(nif->noport), 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	e->inaddr = addr;
+	e->inport = port;
+	e->outaddr = nif->addr;
+	e->outport = outport;
+	e->prot = prot;
+	e->iface = iface;
+	e->closing = (tcpflags & (NAT_TCP_FIN | NAT_TCP_RST)) != 0;
+	e->lastused = natClock();
+	e->pkts[0] = 1;
+
+	bi = natInsideBucket(iface, prot, addr, port);
+	bo = natOutsideBucket(iface, prot, e->outport);
+	lockNATBuckets(nat, bi, bo);
+	// another packet of the endpoint may have been mapped meanwhile
+	for (o = nat->inside[bi]; o != NULL; o = o->innext)
+		if ((o->iface == iface) && (o->prot == prot) && (o->inaddr == addr) && (o->inport == port) && !o->dead)
+			break;
+	if (o != NULL)
+	{
+		o->pkts[0]++;
+		*copy = *o;
+		unlockNATBuckets(nat, bi, bo);
+		freeNATPort(pool, outport, slot);
+		free(e);
+		return 1;
+	}
+	e->innext = nat->inside[bi];
+	nat->inside[bi] = e;
+	e->outnext = nat->outside[bo];
+	nat->outside[bo] = e;
+	*copy = *e;
+	unlockNATBuckets(nat, bi, bo);
+	__atomic_add_fetch(&(nat->count), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(nat->created), 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+
+/*
+ * Rewrite the source (srcside) or destination address of an IP header to
+ * addr and, unless port is -1, the matching port of its transport header
+ * (the id of an ICMP echo) to port, fixing the checksums. Only l4len
+ * bytes of the transport header need be present, as in the packet quoted
+ * by an ICMP error; a checksum that is not there is left alone.
+ */
+static void natRewrite(ip_packet_t *ip_pkt, int l4len, int srcside, uint32_t addr, int port)
+{
+	uchar *l4 = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+	uchar *addrp = srcside ? ip_pkt->ip_src : ip_pkt->ip_dst;
+	uint16_t *portp = NULL, *ckp = NULL;
+	uint16_t oldport, newport, cksum;
+	uint32_t oldaddr;
+	int pseudo = 1;
+
+	memcpy(&oldaddr, addrp, 4);
+	memcpy(addrp, &addr, 4);
+	ip_pkt->ip_cksum = checksumAdjust32(ip_pkt->ip_cksum, oldaddr, addr);
+	if (port < 0)
+		return;
+
+	switch (ip_pkt->ip_prot)
+	{
+	case TCP_PROTOCOL:
+		portp = (uint16_t *)(l4 + (srcside ? 0 : 2));
+		if (l4len >= 18)
+			ckp = (uint16_t *)(l4 + 16);
+		break;
+	case UDP_PROTOCOL:
+		portp = (uint16_t *)(l4 + (srcside ? 0 : 2));
+		// a zero UDP checksum means the sender did not compute one
+		if ((l4len >= 8) && (*(uint16_t *)(l4 + 6) != 0))
+			ckp = (uint16_t *)(l4 + 6);
+		break;
+	case ICMP_PROTOCOL:
+		portp = (uint16_t *)(l4 + 4);
+		if (l4len >= 4)
+			ckp = (uint16_t *)(l4 + 2);
+		pseudo = 0;
+		break;
+	}
+	if ((portp == NULL) || (l4len < (uchar *)portp - l4 + 2))
+		return;
+
+	oldport = *portp;
+	newport = htons(port);
+	*portp = newport;
+	if (ckp == NULL)
+		return;
+	cksum = *ckp;
+	if (pseudo)
+		cksum = checksumAdjust32(cksum, oldaddr, addr);
+	cksum = checksumAdjust16(cksum, oldport, newport);
+	if ((ip_pkt->ip_prot == UDP_PROTOCOL) && (cksum == 0))
+		cksum = 0xffff;
+	*ckp = cksum;
+}
+
+
+// Port, or echo id, of the source or the destination of a transport header
+static inline int natPort(uchar *l4, int prot, int srcside)
+{
+	if (prot == ICMP_PROTOCOL)
+		return (l4[4] << 8) | l4[5];
+	return srcside ? ((l4[0] << 8) | l4[1]) : ((l4[2] << 8) | l4[3]);
+}
+
+
+static inline int isICMPError(int type)
+{
+	return (type == ICMP_DEST_UNREACH) || (type == ICMP_TTL_EXPIRED) ||
+		(type == ICMP_PARAMETERPROB) || (type == ICMP_SOURCE_QUENCH);
+}
+
+
+/*
+ * Translate an ICMP error about a packet of a mapping (RFC 5508): the
+ * quoted packet went the other way, so an outgoing error quotes a packet
+ * to the inside endpoint and an incoming one a packet from the outside
+ * endpoint. The quoted header and the outer address are rewritten and the
+ * ICMP checksum follows the changes of the quote.
+ */
+static int natICMPError(nat_t *nat, natiface_t *nif, int iface, ip_packet_t *ip_pkt, int l4len, int outgoing)
+{
+	uchar *l4 = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+	icmphdr_t *icmphdr = (icmphdr_t *)l4;
+	ip_packet_t *inner = (ip_packet_t *)(l4 + 8);
+	uchar saved[60 + 20];
+	natentry_t m;
+	uint32_t addr;
+	uint16_t old, new;
+	int innerlen, quoted, n, i;
+
+	if (l4len < 8 + 20)
+		return EXIT_SUCCESS;
+	innerlen = inner->ip_hdr_len * 4;
+	quoted = l4len - 8 - innerlen;
+	if ((innerlen < 20) || (quoted < 8) || ((inner->ip_prot != TCP_PROTOCOL) &&
+	    (inner->ip_prot != UDP_PROTOCOL) && (inner->ip_prot != ICMP_PROTOCOL)))
+		return EXIT_SUCCESS;
+
+	if (outgoing)
+	{
+		memcpy(&addr, inner->ip_dst, 4);
+		if (!lookupNAT(nat, 0, iface, inner->ip_prot, addr, natPort((uchar *)inner + innerlen, inner->ip_prot, 0), 0, &m))
+			return EXIT_SUCCESS;
+	} else
+	{
+		memcpy(&addr, inner->ip_src, 4);
+		if ((addr != nif->addr) ||
+		    !lookupNAT(nat, 1, iface, inner->ip_prot, 0, natPort((uchar *)inner + innerlen, inner->ip_prot, 1), 0, &m))
+			return EXIT_SUCCESS;
+	}
+
+	n = innerlen + min(quoted, 20);
+	memcpy(saved, inner, n);
+	if (outgoing)
+		natRewrite(inner, quoted, 0, m.outaddr, m.outport);
+	else
+		natRewrite(inner, quoted, 1, m.inaddr, m.inport);
+	for (i = 0; i + 1 < n; i += 2)
+	{
+		memcpy(&old, saved + i, 2);
+		memcpy(&new, (uchar *)inner + i, 2);
+		if (old != new)
+			icmphdr->checksum = checksumAdjust16(icmphdr->checksum, old, new);
+	}
+
+	if (outgoing)
+		natRewrite(ip_pkt, 0, 1, m.outaddr, -1);
+	else
+		natRewrite(ip_pkt, 0, 0, m.inaddr, -1);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Translate a packet about to leave on its interface. Returns EXIT_FAILURE
+ * if the packet needs a new mapping and the interface has no port left.
+ */
+int natOutgoing(nat_t *nat, gpacket_t *in_pkt)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
+	uchar *l4 = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+	int iface = in_pkt->frame.dst_interface;
+	int l4len, port, flags = 0;
+	natiface_t *nif;
+	natentry_t m;
+	uint32_t src;
+
+	if ((iface < 0) || (iface >= MAX_INTERFACES) ||
+	    ((nif = __atomic_load_n(&(nat->ifaces[iface]), __ATOMIC_ACQUIRE)) == NULL))
+		return EXIT_SUCCESS;
+	memcpy(&src, ip_pkt->ip_src, 4);
+	if (src == nif->addr)
+		return EXIT_SUCCESS;
+	l4len = ntohs(ip_pkt->ip_pkt_len) - ip_pkt->ip_hdr_len * 4;
+
+	// later fragments carry no ports: only the address can be translated
+	if ((ntohs(ip_pkt->ip_frag_off) & IP_OFFMASK) != 0)
+	{
+		if (nif->masq)
+			natRewrite(ip_pkt, 0, 1, nif->addr, -1);
+		return EXIT_SUCCESS;
+	}
+
+	switch (ip_pkt->ip_prot)
+	{
+	case TCP_PROTOCOL:
+		if (l4len < 20)
+			return EXIT_SUCCESS;
+		flags = l4[13];
+		break;
+	case UDP_PROTOCOL:
+		if (l4len < 8)
+			return EXIT_SUCCESS;
+		break;
+	case ICMP_PROTOCOL:
+		if ((l4len >= 8) && isICMPError(l4[0]))
+			return natICMPError(nat, nif, iface, ip_pkt, l4len, 1);
+		if ((l4len >= 8) && (l4[0] == ICMP_ECHO_REQUEST))
+			break;
+		// other messages have nothing to map
+		/* fall through */
+	default:
+		if (nif->masq)
+			natRewrite(ip_pkt, 0, 1, nif->addr, -1);
+		return EXIT_SUCCESS;
+	}
+
+	port = natPort(l4, ip_pkt->ip_prot, 1);
+	if (!lookupNAT(nat, 0, iface, ip_pkt->ip_prot, src, port, flags, &m))
+	{
+		if (!nif->masq)
+			return EXIT_SUCCESS;
+		if (!createNATMapping(nat, nif, iface, ip_pkt->ip_prot, src, port, flags, &m))
+		{
+			verbose(2, "[natOutgoing]:: Packet dropped.. no port left on interface %d ", iface);
+			return EXIT_FAILURE;
+		}
+	}
+	natRewrite(ip_pkt, l4len, 1, m.outaddr, m.outport);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Translate a packet that arrived on its interface for a mapping back to
+ * the inside endpoint. Packets without a mapping are left alone.
+ */
+int natIncoming(nat_t *nat, gpacket_t *in_pkt)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)in_pkt->data->data;
+	uchar *l4 = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+	int iface = in_pkt->frame.src_interface;
+	int l4len, flags = 0;
+	natiface_t *nif;
+	natentry_t m;
+	uint32_t dst;
+
+	if ((iface < 0) || (iface >= MAX_INTERFACES) ||
+	    ((nif = __atomic_load_n(&(nat->ifaces[iface]), __ATOMIC_ACQUIRE)) == NULL))
+		return EXIT_SUCCESS;
+	memcpy(&dst, ip_pkt->ip_dst, 4);
+	if ((dst != nif->addr) || ((ntohs(ip_pkt->ip_frag_off) & IP_OFFMASK) != 0))
+		return EXIT_SUCCESS;
+	l4len = ntohs(ip_pkt->ip_pkt_len) - ip_pkt->ip_hdr_len * 4;
+
+	switch (ip_pkt->ip_prot)
+	{
+	case TCP_PROTOCOL:
+		if (l4len < 20)
+			return EXIT_SUCCESS;
+		flags = l4[13];
+		break;
+	case UDP_PROTOCOL:
+		if (l4len < 8)
+			return EXIT_SUCCESS;
+		break;
+	case ICMP_PROTOCOL:
+		if ((l4len >= 8) && isICMPError(l4[0]))
+			return natICMPError(nat, nif, iface, ip_pkt, l4len, 0);
+		// echo requests are for the router itself
+		if ((l4len >= 8) && (l4[0] == ICMP_ECHO_REPLY))
+			break;
+		return EXIT_SUCCESS;
+	default:
+		return EXIT_SUCCESS;
+	}
+
+	if (lookupNAT(nat, 1, iface, ip_pkt->ip_prot, 0, natPort(l4, ip_pkt->ip_prot, 0), flags, &m))
+		natRewrite(ip_pkt, l4len, 0, m.inaddr, m.inport);
+	return EXIT_SUCCESS;
+}
+
+
+static inline uint32_t natTimeout(natentry_t *e)
+{
+	if (e->prot == TCP_PROTOCOL)
+		return e->closing ? NAT_TCP_CLOSING_TIMEOUT : NAT_TCP_TIMEOUT;
+	return (e->prot == UDP_PROTOCOL) ? NAT_UDP_TIMEOUT : NAT_ICMP_TIMEOUT;
+}
+
+
+/*
+ * Remove the dynamic mappings idle for longer than their timeout, or all
+ * of them. They are unlinked from the inside table a lock stripe at a
+ * time, then from the outside table, and their ports go back in batches.
+ */
+static void sweepNAT(nat_t *nat, int all)
+{
+	natentry_t *e, **pe, *dead = NULL, *next;
+	uint32_t b, now = natClock();
+	int l, slot = natThreadSlot(nat), n = 0;
+
+	for (l = 0; l < NAT_LOCKS; l++)
+	{
+		pthread_mutex_lock(&(nat->locks[l]));
+		for (b = l; b < NAT_BUCKETS; b += NAT_LOCKS)
+			for (pe = &(nat->inside[b]); (e = *pe) != NULL; )
+			{
+				if (e->isstatic || (!all && (now - e->lastused <= natTimeout(e))))
+				{
+					pe = &(e->innext);
+					continue;
+				}
+				*pe = e->innext;
+				__atomic_store_n(&(e->dead), 1, __ATOMIC_RELAXED);
+				e->gcnext = dead;
+				dead = e;
+			}
+		pthread_mutex_unlock(&(nat->locks[l]));
+	}
+
+	// lookups in the outside table skip the dead mappings until they are gone
+	for (e = dead; e != NULL; e = e->gcnext)
+	{
+		b = natOutsideBucket(e->iface, e->prot, e->outport);
+		pthread_mutex_lock(natLock(nat, b));
+		for (pe = &(nat->outside[b]); *pe != e; pe = &((*pe)->outnext))
+			;
+		*pe = e->outnext;
+		pthread_mutex_unlock(natLock(nat, b));
+	}
+
+	for (e = dead; e != NULL; e = next)
+	{
+		next = e->gcnext;
+		freeNATPort(&(nat->ifaces[e->iface]->pools[natProtIndex(e->prot)]), e->outport, slot);
+		free(e);
+		n++;
+	}
+	flushNATPortCaches(nat, slot);
+	if (n > 0)
+	{
+		__atomic_sub_fetch(&(nat->count), n, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(nat->expired), n, __ATOMIC_RELAXED);
+		verbose(2, "[sweepNAT]:: removed %d mappings ", n);
+	}
+}
+
+
+// Expiry function of the aging timer: sweep and rearm
+static void ageNAT(void *arg, twentry_t *list)
+{
+	nat_t *nat = (nat_t *)arg;
+
+	sweepNAT(nat, 0);
+	addTimerWheelEntry(nat->ager, NAT_SWEEP_SECS * 1000000ULL, NULL, 0, nat);
+}
+
+
+void flushNAT(nat_t *nat)
+{
+	sweepNAT(nat, 1);
+}
+
+
+/*
+ * Forward port of the address of interface iface to inport of inaddr
+ * (host byte order). The port must not be in use by another mapping.
+ */
+int addNATStatic(nat_t *nat, int iface, int prot, uint16_t port, uchar *inaddr, uint16_t inport)
+{
+	natiface_t *nif;
+	natportpool_t *pool;
+	natentry_t *e, m;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	uint8_t expected = NAT_PORT_FREE;
+	uint32_t bi, bo;
+
+	if ((nif = getNATIface(nat, iface)) == NULL)
+		return EXIT_FAILURE;
+	pool = &(nif->pools[natProtIndex(prot)]);
+	if (lookupNAT(nat, 1, iface, prot, 0, port, 0, &m) ||
+	    ((port >= NAT_PORT_MIN) &&
+	     !__atomic_compare_exchange_n(&(pool->state[port]), &expected, NAT_PORT_CLAIMED, 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+	{
+		error("[addNATStatic]:: port %d of interface %d is in use ", port, iface);
+		return EXIT_FAILURE;
+	}
+
+	if ((e = (natentry_t *)calloc(1, sizeof(natentry_t))) == NULL)
+	{
+		error("[addNATStatic]:: Could not allocate memory for the mapping ");
+		return EXIT_FAILURE;
+	}
+	memcpy(&(e->inaddr), gHtonl((uchar *)tmpbuf, inaddr), 4);
+	e->inport = inport;
+	e->outaddr = nif->addr;
+	e->outport = port;
+	e->prot = prot;
+	e->iface = iface;
+	e->isstatic = 1;
+	e->lastused = natClock();
+
+	bi = natInsideBucket(iface, prot, e->inaddr, inport);
+	bo = natOutsideBucket(iface, prot, port);
+	lockNATBuckets(nat, bi, bo);
+	e->innext = nat->inside[bi];
+	nat->inside[bi] = e;
+	e->outnext = nat->outside[bo];
+	nat->outside[bo] = e;
+	unlockNATBuckets(nat, bi, bo);
+	nif->nstatic++;
+	__atomic_add_fetch(&(nat->count), 1, __ATOMIC_RELAXED);
+	return EXIT_SUCCESS;
+}
+
+
+int delNATStatic(nat_t *nat, int iface, int prot, uint16_t port)
+{
+	natiface_t *nif;
+	natportpool_t *pool;
+	natentry_t *e, **pe;
+	uint32_t bi, bo;
+	uint8_t expected = NAT_PORT_CLAIMED;
+	uint16_t p = port;
+
+	if ((iface < 0) || (iface >= MAX_INTERFACES) || ((nif = nat->ifaces[iface]) == NULL))
+		return EXIT_FAILURE;
+
+	bo = natOutsideBucket(iface, prot, port);
+	pthread_mutex_lock(natLock(nat, bo));
+	for (e = nat->outside[bo]; e != NULL; e = e->outnext)
+		if ((e->iface == iface) && (e->prot == prot) && (e->outport == port) && e->isstatic)
+			break;
+	pthread_mutex_unlock(natLock(nat, bo));
+	if (e == NULL)
+	{
+		error("[delNATStatic]:: no static mapping for port %d of interface %d ", port, iface);
+		return EXIT_FAILURE;
+	}
+
+	// only the CLI adds and deletes static mappings, so e is still there
+	bi = natInsideBucket(iface, prot, e->inaddr, e->inport);
+	lockNATBuckets(nat, bi, bo);
+	for (pe = &(nat->inside[bi]); *pe != e; pe = &((*pe)->innext))
+		;
+	*pe = e->innext;
+	for (pe = &(nat->outside[bo]); *pe != e; pe = &((*pe)->outnext))
+		;
+	*pe = e->outnext;
+	unlockNATBuckets(nat, bi, bo);
+	free(e);
+
+	// the port goes back to the dynamic range, into the pool if it left it
+	if (port >= NAT_PORT_MIN)
+	{
+		pool = &(nif->pools[natProtIndex(prot)]);
+		if (!__atomic_compare_exchange_n(&(pool->state[port]), &expected, NAT_PORT_FREE, 0,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_store_n(&(pool->state[port]), NAT_PORT_FREE, __ATOMIC_RELEASE);
+			releaseNATPorts(pool, &p, 1);
+		}
+	}
+	nif->nstatic--;
+	__atomic_sub_fetch(&(nat->count), 1, __ATOMIC_RELAXED);
+	return EXIT_SUCCESS;
+}
+
+
+static char *natProtName(int prot)
+{
+	return (prot == TCP_PROTOCOL) ? "tcp" : ((prot == UDP_PROTOCOL) ? "udp" : "icmp");
+}
+
+
+void printNAT(nat_t *nat)
+{
+	natiface_t *nif;
+	natportpool_t *pool;
+	interface_t *ifptr;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	uchar addr[4];
+	int i, j, k, nfree;
+
+	printf("Mappings: %d (created %lu, expired %lu)\n", nat->count, nat->created, nat->expired);
+	printf("Interface   Address          Masquerade  Static  Free ports (tcp/udp/icmp)   No port\n");
+	for (i = 0; i < MAX_INTERFACES; i++)
+	{
+		if ((nif = nat->ifaces[i]) == NULL)
+			continue;
+		ifptr = findInterface(i);
+		printf("%-10s  %-15s  %-10s  %6d  ", (ifptr != NULL) ? ifptr->device_name : "?",
+		       IP2Dot(tmpbuf, gNtohl(addr, (uchar *)&(nif->addr))), nif->masq ? "on" : "off", nif->nstatic);
+		for (j = 0; j < NAT_PROTS; j++)
+		{
+			pool = &(nif->pools[j]);
+			for (nfree = pool->nfree, k = 0; k < NAT_MAX_THREADS; k++)
+				nfree += pool->caches[k].count;
+			// ports claimed by a static mapping wait in the pool until allocNATPort skips them
+			for (k = NAT_PORT_MIN; k <= NAT_PORT_MAX; k++)
+				if (pool->state[k] == NAT_PORT_CLAIMED)
+					nfree--;
+			printf("%s%d", (j == 0) ? "" : "/", nfree);
+		}
+		printf("   %lu\n", nif->noport);
+	}
+}
+
+
+void printNATMappings(nat_t *nat, int max)
+{
+	natentry_t *e;
+	char inbuf[MAX_TMPBUF_LEN], outbuf[MAX_TMPBUF_LEN];
+	uchar addr[4];
+	uint32_t b, now = natClock();
+	int n = 0;
+
+	printf("Prot  Inside                 Outside                Idle    Packets (out/in)\n");
+	for (b = 0; (b < NAT_BUCKETS) && (n < max); b++)
+	{
+		if (nat->inside[b] == NULL)
+			continue;
+		pthread_mutex_lock(natLock(nat, b));
+		for (e = nat->inside[b]; (e != NULL) && (n < max); e = e->innext, n++)
+		{
+			IP2Dot(inbuf, gNtohl(addr, (uchar *)&(e->inaddr)));
+			sprintf(inbuf + strlen(inbuf), ":%d", e->inport);
+			IP2Dot(outbuf, gNtohl(addr, (uchar *)&(e->outaddr)));
+			sprintf(outbuf + strlen(outbuf), ":%d", e->outport);
+			if (e->isstatic)
+				printf("%-5s %-22s %-22s static  %lu/%lu\n", natProtName(e->prot), inbuf, outbuf,
+				       e->pkts[0], e->pkts[1]);
+			else
+				printf("%-5s %-22s %-22s %5us  %lu/%lu\n", natProtName(e->prot), inbuf, outbuf,
+				       now - e->lastused, e->pkts[0], e->pkts[1]);
+		}
+		pthread_mutex_unlock(natLock(nat, b));
+	}
+	if (n < nat->count)
+		printf("... %d more mappings\n", nat->count - n);
+}
@@ -54,6 +54,7 @@
 #include "openflow_defs.h"
 #include "openflow_flowtable.h"
 #include "openflow_pkt_proc.h"
+#include "pktpool.h"
 #include "protocols.h"
 #include "tcp.h"
 
@@ -691,23 +692,41 @@ static int32_t openflow_ctrl_iface_recv_packet_out(ofp_packet_out *msg)
 		return OPENFLOW_CTRL_IFACE_ERR_OPENFLOW;
 	}
 
-	gpacket_t packet;
+	int32_t data_len = ntohs(msg->header.length) - sizeof(ofp_packet_out)
+	        - ntohs(msg->actions_len);
+	gpacket_t *packet = allocPacket(
+	        (data_len > PKT_FRAME_SIZE(DEFAULT_MTU)) ? MAX_JUMBO_MTU : DEFAULT_MTU);
+	if (packet == NULL)
+	{
+		verbose(1, "[openflow_ctrl_iface_recv_packet_out]:: Out of packet"
+				" buffers.");
+		return OPENFLOW_CTRL_IFACE_ERR_OPENFLOW;
+	}
 	uint16_t in_port = openflow_config_get_gnet_port_num(ntohs(msg->in_port));
 	if (in_port < MAX_INTERFACES && findInterface(in_port) != NULL)
 	{
-		packet.frame.src_interface = in_port;
+		packet->frame.src_interface = in_port;
+	}
+	if (data_len < 0)
+	{
+		data_len = 0;
+	}
+	if (data_len > packetCapacity(packet))
+	{
+		data_len = packetCapacity(packet);
 	}
-	memcpy(&packet.data, ((uint8_t *) msg->actions) + htons(msg->actions_len),
-	        ntohs(msg->header.length) - sizeof(ofp_packet_out)
-	                - ntohs(msg->actions_len));
+	packet->len = data_len;
+	memcpy(packet->data, ((uint8_t *) msg->actions) + htons(msg->actions_len),
+	        packet->len);
 
 	uint32_t actions = htons(msg->actions_len) / sizeof(ofp_action_header);
 	uint32_t i;
 	for (i = 0; i < actions; i++)
 	{
 		ofp_action_header *action = &msg->actions[i];
-		openflow_pkt_proc_perform_action(action, &packet);
+		openflow_pkt_proc_perform_action(action, packet);
 	}
+	freePacket(packet);
 	return 0;
 }
 
@@ -825,17 +844,18 @@ int32_t openflow_ctrl_iface_send_packet_in(gpacket_t *packet, uint8_t reason)
 {
 	if (openflow_ctrl_iface_get_conn_state())
 	{
-		uint16_t msg_len = sizeof(ofp_packet_in) + sizeof(pkt_data_t)
+		uint16_t pkt_len = packetLength(packet);
+		uint16_t msg_len = sizeof(ofp_packet_in) + pkt_len
 		        - (sizeof(ofp_packet_in) - offsetof(ofp_packet_in, data));
 		ofp_packet_in *msg = (ofp_packet_in *) openflow_ctrl_iface_create_msg(
 		        OFPT_PACKET_IN, msg_len);
 		msg->header.xid = htonl(openflow_ctrl_iface_get_xid());
 		msg->buffer_id = htonl(-1);
-		msg->total_len = htons(sizeof(pkt_data_t));
+		msg->total_len = htons(pkt_len);
 		msg->in_port = htons(
 		        openflow_config_get_of_port_num(packet->frame.src_interface));
 		msg->reason = reason;
-		memcpy(msg->data, &packet->data, sizeof(pkt_data_t));
+		memcpy(msg->data, packet->data, pkt_len);
 
 		int32_t ret = openflow_ctrl_iface_send(msg, msg_len);
 		free(msg);
@@ -1379,9 +1399,9 @@ static int32_t openflow_ctrl_iface_parse_message(ofp_header *msg)
  */
 int32_t openflow_ctrl_iface_parse_packet(gpacket_t *packet)
 {
-	if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+	if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 	{
-		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 		if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 		        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 		{
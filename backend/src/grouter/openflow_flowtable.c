@@ -25,6 +25,7 @@
 #include "protocols.h"
 #include "simplequeue.h"
 #include "tcp.h"
+#include "trace.h"
 #include "udp.h"
 
 // OpenFlow flowtable
@@ -151,38 +152,38 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	uint8_t dl_dst[OFP_ETH_ALEN];
 	uint16_t dl_vlan = 0;
 	uint8_t dl_vlan_pcp = 0;
-	uint16_t dl_type = packet->data.header.prot;
+	uint16_t dl_type = packet->data->header.prot;
 	uint8_t nw_tos = 0;
 	uint8_t nw_proto = 0;
 	uint32_t nw_src = 0;
 	uint32_t nw_dst = 0;
 	uint16_t tp_src = 0;
 	uint16_t tp_dst = 0;
-	memcpy(&dl_src, packet->data.header.src, OFP_ETH_ALEN);
-	memcpy(&dl_dst, packet->data.header.dst, OFP_ETH_ALEN);
+	memcpy(&dl_src, packet->data->header.src, OFP_ETH_ALEN);
+	memcpy(&dl_dst, packet->data->header.dst, OFP_ETH_ALEN);
 
 	// Accept match if all fields wildcard is present in match
 	if (ntohl(match->wildcards) == OFPFW_ALL)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet matched (all"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet matched (all"
 				" field wildcard).");
 		return 1;
 	}
 
 	// Set headers for IEEE 802.3 Ethernet frame
-	if (ntohs(packet->data.header.prot) < OFP_DL_TYPE_ETH2_CUTOFF)
+	if (ntohs(packet->data->header.prot) < OFP_DL_TYPE_ETH2_CUTOFF)
 	{
-		if (packet->data.data[0] == IEEE_802_2_DSAP_SNAP)
+		if (packet->data->data[0] == IEEE_802_2_DSAP_SNAP)
 		{
 			// SNAP
-			if (packet->data.data[2] & IEEE_802_2_CTRL_8_BITS)
+			if (packet->data->data[2] & IEEE_802_2_CTRL_8_BITS)
 			{
 				// 8-bit control field
 				uint32_t oui;
-				memcpy(&oui, &packet->data.data[3], sizeof(uint8_t) * 3);
+				memcpy(&oui, &packet->data->data[3], sizeof(uint8_t) * 3);
 				if (ntohl(oui) == 0)
 				{
-					memcpy(&dl_type, &packet->data.data[6],
+					memcpy(&dl_type, &packet->data->data[6],
 					        sizeof(uint8_t) * 2);
 				}
 				else
@@ -195,10 +196,10 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 			{
 				// 16-bit control field
 				uint32_t oui;
-				memcpy(&oui, &packet->data.data[4], sizeof(uint8_t) * 3);
+				memcpy(&oui, &packet->data->data[4], sizeof(uint8_t) * 3);
 				if (ntohl(oui) == 0)
 				{
-					memcpy(&dl_type, &packet->data.data[7],
+					memcpy(&dl_type, &packet->data->data[7],
 					        sizeof(uint8_t) * 2);
 				}
 				else
@@ -215,11 +216,11 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	}
 
 	// Set headers for IEEE 802.1Q Ethernet frame
-	if (ntohs(packet->data.header.prot) == ETHERTYPE_IEEE_802_1Q)
+	if (ntohs(packet->data->header.prot) == ETHERTYPE_IEEE_802_1Q)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Setting headers for"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Setting headers for"
 				" IEEE 802.1Q Ethernet frame.");
-		pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
+		pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) packet->data;
 		dl_vlan = htons(ntohs(vlan_data->header.tci) & 0xFFF);
 		dl_vlan_pcp = htons(ntohs(vlan_data->header.tci) >> 13);
 		dl_type = vlan_data->header.prot;
@@ -230,22 +231,22 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	}
 
 	// Set headers for ARP packet
-	if (ntohs(packet->data.header.prot) == ARP_PROTOCOL)
+	if (ntohs(packet->data->header.prot) == ARP_PROTOCOL)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Setting headers for"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Setting headers for"
 				" ARP.");
-		arp_packet_t *arp_packet = (arp_packet_t *) &packet->data.data;
+		arp_packet_t *arp_packet = (arp_packet_t *) &packet->data->data;
 		nw_proto = ntohs(arp_packet->arp_opcode);
 		COPY_IP(&nw_src, &arp_packet->src_ip_addr);
 		COPY_IP(&nw_dst, &arp_packet->dst_ip_addr);
 	}
 
 	// Set headers for IP packet
-	if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+	if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Setting headers for"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Setting headers for"
 				" IP.");
-		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 		nw_proto = ip_packet->ip_prot;
 		COPY_IP(&nw_src, &ip_packet->ip_src);
 		COPY_IP(&nw_dst, &ip_packet->ip_dst);
@@ -255,12 +256,12 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 		        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 		{
 			// IP packet is not fragmented
-			verbose(2, "[openflow_flowtable_match_packet]:: IP packet is not"
+			TRACE(2, "[openflow_flowtable_match_packet]:: IP packet is not"
 					" fragmented.");
 			if (ip_packet->ip_prot == TCP_PROTOCOL)
 			{
 				// TCP packet
-				verbose(2, "[openflow_flowtable_match_packet]:: Setting"
+				TRACE(2, "[openflow_flowtable_match_packet]:: Setting"
 						" headers for TCP.");
 				uint32_t ip_header_length = ip_packet->ip_hdr_len * 4;
 				tcp_packet_type *tcp_packet =
@@ -272,7 +273,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 			else if (ip_packet->ip_prot == UDP_PROTOCOL)
 			{
 				// UDP packet
-				verbose(2, "[openflow_flowtable_match_packet]:: Setting"
+				TRACE(2, "[openflow_flowtable_match_packet]:: Setting"
 						" headers for UDP.");
 				uint32_t ip_header_length = ip_packet->ip_hdr_len * 4;
 				udp_packet_type *udp_packet =
@@ -284,7 +285,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 			else if (ip_packet->ip_prot == ICMP_PROTOCOL)
 			{
 				// ICMP packet
-				verbose(2, "[openflow_flowtable_match_packet]:: Setting"
+				TRACE(2, "[openflow_flowtable_match_packet]:: Setting"
 						" headers for ICMP.");
 				int ip_header_length = ip_packet->ip_hdr_len * 4;
 				icmphdr_t *icmp_packet = (icmphdr_t *) ((uint8_t *) ip_packet
@@ -298,7 +299,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	// Reject match on input port
 	if (!(ntohl(match->wildcards) & OFPFW_IN_PORT) && in_port != match->in_port)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (switch input port).");
 		return 0;
 	}
@@ -307,7 +308,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	if (!(ntohl(match->wildcards) & OFPFW_DL_SRC)
 	        && memcmp(dl_src, match->dl_src, OFP_ETH_ALEN))
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (source MAC address).");
 		return 0;
 	}
@@ -316,7 +317,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	if (!(ntohl(match->wildcards) & OFPFW_DL_DST)
 	        && memcmp(dl_dst, match->dl_dst, OFP_ETH_ALEN))
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (destination MAC address).");
 		return 0;
 	}
@@ -324,7 +325,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	// Reject match on Ethernet VLAN ID
 	if (!(ntohl(match->wildcards) & OFPFW_DL_VLAN) && dl_vlan != match->dl_vlan)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (VLAN ID).");
 		return 0;
 	}
@@ -334,7 +335,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	        && !(ntohl(match->wildcards) & OFPFW_DL_VLAN_PCP)
 	        && dl_vlan_pcp != match->dl_vlan_pcp)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (VLAN priority).");
 		return 0;
 	}
@@ -342,7 +343,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	// Reject match on Ethernet frame type
 	if (!(ntohl(match->wildcards) & OFPFW_DL_TYPE) && dl_type != match->dl_type)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (Ethernet frame type).");
 		return 0;
 	}
@@ -353,7 +354,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	        && !(ntohl(match->wildcards) & OFPFW_NW_TOS)
 	        && nw_tos != match->nw_tos)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (IP type of service).");
 		return 0;
 	}
@@ -365,7 +366,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 	        && !(ntohl(match->wildcards) & OFPFW_NW_PROTO)
 	        && nw_proto != match->nw_proto)
 	{
-		verbose(2, "[openflow_flowtable_match_packet]:: Packet not matched"
+		TRACE(2, "[openflow_flowtable_match_packet]:: Packet not matched"
 				" (IP protocol or ARP opcode).");
 		return 0;
 	}
@@ -382,7 +383,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 		        && !openflow_flowtable_ip_compare(ntohl(nw_src),
 		                ntohl(match->nw_src), ip_src_len))
 		{
-			verbose(2, "[openflow_flowtable_match_packet]:: Packet not"
+			TRACE(2, "[openflow_flowtable_match_packet]:: Packet not"
 					" matched (IP source address).");
 			return 0;
 		}
@@ -400,7 +401,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 		        && !openflow_flowtable_ip_compare(ntohl(nw_dst),
 		                ntohl(match->nw_dst), ip_dst_len))
 		{
-			verbose(2, "[openflow_flowtable_match_packet]:: Packet not"
+			TRACE(2, "[openflow_flowtable_match_packet]:: Packet not"
 					" matched (IP destination address).");
 			return 0;
 		}
@@ -418,7 +419,7 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 			if (!(ntohl(match->wildcards) & OFPFW_TP_SRC)
 			        && tp_src != match->tp_src)
 			{
-				verbose(2, "[openflow_flowtable_match_packet]:: Packet not"
+				TRACE(2, "[openflow_flowtable_match_packet]:: Packet not"
 						" matched (TCP/UDP source port or ICMP type).");
 				return 0;
 			}
@@ -437,14 +438,14 @@ static uint8_t openflow_flowtable_match_packet(ofp_match *match,
 			if (!(ntohl(match->wildcards) & OFPFW_TP_DST)
 			        && tp_dst != match->tp_dst)
 			{
-				verbose(2, "[openflow_flowtable_match_packet]:: Packet not"
+				TRACE(2, "[openflow_flowtable_match_packet]:: Packet not"
 						" matched (TCP/UDP destination port or ICMP code).");
 				return 0;
 			}
 		}
 	}
 
-	verbose(2, "[openflow_flowtable_match_packet]:: Packet matched.");
+	TRACE(2, "[openflow_flowtable_match_packet]:: Packet matched.");
 	return 1;
 }
 
@@ -480,7 +481,7 @@ openflow_flowtable_entry_type *openflow_flowtable_get_entry_for_packet(
 			if (match->wildcards == 0)
 			{
 				// Exact match
-				verbose(2, "[openflow_flowtable_get_entry_for_packet]::"
+				TRACE(2, "[openflow_flowtable_get_entry_for_packet]::"
 						" Found exact match at index %" PRIu32 ".", i);
 				current_entry = entry;
 				break;
@@ -489,7 +490,7 @@ openflow_flowtable_entry_type *openflow_flowtable_get_entry_for_packet(
 			{
 				// Possible wildcard match, but wait to see if there
 				// are any other wildcard matches with higher priority
-				verbose(2, "[openflow_flowtable_get_entry_for_packet]::"
+				TRACE(2, "[openflow_flowtable_get_entry_for_packet]::"
 						" Found possible match at index %" PRIu32 ".", i);
 				current_entry = entry;
 				current_priority = entry->priority;
@@ -502,7 +503,7 @@ openflow_flowtable_entry_type *openflow_flowtable_get_entry_for_packet(
 
 	if (current_entry == NULL)
 	{
-		verbose(2, "[openflow_flowtable_get_entry_for_packet]::"
+		TRACE(2, "[openflow_flowtable_get_entry_for_packet]::"
 				" No entry found.");
 		pthread_mutex_unlock(&flowtable_mutex);
 		return NULL;
@@ -515,7 +516,7 @@ openflow_flowtable_entry_type *openflow_flowtable_get_entry_for_packet(
 		current_entry->stats.packet_count = htonll(
 		        ntohll(current_entry->stats.packet_count) + 1);
 		current_entry->stats.byte_count = htonll(
-		        ntohll(current_entry->stats.byte_count) + sizeof(pkt_data_t));
+		        ntohll(current_entry->stats.byte_count) + packetLength(packet));
 		time(&current_entry->last_matched);
 
 		// Make copy of entry for use outside this function
@@ -5,6 +5,7 @@
 
 #include <inttypes.h>
 #include <arpa/inet.h>
+#include <string.h>
 
 #include <slack/std.h>
 #include <slack/err.h>
@@ -16,84 +17,114 @@
 #include "openflow_flowtable.h"
 #include "openflow_ctrl_iface.h"
 #include "openflow_pkt_proc.h"
+#include "pktpool.h"
 #include "protocols.h"
 #include "tcp.h"
 #include "udp.h"
+#include "checksum.h"
+#include "trace.h"
 
 // GNET packet core
 static pktcore_t *packet_core;
 
 /**
- * Creates a new packet identical to the specified packet but with a VLAN
- * header.
+ * Adds a VLAN header (with a zero TCI) to the specified packet in place,
+ * using the headroom in front of the frame.
  *
  * @param packet The packet to add a VLAN header to.
  *
- * @return The packet with the VLAN header.
+ * @return The VLAN frame, or NULL if there is no headroom left.
  */
-static gpacket_t openflow_pkt_proc_add_vlan_header(gpacket_t *packet)
+static pkt_data_vlan_t *openflow_pkt_proc_add_vlan_header(gpacket_t *packet)
 {
-	gpacket_t new_packet;
-	new_packet.frame = packet->frame;
-	pkt_data_vlan_t vlan_data;
-	COPY_MAC(&vlan_data.header.src, &packet->data.header.src);
-	COPY_MAC(&vlan_data.header.dst, &packet->data.header.dst);
-	vlan_data.header.tpid = htons(ETHERTYPE_IEEE_802_1Q);
-	vlan_data.header.tci = 0;
-	vlan_data.header.prot = packet->data.header.prot;
-	memcpy(&vlan_data.data, &packet->data.data, DEFAULT_MTU);
-	memcpy(&new_packet.data, &vlan_data, sizeof(vlan_data));
-	return new_packet;
+	uint16_t prot = packet->data->header.prot;
+	if (pushPacketHeader(packet, 4) == NULL)
+	{
+		return NULL;
+	}
+	pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) packet->data;
+	memmove(vlan_data, (uint8_t *) vlan_data + 4, 12);
+	vlan_data->header.tpid = htons(ETHERTYPE_IEEE_802_1Q);
+	vlan_data->header.tci = 0;
+	vlan_data->header.prot = prot;
+	return vlan_data;
 }
 
 /**
- * Creates a new packet identical to the specified packet but without a VLAN
- * header.
+ * Removes the VLAN header from the specified packet in place.
  *
  * @param packet The packet to remove the VLAN header from.
- *
- * @return The packet without the VLAN header.
  */
-static gpacket_t openflow_pkt_proc_remove_vlan_header(gpacket_t *packet)
+static void openflow_pkt_proc_remove_vlan_header(gpacket_t *packet)
 {
-	gpacket_t new_packet;
-	new_packet.frame = packet->frame;
-	pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
-	COPY_MAC(&new_packet.data.header.src, &vlan_data->header.src);
-	COPY_MAC(&new_packet.data.header.dst, &vlan_data->header.dst);
-	new_packet.data.header.prot = vlan_data->header.prot;
-	memcpy(&new_packet.data.data, &vlan_data->data, DEFAULT_MTU);
-	return new_packet;
+	memmove((uint8_t *) packet->data + 4, packet->data, 12);
+	pullPacketHeader(packet, 4);
 }
 
 /**
- * Updates the IP (and, if applicable, the TCP or UDP) checksums in a packet.
+ * Updates the TCP or UDP checksum of a packet after a field it covers
+ * changed, touching only the changed words (RFC 1624). A UDP packet sent
+ * without a checksum keeps none.
  *
- * @param packet The packet with the checksums to be updated.
+ * @param ip_packet The packet whose transport checksum is to be updated.
+ * @param old_value The old value of the field, as it sat in the packet.
+ * @param new_value The new value of the field, as it sits in the packet.
+ * @param bits      The width of the field: 16 (a port) or 32 (an address).
  */
-static void openflow_pkt_proc_update_checksums(ip_packet_t *ip_packet)
+static void openflow_pkt_proc_adjust_l4_checksum(ip_packet_t *ip_packet,
+        uint32_t old_value, uint32_t new_value, int bits)
 {
-	// IP packet
-	ip_packet->ip_cksum = 0;
-	ip_packet->ip_cksum = htons(
-	        checksum((void *) ip_packet, ip_packet->ip_hdr_len * 2));
+	uint32_t ip_header_length = ip_packet->ip_hdr_len * 4;
+	uint8_t *l4 = (uint8_t *) ip_packet + ip_header_length;
+	uint16_t *checksum;
 
 	if (ip_packet->ip_prot == TCP_PROTOCOL)
 	{
-		// TCP packet
-		uint32_t ip_header_length = ip_packet->ip_hdr_len * 4;
-		tcp_packet_type *tcp_packet = (tcp_packet_type *) ((uint8_t *) ip_packet
-		        + ip_header_length);
-		tcp_packet->checksum = tcp_checksum(ip_packet);
+		checksum = &((tcp_packet_type *) l4)->checksum;
+	}
+	else if (ip_packet->ip_prot == UDP_PROTOCOL
+	        && ((udp_packet_type *) l4)->checksum != 0)
+	{
+		checksum = &((udp_packet_type *) l4)->checksum;
 	}
-	else if (ip_packet->ip_prot == UDP_PROTOCOL)
+	else
+	{
+		return;
+	}
+
+	if (bits == 32)
 	{
-		// UDP packet
-		uint32_t ip_header_length = ip_packet->ip_hdr_len * 4;
-		udp_packet_type *udp_packet = (udp_packet_type *) ((uint8_t *) ip_packet
-		        + ip_header_length);
-		udp_packet->checksum = udp_checksum(ip_packet);
+		*checksum = checksumAdjust32(*checksum, old_value, new_value);
 	}
+	else
+	{
+		*checksum = checksumAdjust16(*checksum, old_value, new_value);
+	}
+	if (ip_packet->ip_prot == UDP_PROTOCOL && *checksum == 0)
+	{
+		// a computed UDP checksum of zero is sent as all ones
+		*checksum = 0xffff;
+	}
+}
+
+/**
+ * Sets the source or destination address of an IP packet, updating the
+ * IP and transport checksums incrementally.
+ *
+ * @param ip_packet The packet to modify.
+ * @param field     The ip_src or ip_dst field of the packet.
+ * @param nw_addr   The new address, in network byte order.
+ */
+static void openflow_pkt_proc_set_nw_addr(ip_packet_t *ip_packet,
+        uint8_t *field, uint32_t nw_addr)
+{
+	uint32_t old_addr;
+
+	memcpy(&old_addr, field, 4);
+	memcpy(field, &nw_addr, 4);
+	ip_packet->ip_cksum = checksumAdjust32(ip_packet->ip_cksum, old_addr,
+	        nw_addr);
+	openflow_pkt_proc_adjust_l4_checksum(ip_packet, old_addr, nw_addr, 32);
 }
 
 /**
@@ -108,8 +139,13 @@ static void openflow_pkt_proc_update_checksums(ip_packet_t *ip_packet)
 static int32_t openflow_pkt_proc_send_packet_to_queue(gpacket_t *packet,
         simplequeue_t *queue)
 {
-	gpacket_t *new_packet = malloc(sizeof(gpacket_t));
-	memcpy(new_packet, packet, sizeof(gpacket_t));
+	gpacket_t *new_packet = duplicatePacket(packet);
+	if (new_packet == NULL)
+	{
+		verbose(1, "[openflow_pkt_proc_send_packet_to_queue]:: Out of"
+				" packet buffers.");
+		return OPENFLOW_PKT_PROC_ERR_QUEUE;
+	}
 	int32_t ret = writeQueue(queue, new_packet, sizeof(gpacket_t));
 	if (ret == 1)
 	{
@@ -164,7 +200,7 @@ static int32_t openflow_pkt_proc_forward_packet_to_port(gpacket_t *packet,
 
 	ofp_port_stats *stats = openflow_config_get_port_stats(of_port);
 	stats->tx_packets = htonll(ntohll(stats->tx_packets) + 1);
-	stats->tx_bytes = htonll(ntohll(stats->tx_bytes) + sizeof(pkt_data_t));
+	stats->tx_bytes = htonll(ntohll(stats->tx_bytes) + packetLength(packet));
 	openflow_config_set_port_stats(of_port, stats);
 	free(stats);
 
@@ -197,13 +233,13 @@ int32_t openflow_pkt_proc_handle_packet(gpacket_t *packet)
 	        packet->frame.src_interface);
 	ofp_port_stats *stats = openflow_config_get_port_stats(of_port);
 	stats->rx_packets = htonll(ntohll(stats->rx_packets) + 1);
-	stats->rx_bytes = htonll(ntohll(stats->rx_bytes) + sizeof(pkt_data_t));
+	stats->rx_bytes = htonll(ntohll(stats->rx_bytes) + packetLength(packet));
 	openflow_config_set_port_stats(of_port, stats);
 	free(stats);
 
-	if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+	if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 	{
-		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+		ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 		if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 		        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 		{
@@ -212,7 +248,7 @@ int32_t openflow_pkt_proc_handle_packet(gpacket_t *packet)
 			if (flags & OFPC_FRAG_DROP)
 			{
 				// Switch configured to drop fragmented IP packets
-				verbose(2, "[openflow_pkt_proc_handle_packet]::"
+				TRACE(2, "[openflow_pkt_proc_handle_packet]::"
 						" Dropping fragmented IP packet.");
 				return 0;
 			}
@@ -223,7 +259,7 @@ int32_t openflow_pkt_proc_handle_packet(gpacket_t *packet)
 	        openflow_flowtable_get_entry_for_packet(packet);
 	if (matching_entry != NULL)
 	{
-		verbose(2, "[openflow_pkt_proc_handle_packet]:: Performing actions"
+		TRACE(2, "[openflow_pkt_proc_handle_packet]:: Performing actions"
 				" on packet with flowtable match.");
 		uint8_t action_performed = 0;
 		uint32_t i;
@@ -239,7 +275,7 @@ int32_t openflow_pkt_proc_handle_packet(gpacket_t *packet)
 
 		if (!action_performed)
 		{
-			verbose(2, "[openflow_pkt_proc_handle_packet]:: Dropping packet"
+			TRACE(2, "[openflow_pkt_proc_handle_packet]:: Dropping packet"
 					" with no valid actions.");
 		}
 
@@ -248,7 +284,7 @@ int32_t openflow_pkt_proc_handle_packet(gpacket_t *packet)
 	}
 	else
 	{
-		verbose(2, "[openflow_pkt_proc_handle_packet]:: Forwarding packet"
+		TRACE(2, "[openflow_pkt_proc_handle_packet]:: Forwarding packet"
 				" with no flowtable match to controller.");
 		int32_t ret = openflow_ctrl_iface_send_packet_in(packet, OFPR_NO_MATCH);
 		return ret;
@@ -267,6 +303,11 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
         gpacket_t *packet)
 {
 	uint16_t header_type = ntohs(header->type);
+	// Earlier outputs may share the packet data; modify a private copy
+	if (header_type != OFPAT_OUTPUT && makePacketWritable(packet) == NULL)
+	{
+		return OPENFLOW_PKT_PROC_ERR_QUEUE;
+	}
 	if (header_type == OFPAT_OUTPUT)
 	{
 		// Send packet to output port
@@ -275,7 +316,7 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		if (port == OFPP_IN_PORT)
 		{
 			// Send packet to input interface
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_IN_PORT.");
 			uint16_t openflow_port_num = openflow_config_get_of_port_num(
 			        packet->frame.src_interface);
@@ -285,17 +326,22 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		else if (port == OFPP_TABLE)
 		{
 			// OpenFlow pipeline handling
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_TABLE.");
 			return openflow_pkt_proc_handle_packet(packet);
 		}
 		else if (port == OFPP_NORMAL)
 		{
 			// Normal router handling
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_NORMAL.");
-			gpacket_t *new_packet = malloc(sizeof(gpacket_t));
-			memcpy(new_packet, packet, sizeof(gpacket_t));
+			gpacket_t *new_packet = duplicatePacket(packet);
+			if (new_packet == NULL)
+			{
+				verbose(1, "[openflow_pkt_proc_perform_action]:: Out of"
+						" packet buffers for OFPP_NORMAL action.");
+				return OPENFLOW_PKT_PROC_ERR_QUEUE;
+			}
 			int32_t ret = enqueuePacket(packet_core, new_packet,
 			        sizeof(gpacket_t), 0);
 			if (ret == 1)
@@ -310,7 +356,7 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		{
 			// Forward packet to all ports with flooding enabled except source
 			// port
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_FLOOD.");
 			uint32_t i;
 			for (i = 1; i <= OPENFLOW_MAX_PHYSICAL_PORTS; i++)
@@ -328,7 +374,7 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		else if (port == OFPP_ALL)
 		{
 			// Forward packet to all ports except source port
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_ALL.");
 			uint32_t i;
 			for (i = 1; i <= OPENFLOW_MAX_PHYSICAL_PORTS; i++)
@@ -346,21 +392,21 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		else if (port == OFPP_CONTROLLER)
 		{
 			// Forward packet to controller
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_CONTROLLER.");
 			return openflow_ctrl_iface_send_packet_in(packet, OFPR_ACTION);
 		}
 		else if (port == OFPP_LOCAL)
 		{
 			// Forward packet to controller packet processing
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with OFPP_LOCAL.");
 			return openflow_ctrl_iface_parse_packet(packet);
 		}
 		else
 		{
 			// Forward packet to specified port
-			verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+			TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 					" OFPAT_OUTPUT action with port %" PRIu16 ".", port);
 			return openflow_pkt_proc_forward_packet_to_port(packet, port, 0);
 		}
@@ -368,21 +414,24 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_VLAN_VID)
 	{
 		// Modify VLAN ID
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_VLAN_VID action.");
 		ofp_action_vlan_vid *vlan_vid_action = (ofp_action_vlan_vid *) header;
-		if (ntohs(packet->data.header.prot) == ETHERTYPE_IEEE_802_1Q)
+		if (ntohs(packet->data->header.prot) == ETHERTYPE_IEEE_802_1Q)
 		{
 			// Existing VLAN header
-			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
+			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) packet->data;
 			vlan_data->header.tci = vlan_vid_action->vlan_vid;
 		}
 		else
 		{
 			// No VLAN header
-			gpacket_t new_packet = openflow_pkt_proc_add_vlan_header(packet);
-			memcpy(packet, &new_packet, sizeof(gpacket_t));
-			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
+			pkt_data_vlan_t *vlan_data =
+			        openflow_pkt_proc_add_vlan_header(packet);
+			if (vlan_data == NULL)
+			{
+				return OPENFLOW_PKT_PROC_ERR_ACTION_INVALID;
+			}
 			vlan_data->header.tci = vlan_vid_action->vlan_vid;
 		}
 		return 0;
@@ -390,13 +439,13 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_VLAN_PCP)
 	{
 		// Modify VLAN priority
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_VLAN_PCP action.");
 		ofp_action_vlan_pcp *vlan_pcp_action = (ofp_action_vlan_pcp *) header;
-		if (ntohs(packet->data.header.prot) == ETHERTYPE_IEEE_802_1Q)
+		if (ntohs(packet->data->header.prot) == ETHERTYPE_IEEE_802_1Q)
 		{
 			// Existing VLAN header
-			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
+			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) packet->data;
 			vlan_data->header.tci = htons(
 			        ntohs(vlan_data->header.tci) & 0x1fff);
 			vlan_data->header.tci = htons(
@@ -406,9 +455,12 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 		else
 		{
 			// No VLAN header
-			gpacket_t new_packet = openflow_pkt_proc_add_vlan_header(packet);
-			memcpy(packet, &new_packet, sizeof(gpacket_t));
-			pkt_data_vlan_t *vlan_data = (pkt_data_vlan_t *) &packet->data;
+			pkt_data_vlan_t *vlan_data =
+			        openflow_pkt_proc_add_vlan_header(packet);
+			if (vlan_data == NULL)
+			{
+				return OPENFLOW_PKT_PROC_ERR_ACTION_INVALID;
+			}
 			vlan_data->header.tci = htons(
 			        ntohs(vlan_pcp_action->vlan_pcp) << 13);
 		}
@@ -417,48 +469,47 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_STRIP_VLAN)
 	{
 		// Remove VLAN header
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_STRIP_VLAN action.");
-		if (ntohs(packet->data.header.prot) == ETHERTYPE_IEEE_802_1Q)
+		if (ntohs(packet->data->header.prot) == ETHERTYPE_IEEE_802_1Q)
 		{
-			gpacket_t new_packet = openflow_pkt_proc_remove_vlan_header(packet);
-			memcpy(packet, &new_packet, sizeof(gpacket_t));
+			openflow_pkt_proc_remove_vlan_header(packet);
 		}
 		return 0;
 	}
 	else if (header_type == OFPAT_SET_DL_SRC)
 	{
 		// Modify Ethernet source MAC address
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_DL_SRC action.");
 		ofp_action_dl_addr *dl_addr_action = (ofp_action_dl_addr *) header;
-		COPY_MAC(&packet->data.header.src, &dl_addr_action->dl_addr);
+		COPY_MAC(&packet->data->header.src, &dl_addr_action->dl_addr);
 		return 0;
 	}
 	else if (header_type == OFPAT_SET_DL_DST)
 	{
 		// Modify Ethernet destination MAC address
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_DL_DST action.");
 		ofp_action_dl_addr *dl_addr_action = (ofp_action_dl_addr *) header;
-		COPY_MAC(&packet->data.header.dst, &dl_addr_action->dl_addr);
+		COPY_MAC(&packet->data->header.dst, &dl_addr_action->dl_addr);
 		return 0;
 	}
 	else if (header_type == OFPAT_SET_NW_SRC)
 	{
 		// Modify IP source address
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_NW_SRC action.");
 		ofp_action_nw_addr *nw_addr_action = (ofp_action_nw_addr *) header;
-		if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+		if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 		{
-			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 			if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 			        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 			{
 				// IP packet is not fragmented
-				COPY_IP(&ip_packet->ip_src, &nw_addr_action->nw_addr);
-				openflow_pkt_proc_update_checksums(ip_packet);
+				openflow_pkt_proc_set_nw_addr(ip_packet, ip_packet->ip_src,
+				        nw_addr_action->nw_addr);
 			}
 		}
 		return 0;
@@ -466,18 +517,18 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_NW_DST)
 	{
 		// Modify IP destination address
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_NW_DST action.");
 		ofp_action_nw_addr *nw_addr_action = (ofp_action_nw_addr *) header;
-		if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+		if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 		{
-			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 			if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 			        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 			{
 				// IP packet is not fragmented
-				COPY_IP(&ip_packet->ip_dst, &nw_addr_action->nw_addr);
-				openflow_pkt_proc_update_checksums(ip_packet);
+				openflow_pkt_proc_set_nw_addr(ip_packet, ip_packet->ip_dst,
+				        nw_addr_action->nw_addr);
 			}
 		}
 		return 0;
@@ -485,18 +536,24 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_NW_TOS)
 	{
 		// Modify IP type of service
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_NW_TOS action.");
 		ofp_action_nw_tos *nw_tos_action = (ofp_action_nw_tos *) header;
-		if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+		if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 		{
-			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 			if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 			        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 			{
 				// IP packet is not fragmented
+				// the TOS shares its 16-bit header word with the version
+				// and header length
+				uint16_t old_word, new_word;
+				memcpy(&old_word, ip_packet, 2);
 				ip_packet->ip_tos = nw_tos_action->nw_tos;
-				openflow_pkt_proc_update_checksums(ip_packet);
+				memcpy(&new_word, ip_packet, 2);
+				ip_packet->ip_cksum = checksumAdjust16(ip_packet->ip_cksum,
+				        old_word, new_word);
 			}
 		}
 		return 0;
@@ -504,12 +561,12 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_TP_SRC)
 	{
 		// Modify TCP/UDP source port
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_TP_SRC action.");
 		ofp_action_tp_port *tp_port_action = (ofp_action_tp_port *) header;
-		if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+		if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 		{
-			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 			if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 			        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 			{
@@ -520,8 +577,10 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 					tcp_packet_type *tcp_packet =
 					        (tcp_packet_type *) ((uint8_t *) ip_packet
 					                + ip_header_length);
+					uint16_t old_port = tcp_packet->src_port;
 					tcp_packet->src_port = tp_port_action->tp_port;
-					openflow_pkt_proc_update_checksums(ip_packet);
+					openflow_pkt_proc_adjust_l4_checksum(ip_packet, old_port,
+					        tp_port_action->tp_port, 16);
 				}
 				else if (ip_packet->ip_prot == UDP_PROTOCOL)
 				{
@@ -529,8 +588,10 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 					udp_packet_type *udp_packet =
 					        (udp_packet_type *) ((uint8_t *) ip_packet
 					                + ip_header_length);
+					uint16_t old_port = udp_packet->src_port;
 					udp_packet->src_port = tp_port_action->tp_port;
-					openflow_pkt_proc_update_checksums(ip_packet);
+					openflow_pkt_proc_adjust_l4_checksum(ip_packet, old_port,
+					        tp_port_action->tp_port, 16);
 				}
 			}
 		}
@@ -539,12 +600,12 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 	else if (header_type == OFPAT_SET_TP_DST)
 	{
 		// Modify TCP/UDP destination port
-		verbose(2, "[openflow_pkt_proc_perform_action]:: Performing"
+		TRACE(2, "[openflow_pkt_proc_perform_action]:: Performing"
 				" OFPAT_SET_TP_DST action.");
 		ofp_action_tp_port *tp_port_action = (ofp_action_tp_port *) header;
-		if (ntohs(packet->data.header.prot) == IP_PROTOCOL)
+		if (ntohs(packet->data->header.prot) == IP_PROTOCOL)
 		{
-			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data.data;
+			ip_packet_t *ip_packet = (ip_packet_t *) &packet->data->data;
 			if (!(ntohs(ip_packet->ip_frag_off) & 0x1fff)
 			        && !(ntohs(ip_packet->ip_frag_off) & 0x2000))
 			{
@@ -555,8 +616,10 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 					tcp_packet_type *tcp_packet =
 					        (tcp_packet_type *) ((uint8_t *) ip_packet
 					                + ip_header_length);
+					uint16_t old_port = tcp_packet->dst_port;
 					tcp_packet->dst_port = tp_port_action->tp_port;
-					openflow_pkt_proc_update_checksums(ip_packet);
+					openflow_pkt_proc_adjust_l4_checksum(ip_packet, old_port,
+					        tp_port_action->tp_port, 16);
 				}
 				else if (ip_packet->ip_prot == UDP_PROTOCOL)
 				{
@@ -564,8 +627,10 @@ int32_t openflow_pkt_proc_perform_action(ofp_action_header *header,
 					udp_packet_type *udp_packet =
 					        (udp_packet_type *) ((uint8_t *) ip_packet
 					                + ip_header_length);
+					uint16_t old_port = udp_packet->dst_port;
 					udp_packet->dst_port = tp_port_action->tp_port;
-					openflow_pkt_proc_update_checksums(ip_packet);
+					openflow_pkt_proc_adjust_l4_checksum(ip_packet, old_port,
+					        tp_port_action->tp_port, 16);
 				}
 			}
 		}
@@ -10,8 +10,9 @@
  * drop on full policy. The packet scheduler is responsible for picking a
  * packet from the collection of active input queues. The packet scheduler
  * inserts the chosen packet into a work queue that is not part of the
- * packet core. The work queue is serviced by one or more worker threads
- * (for now we have one worker thread).
+ * packet core. There is one work queue per worker thread; the scheduler
+ * picks the worker by hashing the flow 5-tuple so that the packets of a
+ * flow are processed in order.
  */
 #define _XOPEN_SOURCE             500
 #include <unistd.h>
@@ -27,15 +28,21 @@
 #include "protocols.h"
 #include "packetcore.h"
 #include "message.h"
+#include "pktpool.h"
 #include "classifier.h"
 #include "grouter.h"
 #include "openflow_pkt_proc.h"
 #include "filter.h"
 #include "arp.h"
 #include "ip.h"
+#include "ethernet.h"
+#include "codel.h"
+#include "conntrack.h"
+#include "trace.h"
 
 extern classlist_t *classifier;
 extern filtertab_t *filter;
+extern conntrack_t *conntrack;
 extern router_config rconfig;
 
 /*
@@ -78,7 +85,7 @@ int deleteCnameCache(pktcorecnamecache_t *pcache, char *cname)
 	if (found)
 	{
 		free(pcache->cname[j]);
-		for (i = j; j < (pcache->numofentries-1); j++)
+		for (i = j; i < (pcache->numofentries-1); i++)
 			pcache->cname[i] = pcache->cname[i+1];
 		pcache->numofentries--;
 	}
@@ -99,6 +106,9 @@ pktcore_t *createPacketCore(char *rname, simplequeue_t *outQ, simplequeue_t *wor
 	}
 
 	pcore->pcache = createPktCoreCnameCache();
+	pcore->qgen = 0;
+	pcore->classindex = pcore->classretired = NULL;
+	pcore->classgen = 0;
 
 
 	strcpy(pcore->name, rname);
@@ -107,8 +117,26 @@ pktcore_t *createPacketCore(char *rname, simplequeue_t *outQ, simplequeue_t *wor
 	pthread_cond_init(&(pcore->schwaiting), NULL);
 	pcore->lastqid = 0;
 	pcore->packetcnt = 0;
+	strcpy(pcore->spolicy, "rr");
+	pcore->spolicyid = SPOLICY_RR;
+	pcore->vclock = 0.0;
+	pcore->activemap = 0;
+	pcore->schedparked = 0;
+	pcore->qinuse = NULL;
+	if ((pcore->qarray = (pktcoreqarray_t *)calloc(1, sizeof(pktcoreqarray_t))) == NULL)
+	{
+		fatal("[createPktCore]:: Could not allocate memory for the queue array");
+		return NULL;
+	}
+	if ((pcore->delayline = createTimerWheel("queue delay", releaseDelayedPackets, pcore)) == NULL)
+	{
+		fatal("[createPktCore]:: Could not create the queue delay timer wheel");
+		return NULL;
+	}
 	pcore->outputQ = outQ;
 	pcore->workQ = workQ;
+	bzero(pcore->workers, sizeof(pcore->workers));
+	pcore->nworkers = 0;
 	if (rconfig.openflow) {
 		pcore->openflowWorkQ = openflowWorkQ;
 	}
@@ -128,13 +156,40 @@ pktcore_t *createPacketCore(char *rname, simplequeue_t *outQ, simplequeue_t *wor
 }
 
 
+/*
+ * Replace the scheduler's queue array with narray. The scheduler keeps
+ * forwarding from the old array while we build the new one; we only wait
+ * for it to move off the old array before releasing it.
+ */
+static void swapQueueArray(pktcore_t *pcore, pktcoreqarray_t *narray)
+{
+	pktcoreqarray_t *oarray;
+
+	oarray = __atomic_exchange_n(&(pcore->qarray), narray, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&(pcore->qinuse), __ATOMIC_SEQ_CST) == oarray)
+		usleep(100);
+	free(oarray);
+}
+
+
 int addPktCoreQueue(pktcore_t *pcore, char *qname, char *qdisc, double qweight, double delay_us, int nslots)
 {
 	simplequeue_t *pktq;
 	qentrytype_t *qentry;
+	pktcoreqarray_t *narray;
+	int qid;
 
+	for (qid = 0; qid < MAX_QUEUE_NUM; qid++)
+		if (pcore->qarray->q[qid] == NULL)
+			break;
+	if (qid == MAX_QUEUE_NUM)
+	{
+		error("[addPktCoreQueue]:: too many queues (maximum %d).. ", MAX_QUEUE_NUM);
+		return EXIT_FAILURE;
+	}
 
-	if ((pktq = createSimpleQueue(qname, pcore->maxqsize, 0, 0)) == NULL)
+	// size the ring for the requested number of slots
+	if ((pktq = createSimpleQueue(qname, (nslots != 0) ? nslots : pcore->maxqsize, 0, 0)) == NULL)
 	{
 		error("[addPktCoreQueue]:: packet queue creation failed.. ");
 		return EXIT_FAILURE;
@@ -146,6 +201,7 @@ int addPktCoreQueue(pktcore_t *pcore, char *qname, char *qdisc, double qweight,
 	pktq->delay_us = delay_us;
 	strcpy(pktq->qdisc, qdisc);
 	pktq->weight = qweight;
+	pktq->qid = qid;
 	pktq->stime = pktq->ftime = 0.0;
 	if (!strcmp(qdisc, "red"))
 	{
@@ -156,10 +212,33 @@ int addPktCoreQueue(pktcore_t *pcore, char *qname, char *qdisc, double qweight,
 		pktq->avgqsize = 0;
 		pktq->count = -1;
 		pktq->idlestart = 0;
+	} else if (!strcmp(qdisc, "codel") || !strcmp(qdisc, "fq_codel"))
+	{
+		qentry = getqdiscEntry(pcore->qdiscs, qdisc);
+		if ((qentry == NULL) || ((pktq->codel = createCoDelQdisc(qentry, pktq->maxsize)) == NULL))
+		{
+			error("[addPktCoreQueue]:: unable to setup %s for queue %s.. ", qdisc, qname);
+			destroySimpleQueue(pktq);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((narray = (pktcoreqarray_t *)malloc(sizeof(pktcoreqarray_t))) == NULL)
+	{
+		error("[addPktCoreQueue]:: unable to allocate the queue array.. ");
+		destroySimpleQueue(pktq);
+		return EXIT_FAILURE;
 	}
+	memcpy(narray, pcore->qarray, sizeof(pktcoreqarray_t));
+	narray->q[qid] = pktq;
+	narray->nslots = max(narray->nslots, qid + 1);
 
+	pthread_mutex_lock(&(pcore->qlock));
 	map_add(pcore->queues, qname, pktq);
 	insertCnameCache(pcore->pcache, qname);
+	__atomic_add_fetch(&(pcore->qgen), 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(pcore->qlock));
+	swapQueueArray(pcore, narray);
 	return EXIT_SUCCESS;
 }
 
@@ -184,6 +263,8 @@ void printAllQueues(pktcore_t *pcore)
 	{
 		nextq = map_get(pcore->queues, nxtkey);
 		printSimpleQueue(nextq);
+		if (nextq->codel != NULL)
+			printCoDelQdisc(nextq->codel);
 	}
 	lister_release(klster);
 	list_release(keylst);
@@ -228,6 +309,8 @@ void printOneQueue(pktcore_t *pcore, char *qname)
 		{
 			nextq = map_get(pcore->queues, nxtkey);
 			printSimpleQueue(nextq);
+			if (nextq->codel != NULL)
+				printCoDelQdisc(nextq->codel);
 		}
 	}
 	lister_release(klster);
@@ -273,6 +356,12 @@ void modifyQueueDiscipline(pktcore_t *pcore, char *qname, char *qdisc)
 		if (!strcmp(qname, nxtkey))
 		{
 			nextq = map_get(pcore->queues, nxtkey);
+			// the CoDel state lives with the scheduler; it cannot be swapped under it
+			if ((nextq->codel != NULL) || !strcmp(qdisc, "codel") || !strcmp(qdisc, "fq_codel"))
+			{
+				error("[modifyQueueDiscipline]:: cannot change %s to %s, delete and add the queue.. ", nextq->qdisc, qdisc);
+				continue;
+			}
 			strcpy(nextq->qdisc, qdisc);
 		}
 	}
@@ -281,47 +370,109 @@ void modifyQueueDiscipline(pktcore_t *pcore, char *qname, char *qdisc)
 }
 
 
-int delPktCoreQueue(pktcore_t *pcore, char *qname)
+void modifyQueueDelay(pktcore_t *pcore, char *qname, double delay_us)
 {
-	List *keylst;
-	Lister *klster;
-	char *nxtkey;
-	int deleted;
+	simplequeue_t *thisq;
 
-	keylst = map_keys(pcore->queues);
-	klster = lister_create(keylst);
-	deleted = 0;
+	if ((thisq = getCoreQueue(pcore, qname)) != NULL)
+		thisq->delay_us = (delay_us > 0.0) ? delay_us : 0.0;
+}
 
-	while (nxtkey = ((char *)lister_next(klster)))
+
+/*
+ * Rate limits of a queue (rates in kbit/s, burst in bytes, 0 disables).
+ * The rate is enforced by shaping: the scheduler holds packets until the
+ * queue has tokens. The ceiling is enforced by policing: packets that
+ * arrive faster than the ceiling are dropped at enqueue.
+ */
+int setQueueRate(pktcore_t *pcore, char *qname, double rate_kbps, int burst, double ceil_kbps)
+{
+	simplequeue_t *thisq;
+
+	if ((thisq = getCoreQueue(pcore, qname)) == NULL)
 	{
-		if (!strcmp(qname, nxtkey))
-		{
-			map_remove(pcore->queues, qname);
-			deleted = 1;
-			deleteCnameCache(pcore->pcache, qname);
-		}
+		error("[setQueueRate]:: queue %s not found.. ", qname);
+		return EXIT_FAILURE;
+	}
+	if ((ceil_kbps > 0.0) && (rate_kbps > ceil_kbps))
+	{
+		error("[setQueueRate]:: rate %f is above the ceiling %f ", rate_kbps, ceil_kbps);
+		return EXIT_FAILURE;
 	}
-	lister_release(klster);
-	list_release(keylst);
 
-	if (deleted)
-		return EXIT_SUCCESS;
-	else
+	pthread_mutex_lock(&(pcore->qlock));
+	initTokenBucket(&(thisq->policer), ceil_kbps * 1000.0 / 8.0, burst);
+	pthread_mutex_unlock(&(pcore->qlock));
+	initTokenBucket(&(thisq->shaper), rate_kbps * 1000.0 / 8.0, burst);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Shaping: returns 1 if the packet at the head of thisq (len bytes) may be
+ * sent now and takes its tokens. Otherwise the queue is taken out of the
+ * active map until the delay timer wheel says it has enough tokens.
+ */
+int shapeQueue(pktcore_t *pcore, simplequeue_t *thisq, int len, uint64_t now)
+{
+	uint64_t wait_ns;
+
+	if ((thisq->shaper.rate <= 0.0) || tokenBucketConsume(&(thisq->shaper), len, now))
+		return 1;
+
+	wait_ns = tokenBucketDelay(&(thisq->shaper), len, now);
+	__atomic_fetch_and(&(pcore->activemap), ~(1u << thisq->qid), __ATOMIC_SEQ_CST);
+	if (__sync_bool_compare_and_swap(&(thisq->throttled), 0, 1))
+		addTimerWheelEntry(pcore->delayline, wait_ns / 1000 + 1, NULL, 0, thisq);
+	return 0;
+}
+
+
+int delPktCoreQueue(pktcore_t *pcore, char *qname)
+{
+	simplequeue_t *thisq;
+	pktcoreqarray_t *narray;
+	int qid;
+
+	pthread_mutex_lock(&(pcore->qlock));
+	if ((thisq = map_get(pcore->queues, qname)) == NULL)
+	{
+		pthread_mutex_unlock(&(pcore->qlock));
+		return EXIT_FAILURE;
+	}
+	map_remove(pcore->queues, qname);
+	deleteCnameCache(pcore->pcache, qname);
+	__atomic_add_fetch(&(pcore->qgen), 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(pcore->qlock));
+
+	if ((narray = (pktcoreqarray_t *)malloc(sizeof(pktcoreqarray_t))) == NULL)
+	{
+		fatal("[delPktCoreQueue]:: unable to allocate the queue array.. ");
 		return EXIT_FAILURE;
+	}
+	memcpy(narray, pcore->qarray, sizeof(pktcoreqarray_t));
+	narray->q[thisq->qid] = NULL;
+	for (qid = narray->nslots; (qid > 0) && (narray->q[qid-1] == NULL); qid--)
+		;
+	narray->nslots = qid;
+	swapQueueArray(pcore, narray);
+	__atomic_fetch_and(&(pcore->activemap), ~(1u << thisq->qid), __ATOMIC_SEQ_CST);
+
+	return EXIT_SUCCESS;
 }
 
 
 
-// create a thread for the scheduler. for now, hook up the Worst-case WFQ
-// as the scheduler. Only the dequeue is hooked up. The enqueue part is
-// in the classifier. The dequeue will put the scheduler in wait when it
-// runs out of jobs in the queue. The enqueue will wake up a sleeping scheduler.
+// create a thread for the scheduler. The scheduler thread runs the policy
+// selected by "spolicy activate" (round robin by default). Only the dequeue
+// is hooked up. The enqueue part is in the classifier. The scheduler waits
+// when all the queues are empty; the enqueue wakes up a sleeping scheduler.
 pthread_t PktCoreSchedulerInit(pktcore_t *pcore)
 {
 	int threadstat;
 	pthread_t threadid;
 
-	threadstat = pthread_create((pthread_t *)&threadid, NULL, (void *)roundRobinScheduler, (void *)pcore);
+	threadstat = pthread_create((pthread_t *)&threadid, NULL, (void *)packetScheduler, (void *)pcore);
 	if (threadstat != 0)
 	{
 		verbose(1, "[PKTCoreSchedulerInit]:: unable to create thread.. ");
@@ -332,53 +483,330 @@ pthread_t PktCoreSchedulerInit(pktcore_t *pcore)
 }
 
 
-int PktCoreWorkerInit(pktcore_t *pcore)
+/*
+ * Main loop of the scheduler thread. The policy is read on every pass, so
+ * switching it takes effect right away and the queued packets are kept.
+ */
+void *packetScheduler(void *pc)
 {
-	int threadstat, threadid;
+	pktcore_t *pcore = (pktcore_t *)pc;
+	pktcoreqarray_t *qarray;
+	unsigned int amap;
+	int policy = -1, spolicyid;
 
-	threadstat = pthread_create((pthread_t *)&threadid, NULL, (void *)packetProcessor, (void *)pcore);
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	while (1)
+	{
+		amap = waitForActiveQueues(pcore);
+		pthread_testcancel();
+		qarray = pinQueueArray(pcore);
 
-	if (threadstat != 0)
+		spolicyid = __atomic_load_n(&(pcore->spolicyid), __ATOMIC_ACQUIRE);
+		if (spolicyid != policy)
+		{
+			verbose(2, "[packetScheduler]:: switching to scheduling policy %s ", pcore->spolicy);
+			resetSchedulerState(pcore, qarray);
+			policy = spolicyid;
+		}
+
+		switch (policy)
+		{
+		case SPOLICY_DRR:
+			deficitRoundRobinSchedule(pcore, qarray, amap);
+			break;
+		case SPOLICY_WFQ:
+			weightedFairSchedule(pcore, qarray, amap);
+			break;
+		default:
+			roundRobinSchedule(pcore, qarray, amap);
+			break;
+		}
+	}
+}
+
+
+// clear the per queue scheduling state (DRR deficits and WFQ tags)
+void resetSchedulerState(pktcore_t *pcore, pktcoreqarray_t *qarray)
+{
+	int qid;
+
+	pcore->vclock = 0.0;
+	for (qid = 0; qid < qarray->nslots; qid++)
+		if (qarray->q[qid] != NULL)
+		{
+			qarray->q[qid]->deficit = 0;
+			qarray->q[qid]->stime = qarray->q[qid]->ftime = 0.0;
+		}
+}
+
+
+int setSchedulingPolicy(pktcore_t *pcore, char *pname)
+{
+	int spolicyid;
+
+	if (!strcmp(pname, "rr"))
+		spolicyid = SPOLICY_RR;
+	else if (!strcmp(pname, "drr"))
+		spolicyid = SPOLICY_DRR;
+	else if (!strcmp(pname, "wfq"))
+		spolicyid = SPOLICY_WFQ;
+	else
 	{
-		verbose(1, "[PKTCoreWorkerInit]:: unable to create thread.. ");
+		error("[setSchedulingPolicy]:: unknown scheduling policy %s ", pname);
+		return EXIT_FAILURE;
+	}
+
+	strcpy(pcore->spolicy, pname);
+	__atomic_store_n(&(pcore->spolicyid), spolicyid, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+}
+
+
+void printSchedulingPolicy(pktcore_t *pcore)
+{
+	printf("\nScheduling policies: rr (round robin), drr (deficit round robin), wfq (weighted fair queuing)\n");
+	printf("Active scheduling policy: %s \n", pcore->spolicy);
+}
+
+
+/*
+ * Length on the wire of the packet the queue releases next (-1 if empty).
+ * For CoDel queues this runs the dequeue side of the discipline, which may
+ * drop packets at the head; dequeueCorePacket() then takes that packet.
+ */
+int getPacketLength(pktcore_t *pcore, simplequeue_t *thisq, uint64_t now)
+{
+	gpacket_t **hpkt;
+	int size;
+
+	if (thisq->codel != NULL)
+		return codelQueueHead(pcore, thisq, now);
+	if (peekQueue(thisq, (void **)&hpkt, &size) == EXIT_FAILURE)
 		return -1;
+	return packetLength(*hpkt);
+}
+
+
+int dequeueCorePacket(simplequeue_t *thisq, void **pkt, int *size)
+{
+	if (thisq->codel != NULL)
+		return codelQueuePop(thisq, pkt, size);
+	return readQueue(thisq, pkt, size);
+}
+
+
+// FQ-CoDel holds packets outside the ring as well
+int isCoreQueueEmpty(simplequeue_t *thisq)
+{
+	return isQueueEmpty(thisq) && (codelBacklog(thisq) == 0);
+}
+
+
+// start the worker pool (rconfig.workers threads, at least one). Worker 0
+// services the work queue given to createPacketCore().
+pthread_t PktCoreWorkerInit(pktcore_t *pcore)
+{
+	pcore->workers[0].workQ = pcore->workQ;
+	if (PktCoreSetWorkers(pcore, (rconfig.workers > 0) ? rconfig.workers : 1) == EXIT_FAILURE)
+		return -1;
+
+	return pcore->workers[0].threadid;
+}
+
+
+// Change the number of workers that receive packets. New workers get their
+// own work queue and thread. Workers beyond nworkers are not stopped; they
+// only drain what is left in their queues. Flows may be reordered once
+// while the hash moves them to a different worker.
+int PktCoreSetWorkers(pktcore_t *pcore, int nworkers)
+{
+	char qname[MAX_NAME_LEN];
+	pktcoreworker_t *wrk;
+	int i;
+
+	if ((nworkers < 1) || (nworkers > MAX_WORKERS))
+	{
+		error("[PktCoreSetWorkers]:: number of workers should be in [1..%d] ", MAX_WORKERS);
+		return EXIT_FAILURE;
 	}
 
-	return threadid;
+	for (i = 0; i < nworkers; i++)
+	{
+		wrk = &(pcore->workers[i]);
+		if (wrk->pcore != NULL)
+			continue;                       // already running
+
+		wrk->id = i;
+		wrk->pcore = pcore;
+		if (wrk->workQ == NULL)
+		{
+			sprintf(qname, "work Queue %d", i);
+			if ((wrk->workQ = createSimpleQueue(qname, INFINITE_Q_SIZE, 0, 1)) == NULL)
+				return EXIT_FAILURE;
+		}
+		if (pthread_create(&(wrk->threadid), NULL, (void *)packetProcessor, (void *)wrk) != 0)
+		{
+			verbose(1, "[PktCoreSetWorkers]:: unable to create thread.. ");
+			wrk->pcore = NULL;
+			return EXIT_FAILURE;
+		}
+	}
+
+	__atomic_store_n(&(pcore->nworkers), nworkers, __ATOMIC_RELEASE);
+	rconfig.workers = nworkers;
+	verbose(2, "[PktCoreSetWorkers]:: packets are dispatched to %d workers ", nworkers);
+	return EXIT_SUCCESS;
+}
+
+
+void PktCoreWorkerHalt(pktcore_t *pcore)
+{
+	int i;
+
+	for (i = 0; i < MAX_WORKERS; i++)
+		if (pcore->workers[i].pcore != NULL)
+			pthread_cancel(pcore->workers[i].threadid);
+}
+
+
+void printWorkerStats(pktcore_t *pcore)
+{
+	pktcoreworker_t *wrk;
+	int i;
+
+	printf("\nActive workers: %d \n", pcore->nworkers);
+	printf("Worker\tQueued\tPackets\tBytes\t\tBursts\tIP\tARP\tOther\n");
+	for (i = 0; i < MAX_WORKERS; i++)
+	{
+		wrk = &(pcore->workers[i]);
+		if (wrk->pcore == NULL)
+			continue;
+		printf("%d%s\t%d\t%lu\t%-12lu\t%lu\t%lu\t%lu\t%lu\n", i, (i < pcore->nworkers) ? "" : "*",
+		       wrk->workQ->cursize, wrk->pkts, wrk->bytes, wrk->bursts,
+		       wrk->ippkts, wrk->arppkts, wrk->otherpkts);
+	}
+}
+
+
+/*
+ * Flow hash used to pick the worker. TCP and UDP packets are hashed on
+ * the 5-tuple; fragments and other protocols on the addresses and the
+ * protocol (fragments after the first do not carry the ports). Non IP
+ * packets (ARP) hash to 0 so they are all handled by worker 0.
+ */
+uint pktFlowHash(gpacket_t *pkt)
+{
+	ip_packet_t *ip_pkt;
+	uchar *l4hdr;
+	uint h;
+
+	if (ntohs(pkt->data->header.prot) != IP_PROTOCOL)
+		return 0;
+
+	ip_pkt = (ip_packet_t *)pkt->data->data;
+	h = (ip_pkt->ip_src[0] << 24) | (ip_pkt->ip_src[1] << 16) | (ip_pkt->ip_src[2] << 8) | ip_pkt->ip_src[3];
+	h = h * 0x9e3779b1 + ((ip_pkt->ip_dst[0] << 24) | (ip_pkt->ip_dst[1] << 16) | (ip_pkt->ip_dst[2] << 8) | ip_pkt->ip_dst[3]);
+	h = h * 0x9e3779b1 + ip_pkt->ip_prot;
+
+	if (((ip_pkt->ip_prot == TCP_PROTOCOL) || (ip_pkt->ip_prot == UDP_PROTOCOL)) &&
+	    ((ntohs(ip_pkt->ip_frag_off) & (IP_MF | IP_OFFMASK)) == 0))
+	{
+		l4hdr = (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4;
+		// source and destination ports are the first 4 bytes in TCP and UDP
+		h = h * 0x9e3779b1 + ((l4hdr[0] << 24) | (l4hdr[1] << 16) | (l4hdr[2] << 8) | l4hdr[3]);
+	}
+
+	// final avalanche so that the low bits depend on all the input bits
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+
+// hand a batch of scheduled packets to the workers, one burst per worker
+void dispatchPackets(pktcore_t *pcore, void **pkts, int *sizes, int npkts)
+{
+	void *wpkts[MAX_WORKERS][QUEUE_BURST_SIZE];
+	int wsizes[MAX_WORKERS][QUEUE_BURST_SIZE];
+	int wcnt[MAX_WORKERS];
+	int i, j, w, nworkers, chunk;
+
+	nworkers = __atomic_load_n(&(pcore->nworkers), __ATOMIC_ACQUIRE);
+	if (nworkers <= 1)
+	{
+		writeQueueBurst(pcore->workQ, pkts, sizes, npkts);
+		return;
+	}
+
+	for (i = 0; i < npkts; i += chunk)
+	{
+		chunk = min(npkts - i, QUEUE_BURST_SIZE);
+		bzero(wcnt, sizeof(wcnt));
+		for (j = i; j < i + chunk; j++)
+		{
+			w = pktFlowHash((gpacket_t *)pkts[j]) % nworkers;
+			wpkts[w][wcnt[w]] = pkts[j];
+			wsizes[w][wcnt[w]] = sizes[j];
+			wcnt[w]++;
+		}
+		for (w = 0; w < nworkers; w++)
+			if (wcnt[w] > 0)
+				writeQueueBurst(pcore->workers[w].workQ, wpkts[w], wsizes[w], wcnt[w]);
+	}
 }
 
 
 void *packetProcessor(void *pc)
 {
-	pktcore_t *pcore = (pktcore_t *)pc;
+	pktcoreworker_t *wrk = (pktcoreworker_t *)pc;
 	gpacket_t *in_pkt;
-	int pktsize;
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	int i, npkts;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 	while (1)
 	{
-		verbose(2, "[packetProcessor]:: Waiting for a packet...");
-		readQueue(pcore->workQ, (void **)&in_pkt, &pktsize);
+		TRACE(2, "[packetProcessor]:: Waiting for a packet...");
+		npkts = readQueueBurst(wrk->workQ, pkts, sizes, QUEUE_BURST_SIZE);
 		pthread_testcancel();
-		verbose(2, "[packetProcessor]:: Got a packet for further processing..");
+		TRACE(2, "[packetProcessor]:: Worker %d got %d packets for further processing..", wrk->id, npkts);
+		wrk->bursts++;
 
-		// get the protocol field within the packet... and switch it accordingly
-		switch (ntohs(in_pkt->data.header.prot))
+		for (i = 0; i < npkts; i++)
 		{
-		case IP_PROTOCOL:
-			verbose(2, "[packetProcessor]:: Packet sent to IP routine for further processing.. ");
-
-			IPIncomingPacket(in_pkt);
-			break;
-		case ARP_PROTOCOL:
-			verbose(2, "[packetProcessor]:: Packet sent to ARP module for further processing.. ");
-			ARPProcess(in_pkt);
-			break;
-		default:
-			verbose(1, "[packetProcessor]:: Packet discarded: Unknown protocol protocol");
-			// TODO: should we generate ICMP errors here.. check router RFCs
-			free(in_pkt);
-			break;
+			in_pkt = (gpacket_t *)pkts[i];
+			wrk->pkts++;
+			// IP and ARP rewrite the packet in place; a capture may still share it
+			if (makePacketWritable(in_pkt) == NULL)
+			{
+				freePacket(in_pkt);
+				continue;
+			}
+			wrk->bytes += packetLength(in_pkt);
+			// get the protocol field within the packet... and switch it accordingly
+			switch (ntohs(in_pkt->data->header.prot))
+			{
+			case IP_PROTOCOL:
+				TRACE(2, "[packetProcessor]:: Packet sent to IP routine for further processing.. ");
+				wrk->ippkts++;
+				IPIncomingPacket(in_pkt);
+				break;
+			case ARP_PROTOCOL:
+				TRACE(2, "[packetProcessor]:: Packet sent to ARP module for further processing.. ");
+				wrk->arppkts++;
+				ARPProcess(in_pkt);
+				break;
+			default:
+				TRACE(1, "[packetProcessor]:: Packet discarded: Unknown protocol protocol");
+				wrk->otherpkts++;
+				// TODO: should we generate ICMP errors here.. check router RFCs
+				freePacket(in_pkt);
+				break;
+			}
 		}
 	}
 }
@@ -409,96 +837,216 @@ void *openflowPacketProcessor(void *pc) {
 	openflow_pkt_proc_init(pcore);
 	while (1)
 	{
-		verbose(2, "[openflowPacketProcessor]:: Waiting for a packet...");
+		TRACE(2, "[openflowPacketProcessor]:: Waiting for a packet...");
 		readQueue(pcore->openflowWorkQ, (void **)&in_pkt, &pktsize);
 		pthread_testcancel();
-		verbose(2, "[openflowPacketProcessor]:: Got a packet for further"
+		TRACE(2, "[openflowPacketProcessor]:: Got a packet for further"
 			" processing..");
 
 		openflow_pkt_proc_handle_packet(in_pkt);
-		free(in_pkt);
+		freePacket(in_pkt);
 	}
 }
 
 /*
- * Checks if a given packets matches any of the classifier definitions
- * associated with existing queues.
- *
- * TODO: Performance issue; we are caching the cname.. should we actually
- * cache the classification rule itself? This will actually reduce the
- * lookup time. However, changes to the rules made will not be reflected
- * unless the cache is invalidated.
+ * Compile the filter rules and the class definitions of the existing
+ * queues into a new class index. Called with pcore->qlock held. The
+ * generations are read before the definitions so that a change made while
+ * we compile forces another rebuild instead of being lost.
  */
-char *tagPacket(pktcore_t *pcore, gpacket_t *in_pkt)
+static pktcoreclassindex_t *buildClassIndex(pktcore_t *pcore)
 {
+	pktcoreclassindex_t *cindex;
+	classrule_t *rules;
 	classdef_t *cdef;
-	int j, found = FALSE;
+	simplequeue_t *thisq;
 	char *qname;
-	static char *defaultstr = "default";
-
-	verbose(2, "[tagPacket]:: Entering the packet tagging function.. ");
+	int j, nfilter = 0, nrules;
 
+	cindex = (pktcoreclassindex_t *)malloc(sizeof(pktcoreclassindex_t));
+	rules = (classrule_t *)malloc((MAX_FILTER_RULES + MAX_QUEUE_SIZE) * sizeof(classrule_t));
+	if ((cindex == NULL) || (rules == NULL))
+	{
+		error("[buildClassIndex]:: unable to allocate the class index.. ");
+		free(cindex);
+		free(rules);
+		return NULL;
+	}
+	cindex->cgen = getClassifierGen(classifier);
+	cindex->qgen = __atomic_load_n(&(pcore->qgen), __ATOMIC_ACQUIRE);
+	cindex->filteron = filter->filteron;
+	cindex->fgen = getFilterGen(filter);
+	if (cindex->filteron)
+		nfilter = compileFilterRules(filter, rules, cindex->ftype, cindex->fslot, &(cindex->fgen));
+	cindex->defaultq = map_get(pcore->queues, "default");
+
+	nrules = nfilter;
 	for (j = 0; j < pcore->pcache->numofentries; j++)
 	{
-
 		qname = pcore->pcache->cname[j];
 		if (!strcmp(qname, "default"))
 			continue;
-		if ((cdef = getClassDef(classifier, qname)))
+		if (((cdef = getClassDef(classifier, qname)) == NULL) ||
+		    ((thisq = map_get(pcore->queues, qname)) == NULL))
+			continue;
+		compileClassRule(cdef, &(rules[nrules]));
+		cindex->q[nrules - nfilter] = thisq;
+		nrules++;
+	}
+
+	cindex->ts = createTupleSpace(rules, nrules, nfilter);
+	free(rules);
+	if (cindex->ts == NULL)
+	{
+		error("[buildClassIndex]:: unable to build the tuple space.. ");
+		free(cindex);
+		return NULL;
+	}
+	verbose(2, "[buildClassIndex]:: compiled %d filter rules and %d class rules (gen %u/%u/%u)",
+		nfilter, nrules - nfilter, cindex->cgen, cindex->qgen, cindex->fgen);
+	return cindex;
+}
+
+
+static void freeClassIndex(pktcoreclassindex_t *cindex)
+{
+	if (cindex == NULL)
+		return;
+	destroyTupleSpace(cindex->ts);
+	free(cindex);
+}
+
+
+static inline int isClassIndexCurrent(pktcore_t *pcore, pktcoreclassindex_t *cindex)
+{
+	return (cindex->cgen == getClassifierGen(classifier)) &&
+		(cindex->qgen == __atomic_load_n(&(pcore->qgen), __ATOMIC_ACQUIRE)) &&
+		(cindex->fgen == getFilterGen(filter)) && (cindex->filteron == filter->filteron);
+}
+
+
+/*
+ * Return the class index for the current filter, class definitions and
+ * queues, rebuilding it if any of them changed since it was compiled.
+ * Packet threads keep using an index for at most one packet after it is
+ * replaced, so the replaced index is only freed at the following rebuild;
+ * rebuilds happen on CLI changes, far apart.
+ */
+static pktcoreclassindex_t *getClassIndex(pktcore_t *pcore)
+{
+	pktcoreclassindex_t *cindex, *nindex;
+
+	cindex = __atomic_load_n(&(pcore->classindex), __ATOMIC_ACQUIRE);
+	if ((cindex != NULL) && isClassIndexCurrent(pcore, cindex))
+		return cindex;
+
+	pthread_mutex_lock(&(pcore->qlock));
+	cindex = pcore->classindex;
+	if ((cindex == NULL) || !isClassIndexCurrent(pcore, cindex))
+	{
+		if ((nindex = buildClassIndex(pcore)) != NULL)
 		{
-			if (isRuleMatching(cdef, in_pkt))
-			{
-				found = TRUE;
-				break;
-			}
+			nindex->gen = ++pcore->classgen;
+			__atomic_store_n(&(pcore->classindex), nindex, __ATOMIC_RELEASE);
+			freeClassIndex(pcore->classretired);
+			pcore->classretired = cindex;
+			cindex = nindex;
 		}
 	}
+	pthread_mutex_unlock(&(pcore->qlock));
+	return cindex;
+}
 
-	if (found == TRUE)
-		return cdef->cname;
-	else
-		return defaultstr;
+
+/*
+ * Number of the current class index, never 0. A queue tag taken under
+ * one number is still good as long as the number does not change.
+ */
+unsigned int getClassIndexGen(pktcore_t *pcore)
+{
+	pktcoreclassindex_t *cindex = getClassIndex(pcore);
+
+	return (cindex != NULL) ? cindex->gen : 0;
+}
+
+
+/*
+ * Filter and tag the packet with one lookup in the class index. Returns
+ * EXIT_FAILURE if the first matching filter rule denies the packet.
+ * Otherwise sets *thisq to the queue of the first matching class, in
+ * queue creation order, or to the "default" queue (NULL if there is no
+ * queue to take the packet). With nofilter set the packet is only tagged
+ * (e.g. the reply of a tracked connection). No name lookups or library
+ * calls per packet.
+ */
+int classifyPacket(pktcore_t *pcore, gpacket_t *in_pkt, simplequeue_t **thisq, int nofilter)
+{
+	pktcoreclassindex_t *cindex;
+	classkey_t key;
+	int match[TSS_LISTS];
+
+	TRACE(2, "[classifyPacket]:: Entering the packet classifier.. ");
+
+	*thisq = NULL;
+	if ((cindex = getClassIndex(pcore)) == NULL)
+		return EXIT_SUCCESS;
+
+	getClassKey(in_pkt, &key);
+	lookupTupleSpace(cindex->ts, &key, match);
+	if (cindex->filteron && !nofilter)
+	{
+		countFilterHit(filter, (match[0] >= 0) ? cindex->fslot[match[0]] : -1);
+		if ((match[0] >= 0) && (cindex->ftype[match[0]] == 0))
+			return EXIT_FAILURE;
+	}
+	*thisq = (match[1] >= 0) ? cindex->q[match[1]] : cindex->defaultq;
+	return EXIT_SUCCESS;
 }
 
 
 int enqueuePacket(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize,
 	uint8_t openflow)
 {
+	simplequeue_t *thisq;
+	int status;
+
 	if (openflow)
 	{
+		// only the filter verdict matters, the flow tables pick the queue
+		if (filter->filteron && (classifyPacket(pcore, in_pkt, &thisq, 0) == EXIT_FAILURE))
+		{
+			TRACE(2, "[enqueuePacket]:: Packet filtered..!");
+			freePacket(in_pkt);
+			return EXIT_FAILURE;
+		}
 		writeQueue(pcore->openflowWorkQ, in_pkt, pktsize);
 	}
 	else
 	{
-		char *qkey;
-		simplequeue_t *thisq;
-
-		// check for filtering.. if the it should be filtered.. then drop
-		if (filteredPacket(filter, in_pkt))
+		/*
+		 * filter the packet and get its tag in one pass; at the very minimum,
+		 * we get the "default" tag! Packets of tracked connections reuse the
+		 * verdict and the tag of their connection.
+		 */
+		if (conntrack->enabled)
+			status = trackPacket(conntrack, pcore, in_pkt, &thisq);
+		else
+			status = classifyPacket(pcore, in_pkt, &thisq, 0);
+		if (status == EXIT_FAILURE)
 		{
-			verbose(2, "[enqueuePacket]:: Packet filtered..!");
-			free(in_pkt);
+			TRACE(2, "[enqueuePacket]:: Packet filtered..!");
+			freePacket(in_pkt);
 			return EXIT_FAILURE;
 		}
 
-		/*
-		 * invoke the packet classifier to get the packet tag at the very minimum,
-		 * we get the "default" tag!
-		 */
-		qkey = tagPacket(pcore, in_pkt);
-
-		verbose(2, "[enqueuePacket]:: simple packet queuer ..");
-		if (prog_verbosity_level() >= 3)
+		TRACE(2, "[enqueuePacket]:: simple packet queuer ..");
+		if (TRACE_ON(3))
 			printGPacket(in_pkt, 6, "QUEUER");
 
-		pthread_mutex_lock(&(pcore->qlock));
-
-		thisq = map_get(pcore->queues, qkey);
 		if (thisq == NULL)
 		{
-			fatal("[enqueuePacket]:: Invalid %s key presented for queue retrieval", qkey);
-			pthread_mutex_unlock(&(pcore->qlock));
-			free(in_pkt);
+			fatal("[enqueuePacket]:: No queue found for the packet tag");
+			freePacket(in_pkt);
 			return EXIT_FAILURE;             // packet dropped..
 		}
 
@@ -506,31 +1054,171 @@ int enqueuePacket(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize,
 		// TODO: Need to change if we include other buffer management policies (e.g., dropfront)
 		if (thisq->cursize >= thisq->maxsize)
 		{
-			verbose(2, "[enqueuePacket]:: Packet dropped.. Queue for [%s] is full.. cursize %d..  ", qkey, thisq->cursize);
-			free(in_pkt);
-			pthread_mutex_unlock(&(pcore->qlock));
+			if (TRACE_ON(2))
+				verbose(2, "[enqueuePacket]:: Packet dropped.. Queue for [%s] is full.. cursize %d..  ", thisq->name, thisq->cursize);
+			freePacket(in_pkt);
+			return EXIT_FAILURE;
+		}
+
+		// the policer and RED keep per queue state; serialize on the queue, not the core
+		pthread_mutex_lock(&(thisq->qlock));
+		if ((thisq->policer.rate > 0.0) &&
+		    !tokenBucketConsume(&(thisq->policer), packetLength(in_pkt), monotonicNanos()))
+		{
+			if (TRACE_ON(2))
+				verbose(2, "[enqueuePacket]:: Packet dropped.. Queue for [%s] is over its ceiling rate.. ", thisq->name);
+			freePacket(in_pkt);
+			pthread_mutex_unlock(&(thisq->qlock));
 			return EXIT_FAILURE;
 		}
 
 		if ( (!strcmp(thisq->qdisc, "red")) && (redDiscard(thisq, in_pkt)) )
 		{
-			verbose(2, "[enqueuePacket]:: RED Discarded Packet .. ");
-			free(in_pkt);
-			pthread_mutex_unlock(&(pcore->qlock));
+			TRACE(2, "[enqueuePacket]:: RED Discarded Packet .. ");
+			freePacket(in_pkt);
+			pthread_mutex_unlock(&(thisq->qlock));
 			return EXIT_FAILURE;
 		}
+		pthread_mutex_unlock(&(thisq->qlock));
 
-		pcore->packetcnt++;
-		if (pcore->packetcnt == 1)
-			pthread_cond_signal(&(pcore->schwaiting)); // wake up scheduler if it was waiting..
-		pthread_mutex_unlock(&(pcore->qlock));
-		verbose(2, "[enqueuePacket]:: Adding packet.. ");
-		writeQueue(thisq, in_pkt, pktsize);
+		// emulate the link delay: the packet enters the queue when its timer fires
+		if (thisq->delay_us > 0.0)
+		{
+			if (TRACE_ON(2))
+				verbose(2, "[enqueuePacket]:: Delaying packet by %f us.. ", thisq->delay_us);
+			if (addTimerWheelEntry(pcore->delayline, (uint64_t)thisq->delay_us, in_pkt, pktsize, thisq) == EXIT_FAILURE)
+			{
+				freePacket(in_pkt);
+				return EXIT_FAILURE;
+			}
+			return EXIT_SUCCESS;
+		}
+
+		TRACE(2, "[enqueuePacket]:: Adding packet.. ");
+		if (thisq->codel != NULL)
+			in_pkt->frame.qtime = monotonicNanos();
+		if (writeQueue(thisq, in_pkt, pktsize) == EXIT_FAILURE)
+		{
+			freePacket(in_pkt);
+			return EXIT_FAILURE;
+		}
+		__atomic_add_fetch(&(pcore->packetcnt), 1, __ATOMIC_RELAXED);
+		markQueueActive(pcore, thisq);
 		return EXIT_SUCCESS;
 	}
 }
 
 
+/*
+ * Expiry function of the delay timer wheel: move the packets whose delay
+ * is over into their queues, one burst per run of packets for the same
+ * queue, and wake the scheduler. Entries without a packet mark the end of
+ * a shaping wait and simply reactivate their queue.
+ */
+void releaseDelayedPackets(void *pc, twentry_t *list)
+{
+	pktcore_t *pcore = (pktcore_t *)pc;
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	simplequeue_t *thisq;
+	uint64_t now;
+	int i, npkts, nwritten;
+
+	while (list != NULL)
+	{
+		thisq = (simplequeue_t *)list->owner;
+		if (list->data == NULL)
+		{
+			__atomic_store_n(&(thisq->throttled), 0, __ATOMIC_SEQ_CST);
+			if (!isCoreQueueEmpty(thisq))
+				markQueueActive(pcore, thisq);
+			list = list->next;
+			continue;
+		}
+		now = (thisq->codel != NULL) ? monotonicNanos() : 0;
+		for (npkts = 0; (list != NULL) && (list->owner == thisq) && (list->data != NULL) && (npkts < QUEUE_BURST_SIZE); list = list->next)
+		{
+			pkts[npkts] = list->data;
+			sizes[npkts++] = list->size;
+			((gpacket_t *)list->data)->frame.qtime = now;
+		}
+
+		nwritten = writeQueueBurst(thisq, pkts, sizes, npkts);
+		for (i = nwritten; i < npkts; i++)
+		{
+			if (TRACE_ON(2))
+				verbose(2, "[releaseDelayedPackets]:: Packet dropped.. Queue for [%s] is full.. ", thisq->name);
+			freePacket(pkts[i]);
+		}
+		if (nwritten > 0)
+		{
+			__atomic_add_fetch(&(pcore->packetcnt), nwritten, __ATOMIC_RELAXED);
+			markQueueActive(pcore, thisq);
+		}
+	}
+}
+
+
+/*
+ * Clear the active bit of queue qid if it has no packets left. Returns 1
+ * if the bit was cleared.
+ */
+int clearQueueActive(pktcore_t *pcore, simplequeue_t *thisq, int qid)
+{
+	if ((thisq != NULL) && !isCoreQueueEmpty(thisq))
+		return 0;
+
+	__atomic_fetch_and(&(pcore->activemap), ~(1u << qid), __ATOMIC_SEQ_CST);
+	// a writer could have filled the queue before we cleared the bit
+	if ((thisq != NULL) && !isCoreQueueEmpty(thisq) && !thisq->throttled)
+	{
+		__atomic_fetch_or(&(pcore->activemap), 1u << qid, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Set the active bit of a queue after a packet was written into it and
+ * wake the scheduler if it is parked. The write happens before the bit is
+ * set, so a scheduler that clears the bit and then finds the queue empty
+ * cannot miss the packet.
+ */
+void markQueueActive(pktcore_t *pcore, simplequeue_t *thisq)
+{
+	// a throttled queue is reactivated by the timer wheel
+	if (__atomic_load_n(&(thisq->throttled), __ATOMIC_SEQ_CST))
+		return;
+	__atomic_fetch_or(&(pcore->activemap), 1u << thisq->qid, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(pcore->schedparked), __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&(pcore->qlock));
+		pthread_cond_signal(&(pcore->schwaiting));
+		pthread_mutex_unlock(&(pcore->qlock));
+	}
+}
+
+
+// Park the scheduler until some queue becomes active. Returns the active map.
+int waitForActiveQueues(pktcore_t *pcore)
+{
+	unsigned int amap;
+
+	if ((amap = __atomic_load_n(&(pcore->activemap), __ATOMIC_SEQ_CST)) != 0)
+		return amap;
+
+	__atomic_store_n(&(pcore->qinuse), NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&(pcore->qlock));
+	__atomic_store_n(&(pcore->schedparked), 1, __ATOMIC_SEQ_CST);
+	while ((amap = __atomic_load_n(&(pcore->activemap), __ATOMIC_SEQ_CST)) == 0)
+		pthread_cond_wait(&(pcore->schwaiting), &(pcore->qlock));
+	__atomic_store_n(&(pcore->schedparked), 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(pcore->qlock));
+	return amap;
+}
+
+
 /*
  * RED function: evaluate the Random early drop algorithm and return
  * 1 (true) if the packet should be dropped. Return 0 otherwise.
@@ -0,0 +1,421 @@
+/*
+ * pktpool.c (Packet buffer pool)
+ *
+ * Every gpacket_t comes from here. Each thread keeps a small cache of free
+ * buffers, so allocPacket() and freePacket() normally touch no lock and no
+ * shared cache line. A thread whose cache runs dry takes a whole batch from
+ * the global pool, and a thread whose cache overflows hands a batch back;
+ * that is what happens between the device threads (which allocate) and the
+ * output thread (which frees). The global pool grows one slab at a time up
+ * to a limit, optionally backed by huge pages.
+ *
+ * Buffers come in two size classes: standard ones sized for DEFAULT_MTU and
+ * jumbo ones for interfaces with an MTU up to MAX_JUMBO_MTU, so a 9000 byte
+ * frame does not make every packet pay for 9 KB of memory. A third class
+ * holds the bare descriptors of clones, which share the data of another
+ * packet; a buffer goes back to the pool when its last reference is freed.
+ */
+
+#include <slack/std.h>
+#include <slack/err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "grouter.h"
+#include "pktpool.h"
+
+
+static pktpool_t pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+			 .classes = {{.name = "Standard", .mtu = DEFAULT_MTU,
+				      .bufsize = PKTPOOL_BUF_SIZE(DEFAULT_MTU), .maxbufs = PKTPOOL_MAX_BUFS},
+				     {.name = "Jumbo", .mtu = MAX_JUMBO_MTU,
+				      .bufsize = PKTPOOL_BUF_SIZE(MAX_JUMBO_MTU),
+				      .maxbufs = PKTPOOL_MAX_BUFS / PKTPOOL_JUMBO_SHARE},
+				     {.name = "Clone", .mtu = 0, .bufsize = PKTPOOL_CLONE_SIZE,
+				      .maxbufs = PKTPOOL_MAX_BUFS}},
+			 .hugepages = 0, .slabs = NULL, .caches = NULL, .clones = 0, .cowcopies = 0};
+
+static __thread pktcache_t *mycache = NULL;
+static pthread_key_t cachekey;
+static pthread_once_t cacheonce = PTHREAD_ONCE_INIT;
+
+
+// carve a new slab of the given class into batches; called with pool.lock held
+static int growPacketPool(pktclass_t *pc)
+{
+	pktslab_t *slab;
+	pktfree_t *buf, *prev;
+	char *base;
+	size_t len;
+	int nbufs, j, huge;
+
+	if (pc->totalbufs >= pc->maxbufs)
+		return 0;
+
+	nbufs = min(PKTPOOL_SLAB_BUFS, pc->maxbufs - pc->totalbufs);
+	len = nbufs * pc->bufsize;
+	base = MAP_FAILED;
+	huge = 0;
+#ifdef MAP_HUGETLB
+	if (pool.hugepages)
+	{
+		len = (len + PKTPOOL_HUGE_PAGE - 1) & ~((size_t)PKTPOOL_HUGE_PAGE - 1);
+		base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base == MAP_FAILED)
+		{
+			verbose(1, "[growPacketPool]:: no huge pages available, using normal pages.. ");
+			len = nbufs * pc->bufsize;
+		} else
+		{
+			huge = 1;
+			nbufs = min(len / pc->bufsize, pc->maxbufs - pc->totalbufs);
+		}
+	}
+#endif
+	if ((base == MAP_FAILED) &&
+	    ((base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED))
+	{
+		error("[growPacketPool]:: unable to map a slab of %d packet buffers.. ", nbufs);
+		return 0;
+	}
+	if ((slab = (pktslab_t *)malloc(sizeof(pktslab_t))) == NULL)
+	{
+		munmap(base, len);
+		return 0;
+	}
+	slab->base = base;
+	slab->len = len;
+	slab->huge = huge;
+	slab->next = pool.slabs;
+	pool.slabs = slab;
+	pc->nslabs++;
+	pc->hugeslabs += huge;
+
+	// link the buffers into chains of PKTPOOL_BATCH
+	prev = NULL;
+	for (j = 0; j < nbufs; j++)
+	{
+		buf = (pktfree_t *)(base + j * pc->bufsize);
+		if ((j % PKTPOOL_BATCH) == 0)
+		{
+			buf->nextbatch = pc->batches;
+			buf->count = min(PKTPOOL_BATCH, nbufs - j);
+			pc->batches = buf;
+			pc->nbatches++;
+		} else
+			prev->next = buf;
+		buf->next = NULL;
+		prev = buf;
+	}
+	pc->totalbufs += nbufs;
+	pc->nfree += nbufs;
+	verbose(2, "[growPacketPool]:: added %d %d byte packet buffers (%s pages).. ",
+		nbufs, (int)pc->bufsize, huge ? "huge" : "normal");
+	return nbufs;
+}
+
+
+// return the last n buffers of a class in the cache to the global pool as one batch
+static void flushPacketCache(pktcache_t *cache, int cls, int n)
+{
+	pktclass_t *pc = &(pool.classes[cls]);
+	pktfree_t *head, *buf;
+	int j;
+
+	if (n <= 0)
+		return;
+	head = (pktfree_t *)cache->bufs[cls][cache->count[cls] - n];
+	for (buf = head, j = cache->count[cls] - n + 1; j < cache->count[cls]; j++)
+	{
+		buf->next = (pktfree_t *)cache->bufs[cls][j];
+		buf = buf->next;
+	}
+	buf->next = NULL;
+	head->count = n;
+	cache->count[cls] -= n;
+
+	pthread_mutex_lock(&(pool.lock));
+	head->nextbatch = pc->batches;
+	pc->batches = head;
+	pc->nbatches++;
+	pc->nfree += n;
+	pthread_mutex_unlock(&(pool.lock));
+}
+
+
+static int refillPacketCache(pktcache_t *cache, int cls)
+{
+	pktclass_t *pc = &(pool.classes[cls]);
+	pktfree_t *buf;
+
+	pthread_mutex_lock(&(pool.lock));
+	if ((pc->batches == NULL) && (growPacketPool(pc) == 0))
+	{
+		pthread_mutex_unlock(&(pool.lock));
+		return 0;
+	}
+	buf = pc->batches;
+	pc->batches = buf->nextbatch;
+	pc->nbatches--;
+	pc->nfree -= buf->count;
+	pthread_mutex_unlock(&(pool.lock));
+
+	// a batch never holds more than PKTPOOL_BATCH buffers
+	for (; buf != NULL; buf = buf->next)
+		cache->bufs[cls][cache->count[cls]++] = buf;
+	return cache->count[cls];
+}
+
+
+// thread exit: give the cached buffers back
+static void releasePacketCache(void *arg)
+{
+	pktcache_t *cache = (pktcache_t *)arg;
+	pktcache_t **pp;
+	int cls;
+
+	for (cls = 0; cls < PKTPOOL_NCLASSES; cls++)
+		while (cache->count[cls] > 0)
+			flushPacketCache(cache, cls, min(cache->count[cls], PKTPOOL_BATCH));
+
+	pthread_mutex_lock(&(pool.lock));
+	for (pp = &(pool.caches); *pp != NULL; pp = &((*pp)->next))
+		if (*pp == cache)
+		{
+			*pp = cache->next;
+			break;
+		}
+	pthread_mutex_unlock(&(pool.lock));
+	free(cache);
+}
+
+
+static void createCacheKey(void)
+{
+	pthread_key_create(&cachekey, releasePacketCache);
+}
+
+
+static pktcache_t *getPacketCache(void)
+{
+	pktcache_t *cache;
+
+	if (mycache != NULL)
+		return mycache;
+
+	pthread_once(&cacheonce, createCacheKey);
+	if ((cache = (pktcache_t *)calloc(1, sizeof(pktcache_t))) == NULL)
+		return NULL;
+	cache->thread = pthread_self();
+	pthread_mutex_lock(&(pool.lock));
+	cache->next = pool.caches;
+	pool.caches = cache;
+	pthread_mutex_unlock(&(pool.lock));
+	pthread_setspecific(cachekey, cache);
+	mycache = cache;
+	return cache;
+}
+
+
+/*
+ * Set the pool limits and map the first standard slab. A zero maxbufs keeps
+ * the default limit; jumbo buffers get a share of it and are only mapped
+ * once a jumbo interface asks for one.
+ */
+void initPacketPool(int maxbufs, int hugepages)
+{
+	pthread_mutex_lock(&(pool.lock));
+	if (maxbufs > 0)
+	{
+		pool.classes[PKTPOOL_STD].maxbufs = maxbufs;
+		pool.classes[PKTPOOL_JUMBO].maxbufs = max(maxbufs / PKTPOOL_JUMBO_SHARE, PKTPOOL_BATCH);
+		pool.classes[PKTPOOL_CLONE].maxbufs = maxbufs;
+	}
+	pool.hugepages = hugepages;
+	if (pool.classes[PKTPOOL_STD].totalbufs == 0)
+		growPacketPool(&(pool.classes[PKTPOOL_STD]));
+	pthread_mutex_unlock(&(pool.lock));
+}
+
+
+// take a buffer of class cls from the thread cache
+static gpacket_t *getPacketBuffer(int cls)
+{
+	pktcache_t *cache;
+	gpacket_t *pkt;
+
+	if (((cache = mycache) == NULL) && ((cache = getPacketCache()) == NULL))
+		return NULL;
+	if ((cache->count[cls] == 0) && (refillPacketCache(cache, cls) == 0))
+	{
+		__atomic_add_fetch(&(pool.classes[cls].failures), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	pkt = (gpacket_t *)cache->bufs[cls][--cache->count[cls]];
+	cache->allocs++;
+	pkt->bufsize = pool.classes[cls].bufsize - sizeof(gpacket_t);
+	pkt->refcnt = 1;
+	pkt->owner = NULL;
+	return pkt;
+}
+
+
+static void putPacketBuffer(gpacket_t *pkt)
+{
+	pktcache_t *cache;
+	int cls;
+
+	if (((cache = mycache) == NULL) && ((cache = getPacketCache()) == NULL))
+	{
+		error("[freePacket]:: no packet cache for this thread, buffer lost.. ");
+		return;
+	}
+
+	if (pkt->bufsize + sizeof(gpacket_t) <= pool.classes[PKTPOOL_CLONE].bufsize)
+		cls = PKTPOOL_CLONE;
+	else if (pkt->bufsize + sizeof(gpacket_t) <= pool.classes[PKTPOOL_STD].bufsize)
+		cls = PKTPOOL_STD;
+	else
+		cls = PKTPOOL_JUMBO;
+	if (cache->count[cls] == PKTPOOL_CACHE_SIZE)
+		flushPacketCache(cache, cls, PKTPOOL_BATCH);
+	cache->bufs[cls][cache->count[cls]++] = pkt;
+	cache->frees++;
+}
+
+
+/*
+ * Drop one reference to the buffer of pkt. A count of one means nobody
+ * else can see the buffer (only holders make clones), so the common
+ * unshared case needs no atomic update.
+ */
+static void releasePacketBuffer(gpacket_t *pkt)
+{
+	if ((__atomic_load_n(&(pkt->refcnt), __ATOMIC_ACQUIRE) == 1) ||
+	    (__atomic_sub_fetch(&(pkt->refcnt), 1, __ATOMIC_ACQ_REL) == 0))
+		putPacketBuffer(pkt);
+}
+
+
+/*
+ * Get a packet buffer big enough for a frame of an interface with the given
+ * MTU (0 means DEFAULT_MTU). Only the GINI metadata (frame) and the
+ * descriptor are set up; data points just past the headroom and the packet
+ * is empty (len 0) until its owner writes it. Returns NULL when the pool is
+ * at its limit.
+ */
+gpacket_t *allocPacket(int mtu)
+{
+	gpacket_t *pkt;
+
+	if ((pkt = getPacketBuffer((mtu <= DEFAULT_MTU) ? PKTPOOL_STD : PKTPOOL_JUMBO)) == NULL)
+		return NULL;
+	memset(&(pkt->frame), 0, sizeof(pkt_frame_t));
+	pkt->data = (pkt_data_t *)(pkt->buf + PKT_HEADROOM);
+	pkt->len = 0;
+	return pkt;
+}
+
+
+/*
+ * Make a packet that shares the data of pkt: only the descriptor and the
+ * GINI frame are copied. Returns NULL when the pool is at its limit.
+ */
+gpacket_t *clonePacket(gpacket_t *pkt)
+{
+	gpacket_t *holder = PKT_HOLDER(pkt);
+	gpacket_t *cpkt;
+
+	if ((cpkt = getPacketBuffer(PKTPOOL_CLONE)) == NULL)
+		return NULL;
+	memcpy(&(cpkt->frame), &(pkt->frame), sizeof(pkt_frame_t));
+	cpkt->data = pkt->data;
+	cpkt->len = pkt->len;
+	cpkt->bufsize = 0;
+	cpkt->owner = holder;
+	__atomic_add_fetch(&(holder->refcnt), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(pool.clones), 1, __ATOMIC_RELAXED);
+	return cpkt;
+}
+
+
+/*
+ * Copy on write: give pkt a private copy of its data if the buffer is
+ * shared with other packets. Returns the (possibly new) data, or NULL if
+ * no buffer could be had; pkt is left unchanged then.
+ */
+pkt_data_t *makePacketWritable(gpacket_t *pkt)
+{
+	gpacket_t *holder = PKT_HOLDER(pkt);
+	gpacket_t *npkt;
+	int len;
+
+	if (__atomic_load_n(&(holder->refcnt), __ATOMIC_ACQUIRE) == 1)
+		return pkt->data;
+
+	len = packetLength(pkt);
+	if ((npkt = getPacketBuffer((len > PKT_FRAME_SIZE(DEFAULT_MTU)) ? PKTPOOL_JUMBO : PKTPOOL_STD)) == NULL)
+	{
+		verbose(1, "[makePacketWritable]:: no packet buffer for a private copy.. ");
+		return NULL;
+	}
+	npkt->data = (pkt_data_t *)(npkt->buf + PKT_HEADROOM);
+	memcpy(npkt->data, pkt->data, len);
+	pkt->data = npkt->data;
+	pkt->len = len;
+	// our own buffer stays until pkt itself is freed; a borrowed one is released now
+	if (pkt->owner != NULL)
+		releasePacketBuffer(pkt->owner);
+	pkt->owner = npkt;
+	__atomic_add_fetch(&(pool.cowcopies), 1, __ATOMIC_RELAXED);
+	return pkt->data;
+}
+
+
+void freePacket(gpacket_t *pkt)
+{
+	if (pkt == NULL)
+		return;
+	if (pkt->owner != NULL)
+		releasePacketBuffer(pkt->owner);
+	releasePacketBuffer(pkt);
+}
+
+
+void printPacketPoolStats(void)
+{
+	pktcache_t *cache;
+	pktclass_t *pc;
+	int cls, cached;
+
+	pthread_mutex_lock(&(pool.lock));
+	printf("\nPacket buffer pool (%d bytes headroom)\n", PKT_HEADROOM);
+	for (cls = 0; cls < PKTPOOL_NCLASSES; cls++)
+	{
+		pc = &(pool.classes[cls]);
+		cached = 0;
+		for (cache = pool.caches; cache != NULL; cache = cache->next)
+			cached += cache->count[cls];
+
+		if (pc->mtu > 0)
+			printf("%s class: MTU %d, %lu byte buffers\n", pc->name, pc->mtu, (unsigned long)pc->bufsize);
+		else
+			printf("%s class: %lu byte descriptors\n", pc->name, (unsigned long)pc->bufsize);
+		printf("  Buffers: %d mapped (limit %d) in %d slabs (%d on huge pages)\n",
+		       pc->totalbufs, pc->maxbufs, pc->nslabs, pc->hugeslabs);
+		printf("  In use: %d \t Free: %d global, %d in thread caches\n",
+		       pc->totalbufs - pc->nfree - cached, pc->nfree, cached);
+		printf("  Allocation failures: %lu\n", __atomic_load_n(&(pc->failures), __ATOMIC_RELAXED));
+	}
+	printf("Clones: %lu \t Shared data copied on write: %lu\n",
+	       __atomic_load_n(&(pool.clones), __ATOMIC_RELAXED), __atomic_load_n(&(pool.cowcopies), __ATOMIC_RELAXED));
+	printf("Thread caches:\n");
+	for (cache = pool.caches; cache != NULL; cache = cache->next)
+		printf("  thread %lu: %d + %d + %d cached, %lu allocs, %lu frees\n", (unsigned long)cache->thread,
+		       cache->count[PKTPOOL_STD], cache->count[PKTPOOL_JUMBO], cache->count[PKTPOOL_CLONE],
+		       cache->allocs, cache->frees);
+	pthread_mutex_unlock(&(pool.lock));
+}
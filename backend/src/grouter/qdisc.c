@@ -33,8 +33,14 @@ void printQdiscs(qdisctable_t *qdiscs)
 		if (!strcmp(qdiscs->qentry[j].name, "red"))
 			printf("\t-min %f -max %f -pmax %f",
 					qdiscs->qentry[j].minval, qdiscs->qentry[j].maxval, qdiscs->qentry[j].pmaxval);
-		else
-			printf("\n");
+		else if (!strcmp(qdiscs->qentry[j].name, "codel"))
+			printf("\t-target %.0f -interval %.0f%s", qdiscs->qentry[j].target,
+					qdiscs->qentry[j].interval, qdiscs->qentry[j].ecn ? " -ecn" : "");
+		else if (!strcmp(qdiscs->qentry[j].name, "fq_codel"))
+			printf("\t-target %.0f -interval %.0f -flows %d -quantum %d%s", qdiscs->qentry[j].target,
+					qdiscs->qentry[j].interval, qdiscs->qentry[j].flows, qdiscs->qentry[j].quantum,
+					qdiscs->qentry[j].ecn ? " -ecn" : "");
+		printf("\n");
 	}
 	printf("\n");
 }
@@ -103,3 +109,42 @@ void addRED(qdisctable_t *qdiscs, double minl, double maxl, double pmax)
 
 }
 
+
+
+/*
+ * CoDel and FQ-CoDel entries: like red, there is one entry per discipline
+ * and adding it again overwrites the parameters. Queues pick up the
+ * parameters when they are created.
+ */
+static qentrytype_t *addCoDelEntry(qdisctable_t *qdiscs, char *name, double target, double interval, int ecn)
+{
+	int indx;
+
+	if ((indx = lookupQDisc(qdiscs, name)) < 0)
+	{
+		indx = qdiscs->qdiscnums;
+		qdiscs->qdiscnums++;
+	}
+
+	strcpy(qdiscs->qentry[indx].name, name);
+	qdiscs->qentry[indx].target = target;
+	qdiscs->qentry[indx].interval = interval;
+	qdiscs->qentry[indx].ecn = ecn;
+	return &(qdiscs->qentry[indx]);
+}
+
+
+void addCoDel(qdisctable_t *qdiscs, double target, double interval, int ecn)
+{
+	addCoDelEntry(qdiscs, "codel", target, interval, ecn);
+}
+
+
+void addFQCoDel(qdisctable_t *qdiscs, double target, double interval, int ecn, int flows, int quantum)
+{
+	qentrytype_t *qentry;
+
+	qentry = addCoDelEntry(qdiscs, "fq_codel", target, interval, ecn);
+	qentry->flows = flows;
+	qentry->quantum = quantum;
+}
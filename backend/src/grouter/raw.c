@@ -14,11 +14,13 @@
 #include "filter.h"
 #include "protocols.h"
 #include "message.h"
+#include "pktpool.h"
 #include "gnet.h"
 #include "arp.h"
 #include "ip.h"
 #include "ethernet.h"
 #include "icmp.h"
+#include "trace.h"
 
 #include <netinet/in.h>
 #include <errno.h>
@@ -45,7 +47,6 @@
 
 extern pktcore_t *pcore;
 extern classlist_t *classifier;
-extern filtertab_t *filter;
 
 
 extern router_config rconfig;
@@ -58,45 +59,27 @@ void *toRawDev(void *arg)
 	char tmpbuf[MAX_TMPBUF_LEN];
 	int pkt_size;
 
-	verbose(1, "[toRawDev]:: entering the function.. ");
+	TRACE(1, "[toRawDev]:: entering the function.. ");
 	// find the outgoing interface and device...
 	if ((iface = findInterface(inpkt->frame.dst_interface)) != NULL)
 	{
-		char tmp[40];
-		memset(tmp, 0, sizeof(tmp));
-		IP2Dot(tmp, inpkt->frame.src_ip_addr);
-		/* The Amazon network has the prefix 172, so if a packet is sent to the raw interface and it does
-		not begin with that prefix, we know that the packet has come from the local gini network instead.
-		In this case we want to apply a SNAT, to make the packet seem as if it has come from the cRouter 
-		so that Amazon machines will be able to respond (recognize the address). Note that the reverse
-		NAT operation is performed in ip.c*/
-		/*if(inpkt->data.header.prot != htons(ARP_PROTOCOL) && !(tmp[0] == '1' && tmp[1] == '7' && tmp[2] == '2')) {
-			//printf("\n\n TRYING TO PING AMAZON CLOUD\n");				
-			//printGPacket(inpkt, 3, "CONNOR PACKET");
-			ip_packet_t *ipkt = (ip_packet_t *)(inpkt->data.data);
-			ipkt->ip_hdr_len = 5;                                  // no IP header options!!
-			icmphdr_t *icmphdr = (icmphdr_t *)((uchar *)ipkt + ipkt->ip_hdr_len*4);
-			printf("\n\nICMP ID: %d\n", icmphdr->un.echo.id); 
-			The IP address given to the SNAT function is the private ip address of the 
-			Amazon instance that is running the cRouter in reverse 
-			applySNAT("62.44.31.172", (ip_packet_t*)inpkt->data.data, icmphdr->un.echo.id);
-			printNAT();	
-		}*/
+		// packets from the gini network are masqueraded by the NAT in the
+		// forwarding path ("nat masq"), like on any other interface
 		/* send IP packet or ARP reply */
-		if (inpkt->data.header.prot == htons(ARP_PROTOCOL))
+		if ((inpkt->data->header.prot == htons(ARP_PROTOCOL)) && (makePacketWritable(inpkt) != NULL))
 		{
 			printf("CONNORS DEBUG arp in toRawDev\n");
-			apkt = (arp_packet_t *) inpkt->data.data;
+			apkt = (arp_packet_t *) inpkt->data->data;
 			COPY_MAC(apkt->src_hw_addr, iface->mac_addr);
 			COPY_IP(apkt->src_ip_addr, gHtonl(tmpbuf, iface->ip_addr));
 		}
-		if(inpkt->data.header.prot == htons(ICMP_PROTOCOL)){
+		if(inpkt->data->header.prot == htons(ICMP_PROTOCOL)){
 			printf("\nICMP Request over raw\n");
 		}		
-		pkt_size = findPacketSize(&(inpkt->data));
-		verbose(2, "[toRawDev]:: raw_sendto called for interface %d.. ", iface->interface_id);
-		raw_sendto(iface->vpl_data, &(inpkt->data), pkt_size);
-		free(inpkt);          // finally destroy the memory allocated to the packet..
+		pkt_size = packetLength(inpkt);
+		TRACE(2, "[toRawDev]:: raw_sendto called for interface %d.. ", iface->interface_id);
+		raw_sendto(iface->vpl_data, inpkt->data, pkt_size);
+		freePacket(inpkt);          // finally destroy the memory allocated to the packet..
 	} else
 		error("[toRawDev]:: ERROR!! Could not find outgoing interface ...");
 
@@ -112,32 +95,34 @@ void* fromRawDev(void *arg)
     interface_t *iface = (interface_t *) arg;
     uchar bcast_mac[] = MAC_BCAST_ADDR;
     gpacket_t *in_pkt;
+    pkt_data_t scratch;
     int pktsize;
-    char tmpbuf[MAX_TMPBUF_LEN];
     
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);		// die as soon as cancelled
     while (1)
     {
-        verbose(2, "[fromRawDev]:: Receiving a packet ...");
-        if ((in_pkt = (gpacket_t *)malloc(sizeof(gpacket_t))) == NULL)
+        TRACE(2, "[fromRawDev]:: Receiving a packet ...");
+        if ((in_pkt = allocPacket(iface->device_mtu)) == NULL)
         {
-            fatal("[fromRawDev]:: unable to allocate memory for packet.. ");
-            return NULL;
+            // out of packet buffers: take the frame off the device and drop it
+            raw_recvfrom(iface->vpl_data, &scratch, sizeof(pkt_data_t));
+            TRACE(1, "[fromRawDev]:: Packet dropped .. no packet buffers ");
+            continue;
         }
 
-        bzero(in_pkt, sizeof(gpacket_t));
-        pktsize = raw_recvfrom(iface->vpl_data, &(in_pkt->data), sizeof(pkt_data_t));
+        pktsize = raw_recvfrom(iface->vpl_data, in_pkt->data, packetCapacity(in_pkt));
+        in_pkt->len = max(pktsize, 0);
         pthread_testcancel();
         
-        verbose(2, "[fromRawDev]:: Destination MAC is %s ", MAC2Colon(tmpbuf, in_pkt->data.header.dst));
+        TRACE(2, "[fromRawDev]:: Destination MAC is %M ", TRACE_MAC(in_pkt->data->header.dst));
         // check whether the incoming packet is a layer 2 broadcast or
         // meant for this node... otherwise should be thrown..
         // TODO: fix for promiscuous mode packet snooping.
-        if ((COMPARE_MAC(in_pkt->data.header.dst, iface->mac_addr) != 0) &&
-                (COMPARE_MAC(in_pkt->data.header.dst, bcast_mac) != 0))
+        if ((COMPARE_MAC(in_pkt->data->header.dst, iface->mac_addr) != 0) &&
+                (COMPARE_MAC(in_pkt->data->header.dst, bcast_mac) != 0))
         {
-            verbose(2, "[fromRawDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
-            free(in_pkt);
+            TRACE(2, "[fromRawDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
+            freePacket(in_pkt);
             continue;
         }
 		
@@ -145,23 +130,8 @@ void* fromRawDev(void *arg)
         in_pkt->frame.src_interface = iface->interface_id;
         COPY_MAC(in_pkt->frame.src_hw_addr, iface->mac_addr);
         COPY_IP(in_pkt->frame.src_ip_addr, iface->ip_addr);
-	
-	
-	char buf[20];
-	memset(buf, 0, sizeof(buf));
-	IP2Dot(buf, in_pkt->frame.src_ip_addr);
-//	if(strcmp(buf, "172.31.32.1")==0)
-//		printf("FROM RAW IP %s\n", buf);
-        // check for filtering.. if the it should be filtered.. then drop
-     
-	if (filteredPacket(filter, in_pkt))
-        {
-            verbose(2, "[fromRawDev]:: Packet filtered..!");
-            free(in_pkt);
-            continue;   // skip the rest of the loop
-        }
 
-        verbose(2, "[fromRawDev]:: Packet is sent for enqueuing..");
+        TRACE(2, "[fromRawDev]:: Packet is sent for enqueuing..");
         enqueuePacket(pcore, in_pkt, sizeof(gpacket_t), rconfig.openflow);
     }
 }
@@ -254,18 +224,17 @@ int raw_recvfrom(vpl_data_t *vpl, void *buf, int len)
 {
     int n, rcv_addr_len;
     struct sockaddr rcvaddr;
-    char tmpbuf[100];
     
     rcv_addr_len = sizeof(rcvaddr);
     n=recvfrom(vpl->data, buf, len, 0, &rcvaddr, &rcv_addr_len);
     if (n == -1) 
     {
         verbose(2, "[raw_recvfrom]:: unable to receive packet, error = %s", strerror(errno));		
-        return EXIT_FAILURE;
+        return -1;
     } 
     
-    verbose(2, "[raw_recvfrom]:: Destination MAC is %s ", MAC2Colon(tmpbuf, buf));
-    return EXIT_SUCCESS;   
+    TRACE(2, "[raw_recvfrom]:: Destination MAC is %M ", TRACE_MAC(buf));
+    return n;   
 }
 
 
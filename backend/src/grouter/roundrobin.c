@@ -11,62 +11,90 @@
 #include "grouter.h"
 
 /*
- * Roundrobin scheduler implementation -- when the roundrobin scheme is used, we need to use
- * the corresponding "queuer" as well.
+ * Roundrobin scheduler implementation -- the packet scheduler thread
+ * (packetScheduler in packetcore.c) calls roundRobinSchedule() once per
+ * pass when the "rr" policy is active.
  */
 
 extern router_config rconfig;
 
-void *roundRobinScheduler(void *pc)
+/*
+ * Pin the current queue array so that a concurrent add/del does not free
+ * it under us. See swapQueueArray() in packetcore.c.
+ */
+pktcoreqarray_t *pinQueueArray(pktcore_t *pcore)
 {
-	pktcore_t *pcore = (pktcore_t *)pc;
-	List *keylst;
-	int nextqid, qcount, rstatus, pktsize;
-	char *nextqkey;
-	gpacket_t *in_pkt;
-	simplequeue_t *nextq;
-
+	pktcoreqarray_t *qarray;
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	while (1)
+	do
 	{
-		verbose(2, "[roundRobinScheduler]:: Round robin scheduler processing... ");
-		keylst = map_keys(pcore->queues);
-		nextqid = pcore->lastqid;
-		qcount = list_length(keylst);
+		qarray = __atomic_load_n(&(pcore->qarray), __ATOMIC_SEQ_CST);
+		__atomic_store_n(&(pcore->qinuse), qarray, __ATOMIC_SEQ_CST);
+	} while (qarray != __atomic_load_n(&(pcore->qarray), __ATOMIC_SEQ_CST));
 
-		pthread_mutex_lock(&(pcore->qlock));
-		if (pcore->packetcnt == 0)
-			pthread_cond_wait(&(pcore->schwaiting), &(pcore->qlock));
-		pthread_mutex_unlock(&(pcore->qlock));
+	return qarray;
+}
 
-		pthread_testcancel();
-		do
-		{
-			nextqid = (1 + nextqid) % qcount;
-			nextqkey = list_item(keylst, nextqid);
-			// get the queue..
-			nextq = map_get(pcore->queues, nextqkey);
-			// read the queue..
-			rstatus = readQueue(nextq, (void **)&in_pkt, &pktsize);
 
-			if (rstatus == EXIT_SUCCESS)
-			{
-				pcore->lastqid = nextqid;
-				writeQueue(pcore->workQ, in_pkt, pktsize);
-			}
+/*
+ * Move up to one burst from queue qid to the workers. Clears the active bit
+ * of the queue when it runs dry. Returns the number of packets moved.
+ */
+int serviceQueue(pktcore_t *pcore, pktcoreqarray_t *qarray, int qid, int max)
+{
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	simplequeue_t *thisq;
+	uint64_t now;
+	int npkts, len;
 
-		} while (nextqid != pcore->lastqid && rstatus == EXIT_FAILURE);
-		list_release(keylst);
+	if ((thisq = qarray->q[qid]) == NULL)
+	{
+		clearQueueActive(pcore, NULL, qid);
+		return 0;
+	}
 
-		pthread_mutex_lock(&(pcore->qlock));
-		if (rstatus == EXIT_SUCCESS)
-			pcore->packetcnt--;
-		pthread_mutex_unlock(&(pcore->qlock));
+	max = min(max, QUEUE_BURST_SIZE);
+	if ((thisq->shaper.rate > 0.0) || (thisq->codel != NULL))
+	{
+		// shaped or CoDel queue: take packets one at a time
+		now = monotonicNanos();
+		for (npkts = 0; (npkts < max) && ((len = getPacketLength(pcore, thisq, now)) > 0); npkts++)
+			if (!shapeQueue(pcore, thisq, len, now) ||
+			    (dequeueCorePacket(thisq, &(pkts[npkts]), &(sizes[npkts])) == EXIT_FAILURE))
+				break;
+	} else
+		npkts = readQueueBurst(thisq, pkts, sizes, max);
 
-		usleep(rconfig.schedcycle);
+	if (npkts > 0)
+	{
+		dispatchPackets(pcore, pkts, sizes, npkts);
+		__atomic_sub_fetch(&(pcore->packetcnt), npkts, __ATOMIC_RELAXED);
 	}
+
+	clearQueueActive(pcore, thisq, qid);
+	return npkts;
 }
 
 
+/*
+ * One round robin pass visits every active queue once, starting right
+ * after the last queue served, and moves a burst from each.
+ */
+void roundRobinSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap)
+{
+	unsigned int rotmap;
+	int qid, start, bit;
 
+	verbose(2, "[roundRobinSchedule]:: Round robin scheduler processing... ");
+	start = (pcore->lastqid + 1) % MAX_QUEUE_NUM;
+	rotmap = (start == 0) ? amap : ((amap >> start) | (amap << (MAX_QUEUE_NUM - start)));
+	while (rotmap != 0)
+	{
+		bit = __builtin_ctz(rotmap);
+		rotmap &= rotmap - 1;
+		qid = (start + bit) % MAX_QUEUE_NUM;
+		if (serviceQueue(pcore, qarray, qid, QUEUE_BURST_SIZE) > 0)
+			pcore->lastqid = qid;
+	}
+}
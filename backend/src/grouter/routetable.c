@@ -6,9 +6,15 @@
 
 #include "routetable.h"
 #include "gnet.h"
+#include "ip.h"
+#include "protocols.h"
+#include "localaddr.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <netinet/in.h>
 #include <slack/err.h>
 
 
@@ -18,133 +24,836 @@
  *-------------------------------------------------------------------------*/
 
 /*
- * These route table functions are not very efficient.. I guess because
- * of the small topologies that are targeted here... efficiency is not
- * a major concern...
+ * The routes as configured are kept in an array (so "route del" can name
+ * them by index) and hashed on network and netmask length. Forwarding
+ * never looks at them: findRouteEntry() only reads the DIR-24-8 table
+ * built from them. Writers hold the table lock and update the DIR-24-8
+ * entries one 32 bit store at a time, so a lookup sees either the old or
+ * the new route. A tbl8 group or a next hop that goes out of use is only
+ * reused FIB_GRACE_SECS later, after any lookup still reading it is done.
  */
 
 
-int rtbl_replace_indx;         // indicate which entry in routing table should be replaced
+static const uchar null_ip_addr[] = {0, 0, 0, 0};
+
+
+// IP addresses are kept in host byte order: ip_addr[3] is the most significant byte
+static inline uint32_t fibAddr(uchar *ip_addr)
+{
+	return ((uint32_t)ip_addr[3] << 24) | ((uint32_t)ip_addr[2] << 16) | ((uint32_t)ip_addr[1] << 8) | ip_addr[0];
+}
+
+
+static inline void fibAddr2IP(uchar *ip_addr, uint32_t addr)
+{
+	ip_addr[0] = addr & 0xff;
+	ip_addr[1] = (addr >> 8) & 0xff;
+	ip_addr[2] = (addr >> 16) & 0xff;
+	ip_addr[3] = addr >> 24;
+}
+
+
+static inline uint32_t fibMask(int len)
+{
+	return (len == 0) ? 0 : (0xffffffff << (32 - len));
+}
+
+
+static inline uint32_t fibClock(void)
+{
+	return (uint32_t)time(NULL);
+}
+
+
+static inline uint32_t fibLookup(routetable_t *rtbl, uint32_t addr)
+{
+	uint32_t e;
+
+	e = __atomic_load_n(&(rtbl->tbl24[addr >> 8]), __ATOMIC_ACQUIRE);
+	if (e & FIB_EXT)
+		e = __atomic_load_n(&(rtbl->tbl8[(FIB_INDEX(e) << 8) | (addr & 0xff)]), __ATOMIC_ACQUIRE);
+	return e;
+}
+
+
+// the next hop of FIB entry e for a packet of the given flow hash
+static inline int fibNexthop(routetable_t *rtbl, uint32_t e, uint32_t hash)
+{
+	uint32_t i = FIB_INDEX(e);
+
+	if (i & FIB_GROUP)
+		return __atomic_load_n(&(rtbl->groups[i & ~FIB_GROUP].buckets[hash & (FIB_PATH_BUCKETS - 1)]),
+				       __ATOMIC_ACQUIRE);
+	return i;
+}
+
+
+static inline uint32_t fibHashMix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
 
 
 /*
- * Find an interface corresponding to an IP address
- * Result stored in pbNhop and ppsInterfaceRet
- * Returns NO_ERROR if match found, ERROR if no match found
+ * Hash the addresses, the protocol and the TCP or UDP ports of a packet.
+ * Fragments carry no ports past the first one, so all fragments are
+ * hashed on the addresses and protocol alone and take the same path.
  */
-int findRouteEntry(route_entry_t route_tbl[], uchar *ip_addr, uchar *nhop, int *ixface)
+static inline uint32_t fibFlowHash(routetable_t *rtbl, ip_packet_t *ip_pkt)
 {
-	int icount;
-	uchar null_ip_addr[] = {0, 0, 0, 0};
-	char tmpbuf[MAX_TMPBUF_LEN];
-	int mindex[] = {-1, -1, -1, -1};
-	int j = 0;
-
-	// Try getting data
-	for (icount = 0; icount < MAX_ROUTES; icount++)
-	{
-		if (route_tbl[icount].is_empty == TRUE) continue;
-		verbose(2, "[findRouteEntry]:: Testing the route entry.. g %s at RT[%d], net %s netmask %s nexthop %s int %d",
-			       IP2Dot(tmpbuf, ip_addr), icount, IP2Dot(tmpbuf+15, route_tbl[icount].network),
-			       IP2Dot(tmpbuf+30, route_tbl[icount].netmask), IP2Dot(tmpbuf+45, route_tbl[icount].nexthop),
-			       route_tbl[icount].interface);
-		if (compareIPUsingMask(ip_addr, route_tbl[icount].network, route_tbl[icount].netmask) == 0)
-		{
-			verbose(2, "[findRouteEntry]:: Found a route for %s at RT[%d], net %s netmask %s nexthop %s int %d",
-			       IP2Dot(tmpbuf, ip_addr), icount, IP2Dot(tmpbuf+15, route_tbl[icount].network),
-			       IP2Dot(tmpbuf+30, route_tbl[icount].netmask), IP2Dot(tmpbuf+45, route_tbl[icount].nexthop),
-			       route_tbl[icount].interface);
+	uint32_t src, dst, ports = 0;
+
+	memcpy(&src, ip_pkt->ip_src, 4);
+	memcpy(&dst, ip_pkt->ip_dst, 4);
+	if (((ip_pkt->ip_prot == TCP_PROTOCOL) || (ip_pkt->ip_prot == UDP_PROTOCOL)) &&
+	    !(ntohs(ip_pkt->ip_frag_off) & (IP_MF | IP_OFFMASK)))
+		memcpy(&ports, (uchar *)ip_pkt + ip_pkt->ip_hdr_len * 4, 4);
+	return fibHashMix((src ^ rtbl->seed) * 0x9e3779b1u + (dst ^ ports) * 0xc2b2ae35u + ip_pkt->ip_prot);
+}
 
-			// save the index count
-			mindex[j++] = icount;
-		}
-	}
 
-	int k = -1;
-	int nmlen = 0;
-	for (int i = 0; i < j; i++)
+static __thread fib_counters_t *mycounters;
+
+static void countFIBNexthop(routetable_t *rtbl, int i, int len)
+{
+	fib_counters_t *c = mycounters;
+
+	if (c == NULL)
 	{
-		int q = mindex[i];
-		if (nmlen < netMaskLen(route_tbl[q].netmask))
-		{
-			nmlen = netMaskLen(route_tbl[q].netmask);
-			k = q;
-		}
+		// the first packet of this thread: add its counters to the list
+		if ((c = (fib_counters_t *)calloc(1, sizeof(fib_counters_t))) == NULL)
+			return;
+		pthread_mutex_lock(&(rtbl->lock));
+		c->next = rtbl->counters;
+		__atomic_store_n(&(rtbl->counters), c, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&(rtbl->lock));
+		mycounters = c;
 	}
+	// only this thread writes them
+	__atomic_store_n(&(c->packets[i]), c->packets[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&(c->bytes[i]), c->bytes[i] + len, __ATOMIC_RELAXED);
+}
+
+
+static void sumFIBNexthop(routetable_t *rtbl, int i, unsigned long *packets, unsigned long *bytes)
+{
+	fib_counters_t *c;
 
-	if (k >= 0)
+	*packets = *bytes = 0;
+	for (c = __atomic_load_n(&(rtbl->counters), __ATOMIC_ACQUIRE); c != NULL; c = c->next)
 	{
-		if (COMPARE_IP(route_tbl[k].nexthop, null_ip_addr) == 0)
-			COPY_IP(nhop, ip_addr);
-		else
-			COPY_IP(nhop, route_tbl[k].nexthop);
+		*packets += __atomic_load_n(&(c->packets[i]), __ATOMIC_RELAXED);
+		*bytes += __atomic_load_n(&(c->bytes[i]), __ATOMIC_RELAXED);
+	}
+}
 
-		*ixface = route_tbl[k].interface;
 
-		return EXIT_SUCCESS;
+/*
+ * Find the next hop and interface of the route to ip_addr.
+ * Returns EXIT_SUCCESS if a route matches, EXIT_FAILURE otherwise.
+ * On a multipath route the destination address picks the next hop.
+ */
+int findRouteEntry(routetable_t *rtbl, uchar *ip_addr, uchar *nhop, int *ixface)
+{
+	fib_nexthop_t *nh;
+	uint32_t e, addr = fibAddr(ip_addr);
+
+	e = fibLookup(rtbl, addr);
+	if (!(e & FIB_VALID))
+	{
+		TRACE(2, "[findRouteEntry]:: No match for %I in route table", TRACE_IP(ip_addr));
+		return EXIT_FAILURE;
 	}
+
+	nh = &(rtbl->nexthops[fibNexthop(rtbl, e, fibHashMix(addr ^ rtbl->seed))]);
+	*ixface = nh->interface;
+	if (COMPARE_IP(nh->nexthop, null_ip_addr) == 0)
+		COPY_IP(nhop, ip_addr);
 	else
+		COPY_IP(nhop, nh->nexthop);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Route an IP packet: fill in the next hop, the output interface and the
+ * adjacency of its frame, and count it on the next hop. The flow hash of
+ * the packet picks the next hop of a multipath route. The adjacency of a
+ * gateway comes with the route; for a host on a connected network it is
+ * looked up and is NULL until gnet created it.
+ */
+int findRoutePacket(routetable_t *rtbl, gpacket_t *pkt)
+{
+	ip_packet_t *ip_pkt = (ip_packet_t *)pkt->data->data;
+	uchar dst[4];
+	fib_nexthop_t *nh;
+	uint32_t e;
+	int i;
+
+	gNtohl(dst, ip_pkt->ip_dst);
+	e = fibLookup(rtbl, fibAddr(dst));
+	if (!(e & FIB_VALID))
 	{
-		verbose(2, "[findRouteEntry]:: No match for %s in route table", IP2Dot(tmpbuf, ip_addr));
+		TRACE(2, "[findRoutePacket]:: No match for %I in route table", TRACE_IP(dst));
 		return EXIT_FAILURE;
 	}
+
+	i = fibNexthop(rtbl, e, fibFlowHash(rtbl, ip_pkt));
+	nh = &(rtbl->nexthops[i]);
+	pkt->frame.dst_interface = nh->interface;
+	if (COMPARE_IP(nh->nexthop, null_ip_addr) == 0)
+	{
+		COPY_IP(pkt->frame.nxth_ip_addr, dst);
+		pkt->frame.adj = findAdjacency(nh->interface, dst);
+	} else
+	{
+		COPY_IP(pkt->frame.nxth_ip_addr, nh->nexthop);
+		pkt->frame.adj = nh->adj;
+	}
+	countFIBNexthop(rtbl, i, ntohs(ip_pkt->ip_pkt_len));
+	return EXIT_SUCCESS;
 }
 
 
 /*
- * Add a route entry to the table, if entry found update, else fill in an empty one,
- * if no empty entry, overwrite a used one, indicated by rtbl_replace_indx
+ * Find the network of the longest prefix matching an IP address.
+ * connected (if not NULL) tells whether the route has no gateway.
  */
-void addRouteEntry(route_entry_t route_tbl[], uchar* nwork, uchar* nmask, uchar* nhop, int interface)
+int findRouteNetwork(routetable_t *rtbl, uchar *ip_addr, uchar *network, uchar *netmask, bool *connected)
+{
+	uint32_t e, mask;
+
+	e = fibLookup(rtbl, fibAddr(ip_addr));
+	if (!(e & FIB_VALID))
+		return EXIT_FAILURE;
+
+	mask = fibMask(FIB_DEPTH(e));
+	fibAddr2IP(network, fibAddr(ip_addr) & mask);
+	fibAddr2IP(netmask, mask);
+	if (connected != NULL)
+		*connected = (COMPARE_IP(rtbl->nexthops[fibNexthop(rtbl, e, 0)].nexthop, null_ip_addr) == 0);
+	return EXIT_SUCCESS;
+}
+
+
+static int initFIBFreeList(fib_freelist_t *fl, int size)
+{
+	fl->slots = (int *)calloc(size, sizeof(int));
+	fl->when = (uint32_t *)calloc(size, sizeof(uint32_t));
+	fl->size = size;
+	return ((fl->slots != NULL) && (fl->when != NULL)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static void pushFIBFreeList(fib_freelist_t *fl, int slot)
 {
+	int i = (fl->head + fl->count) % fl->size;
+
+	fl->slots[i] = slot;
+	fl->when[i] = fibClock();
+	fl->count++;
+}
+
+
+// the oldest freed slot, or -1 if none has been free for the grace period
+static int popFIBFreeList(fib_freelist_t *fl)
+{
+	int slot;
+
+	if ((fl->count == 0) || (fibClock() - fl->when[fl->head] < FIB_GRACE_SECS))
+		return -1;
+	slot = fl->slots[fl->head];
+	fl->head = (fl->head + 1) % fl->size;
+	fl->count--;
+	return slot;
+}
+
+
+/*
+ * Take a reference on the next hop (nhop, interface), creating it if no
+ * route uses it yet. Returns its index or -1 if the next hop table is full.
+ */
+static int getFIBNexthop(routetable_t *rtbl, uchar *nhop, int interface)
+{
+	fib_nexthop_t *nh;
+	interface_t *iface;
 	int i;
-	int ifree = -1;
 
-	// First check if the entry is already in the table, if it is, update it
-	for (i = 0; i < MAX_ROUTES; i++)
+	for (i = 0; i < rtbl->nhused; i++)
 	{
-		if (route_tbl[i].is_empty == TRUE)
+		nh = &(rtbl->nexthops[i]);
+		if ((nh->refcnt > 0) && (nh->interface == interface) && (COMPARE_IP(nh->nexthop, nhop) == 0))
 		{
-			if (ifree < 0) ifree = i;
+			nh->refcnt++;
+			return i;
+		}
+	}
+
+	if ((i = popFIBFreeList(&(rtbl->nhfree))) < 0)
+	{
+		if (rtbl->nhused >= FIB_MAX_NEXTHOPS)
+			return -1;
+		i = rtbl->nhused++;
+	}
+	nh = &(rtbl->nexthops[i]);
+	COPY_IP(nh->nexthop, nhop);
+	nh->interface = interface;
+	nh->refcnt = 1;
+	nh->adj = (COMPARE_IP(nhop, null_ip_addr) == 0) ? NULL : getAdjacency(interface, nhop);
+	iface = findInterface(interface);
+	nh->down = (iface != NULL) && (iface->state == INTERFACE_DOWN);
+	sumFIBNexthop(rtbl, i, &(nh->pktbase), &(nh->bytebase));
+	rtbl->nhcount++;
+	return i;
+}
 
-		} else if ((COMPARE_IP(nwork, route_tbl[i].network)) == 0)
+
+static void putFIBNexthop(routetable_t *rtbl, int i)
+{
+	if (--rtbl->nexthops[i].refcnt == 0)
+	{
+		pushFIBFreeList(&(rtbl->nhfree), i);
+		rtbl->nhcount--;
+	}
+}
+
+
+// A tbl8 group whose 256 entries all hold fill
+static int allocTbl8Group(routetable_t *rtbl, uint32_t fill)
+{
+	uint32_t *grp;
+	int g, i;
+
+	if ((g = popFIBFreeList(&(rtbl->tbl8free))) < 0)
+	{
+		if (rtbl->tbl8used >= FIB_TBL8_GROUPS)
+			return -1;
+		g = rtbl->tbl8used++;
+	}
+	grp = &(rtbl->tbl8[g << 8]);
+	for (i = 0; i < 256; i++)
+		grp[i] = fill;
+	rtbl->tbl8groups++;
+	return g;
+}
+
+
+/*
+ * Fold the tbl8 group of tbl24 entry i back into the tbl24 entry once its
+ * entries are all the same and no longer than /24.
+ */
+static void compactTbl8Group(routetable_t *rtbl, uint32_t i)
+{
+	uint32_t *grp, e;
+	int g, j;
+
+	g = FIB_INDEX(rtbl->tbl24[i]);
+	grp = &(rtbl->tbl8[g << 8]);
+	e = grp[0];
+	if ((e & FIB_VALID) && (FIB_DEPTH(e) > 24))
+		return;
+	for (j = 1; j < 256; j++)
+		if (grp[j] != e)
+			return;
+
+	__atomic_store_n(&(rtbl->tbl24[i]), e, __ATOMIC_RELEASE);
+	pushFIBFreeList(&(rtbl->tbl8free), g);
+	rtbl->tbl8groups--;
+}
+
+
+/*
+ * Does a change of the prefix of length depth touch entry e? An added
+ * prefix overrides the shorter ones; a changed or deleted prefix only
+ * the entries it had set itself.
+ */
+static inline int fibCovers(uint32_t e, int depth, int replace)
+{
+	if (replace)
+		return (e & FIB_VALID) && (FIB_DEPTH(e) == depth);
+	return !(e & FIB_VALID) || (FIB_DEPTH(e) <= depth);
+}
+
+
+static inline void updateTbl8Range(routetable_t *rtbl, int g, int first, int n, int depth, uint32_t value, int replace)
+{
+	uint32_t *grp = &(rtbl->tbl8[g << 8]);
+	int j;
+
+	for (j = first; j < first + n; j++)
+		if (fibCovers(grp[j], depth, replace))
+			__atomic_store_n(&(grp[j]), value, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Set the entries of prefix addr/depth to value. With replace, only the
+ * entries the prefix had set are rewritten (route changed or deleted).
+ * Fails only when a prefix longer than /24 needs a tbl8 group and none is left.
+ */
+static int updateFIB(routetable_t *rtbl, uint32_t addr, int depth, uint32_t value, int replace)
+{
+	uint32_t i, e, first, n;
+	int g;
+
+	if (depth <= 24)
+	{
+		first = addr >> 8;
+		n = 1 << (24 - depth);
+		for (i = first; i < first + n; i++)
 		{
-			if ((COMPARE_IP(nmask, route_tbl[i].netmask)) == 0)
+			e = rtbl->tbl24[i];
+			if (e & FIB_EXT)
 			{
-				// match
-				COPY_IP(route_tbl[i].nexthop, nhop);
-				route_tbl[i].interface = interface;
-
-				verbose(2, "[addRouteEntry]:: updated route table entry #%d", i);
-				return;
-			}
+				updateTbl8Range(rtbl, FIB_INDEX(e), 0, 256, depth, value, replace);
+				if (replace)
+					compactTbl8Group(rtbl, i);
+			} else if (fibCovers(e, depth, replace))
+				__atomic_store_n(&(rtbl->tbl24[i]), value, __ATOMIC_RELEASE);
 		}
+		return EXIT_SUCCESS;
 	}
 
-	if (ifree < 0)
+	i = addr >> 8;
+	e = rtbl->tbl24[i];
+	first = addr & 0xff;
+	n = 1 << (32 - depth);
+	if (e & FIB_EXT)
+	{
+		updateTbl8Range(rtbl, FIB_INDEX(e), first, n, depth, value, replace);
+		if (replace)
+			compactTbl8Group(rtbl, i);
+	} else if (!replace)
 	{
-		ifree = rtbl_replace_indx;
-		rtbl_replace_indx = (rtbl_replace_indx + 1) % MAX_ROUTES;
+		// the new group starts as a copy of the /24 entry and is published complete
+		if ((g = allocTbl8Group(rtbl, e)) < 0)
+			return EXIT_FAILURE;
+		updateTbl8Range(rtbl, g, first, n, depth, value, 0);
+		__atomic_store_n(&(rtbl->tbl24[i]), FIB_EXT | g, __ATOMIC_RELEASE);
 	}
+	return EXIT_SUCCESS;
+}
 
-	COPY_IP(route_tbl[ifree].network, nwork);
-	COPY_IP(route_tbl[ifree].netmask, nmask);
-	COPY_IP(route_tbl[ifree].nexthop, nhop);
-	route_tbl[ifree].interface = interface;
-	route_tbl[ifree].is_empty = FALSE;
 
-	verbose(2, "[addRouteEntry]:: overwrote route entry #%d", rtbl_replace_indx);
-	return;
+static inline uint32_t ribHash(uint32_t net, int len)
+{
+	uint32_t h;
+
+	h = (net ^ ((uint32_t)len << 26)) * 0x9e3779b1u;
+	return (h ^ (h >> 16)) & (FIB_RIB_BUCKETS - 1);
+}
+
+
+// index of the route for net/len, or -1
+static int findRoute(routetable_t *rtbl, uint32_t net, int len)
+{
+	route_entry_t *r;
+	int i;
+
+	for (i = rtbl->buckets[ribHash(net, len)] - 1; i >= 0; i = r->next - 1)
+	{
+		r = &(rtbl->routes[i]);
+		if ((r->preflen == len) && (fibAddr(r->network) == net))
+			return i;
+	}
+	return -1;
+}
+
+
+static int allocRoute(routetable_t *rtbl)
+{
+	route_entry_t *routes;
+	int i, size;
+
+	if (rtbl->freeroute > 0)
+	{
+		i = rtbl->freeroute - 1;
+		rtbl->freeroute = rtbl->routes[i].next;
+		return i;
+	}
+	if (rtbl->used == rtbl->size)
+	{
+		size = (rtbl->size == 0) ? 64 : 2 * rtbl->size;
+		if (size > MAX_ROUTES)
+			size = MAX_ROUTES;
+		if ((rtbl->used == size) ||
+		    ((routes = (route_entry_t *)realloc(rtbl->routes, size * sizeof(route_entry_t))) == NULL))
+			return -1;
+		rtbl->routes = routes;
+		rtbl->size = size;
+	}
+	return rtbl->used++;
+}
+
+
+static void freeRoute(routetable_t *rtbl, int i)
+{
+	rtbl->routes[i].is_empty = TRUE;
+	rtbl->routes[i].next = rtbl->freeroute;
+	rtbl->freeroute = i + 1;
+}
+
+
+static int allocFIBGroup(routetable_t *rtbl)
+{
+	int g;
+
+	if ((g = popFIBFreeList(&(rtbl->grpfree))) < 0)
+	{
+		if (rtbl->grpused >= FIB_MAX_GROUPS)
+			return -1;
+		g = rtbl->grpused++;
+	}
+	rtbl->groups[g].nmembers = 0;
+	rtbl->groups[g].inuse = TRUE;
+	rtbl->grpcount++;
+	return g;
+}
+
+
+static void freeFIBGroup(routetable_t *rtbl, int g)
+{
+	rtbl->groups[g].inuse = FALSE;
+	pushFIBFreeList(&(rtbl->grpfree), g);
+	rtbl->grpcount--;
+}
+
+
+/*
+ * Share the buckets of a group evenly among its next hops that are up
+ * (among all of them if none is). A bucket only moves when its next hop
+ * left the group, went down or holds more than its share, so a change of
+ * one next hop leaves the flows of the others where they were. A bucket
+ * moved off a next hop that went down goes back to it when it is up again.
+ */
+static void balanceFIBGroup(routetable_t *rtbl, fib_group_t *grp)
+{
+	int live[FIB_MAX_PATHS], quota[FIB_MAX_PATHS], have[FIB_MAX_PATHS];
+	int want[FIB_PATH_BUCKETS], orphans[FIB_PATH_BUCKETS];
+	int nlive = 0, norphans = 0, i, j, h;
+
+	for (i = 0; i < grp->nmembers; i++)
+		if (!rtbl->nexthops[grp->members[i]].down)
+			live[nlive++] = grp->members[i];
+	if (nlive == 0)
+		for (i = 0; i < grp->nmembers; i++)
+			live[nlive++] = grp->members[i];
+
+	for (j = 0; j < nlive; j++)
+	{
+		quota[j] = FIB_PATH_BUCKETS / nlive + (j < FIB_PATH_BUCKETS % nlive);
+		have[j] = 0;
+	}
+	for (i = 0; i < FIB_PATH_BUCKETS; i++)
+	{
+		for (h = 0; (h < nlive) && (live[h] != grp->home[i]); h++)
+			;
+		want[i] = (h < nlive) ? grp->home[i] : grp->buckets[i];
+		for (j = 0; (j < nlive) && (live[j] != want[i]); j++)
+			;
+		if ((j == nlive) || (have[j] == quota[j]))
+			orphans[norphans++] = i;
+		else
+			have[j]++;
+	}
+	for (i = 0, j = 0; i < norphans; i++)
+	{
+		while (have[j] == quota[j])
+			j++;
+		want[orphans[i]] = live[j];
+		have[j]++;
+	}
+
+	for (i = 0; i < FIB_PATH_BUCKETS; i++)
+	{
+		// a bucket keeps its home while the home is a member that is down
+		for (h = 0; (h < grp->nmembers) && (grp->members[h] != grp->home[i]); h++)
+			;
+		if ((h == grp->nmembers) || !rtbl->nexthops[grp->home[i]].down)
+			grp->home[i] = want[i];
+		if (grp->buckets[i] != want[i])
+			__atomic_store_n(&(grp->buckets[i]), want[i], __ATOMIC_RELEASE);
+	}
+}
+
+
+// the next hops of route r
+static inline int *routePaths(routetable_t *rtbl, route_entry_t *r)
+{
+	return (r->npaths > 1) ? rtbl->groups[r->group].members : &(r->nhindex);
+}
+
+
+static inline uint32_t routeFIBEntry(route_entry_t *r, int len)
+{
+	return FIB_ENTRY((r->npaths > 1) ? (FIB_GROUP | r->group) : r->nhindex, len);
+}
+
+
+// position of next hop (nhop, interface) among the paths of r, or -1; interface < 0 matches any
+static int findRoutePath(routetable_t *rtbl, route_entry_t *r, uchar *nhop, int interface)
+{
+	fib_nexthop_t *nh;
+	int *paths = routePaths(rtbl, r);
+	int k;
+
+	for (k = 0; k < r->npaths; k++)
+	{
+		nh = &(rtbl->nexthops[paths[k]]);
+		if (((interface < 0) || (nh->interface == interface)) && (COMPARE_IP(nh->nexthop, nhop) == 0))
+			return k;
+	}
+	return -1;
 }
 
 
+/*
+ * A path to a directly connected network (next hop 0.0.0.0) makes the
+ * broadcast address of the network local to the router on its interface.
+ * Called with the table lock held.
+ */
+static void setRouteBroadcast(routetable_t *rtbl, route_entry_t *r, int nh, bool add)
+{
+	fib_nexthop_t *n = &(rtbl->nexthops[nh]);
+	uchar bcast_ip[4];
+
+	// /31 and /32 networks have no broadcast address, nor has the default route
+	if ((r->preflen == 0) || (r->preflen > 30) || (fibAddr(n->nexthop) != 0))
+		return;
+	fibAddr2IP(bcast_ip, fibAddr(r->network) | ~fibMask(r->preflen));
+	if (add)
+		addLocalAddress(bcast_ip, n->interface, LOCAL_BCAST);
+	else
+		deleteLocalAddress(bcast_ip, n->interface, LOCAL_BCAST);
+}
+
+
+/*
+ * Add next hop nh to route r, turning it into a multipath route if it had
+ * one next hop. The new next hop takes its share of buckets from the others.
+ */
+static int addRoutePath(routetable_t *rtbl, route_entry_t *r, int nh)
+{
+	fib_group_t *grp;
+	int g, i;
+
+	if (r->npaths > 1)
+	{
+		grp = &(rtbl->groups[r->group]);
+		grp->members[grp->nmembers++] = nh;
+		balanceFIBGroup(rtbl, grp);
+		r->npaths++;
+		return EXIT_SUCCESS;
+	}
+
+	// the group starts with all buckets on the old next hop and is published balanced
+	if ((g = allocFIBGroup(rtbl)) < 0)
+		return EXIT_FAILURE;
+	grp = &(rtbl->groups[g]);
+	for (i = 0; i < FIB_PATH_BUCKETS; i++)
+		grp->buckets[i] = grp->home[i] = r->nhindex;
+	grp->members[0] = r->nhindex;
+	grp->members[1] = nh;
+	grp->nmembers = 2;
+	balanceFIBGroup(rtbl, grp);
+	r->group = g;
+	r->npaths = 2;
+	updateFIB(rtbl, fibAddr(r->network), r->preflen, routeFIBEntry(r, r->preflen), 1);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Remove the k-th next hop of multipath route r. Its buckets go to the
+ * others; with one next hop left the route no longer needs its group.
+ */
+static void removeRoutePath(routetable_t *rtbl, route_entry_t *r, int k)
+{
+	fib_group_t *grp = &(rtbl->groups[r->group]);
+	int nh = grp->members[k];
+
+	grp->nmembers--;
+	memmove(&(grp->members[k]), &(grp->members[k + 1]), (grp->nmembers - k) * sizeof(int));
+	r->npaths--;
+	if (r->npaths == 1)
+	{
+		r->nhindex = grp->members[0];
+		updateFIB(rtbl, fibAddr(r->network), r->preflen, routeFIBEntry(r, r->preflen), 1);
+		freeFIBGroup(rtbl, r->group);
+	} else
+		balanceFIBGroup(rtbl, grp);
+	setRouteBroadcast(rtbl, r, nh, FALSE);
+	putFIBNexthop(rtbl, nh);
+}
+
+
+/*
+ * Add a route entry to the table. A route to a network already in the
+ * table gets the next hop as one more equal-cost path (up to FIB_MAX_PATHS).
+ * Returns EXIT_FAILURE if the netmask is not contiguous or the table is full.
+ */
+int addRouteEntry(routetable_t *rtbl, uchar* nwork, uchar* nmask, uchar* nhop, int interface)
+{
+	route_entry_t *r;
+	uint32_t net, mask, b;
+	int i, len, nh;
+	char *errstr = NULL;
+
+	mask = fibAddr(nmask);
+	len = __builtin_popcount(mask);
+	if (mask != fibMask(len))
+	{
+		error("[addRouteEntry]:: netmask is not contiguous ");
+		return EXIT_FAILURE;
+	}
+	net = fibAddr(nwork) & mask;
+
+	pthread_mutex_lock(&(rtbl->lock));
+	if ((i = findRoute(rtbl, net, len)) >= 0)
+	{
+		// First check if the next hop is already in the table, if not, add the path
+		r = &(rtbl->routes[i]);
+		if (findRoutePath(rtbl, r, nhop, interface) >= 0)
+			;
+		else if (r->npaths == FIB_MAX_PATHS)
+			errstr = "route has the maximum number of next hops";
+		else if ((nh = getFIBNexthop(rtbl, nhop, interface)) < 0)
+			errstr = "next hop table full";
+		else if (addRoutePath(rtbl, r, nh) == EXIT_FAILURE)
+		{
+			putFIBNexthop(rtbl, nh);
+			errstr = "no multipath group left";
+		} else
+			setRouteBroadcast(rtbl, r, nh, TRUE);
+	} else if ((i = allocRoute(rtbl)) < 0)
+		errstr = "route table full";
+	else if ((nh = getFIBNexthop(rtbl, nhop, interface)) < 0)
+	{
+		freeRoute(rtbl, i);
+		errstr = "next hop table full";
+	} else if (updateFIB(rtbl, net, len, FIB_ENTRY(nh, len), 0) == EXIT_FAILURE)
+	{
+		putFIBNexthop(rtbl, nh);
+		freeRoute(rtbl, i);
+		errstr = "no tbl8 group left for a prefix longer than /24";
+	} else
+	{
+		r = &(rtbl->routes[i]);
+		fibAddr2IP(r->network, net);
+		COPY_IP(r->netmask, nmask);
+		r->preflen = len;
+		r->npaths = 1;
+		r->nhindex = nh;
+		r->group = -1;
+		r->is_empty = FALSE;
+		b = ribHash(net, len);
+		r->next = rtbl->buckets[b];
+		rtbl->buckets[b] = i + 1;
+		rtbl->count++;
+		setRouteBroadcast(rtbl, r, nh, TRUE);
+	}
+	pthread_mutex_unlock(&(rtbl->lock));
+
+	if (errstr != NULL)
+	{
+		error("[addRouteEntry]:: %s ", errstr);
+		return EXIT_FAILURE;
+	}
+	verbose(2, "[addRouteEntry]:: route table entry #%d set", i);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * Remove route i: its entries go back to the longest route covering it.
+ * Called with the table lock held.
+ */
+static void removeRoute(routetable_t *rtbl, int i)
+{
+	route_entry_t *r = &(rtbl->routes[i]);
+	uint32_t net, value = 0;
+	int len, c, k, *link, *paths;
+
+	net = fibAddr(r->network);
+	for (len = r->preflen - 1; len >= 0; len--)
+		if ((c = findRoute(rtbl, net & fibMask(len), len)) >= 0)
+		{
+			value = routeFIBEntry(&(rtbl->routes[c]), len);
+			break;
+		}
+	updateFIB(rtbl, net, r->preflen, value, 1);
+	paths = routePaths(rtbl, r);
+	for (k = 0; k < r->npaths; k++)
+	{
+		setRouteBroadcast(rtbl, r, paths[k], FALSE);
+		putFIBNexthop(rtbl, paths[k]);
+	}
+	if (r->npaths > 1)
+		freeFIBGroup(rtbl, r->group);
+
+	for (link = &(rtbl->buckets[ribHash(net, r->preflen)]); *link != i + 1; link = &(rtbl->routes[*link - 1].next))
+		;
+	*link = r->next;
+	freeRoute(rtbl, i);
+	rtbl->count--;
+}
+
+
+/*
+ * delete the route to network nwork/nmask, or only its next hop nhop
+ * (on interface, if not < 0) when nhop is not NULL
+ */
+int deleteRouteEntry(routetable_t *rtbl, uchar* nwork, uchar* nmask, uchar *nhop, int interface)
+{
+	char tmpbuf[MAX_TMPBUF_LEN];
+	route_entry_t *r;
+	uint32_t mask;
+	int i, k = -1;
+
+	mask = fibAddr(nmask);
+	pthread_mutex_lock(&(rtbl->lock));
+	if ((i = findRoute(rtbl, fibAddr(nwork) & mask, __builtin_popcount(mask))) >= 0)
+	{
+		r = &(rtbl->routes[i]);
+		if (nhop == NULL)
+			removeRoute(rtbl, i);
+		else if ((k = findRoutePath(rtbl, r, nhop, interface)) < 0)
+			i = -1;
+		else if (r->npaths == 1)
+			removeRoute(rtbl, i);
+		else
+			removeRoutePath(rtbl, r, k);
+	}
+	pthread_mutex_unlock(&(rtbl->lock));
+
+	if (i < 0)
+	{
+		error("[deleteRouteEntry]:: no route to %s/%d%s%s ", IP2Dot(tmpbuf, nwork), __builtin_popcount(mask),
+		      (nhop != NULL) ? " via " : "", (nhop != NULL) ? IP2Dot((tmpbuf+20), nhop) : "");
+		return EXIT_FAILURE;
+	}
+	verbose(2, "[deleteRouteEntry]:: route entry #%d deleted", i);
+	return EXIT_SUCCESS;
+}
+
 
 /*
  * delete route table entry by argument index i
  */
-void deleteRouteEntryByIndex(route_entry_t route_tbl[], int i)
+void deleteRouteEntryByIndex(routetable_t *rtbl, int i)
 {
-	route_tbl[i].is_empty = TRUE;
+	pthread_mutex_lock(&(rtbl->lock));
+	if ((i < 0) || (i >= rtbl->used) || (rtbl->routes[i].is_empty == TRUE))
+	{
+		pthread_mutex_unlock(&(rtbl->lock));
+		error("[deleteRouteEntryByIndex]:: no route entry #%d ", i);
+		return;
+	}
+	removeRoute(rtbl, i);
+	pthread_mutex_unlock(&(rtbl->lock));
 	verbose(2, "[deleteRouteEntryByIndex]:: route entry #%d deleted", i);
 	return;
 }
@@ -152,16 +861,28 @@ void deleteRouteEntryByIndex(route_entry_t route_tbl[], int i)
 
 /*
  * delete route table entries related to
- * interface specified by argument indx
+ * interface specified by argument indx; multipath
+ * routes only lose their next hops on the interface
  */
-void deleteRouteEntryByInterface(route_entry_t route_tbl[], int interface)
+void deleteRouteEntryByInterface(routetable_t *rtbl, int interface)
 {
-	int i;
+	route_entry_t *r;
+	int i, k;
 
-	for (i = 0; i < MAX_ROUTES; i++)
-		if ((route_tbl[i].is_empty == FALSE) &&
-		    (route_tbl[i].interface == interface))
-			deleteRouteEntryByIndex(route_tbl, i);
+	pthread_mutex_lock(&(rtbl->lock));
+	for (i = 0; i < rtbl->used; i++)
+	{
+		r = &(rtbl->routes[i]);
+		for (k = r->npaths - 1; (r->is_empty == FALSE) && (k >= 0); k--)
+			if (rtbl->nexthops[routePaths(rtbl, r)[k]].interface == interface)
+			{
+				if (r->npaths == 1)
+					removeRoute(rtbl, i);
+				else
+					removeRoutePath(rtbl, r, k);
+			}
+	}
+	pthread_mutex_unlock(&(rtbl->lock));
 
 	verbose(2, "[deleteRouteEntryByInterface]:: table cleared of references to interface: %d", interface);
 	return;
@@ -169,45 +890,143 @@ void deleteRouteEntryByInterface(route_entry_t route_tbl[], int interface)
 
 
 /*
- * initialize the route table to be empty
+ * An interface went up or down: the multipath groups move the flows of
+ * its next hops to the other next hops, or give them their share back.
  */
-void RouteTableInit(route_entry_t route_tbl[])
+void setRouteInterfaceState(routetable_t *rtbl, int interface, bool up)
 {
-	int i;
+	fib_group_t *grp;
+	int i, k;
+
+	pthread_mutex_lock(&(rtbl->lock));
+	for (i = 0; i < rtbl->nhused; i++)
+		if ((rtbl->nexthops[i].refcnt > 0) && (rtbl->nexthops[i].interface == interface))
+			rtbl->nexthops[i].down = !up;
+	for (i = 0; i < rtbl->grpused; i++)
+	{
+		grp = &(rtbl->groups[i]);
+		for (k = 0; grp->inuse && (k < grp->nmembers); k++)
+			if (rtbl->nexthops[grp->members[k]].interface == interface)
+			{
+				balanceFIBGroup(rtbl, grp);
+				break;
+			}
+	}
+	pthread_mutex_unlock(&(rtbl->lock));
+
+	verbose(2, "[setRouteInterfaceState]:: interface %d is %s", interface, up ? "up" : "down");
+}
 
-	rtbl_replace_indx = 0;
 
-	for(i = 0; i < MAX_ROUTES; i++)
-		route_tbl[i].is_empty = TRUE;
+/*
+ * create an empty route table
+ */
+routetable_t *RouteTableInit(void)
+{
+	routetable_t *rtbl;
+
+	// calloc leaves the untouched parts of the big tables unbacked by memory
+	if (((rtbl = (routetable_t *)calloc(1, sizeof(routetable_t))) == NULL) ||
+	    ((rtbl->tbl24 = (uint32_t *)calloc(FIB_TBL24_SIZE, sizeof(uint32_t))) == NULL) ||
+	    ((rtbl->tbl8 = (uint32_t *)calloc(FIB_TBL8_GROUPS * 256, sizeof(uint32_t))) == NULL) ||
+	    ((rtbl->nexthops = (fib_nexthop_t *)calloc(FIB_MAX_NEXTHOPS, sizeof(fib_nexthop_t))) == NULL) ||
+	    ((rtbl->groups = (fib_group_t *)calloc(FIB_MAX_GROUPS, sizeof(fib_group_t))) == NULL) ||
+	    ((rtbl->buckets = (int *)calloc(FIB_RIB_BUCKETS, sizeof(int))) == NULL) ||
+	    (initFIBFreeList(&(rtbl->tbl8free), FIB_TBL8_GROUPS) == EXIT_FAILURE) ||
+	    (initFIBFreeList(&(rtbl->nhfree), FIB_MAX_NEXTHOPS) == EXIT_FAILURE) ||
+	    (initFIBFreeList(&(rtbl->grpfree), FIB_MAX_GROUPS) == EXIT_FAILURE))
+	{
+		fatal("[RouteTableInit]:: Could not allocate memory for the route table ");
+		return NULL;
+	}
+	pthread_mutex_init(&(rtbl->lock), NULL);
+	rtbl->seed = (uint32_t)random();
 	verbose(2, "[initRouteTable]:: table initialized");
 
-	return;
+	return rtbl;
 }
 
 
 /*
- * print the route table
+ * print the first max routes (all if max < 0) and the memory of the table
  */
-void printRouteTable(route_entry_t route_tbl[])
+void printRouteTable(routetable_t *rtbl, int max)
 {
-	int i, rcount = 0;
+	int i, k, rcount = 0, *paths;
 	char tmpbuf[MAX_TMPBUF_LEN];
 	interface_t *iface;
+	route_entry_t *r;
+	fib_nexthop_t *nh;
+	unsigned long tbl24kb, tbl8kb, nhkb, grpkb, ribkb;
 
+	pthread_mutex_lock(&(rtbl->lock));
 	printf("\n=================================================================\n");
 	printf("      R O U T E  T A B L E \n");
 	printf("-----------------------------------------------------------------\n");
 	printf("Index\tNetwork\t\tNetmask\t\tNexthop\t\tInterface \n");
 
-	for (i = 0; i < MAX_ROUTES; i++)
-		if (route_tbl[i].is_empty != TRUE)
+	for (i = 0; (i < rtbl->used) && ((max < 0) || (rcount < max)); i++)
+		if (rtbl->routes[i].is_empty != TRUE)
 		{
-			iface = findInterface(route_tbl[i].interface);
-			printf("[%d]\t%s\t%s\t%s\t\t%s\n", i, IP2Dot(tmpbuf, route_tbl[i].network),
-			       IP2Dot((tmpbuf+20), route_tbl[i].netmask), IP2Dot((tmpbuf+40), route_tbl[i].nexthop), iface->device_name);
+			r = &(rtbl->routes[i]);
+			paths = routePaths(rtbl, r);
+			for (k = 0; k < r->npaths; k++)
+			{
+				nh = &(rtbl->nexthops[paths[k]]);
+				iface = findInterface(nh->interface);
+				if (k == 0)
+					printf("[%d]\t%s\t%s\t", i, IP2Dot(tmpbuf, r->network), IP2Dot((tmpbuf+20), r->netmask));
+				else
+					printf("\t\t\t\t\t");
+				printf("%s\t\t%s\n", IP2Dot((tmpbuf+40), nh->nexthop), (iface != NULL) ? iface->device_name : "?");
+			}
 			rcount++;
 		}
 	printf("-----------------------------------------------------------------\n");
-	printf("      %d number of routes found. \n", rcount);
+	printf("      %d number of routes found. \n", rtbl->count);
+
+	tbl24kb = FIB_TBL24_SIZE * sizeof(uint32_t) / 1024;
+	tbl8kb = (unsigned long)rtbl->tbl8groups * 256 * sizeof(uint32_t) / 1024;
+	nhkb = (unsigned long)rtbl->nhused * sizeof(fib_nexthop_t) / 1024;
+	grpkb = (unsigned long)rtbl->grpused * sizeof(fib_group_t) / 1024;
+	ribkb = ((unsigned long)rtbl->size * sizeof(route_entry_t) + FIB_RIB_BUCKETS * sizeof(int)) / 1024;
+	printf("      FIB: tbl24 %lu KB, tbl8 %d/%d groups %lu KB, %d next hops %lu KB, %d multipath groups %lu KB;"
+	       " routes %lu KB; total %lu KB\n", tbl24kb, rtbl->tbl8groups, FIB_TBL8_GROUPS, tbl8kb, rtbl->nhcount, nhkb,
+	       rtbl->grpcount, grpkb, ribkb, tbl24kb + tbl8kb + nhkb + grpkb + ribkb);
+	pthread_mutex_unlock(&(rtbl->lock));
+	return;
+}
+
+
+/*
+ * print the next hops in use with the packets and bytes sent to them
+ */
+void printRouteNexthops(routetable_t *rtbl)
+{
+	int i;
+	char tmpbuf[MAX_TMPBUF_LEN];
+	interface_t *iface;
+	fib_nexthop_t *nh;
+	unsigned long packets, bytes;
+
+	pthread_mutex_lock(&(rtbl->lock));
+	printf("\n=================================================================\n");
+	printf("      N E X T  H O P S \n");
+	printf("-----------------------------------------------------------------\n");
+	printf("Nexthop\t\tInterface\tState\tRoutes\tPackets\t\tBytes \n");
+
+	for (i = 0; i < rtbl->nhused; i++)
+		if (rtbl->nexthops[i].refcnt > 0)
+		{
+			nh = &(rtbl->nexthops[i]);
+			iface = findInterface(nh->interface);
+			sumFIBNexthop(rtbl, i, &packets, &bytes);
+			printf("%s\t\t%s\t\t%s\t%d\t%lu\t\t%lu\n", IP2Dot(tmpbuf, nh->nexthop),
+			       (iface != NULL) ? iface->device_name : "?", nh->down ? "down" : "up", nh->refcnt,
+			       packets - nh->pktbase, bytes - nh->bytebase);
+		}
+	printf("-----------------------------------------------------------------\n");
+	printf("      %d next hops in use. \n", rtbl->nhcount);
+	pthread_mutex_unlock(&(rtbl->lock));
 	return;
 }
@@ -13,9 +13,41 @@
 #include <slack/list.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "simplequeue.h"
 
+/*
+ * The queue is a bounded ring of power-of-two size (Vyukov style). Every
+ * slot carries a sequence number: a producer may fill slot (pos & rmask)
+ * when seq == pos, and a consumer may empty it when seq == pos + 1. So
+ * writers and readers only contend on the head/tail counters and no
+ * wrapper is allocated per element. A reader blocks on a futex only after
+ * it has announced itself in notempty.waiters, which lets writers skip the
+ * wakeup system call in the common case.
+ */
+
+static void sqEventWait(sqevent_t *ev, simplequeue_t *msgqueue, int wantdata);
+static void sqEventSignal(sqevent_t *ev);
+static int ringPush(simplequeue_t *msgqueue, void *data, int size);
+static int ringPop(simplequeue_t *msgqueue, void **data, int *size);
+static int ringPushBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int count);
+static int ringPopBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int max);
+
+
+static unsigned int roundUpPow2(unsigned int n)
+{
+	unsigned int p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+
 // For unbounded queues, set maxsize to 0.
 // For bounded queues, blockonwrite could be true or false. If true,
 // a write waits if the queue is full. Otherwise, the write returns failed.
@@ -25,12 +57,14 @@ simplequeue_t *createSimpleQueue(char *name, int maxsize, int blockonwrite,
 				 int blockonread)
 {
 	simplequeue_t *msgqueue;
+	unsigned int nslots, i;
 
 	if ((msgqueue = (simplequeue_t *) malloc(sizeof(simplequeue_t))) == NULL)
 	{
 		fatal("[createSimpleQueue]:: Could not allocate memory for message queue structure");
 		return NULL;
 	}
+	bzero(msgqueue, sizeof(simplequeue_t));
 	strcpy(msgqueue->name, name);
 	msgqueue->maxsize = maxsize;
 	msgqueue->cursize = 0;
@@ -41,16 +75,34 @@ simplequeue_t *createSimpleQueue(char *name, int maxsize, int blockonwrite,
 	msgqueue->blockonread = blockonread;
 
 	pthread_mutex_init(&(msgqueue->qlock), NULL);
-	pthread_cond_init(&(msgqueue->qfull), NULL);
-	pthread_cond_init(&(msgqueue->qempty), NULL);
 
-	if (!(msgqueue->queue = list_create(NULL)))
+	// unbounded queues get a default sized ring and an overflow list
+	if ((maxsize <= 0) || (maxsize > SQ_RING_MAX_SLOTS))
 	{
-		fatal("[createSimpleQueue]:: Could not create the message list..");
+		nslots = SQ_RING_UNBOUNDED_SLOTS;
+		msgqueue->blockonwrite = 0;
+		if (!(msgqueue->queue = list_create(NULL)))
+		{
+			fatal("[createSimpleQueue]:: Could not create the overflow list..");
+			return NULL;
+		}
+	} else
+		nslots = roundUpPow2(maxsize);
+
+	if ((msgqueue->ring = (sqslot_t *)malloc(nslots * sizeof(sqslot_t))) == NULL)
+	{
+		fatal("[createSimpleQueue]:: Could not allocate the ring for message queue");
 		return NULL;
 	}
+	for (i = 0; i < nslots; i++)
+	{
+		msgqueue->ring[i].seq = i;
+		msgqueue->ring[i].data = NULL;
+		msgqueue->ring[i].size = 0;
+	}
+	msgqueue->rmask = nslots - 1;
 
-	verbose(6, "[createSimpleQueue]:: Queue created -- name %s", name);
+	verbose(6, "[createSimpleQueue]:: Queue created -- name %s ring slots %d", name, nslots);
 	return msgqueue;
 }
 
@@ -64,6 +116,7 @@ int destroySimpleQueue(simplequeue_t *msgqueue)
   {
 	  if (msgqueue->queue != NULL)
 		  list_release(msgqueue->queue);
+	  free(msgqueue->ring);
 	  free(msgqueue);
   }
   verbose(4, "[destroySimpleQueue]:: released all the simple queue data structures.. ");
@@ -79,10 +132,17 @@ void printSimpleQueue(simplequeue_t *msgqueue)
 	printf("Queuing discipline: %s\n", msgqueue->qdisc);
 	printf("Queue weight: %f\n", msgqueue->weight);
 	printf("Queuing delay: %f\n", msgqueue->delay_us);
-	if (msgqueue->maxsize == 0)
+	if (msgqueue->shaper.rate > 0.0)
+		printf("Shaping rate: %.0f bytes/s burst %.0f bytes (%lu sent, %lu deferred)\n",
+		       msgqueue->shaper.rate, msgqueue->shaper.depth, msgqueue->shaper.conform, msgqueue->shaper.exceed);
+	if (msgqueue->policer.rate > 0.0)
+		printf("Ceiling rate: %.0f bytes/s burst %.0f bytes (%lu passed, %lu dropped)\n",
+		       msgqueue->policer.rate, msgqueue->policer.depth, msgqueue->policer.conform, msgqueue->policer.exceed);
+	if (msgqueue->queue != NULL)
 		printf("Queue size (maximum): Unlimited \n");
 	else
 		printf("Queue size (maximum): %d \n", msgqueue->maxsize);
+	printf("Ring slots: %u \n", msgqueue->rmask + 1);
 
 //	printf("Block on write: %s\n", msgqueue->blockonwrite ? "enabled" : "not enabled");
 //	printf("Block on read: %s\n", msgqueue->blockonread ? "enabled" : "not enabled");
@@ -112,91 +172,393 @@ int copy2Queue(simplequeue_t *msgqueue, void *data, int size)
 }
 
 
-int writeQueue(simplequeue_t *msgqueue, void *data, int size)
+/*
+ * Futex based event count. The waiter samples seq, registers itself and
+ * rechecks the queue before sleeping; the signaller bumps seq before the
+ * wake. Either the waiter sees the new element or the futex call returns
+ * right away because seq changed, so no wakeup is lost.
+ */
+static void sqEventWait(sqevent_t *ev, simplequeue_t *msgqueue, int wantdata)
 {
-	simplewrapper_t *swrap;
+	int key;
+
+	key = __atomic_load_n(&(ev->seq), __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&(ev->waiters), 1, __ATOMIC_SEQ_CST);
 
-	if ((swrap = (simplewrapper_t *)malloc(sizeof(simplewrapper_t))) == NULL)
+	if (wantdata)
 	{
-		fatal("[writeQueue]:: unable to allocate memory for packet wrapper ");
-		return EXIT_FAILURE;
+		if (__atomic_load_n(&(msgqueue->cursize), __ATOMIC_SEQ_CST) <= 0)
+			syscall(SYS_futex, &(ev->seq), FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+	} else
+	{
+		if (__atomic_load_n(&(msgqueue->cursize), __ATOMIC_SEQ_CST) >= msgqueue->maxsize)
+			syscall(SYS_futex, &(ev->seq), FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
 	}
-	swrap->size = size;
-	swrap->data = data;
+	__atomic_sub_fetch(&(ev->waiters), 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void sqEventSignal(sqevent_t *ev)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ev->waiters), __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_add_fetch(&(ev->seq), 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &(ev->seq), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
 
-	pthread_mutex_lock(&(msgqueue->qlock));           // lock the queue..
 
-	if (msgqueue->cursize >= msgqueue->maxsize)
+static int ringPush(simplequeue_t *msgqueue, void *data, int size)
+{
+	sqslot_t *slot;
+	unsigned int pos, seq;
+	int dif;
+
+	pos = __atomic_load_n(&(msgqueue->tail), __ATOMIC_RELAXED);
+	while (1)
 	{
-		// finite queue size and it is already full..
-		if (msgqueue->blockonwrite)
-			// wait if blockonwrite .. otherwise just quit
-			pthread_cond_wait(&(msgqueue->qfull), &(msgqueue->qlock));
+		slot = &(msgqueue->ring[pos & msgqueue->rmask]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (int)(seq - pos);
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&(msgqueue->tail), &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return EXIT_FAILURE;             // ring is full
+		else
+			pos = __atomic_load_n(&(msgqueue->tail), __ATOMIC_RELAXED);
+	}
+	slot->data = data;
+	slot->size = size;
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+}
+
+
+static int ringPop(simplequeue_t *msgqueue, void **data, int *size)
+{
+	sqslot_t *slot;
+	unsigned int pos, seq;
+	int dif;
+
+	pos = __atomic_load_n(&(msgqueue->head), __ATOMIC_RELAXED);
+	while (1)
+	{
+		slot = &(msgqueue->ring[pos & msgqueue->rmask]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		dif = (int)(seq - (pos + 1));
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&(msgqueue->head), &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return EXIT_FAILURE;             // ring is empty
 		else
+			pos = __atomic_load_n(&(msgqueue->head), __ATOMIC_RELAXED);
+	}
+	*data = slot->data;
+	*size = slot->size;
+	slot->data = NULL;
+	__atomic_store_n(&(slot->seq), pos + msgqueue->rmask + 1, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+}
+
+
+// Reserve up to count consecutive free slots with a single CAS on the tail
+// and fill them. Returns the number of slots filled.
+static int ringPushBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int count)
+{
+	sqslot_t *slot;
+	unsigned int pos;
+	int i, n;
+
+	pos = __atomic_load_n(&(msgqueue->tail), __ATOMIC_RELAXED);
+	while (1)
+	{
+		for (n = 0; n < count; n++)
+		{
+			slot = &(msgqueue->ring[(pos + n) & msgqueue->rmask]);
+			if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != (pos + n))
+				break;
+		}
+		if (n == 0)
+		{
+			slot = &(msgqueue->ring[pos & msgqueue->rmask]);
+			if ((int)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - pos) < 0)
+				return 0;                // ring is full
+			pos = __atomic_load_n(&(msgqueue->tail), __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&(msgqueue->tail), &pos, pos + n, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		slot = &(msgqueue->ring[(pos + i) & msgqueue->rmask]);
+		slot->data = pkts[i];
+		slot->size = sizes[i];
+		__atomic_store_n(&(slot->seq), pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+
+// Claim up to max filled slots with a single CAS on the head.
+static int ringPopBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int max)
+{
+	sqslot_t *slot;
+	unsigned int pos;
+	int i, n;
+
+	pos = __atomic_load_n(&(msgqueue->head), __ATOMIC_RELAXED);
+	while (1)
+	{
+		for (n = 0; n < max; n++)
+		{
+			slot = &(msgqueue->ring[(pos + n) & msgqueue->rmask]);
+			if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != (pos + n + 1))
+				break;
+		}
+		if (n == 0)
+		{
+			slot = &(msgqueue->ring[pos & msgqueue->rmask]);
+			if ((int)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - (pos + 1)) < 0)
+				return 0;                // ring is empty
+			pos = __atomic_load_n(&(msgqueue->head), __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&(msgqueue->head), &pos, pos + n, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		slot = &(msgqueue->ring[(pos + i) & msgqueue->rmask]);
+		pkts[i] = slot->data;
+		sizes[i] = slot->size;
+		slot->data = NULL;
+		__atomic_store_n(&(slot->seq), pos + i + msgqueue->rmask + 1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+
+int writeQueue(simplequeue_t *msgqueue, void *data, int size)
+{
+	simplewrapper_t *swrap;
+
+	while (1)
+	{
+		// once we spill, keep spilling until the reader drains the list
+		// so that the packet order is preserved
+		if ((msgqueue->queue == NULL) || (__atomic_load_n(&(msgqueue->spilled), __ATOMIC_ACQUIRE) == 0))
+		{
+			if (((msgqueue->queue != NULL) || (msgqueue->cursize < msgqueue->maxsize)) &&
+			    (ringPush(msgqueue, data, size) == EXIT_SUCCESS))
+				break;
+		}
+
+		if (msgqueue->queue != NULL)
 		{
+			if ((swrap = (simplewrapper_t *)malloc(sizeof(simplewrapper_t))) == NULL)
+			{
+				fatal("[writeQueue]:: unable to allocate memory for packet wrapper ");
+				return EXIT_FAILURE;
+			}
+			swrap->size = size;
+			swrap->data = data;
+			pthread_mutex_lock(&(msgqueue->qlock));
+			list_push(msgqueue->queue, swrap);
+			__atomic_add_fetch(&(msgqueue->spilled), 1, __ATOMIC_RELEASE);
 			pthread_mutex_unlock(&(msgqueue->qlock));
-			free(swrap);
-			return EXIT_FAILURE;
+			break;
 		}
+
+		// finite queue size and it is already full..
+		// wait if blockonwrite .. otherwise just quit
+		if (!msgqueue->blockonwrite)
+			return EXIT_FAILURE;
+		sqEventWait(&(msgqueue->notfull), msgqueue, 0);
 	}
-	list_push(msgqueue->queue, swrap);
-	msgqueue->cursize++;
-	msgqueue->bytesleft += size;
 
-	if ((msgqueue->cursize == 1) && (msgqueue->blockonread))
-		pthread_cond_signal(&(msgqueue->qempty));
+	__atomic_add_fetch(&(msgqueue->bytesleft), size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(msgqueue->cursize), 1, __ATOMIC_SEQ_CST);
+
+	if (msgqueue->blockonread)
+		sqEventSignal(&(msgqueue->notempty));
+	return EXIT_SUCCESS;
+}
+
+
+static int dequeueOne(simplequeue_t *msgqueue, void **data, int *size)
+{
+	simplewrapper_t *swrap;
+
+	if (ringPop(msgqueue, data, size) == EXIT_SUCCESS)
+		return EXIT_SUCCESS;
 
+	if ((msgqueue->queue == NULL) || (__atomic_load_n(&(msgqueue->spilled), __ATOMIC_ACQUIRE) == 0))
+		return EXIT_FAILURE;
+
+	pthread_mutex_lock(&(msgqueue->qlock));
+	swrap = list_shift(msgqueue->queue);
+	if (swrap != NULL)
+		__atomic_sub_fetch(&(msgqueue->spilled), 1, __ATOMIC_RELEASE);
 	pthread_mutex_unlock(&(msgqueue->qlock));
+
+	if (swrap == NULL)
+		return EXIT_FAILURE;
+	*data = swrap->data;
+	*size = swrap->size;
+	free(swrap);
 	return EXIT_SUCCESS;
 }
 
 
-// TODO: We need to shorten this function.. it is bit long!
-// Just reorganize the loops .. lots of redundant statements.
 int readQueue(simplequeue_t *msgqueue, void **data, int *size)
+{
+	while (dequeueOne(msgqueue, data, size) == EXIT_FAILURE)
+	{
+		if (!msgqueue->blockonread)
+		{
+			*data = NULL;
+			*size = 0;
+			return EXIT_FAILURE;
+		}
+		sqEventWait(&(msgqueue->notempty), msgqueue, 1);
+	}
+
+	__atomic_sub_fetch(&(msgqueue->cursize), 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&(msgqueue->bytesleft), *size, __ATOMIC_RELAXED);
+	if (msgqueue->blockonwrite)
+		sqEventSignal(&(msgqueue->notfull));
+
+	computeAvgByteRate(msgqueue, *size);
+	return EXIT_SUCCESS;
+}
+
+
+// Write up to count packets with one reservation and at most one wakeup.
+// Returns the number of packets that made it into the queue; the caller
+// owns the rest (only possible for bounded, non-blocking queues).
+int writeQueueBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int count)
 {
 	simplewrapper_t *swrap;
-	int rvalue;
+	int i, n, done = 0, bytes = 0, room;
 
-	pthread_mutex_lock(&(msgqueue->qlock));
-	if (msgqueue->cursize <= 0)
+	while (done < count)
 	{
-		if (msgqueue->blockonread)
+		n = 0;
+		if ((msgqueue->queue == NULL) || (__atomic_load_n(&(msgqueue->spilled), __ATOMIC_ACQUIRE) == 0))
 		{
-			pthread_cond_wait(&(msgqueue->qempty), &(msgqueue->qlock));
-			swrap = list_shift(msgqueue->queue);
-			*size = swrap->size;
-			*data = swrap->data;
-			swrap->data = NULL;
-			msgqueue->cursize--;
-			msgqueue->bytesleft -= *size;
-			rvalue = EXIT_SUCCESS;
+			room = count - done;
+			if ((msgqueue->queue == NULL) && (room > (msgqueue->maxsize - msgqueue->cursize)))
+				room = msgqueue->maxsize - msgqueue->cursize;
+			if (room > 0)
+				n = ringPushBurst(msgqueue, pkts + done, sizes + done, room);
+		}
+
+		if (n == 0)
+		{
+			if (msgqueue->queue != NULL)
+			{
+				// unbounded queue: put the remainder in the overflow list
+				pthread_mutex_lock(&(msgqueue->qlock));
+				for (i = done; i < count; i++)
+				{
+					if ((swrap = (simplewrapper_t *)malloc(sizeof(simplewrapper_t))) == NULL)
+					{
+						fatal("[writeQueueBurst]:: unable to allocate memory for packet wrapper ");
+						break;
+					}
+					swrap->size = sizes[i];
+					swrap->data = pkts[i];
+					list_push(msgqueue->queue, swrap);
+					__atomic_add_fetch(&(msgqueue->spilled), 1, __ATOMIC_RELEASE);
+					bytes += sizes[i];
+					n++;
+				}
+				pthread_mutex_unlock(&(msgqueue->qlock));
+				if (n == 0)
+					break;
+			} else if (msgqueue->blockonwrite)
+			{
+				sqEventWait(&(msgqueue->notfull), msgqueue, 0);
+				continue;
+			} else
+				break;
 		} else
 		{
-			*data = NULL;
-			*size = 0;
-			rvalue = EXIT_FAILURE;
+			for (i = done; i < done + n; i++)
+				bytes += sizes[i];
 		}
+		done += n;
+	}
+
+	if (done == 0)
+		return 0;
+
+	__atomic_add_fetch(&(msgqueue->bytesleft), bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(msgqueue->cursize), done, __ATOMIC_SEQ_CST);
 
-	} else if (msgqueue->cursize <= msgqueue->maxsize)
+	if (msgqueue->blockonread)
+		sqEventSignal(&(msgqueue->notempty));
+	return done;
+}
+
+
+// Read up to max packets. Blocks (for blockonread queues) until at least
+// one packet is available and returns the number of packets read.
+int readQueueBurst(simplequeue_t *msgqueue, void **pkts, int *sizes, int max)
+{
+	simplewrapper_t *swrap;
+	int i, n, bytes = 0;
+
+	while (1)
 	{
-		msgqueue->cursize--;
-		swrap = list_shift(msgqueue->queue);
-		*size = swrap->size;
-		*data = swrap->data;
-		swrap->data = NULL;
-		msgqueue->bytesleft -= *size;
-		if ((msgqueue->blockonwrite) && (msgqueue->cursize >= (msgqueue->maxsize-1)))
-			pthread_cond_signal(&(msgqueue->qfull));
-		rvalue = EXIT_SUCCESS;
+		n = ringPopBurst(msgqueue, pkts, sizes, max);
+		if ((n < max) && (msgqueue->queue != NULL) &&
+		    (__atomic_load_n(&(msgqueue->spilled), __ATOMIC_ACQUIRE) > 0))
+		{
+			pthread_mutex_lock(&(msgqueue->qlock));
+			while ((n < max) && ((swrap = list_shift(msgqueue->queue)) != NULL))
+			{
+				__atomic_sub_fetch(&(msgqueue->spilled), 1, __ATOMIC_RELEASE);
+				pkts[n] = swrap->data;
+				sizes[n] = swrap->size;
+				free(swrap);
+				n++;
+			}
+			pthread_mutex_unlock(&(msgqueue->qlock));
+		}
+		if (n > 0)
+			break;
+		if (!msgqueue->blockonread)
+			return 0;
+		sqEventWait(&(msgqueue->notempty), msgqueue, 1);
 	}
-	pthread_mutex_unlock(&(msgqueue->qlock));
-	if (rvalue == EXIT_SUCCESS)
-		free(swrap);
 
-	if (rvalue == EXIT_SUCCESS)
-		computeAvgByteRate(msgqueue, *size);
-	return rvalue;
+	for (i = 0; i < n; i++)
+		bytes += sizes[i];
+	__atomic_sub_fetch(&(msgqueue->cursize), n, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&(msgqueue->bytesleft), bytes, __ATOMIC_RELAXED);
+	if (msgqueue->blockonwrite)
+		sqEventSignal(&(msgqueue->notfull));
+
+	computeAvgByteRate(msgqueue, bytes);
+	return n;
+}
+
+
+int isQueueEmpty(simplequeue_t *msgqueue)
+{
+	return (__atomic_load_n(&(msgqueue->cursize), __ATOMIC_ACQUIRE) <= 0);
 }
 
 
@@ -234,26 +596,36 @@ double getAvgByteRate(simplequeue_t *sq)
 
 
 // get the next element without actually removing it from the queeue.
+// Only the consumer of the queue should peek at it.
 int peekQueue(simplequeue_t *msgqueue, void **data, int *size)
 {
 	simplewrapper_t *swrap;
+	sqslot_t *slot;
+	unsigned int pos;
 
-	pthread_mutex_lock(&(msgqueue->qlock));
-
-	if (msgqueue->cursize <= 0)
+	pos = __atomic_load_n(&(msgqueue->head), __ATOMIC_RELAXED);
+	slot = &(msgqueue->ring[pos & msgqueue->rmask]);
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) == (pos + 1))
 	{
-		*size = 0;
-		*data = NULL;
-		pthread_mutex_unlock(&(msgqueue->qlock));
-		return EXIT_FAILURE;
-	} else
+		*size = slot->size;
+		*data = &(slot->data);
+		return EXIT_SUCCESS;
+	}
+
+	if ((msgqueue->queue != NULL) && (__atomic_load_n(&(msgqueue->spilled), __ATOMIC_ACQUIRE) > 0))
 	{
-		swrap = list_shift(msgqueue->queue);
-		*size = swrap->size;
-		*data = &(swrap->data);
-		list_unshift(msgqueue->queue, swrap);
+		pthread_mutex_lock(&(msgqueue->qlock));
+		swrap = list_item(msgqueue->queue, 0);
 		pthread_mutex_unlock(&(msgqueue->qlock));
-		return EXIT_SUCCESS;
+		if (swrap != NULL)
+		{
+			*size = swrap->size;
+			*data = &(swrap->data);
+			return EXIT_SUCCESS;
+		}
 	}
-}
 
+	*size = 0;
+	*data = NULL;
+	return EXIT_FAILURE;
+}
@@ -12,11 +12,13 @@
 #include "filter.h"
 #include "protocols.h"
 #include "message.h"
+#include "pktpool.h"
 #include "gnet.h"
 #include "arp.h"
 #include "ip.h"
 #include "ethernet.h"
 #include "tapio.h"
+#include "trace.h"
 #include <netinet/in.h>
 #include <stdlib.h>
 
@@ -30,7 +32,6 @@
 
 extern pktcore_t *pcore;
 extern classlist_t *classifier;
-extern filtertab_t *filter;
 
 
 extern router_config rconfig;
@@ -44,22 +45,22 @@ void *toTapDev(void *arg)
 	char tmpbuf[MAX_TMPBUF_LEN];
 	int pkt_size;
 
-	verbose(2, "[toTapDev]:: entering the function.. ");
+	TRACE(2, "[toTapDev]:: entering the function.. ");
 	// find the outgoing interface and device...
 	if ((iface = findInterface(inpkt->frame.dst_interface)) != NULL)
 	{
 		/* send IP packet or ARP reply */
-		if (inpkt->data.header.prot == htons(ARP_PROTOCOL))
+		if ((inpkt->data->header.prot == htons(ARP_PROTOCOL)) && (makePacketWritable(inpkt) != NULL))
 		{
-			apkt = (arp_packet_t *) inpkt->data.data;
+			apkt = (arp_packet_t *) inpkt->data->data;
 			COPY_MAC(apkt->src_hw_addr, iface->mac_addr);
 			COPY_IP(apkt->src_ip_addr, gHtonl(tmpbuf, iface->ip_addr));
 		}
-		pkt_size = findPacketSize(&(inpkt->data));
+		pkt_size = packetLength(inpkt);
 
-		verbose(2, "[toTapDev]:: tap_sendto called for interface %d.. ", iface->interface_id);
-		tap_sendto(iface->vpl_data, &(inpkt->data), pkt_size);
-		free(inpkt);          // finally destroy the memory allocated to the packet..
+		TRACE(2, "[toTapDev]:: tap_sendto called for interface %d.. ", iface->interface_id);
+		tap_sendto(iface->vpl_data, inpkt->data, pkt_size);
+		freePacket(inpkt);          // finally destroy the memory allocated to the packet..
 	} else
 		error("[toTapDev]:: ERROR!! Could not find outgoing interface ...");
 
@@ -77,31 +78,34 @@ void* fromTapDev(void *arg)
 	interface_array_t *iarr = (interface_array_t *)iface->iarray;
 	uchar bcast_mac[] = MAC_BCAST_ADDR;
 	gpacket_t *in_pkt;
+	pkt_data_t scratch;
 	int pktsize;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);		// die as soon as cancelled
 	while (1)
 	{
-		verbose(2, "[fromTapDev]:: Receiving a packet ...");
-		if ((in_pkt = (gpacket_t *)malloc(sizeof(gpacket_t))) == NULL)
+		TRACE(2, "[fromTapDev]:: Receiving a packet ...");
+		if ((in_pkt = allocPacket(iface->device_mtu)) == NULL)
 		{
-			fatal("[fromTapDev]:: unable to allocate memory for packet.. ");
-			return NULL;
+			// out of packet buffers: take the frame off the device and drop it
+			tap_recvfrom(iface->vpl_data, &scratch, sizeof(pkt_data_t));
+			TRACE(1, "[fromTapDev]:: Packet dropped .. no packet buffers ");
+			continue;
 		}
 
-		bzero(in_pkt, sizeof(gpacket_t));
-		pktsize = tap_recvfrom(iface->vpl_data, &(in_pkt->data), sizeof(pkt_data_t));
+		pktsize = tap_recvfrom(iface->vpl_data, in_pkt->data, packetCapacity(in_pkt));
+in_pkt->len = max(pktsize, 0);
 		pthread_testcancel();
 
 		// check whether the incoming packet is a layer 2 broadcast or
 		// meant for this node... otherwise should be thrown..
 		// TODO: fix for promiscuous mode packet snooping.
 
-		if ((COMPARE_MAC(in_pkt->data.header.dst, iface->mac_addr) != 0) &&
-			(COMPARE_MAC(in_pkt->data.header.dst, bcast_mac) != 0))
+		if ((COMPARE_MAC(in_pkt->data->header.dst, iface->mac_addr) != 0) &&
+			(COMPARE_MAC(in_pkt->data->header.dst, bcast_mac) != 0))
 		{
-			verbose(1, "[fromTapDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
-			free(in_pkt);
+			TRACE(1, "[fromTapDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
+			freePacket(in_pkt);
 			continue;
 		}
 
@@ -110,15 +114,7 @@ void* fromTapDev(void *arg)
 		COPY_MAC(in_pkt->frame.src_hw_addr, iface->mac_addr);
 		COPY_IP(in_pkt->frame.src_ip_addr, iface->ip_addr);
 
-		// check for filtering.. if the it should be filtered.. then drop
-		if (filteredPacket(filter, in_pkt))
-		{
-			verbose(2, "[fromTapDev]:: Packet filtered..!");
-			free(in_pkt);
-			continue;   // skip the rest of the loop
-		}
-
-		verbose(2, "[fromTapDev]:: Packet is sent for enqueuing..");
+		TRACE(2, "[fromTapDev]:: Packet is sent for enqueuing..");
 		enqueuePacket(pcore, in_pkt, sizeof(gpacket_t), rconfig.openflow);
 	}
 }
@@ -96,7 +96,8 @@ int tap_recvfrom(vpl_data_t *vpl, void *buf, int len)
 	int n;
 	uchar localbuf[MAX_MESSAGE_SIZE];
 
-	while (((n = read(vpl->data, localbuf, len)) < 0) && (errno == EINTR))
+	// the 4 prepended bytes do not count against len
+	while (((n = read(vpl->data, localbuf, min(len + 4, MAX_MESSAGE_SIZE))) < 0) && (errno == EINTR))
 		;
 
 	if (n < 0) {
@@ -122,7 +123,9 @@ int tap_sendto(vpl_data_t *vpl, void *buf, int len)
 	int n;
 	uchar localbuf[MAX_MESSAGE_SIZE];
 
-	bzero(localbuf, MAX_MESSAGE_SIZE);
+	if (len > MAX_MESSAGE_SIZE - 4)
+		len = MAX_MESSAGE_SIZE - 4;
+	bzero(localbuf, 4);
 	bcopy(buf, (localbuf+4), len);
 
 	while(((n = write(vpl->data, localbuf, len+4)) < 0) && (errno == EINTR)) ;
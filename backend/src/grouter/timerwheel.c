@@ -0,0 +1,276 @@
+/*
+ * timerwheel.c (A hashed hierarchical timer wheel)
+ *
+ * Entries are hashed into TW_LEVELS wheels of TW_LEVEL_SLOTS slots. Level 0
+ * holds the entries that fire within the next TW_LEVEL_SLOTS ticks; each
+ * higher level covers TW_LEVEL_SLOTS times the span of the level below and
+ * its slots are cascaded down when the lower level wraps around. Adding an
+ * entry and expiring it are O(1); an entry is cascaded at most TW_LEVELS-1
+ * times. The wheel thread sleeps until the next occupied level 0 slot (or
+ * the next cascade) and hands all the entries of a slot to the expiry
+ * function in one call.
+ */
+
+#include <slack/std.h>
+#include <slack/err.h>
+#include <errno.h>
+#include <string.h>
+#include "timerwheel.h"
+
+
+static uint64_t elapsedUsecs(timerwheel_t *twheel)
+{
+	struct timespec now;
+	uint64_t usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - twheel->start.tv_sec) * 1000000ULL;
+	usecs += (now.tv_nsec - twheel->start.tv_nsec) / 1000;
+	return usecs;
+}
+
+
+static uint64_t elapsedTicks(timerwheel_t *twheel)
+{
+	return elapsedUsecs(twheel) / TW_TICK_US;
+}
+
+
+static twentry_t *allocEntry(timerwheel_t *twheel)
+{
+	twentry_t *chunk, *entry;
+	int i;
+
+	if (twheel->freelist == NULL)
+	{
+		if ((chunk = (twentry_t *)malloc(TW_POOL_CHUNK * sizeof(twentry_t))) == NULL)
+			return NULL;
+		for (i = 0; i < TW_POOL_CHUNK - 1; i++)
+			chunk[i].next = &(chunk[i+1]);
+		chunk[TW_POOL_CHUNK - 1].next = NULL;
+		twheel->freelist = chunk;
+	}
+	entry = twheel->freelist;
+	twheel->freelist = entry->next;
+	entry->next = NULL;
+	return entry;
+}
+
+
+// hash the entry into the level that covers its distance from curtick
+static void placeEntry(timerwheel_t *twheel, twentry_t *entry)
+{
+	uint64_t delta;
+	twslot_t *slot;
+	int level, indx;
+
+	if (entry->expires <= twheel->curtick)
+		entry->expires = twheel->curtick + 1;
+	delta = entry->expires - twheel->curtick;
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1ULL << (TW_LEVEL_BITS * (level + 1))))
+			break;
+	indx = (entry->expires >> (TW_LEVEL_BITS * level)) & TW_LEVEL_MASK;
+
+	slot = &(twheel->slots[level][indx]);
+	entry->next = NULL;
+	if (slot->tail == NULL)
+		slot->head = entry;
+	else
+		slot->tail->next = entry;
+	slot->tail = entry;
+	twheel->occupied[level] |= (1ULL << indx);
+}
+
+
+static twentry_t *takeSlot(timerwheel_t *twheel, int level, int indx)
+{
+	twentry_t *list;
+
+	list = twheel->slots[level][indx].head;
+	twheel->slots[level][indx].head = twheel->slots[level][indx].tail = NULL;
+	twheel->occupied[level] &= ~(1ULL << indx);
+	return list;
+}
+
+
+// move the entries of the current slot of each higher level down a level
+static void cascade(timerwheel_t *twheel)
+{
+	twentry_t *list, *nxt;
+	int level, indx;
+
+	for (level = 1; level < TW_LEVELS; level++)
+	{
+		indx = (twheel->curtick >> (TW_LEVEL_BITS * level)) & TW_LEVEL_MASK;
+		for (list = takeSlot(twheel, level, indx); list != NULL; list = nxt)
+		{
+			nxt = list->next;
+			placeEntry(twheel, list);
+			twheel->cascaded++;
+		}
+		if (indx != 0)
+			break;
+	}
+}
+
+
+// next tick at which the wheel has something to do (expiry or cascade)
+static uint64_t nextEventTick(timerwheel_t *twheel)
+{
+	uint64_t pending, wrap;
+	int cur;
+
+	wrap = (twheel->curtick | TW_LEVEL_MASK) + 1;
+	cur = twheel->curtick & TW_LEVEL_MASK;
+	if (cur == TW_LEVEL_MASK)
+		return wrap;
+	pending = twheel->occupied[0] & ~((2ULL << cur) - 1);
+	if (pending != 0)
+		return (twheel->curtick & ~(uint64_t)TW_LEVEL_MASK) + __builtin_ctzll(pending);
+	return wrap;
+}
+
+
+timerwheel_t *createTimerWheel(char *name, twexpire_t expirefn, void *expirearg)
+{
+	timerwheel_t *twheel;
+	pthread_condattr_t cattr;
+
+	if ((twheel = (timerwheel_t *)malloc(sizeof(timerwheel_t))) == NULL)
+	{
+		fatal("[createTimerWheel]:: Could not allocate memory for timer wheel");
+		return NULL;
+	}
+	bzero(twheel, sizeof(timerwheel_t));
+	strcpy(twheel->name, name);
+	twheel->expirefn = expirefn;
+	twheel->expirearg = expirearg;
+	clock_gettime(CLOCK_MONOTONIC, &(twheel->start));
+
+	pthread_mutex_init(&(twheel->twlock), NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(twheel->twcond), &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&(twheel->threadid), NULL, timerWheelHandler, (void *)twheel) != 0)
+	{
+		error("[createTimerWheel]:: unable to create the timer wheel thread.. ");
+		free(twheel);
+		return NULL;
+	}
+
+	verbose(6, "[createTimerWheel]:: Timer wheel created -- name %s", name);
+	return twheel;
+}
+
+
+int addTimerWheelEntry(timerwheel_t *twheel, uint64_t delay_us, void *data, int size, void *owner)
+{
+	twentry_t *entry;
+	uint64_t now;
+
+	if (delay_us > TW_MAX_TICKS * TW_TICK_US)
+		delay_us = TW_MAX_TICKS * TW_TICK_US;
+
+	pthread_mutex_lock(&(twheel->twlock));
+	if ((entry = allocEntry(twheel)) == NULL)
+	{
+		pthread_mutex_unlock(&(twheel->twlock));
+		error("[addTimerWheelEntry]:: unable to allocate timer entry ");
+		return EXIT_FAILURE;
+	}
+	// an idle wheel catches up with the clock before we hash the entry
+	now = elapsedUsecs(twheel);
+	if (twheel->count == 0)
+		twheel->curtick = now / TW_TICK_US;
+	// round up so that an entry never fires early
+	entry->expires = (now + delay_us + TW_TICK_US - 1) / TW_TICK_US;
+	entry->data = data;
+	entry->size = size;
+	entry->owner = owner;
+	placeEntry(twheel, entry);
+	twheel->count++;
+	twheel->added++;
+	if (twheel->count > twheel->maxcount)
+		twheel->maxcount = twheel->count;
+
+	// wake the thread if it sleeps past this entry (or is idle)
+	if ((twheel->count == 1) || (entry->expires < twheel->wakeat))
+		pthread_cond_signal(&(twheel->twcond));
+	pthread_mutex_unlock(&(twheel->twlock));
+	return EXIT_SUCCESS;
+}
+
+
+void *timerWheelHandler(void *arg)
+{
+	timerwheel_t *twheel = (timerwheel_t *)arg;
+	twentry_t *list, *last;
+	struct timespec wakeup;
+	uint64_t now, usecs;
+	int n;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	pthread_mutex_lock(&(twheel->twlock));
+	while (1)
+	{
+		while (twheel->count == 0)
+		{
+			twheel->wakeat = UINT64_MAX;
+			pthread_cond_wait(&(twheel->twcond), &(twheel->twlock));
+		}
+
+		now = elapsedTicks(twheel);
+		while ((twheel->count > 0) && (twheel->curtick < now))
+		{
+			// skip idle ticks up to the next expiry or cascade
+			twheel->curtick = min(nextEventTick(twheel), now);
+			if ((twheel->curtick & TW_LEVEL_MASK) == 0)
+				cascade(twheel);
+
+			list = takeSlot(twheel, 0, twheel->curtick & TW_LEVEL_MASK);
+			if (list == NULL)
+				continue;
+
+			for (n = 1, last = list; last->next != NULL; last = last->next)
+				n++;
+			twheel->count -= n;
+			twheel->expired += n;
+
+			// release the batch without holding the wheel lock
+			pthread_mutex_unlock(&(twheel->twlock));
+			twheel->expirefn(twheel->expirearg, list);
+			pthread_mutex_lock(&(twheel->twlock));
+
+			last->next = twheel->freelist;
+			twheel->freelist = list;
+		}
+
+		if (twheel->count == 0)
+			continue;
+
+		twheel->wakeat = nextEventTick(twheel);
+		usecs = twheel->wakeat * TW_TICK_US;
+		wakeup.tv_sec = twheel->start.tv_sec + usecs / 1000000;
+		wakeup.tv_nsec = twheel->start.tv_nsec + (usecs % 1000000) * 1000;
+		if (wakeup.tv_nsec >= 1000000000)
+		{
+			wakeup.tv_sec++;
+			wakeup.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&(twheel->twcond), &(twheel->twlock), &wakeup);
+	}
+}
+
+
+void printTimerWheel(timerwheel_t *twheel)
+{
+	printf("Timer wheel: %s (tick %d us, %d levels of %d slots)\n", twheel->name,
+	       TW_TICK_US, TW_LEVELS, TW_LEVEL_SLOTS);
+	printf("Entries pending: %d (maximum %lu)\n", twheel->count, twheel->maxcount);
+	printf("Entries added: %lu expired: %lu cascaded: %lu\n", twheel->added,
+	       twheel->expired, twheel->cascaded);
+}
@@ -0,0 +1,80 @@
+/*
+ * tokenbucket.c (Token bucket used to police and shape the core queues)
+ *
+ * The bucket fills at rate bytes per second up to depth bytes. A packet
+ * conforms if the bucket holds at least its length in tokens. Time comes
+ * from the monotonic clock (a vDSO call, no system call), and the callers
+ * read it once per batch rather than once per packet.
+ */
+
+#include <time.h>
+#include "message.h"
+#include "tokenbucket.h"
+
+
+uint64_t monotonicNanos(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/*
+ * A zero depth selects the default burst for the rate. The depth is never
+ * below the largest frame: a bucket that cannot hold a frame's tokens
+ * would hold it back for ever.
+ */
+void initTokenBucket(tokenbucket_t *tb, double rate, double depth)
+{
+	tb->rate = (rate > 0.0) ? rate : 0.0;
+	if (depth <= 0.0)
+		depth = tb->rate * TB_DEFAULT_BURST_NS / 1e9;
+	tb->depth = (depth < TB_MIN_BURST) ? TB_MIN_BURST : depth;
+	tb->tokens = tb->depth;
+	tb->last = monotonicNanos();
+	tb->conform = tb->exceed = 0;
+}
+
+
+static void refillTokenBucket(tokenbucket_t *tb, uint64_t now)
+{
+	if (now <= tb->last)
+		return;
+	tb->tokens += tb->rate * (now - tb->last) / 1e9;
+	if (tb->tokens > tb->depth)
+		tb->tokens = tb->depth;
+	tb->last = now;
+}
+
+
+// take len tokens if they are available. Returns 1 if the packet conforms.
+int tokenBucketConsume(tokenbucket_t *tb, int len, uint64_t now)
+{
+	if (tb->rate <= 0.0)
+		return 1;
+
+	refillTokenBucket(tb, now);
+	if (tb->tokens >= len)
+	{
+		tb->tokens -= len;
+		tb->conform++;
+		return 1;
+	}
+	tb->exceed++;
+	return 0;
+}
+
+
+// nanoseconds until len tokens are available (0 if they already are)
+uint64_t tokenBucketDelay(tokenbucket_t *tb, int len, uint64_t now)
+{
+	if (tb->rate <= 0.0)
+		return 0;
+
+	refillTokenBucket(tb, now);
+	if (tb->tokens >= len)
+		return 0;
+	return (uint64_t)((len - tb->tokens) * 1e9 / tb->rate) + 1;
+}
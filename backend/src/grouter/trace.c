@@ -0,0 +1,310 @@
+/*
+ * trace.c (packet path tracing)
+ *
+ * Each thread that traces with the ring on gets a ring of its own the
+ * first time, so writing a record takes no lock and touches no shared
+ * line. A record is written like a sequence lock: its seq is cleared,
+ * the fields are stored and seq is set last; a reader that sees seq
+ * change under it drops the record. The ring overwrites its oldest
+ * records. Formats are kept by address, so a dump is decoded here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <slack/err.h>
+#include <slack/prog.h>
+
+#include "tokenbucket.h"
+#include "trace.h"
+
+
+#define MAX_TRACE_LINE                  256
+
+typedef struct _trace_ring_t
+{
+	uint64_t head;                          // records ever written, by the owner only
+	uint64_t cleared;                       // head at the last "trace clear"
+	int tid;
+	trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+typedef struct _trace_entry_t
+{
+	trace_record_t rec;
+	int tid;
+} trace_entry_t;
+
+
+int trace_level;                        // the verbosity level, see traceSetLevel()
+int trace_ring;
+
+static trace_ring_t *trace_rings[TRACE_MAX_THREADS];
+static int trace_nrings;
+static uint64_t trace_lost;             // traces of threads past TRACE_MAX_THREADS
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t *thread_ring;
+static __thread int thread_ringless;
+
+
+/*
+ * Write a trace into buf as printf() would. Flags and a width are kept
+ * for %d, %u, %x and %s; length modifiers are not needed and skipped.
+ */
+static int traceFormat(char *buf, int size, const char *fmt, const uint64_t *args)
+{
+	char spec[16];
+	uint8_t b[8];
+	uint64_t v;
+	const char *p;
+	int n = 0, k = 0, s;
+
+	for (p = fmt; (*p != '\0') && (n < size - 1); p++)
+	{
+		if (*p != '%')
+		{
+			buf[n++] = *p;
+			continue;
+		}
+		spec[0] = '%';
+		for (s = 1; (p[1] != '\0') && (strchr("-+ #0123456789.", p[1]) != NULL) && (s < 8); s++)
+			spec[s] = *++p;
+		while ((p[1] == 'l') || (p[1] == 'h') || (p[1] == 'z'))
+			p++;
+		if (*++p == '\0')
+			break;
+		v = (k < TRACE_ARGS) ? args[k] : 0;
+		switch (*p)
+		{
+		case 'd':
+		case 'i':
+			strcpy(spec + s, "lld");
+			n += snprintf(buf + n, size - n, spec, (long long)(int64_t)v);
+			k++;
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			sprintf(spec + s, "ll%c", *p);
+			n += snprintf(buf + n, size - n, spec, (unsigned long long)v);
+			k++;
+			break;
+		case 'c':
+			buf[n++] = (char)v;
+			k++;
+			break;
+		case 's':
+			strcpy(spec + s, "s");
+			n += snprintf(buf + n, size - n, spec, (v != 0) ? (const char *)(uintptr_t)v : "(null)");
+			k++;
+			break;
+		case 'I':
+			memcpy(b, &v, 4);
+			n += snprintf(buf + n, size - n, "%u.%u.%u.%u", b[3], b[2], b[1], b[0]);
+			k++;
+			break;
+		case 'N':
+			memcpy(b, &v, 4);
+			n += snprintf(buf + n, size - n, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+			k++;
+			break;
+		case 'M':
+			memcpy(b, &v, 6);
+			n += snprintf(buf + n, size - n, "%02x:%02x:%02x:%02x:%02x:%02x", b[0], b[1], b[2], b[3], b[4], b[5]);
+			k++;
+			break;
+		case '%':
+			buf[n++] = '%';
+			break;
+		default:
+			buf[n++] = *p;
+			break;
+		}
+		if (n > size - 1)
+			n = size - 1;
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+
+// the calling thread's ring, set up on its first trace with the ring on
+static trace_ring_t *traceThreadRing(void)
+{
+	trace_ring_t *ring = NULL;
+
+	if ((thread_ring != NULL) || thread_ringless)
+		return thread_ring;
+
+	pthread_mutex_lock(&trace_lock);
+	if ((trace_nrings < TRACE_MAX_THREADS) && ((ring = calloc(1, sizeof(trace_ring_t))) != NULL))
+	{
+		ring->tid = (int)syscall(SYS_gettid);
+		trace_rings[trace_nrings] = ring;
+		__atomic_store_n(&trace_nrings, trace_nrings + 1, __ATOMIC_RELEASE);
+	} else
+		thread_ringless = 1;
+	pthread_mutex_unlock(&trace_lock);
+
+	if (ring == NULL)
+		error("[traceThreadRing]:: no trace ring for thread %d, its traces are lost ", (int)syscall(SYS_gettid));
+	return (thread_ring = ring);
+}
+
+
+/*
+ * Called by TRACE() once the level is known to be on; use TRACE() rather
+ * than this.
+ */
+void traceEvent(int level, const char *fmt, uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+	uint64_t args[TRACE_ARGS] = {a, b, c, d, e};
+	char buf[MAX_TRACE_LINE];
+	trace_record_t *rec;
+	trace_ring_t *ring;
+	uint64_t pos;
+
+	if (!trace_ring)
+	{
+		traceFormat(buf, sizeof(buf), fmt, args);
+		verbose(level, "%s", buf);
+		return;
+	}
+
+	if ((ring = traceThreadRing()) == NULL)
+	{
+		__atomic_add_fetch(&trace_lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	pos = ring->head;
+	rec = &(ring->records[pos & (TRACE_RING_RECORDS - 1)]);
+	__atomic_store_n(&(rec->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->nanos = monotonicNanos();
+	rec->fmt = fmt;
+	memcpy(rec->args, args, sizeof(args));
+	__atomic_store_n(&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(ring->head), pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Set the verbosity level for verbose() and TRACE() alike. Traces above
+ * TRACE_LEVEL_MAX are not in the build whatever the level.
+ */
+void traceSetLevel(int level)
+{
+	prog_set_verbosity_level(level);
+	trace_level = level;
+}
+
+
+void traceSetRing(int on)
+{
+	trace_ring = on;
+}
+
+
+// drop what the rings hold from dumps; the writers are not stopped
+void traceClear(void)
+{
+	int i, n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < n; i++)
+		__atomic_store_n(&(trace_rings[i]->cleared), __atomic_load_n(&(trace_rings[i]->head), __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+}
+
+
+// copy out the records of a ring; returns how many were read whole
+static int traceReadRing(trace_ring_t *ring, trace_entry_t *out)
+{
+	trace_record_t *rec;
+	uint64_t head, first, pos, seq;
+	int n = 0;
+
+	head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	first = __atomic_load_n(&(ring->cleared), __ATOMIC_ACQUIRE);
+	if (head - first > TRACE_RING_RECORDS)
+		first = head - TRACE_RING_RECORDS;
+
+	for (pos = first; pos < head; pos++)
+	{
+		rec = &(ring->records[pos & (TRACE_RING_RECORDS - 1)]);
+		seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+		memcpy(&(out[n].rec), rec, sizeof(trace_record_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		// overwritten or being written since head was read
+		if ((seq != pos + 1) || (__atomic_load_n(&(rec->seq), __ATOMIC_RELAXED) != seq))
+			continue;
+		out[n++].tid = ring->tid;
+	}
+	return n;
+}
+
+
+static int traceCompare(const void *a, const void *b)
+{
+	const trace_entry_t *ta = a, *tb = b;
+
+	if (ta->rec.nanos != tb->rec.nanos)
+		return (ta->rec.nanos < tb->rec.nanos) ? -1 : 1;
+	return (ta->rec.seq < tb->rec.seq) ? -1 : (ta->rec.seq > tb->rec.seq);
+}
+
+
+/*
+ * Print the last count records of all the rings (all of them if count is
+ * 0), oldest first and merged by time, while they are still being
+ * written. Returns the number printed, or -1 if out of memory.
+ */
+int traceDump(FILE *fp, int count)
+{
+	trace_entry_t *entries;
+	char buf[MAX_TRACE_LINE];
+	int i, n = 0, first, nrings = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+
+	if ((entries = malloc((size_t)(nrings > 0 ? nrings : 1) * TRACE_RING_RECORDS * sizeof(trace_entry_t))) == NULL)
+	{
+		error("[traceDump]:: out of memory for %d trace rings ", nrings);
+		return -1;
+	}
+	for (i = 0; i < nrings; i++)
+		n += traceReadRing(trace_rings[i], entries + n);
+	qsort(entries, n, sizeof(trace_entry_t), traceCompare);
+
+	first = ((count > 0) && (count < n)) ? n - count : 0;
+	for (i = first; i < n; i++)
+	{
+		traceFormat(buf, sizeof(buf), entries[i].rec.fmt, entries[i].rec.args);
+		fprintf(fp, "%llu.%09llu [%d] %s\n", (unsigned long long)(entries[i].rec.nanos / 1000000000ULL),
+			(unsigned long long)(entries[i].rec.nanos % 1000000000ULL), entries[i].tid, buf);
+	}
+	free(entries);
+	return n - first;
+}
+
+
+void printTraceStats(void)
+{
+	uint64_t head, held;
+	int i, nrings = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+
+	printf("Trace level: %d (traces above %d are not built in)\n", trace_level, TRACE_LEVEL_MAX);
+	printf("Trace ring: %s, %d records per thread\n", trace_ring ? "on" : "off", TRACE_RING_RECORDS);
+	printf("-----------------------------------------------------------\n");
+	printf("Thread\t\tWritten\t\tHeld \n");
+	for (i = 0; i < nrings; i++)
+	{
+		head = __atomic_load_n(&(trace_rings[i]->head), __ATOMIC_ACQUIRE);
+		held = head - __atomic_load_n(&(trace_rings[i]->cleared), __ATOMIC_ACQUIRE);
+		printf("%d\t\t%llu\t\t%llu\n", trace_rings[i]->tid, (unsigned long long)head,
+		       (unsigned long long)((held > TRACE_RING_RECORDS) ? TRACE_RING_RECORDS : held));
+	}
+	printf("-----------------------------------------------------------\n");
+	if (trace_lost > 0)
+		printf("Lost (no ring): %llu\n", (unsigned long long)trace_lost);
+}
@@ -12,10 +12,12 @@
 #include "filter.h"
 #include "protocols.h"
 #include "message.h"
+#include "pktpool.h"
 #include "gnet.h"
 #include "arp.h"
 #include "ip.h"
 #include "ethernet.h"
+#include "trace.h"
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -23,7 +25,6 @@
 
 extern pktcore_t *pcore;
 extern classlist_t *classifier;
-extern filtertab_t *filter;
 
 
 extern router_config rconfig;
@@ -36,21 +37,21 @@ void *toTunDev(void *arg)
 	char tmpbuf[MAX_TMPBUF_LEN];
 	int pkt_size;
 
-	verbose(2, "[toTunDev]:: entering the function.. ");
+	TRACE(2, "[toTunDev]:: entering the function.. ");
 	// find the outgoing interface and device...
 	if ((iface = findInterface(inpkt->frame.dst_interface)) != NULL)
 	{
 		/* send IP packet or ARP reply */
-		if (inpkt->data.header.prot == htons(ARP_PROTOCOL))
+		if ((inpkt->data->header.prot == htons(ARP_PROTOCOL)) && (makePacketWritable(inpkt) != NULL))
 		{
-			apkt = (arp_packet_t *) inpkt->data.data;
+			apkt = (arp_packet_t *) inpkt->data->data;
 			COPY_MAC(apkt->src_hw_addr, iface->mac_addr);
 			COPY_IP(apkt->src_ip_addr, gHtonl(tmpbuf, iface->ip_addr));
 		}
-		pkt_size = findPacketSize(&(inpkt->data));
-		verbose(2, "[toTunDev]:: tun_sendto called for interface %d.. ", iface->interface_id);
-		tun_sendto(iface->vpl_data, &(inpkt->data), pkt_size);
-		free(inpkt);          // finally destroy the memory allocated to the packet..
+		pkt_size = packetLength(inpkt);
+		TRACE(2, "[toTunDev]:: tun_sendto called for interface %d.. ", iface->interface_id);
+		tun_sendto(iface->vpl_data, inpkt->data, pkt_size);
+		freePacket(inpkt);          // finally destroy the memory allocated to the packet..
 	} else
 		error("[toTunDev]:: ERROR!! Could not find outgoing interface ...");
 
@@ -65,30 +66,32 @@ void* fromTunDev(void *arg)
     interface_array_t *iarr = (interface_array_t *)iface->iarray;
     uchar bcast_mac[] = MAC_BCAST_ADDR;
     gpacket_t *in_pkt;
+    pkt_data_t scratch;
     int pktsize;
-    char tmpbuf[MAX_TMPBUF_LEN];
     
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);		// die as soon as cancelled
     while (1)
     {
-        verbose(2, "[fromTunDev]:: Receiving a packet ...");
-        if ((in_pkt = (gpacket_t *)malloc(sizeof(gpacket_t))) == NULL)
+        TRACE(2, "[fromTunDev]:: Receiving a packet ...");
+        if ((in_pkt = allocPacket(iface->device_mtu)) == NULL)
         {
-            fatal("[fromTunDev]:: unable to allocate memory for packet.. ");
-            return NULL;
+            // out of packet buffers: take the frame off the device and drop it
+            tun_recvfrom(iface->vpl_data, &scratch, sizeof(pkt_data_t));
+            TRACE(1, "[fromTunDev]:: Packet dropped .. no packet buffers ");
+            continue;
         }
 
-        bzero(in_pkt, sizeof(gpacket_t));
-        pktsize = tun_recvfrom(iface->vpl_data, &(in_pkt->data), sizeof(pkt_data_t));
+        pktsize = tun_recvfrom(iface->vpl_data, in_pkt->data, packetCapacity(in_pkt));
+        in_pkt->len = max(pktsize, 0);
         pthread_testcancel();
         
-        verbose(2, "[fromTunDev]:: Destination MAC is %s ", MAC2Colon(tmpbuf, in_pkt->data.header.dst));
+        TRACE(2, "[fromTunDev]:: Destination MAC is %M ", TRACE_MAC(in_pkt->data->header.dst));
       
-        if ((COMPARE_MAC(in_pkt->data.header.dst, iface->mac_addr) != 0) &&
-                (COMPARE_MAC(in_pkt->data.header.dst, bcast_mac) != 0))
+        if ((COMPARE_MAC(in_pkt->data->header.dst, iface->mac_addr) != 0) &&
+                (COMPARE_MAC(in_pkt->data->header.dst, bcast_mac) != 0))
         {
-            verbose(1, "[fromTunDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
-            free(in_pkt);
+            TRACE(1, "[fromTunDev]:: Packet[%d] dropped .. not for this router!? ", pktsize);
+            freePacket(in_pkt);
             continue;
         }
 
@@ -97,15 +100,7 @@ void* fromTunDev(void *arg)
         COPY_MAC(in_pkt->frame.src_hw_addr, iface->mac_addr);
         COPY_IP(in_pkt->frame.src_ip_addr, iface->ip_addr);
 
-        // check for filtering.. if the it should be filtered.. then drop
-        if (filteredPacket(filter, in_pkt))
-        {
-            verbose(2, "[fromTunDev]:: Packet filtered..!");
-            free(in_pkt);
-            continue;   // skip the rest of the loop
-        }
-
-        verbose(2, "[fromTunDev]:: Packet is sent for enqueuing..");
+        TRACE(2, "[fromTunDev]:: Packet is sent for enqueuing..");
         enqueuePacket(pcore, in_pkt, sizeof(gpacket_t), rconfig.openflow);
     }
 }
@@ -172,23 +167,22 @@ int tun_recvfrom(vpl_data_t *vpl, void *buf, int len)
     int n, rcv_addr_len;
     struct sockaddr_in* dstaddr = (struct sockaddr_in*)vpl->data_addr;
     struct sockaddr_in rcvaddr;
-    char tmpbuf[100];
     
     rcv_addr_len = sizeof(rcvaddr);
     n=recvfrom(vpl->data,buf,len,0,(struct sockaddr *)&rcvaddr,&rcv_addr_len);
     if (n == -1) 
     {
         verbose(2, "[tun_recvfrom]:: unable to receive packet, error = %s", strerror(errno));		
-        return EXIT_FAILURE;
+        return -1;
     } else if((rcvaddr.sin_addr.s_addr != dstaddr->sin_addr.s_addr) || 
                rcvaddr.sin_port != dstaddr->sin_port)
     { 
-        verbose(2, "[tun_recvfrom]:: source IP or port does not match interface router");
-        return EXIT_FAILURE;
+        TRACE(2, "[tun_recvfrom]:: source IP or port does not match interface router");
+        return -1;
     }
     
-    verbose(2, "[tun_recvfrom]:: Destination MAC is %s ", MAC2Colon(tmpbuf, buf));
-    return EXIT_SUCCESS;
+    TRACE(2, "[tun_recvfrom]:: Destination MAC is %M ", TRACE_MAC(buf));
+    return n;
         
 }
 
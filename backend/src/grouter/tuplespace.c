@@ -0,0 +1,190 @@
+/*
+ * tuplespace.c (tuple space search over compiled class rules)
+ *
+ * The rule set is immutable once built: a change to the class definitions
+ * or to the rules that use them builds a new tuple space. Lookups take no
+ * locks and make no library calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <slack/std.h>
+#include <slack/err.h>
+
+#include "tuplespace.h"
+
+
+static int ruleFields(const classrule_t *rule)
+{
+	int fields = 0;
+
+	if (rule->prot != 0)
+		fields |= TSS_USE_PROT;
+	if (rule->tos != 0)
+		fields |= TSS_USE_TOS;
+	if (rule->sportlo == rule->sporthi)
+		fields |= TSS_USE_SPORT;
+	if (rule->dportlo == rule->dporthi)
+		fields |= TSS_USE_DPORT;
+	return fields;
+}
+
+
+/*
+ * Hash of the masked fields of tuple t. The two multiplies are independent
+ * so the hash costs a few cycles per tuple.
+ */
+static inline uint32_t tupleHash(int t, uint32_t src, uint32_t dst, uint32_t prottos, uint32_t ports)
+{
+	uint32_t h;
+
+	h = ((src ^ (dst << 16 | dst >> 16)) * 0x9e3779b1u) ^ ((ports ^ (prottos << 12) ^ (uint32_t)t) * 0x85ebca77u);
+	return h ^ (h >> 16);
+}
+
+
+/*
+ * Build a tuple space over a copy of rules[0 .. nrules-1], the first list
+ * being rules[0 .. nfirst-1]. Returns NULL if memory runs out.
+ */
+tuplespace_t *createTupleSpace(classrule_t *rules, int nrules, int nfirst)
+{
+	tuplespace_t *ts;
+	classrule_t *r;
+	tsstuple_t *tp;
+	uint32_t h, nbuckets;
+	int i, t, fields;
+
+	if ((ts = (tuplespace_t *)calloc(1, sizeof(tuplespace_t))) == NULL)
+		return NULL;
+
+	for (nbuckets = 16; nbuckets < 2 * (uint32_t)nrules; nbuckets <<= 1)
+		;
+	ts->nrules = nrules;
+	ts->nfirst = min(max(nfirst, 0), nrules);
+	ts->hashmask = nbuckets - 1;
+	ts->rules = (classrule_t *)malloc(max(nrules, 1) * sizeof(classrule_t));
+	ts->ruletuple = (int *)malloc(max(nrules, 1) * sizeof(int));
+	ts->links = (tsslink_t *)malloc(max(nrules, 1) * sizeof(tsslink_t));
+	ts->tuples = (tsstuple_t *)malloc(max(nrules, 1) * sizeof(tsstuple_t));
+	ts->buckets = (int *)malloc(nbuckets * sizeof(int));
+	if ((ts->rules == NULL) || (ts->ruletuple == NULL) || (ts->links == NULL) ||
+	    (ts->tuples == NULL) || (ts->buckets == NULL))
+	{
+		destroyTupleSpace(ts);
+		return NULL;
+	}
+	memcpy(ts->rules, rules, nrules * sizeof(classrule_t));
+	memset(ts->buckets, 0xff, nbuckets * sizeof(int));
+
+	// group the rules into tuples; rules come in priority order, so the
+	// first rule of each list in a tuple is its best one
+	for (i = 0; i < nrules; i++)
+	{
+		r = &(ts->rules[i]);
+		fields = ruleFields(r);
+		for (t = 0; t < ts->ntuples; t++)
+		{
+			tp = &(ts->tuples[t]);
+			if ((tp->srcmask == r->srcmask) && (tp->dstmask == r->dstmask) && (tp->fields == fields))
+				break;
+		}
+		if (t == ts->ntuples)
+		{
+			tp = &(ts->tuples[ts->ntuples++]);
+			tp->srcmask = r->srcmask;
+			tp->dstmask = r->dstmask;
+			tp->fields = fields;
+			tp->protmask = ((fields & TSS_USE_PROT) ? 0xff00 : 0) | ((fields & TSS_USE_TOS) ? 0xff : 0);
+			tp->portmask = ((fields & TSS_USE_SPORT) ? 0xffff0000u : 0) | ((fields & TSS_USE_DPORT) ? 0xffff : 0);
+			tp->bestrule[0] = tp->bestrule[1] = nrules;
+			tp->nrules = 0;
+		}
+		tp = &(ts->tuples[t]);
+		if (tp->bestrule[i >= ts->nfirst] == nrules)
+			tp->bestrule[i >= ts->nfirst] = i;
+		tp->nrules++;
+		ts->ruletuple[i] = t;
+	}
+
+	// chain the rules in reverse so every chain is in index order
+	for (i = nrules - 1; i >= 0; i--)
+	{
+		r = &(ts->rules[i]);
+		tp = &(ts->tuples[ts->ruletuple[i]]);
+		h = tupleHash(ts->ruletuple[i], r->srcaddr, r->dstaddr,
+			((r->prot << 8) | r->tos) & tp->protmask, ((r->sportlo << 16) | r->dportlo) & tp->portmask);
+		ts->links[i].hash = h;
+		ts->links[i].next = ts->buckets[h & ts->hashmask];
+		ts->buckets[h & ts->hashmask] = i;
+	}
+
+	ts->linear = (nrules <= TSS_LINEAR_FACTOR * ts->ntuples);
+	verbose(2, "[createTupleSpace]:: %d rules in %d tuples, %u buckets%s", nrules, ts->ntuples, nbuckets,
+		ts->linear ? ", linear scan" : "");
+	return ts;
+}
+
+
+void destroyTupleSpace(tuplespace_t *ts)
+{
+	if (ts == NULL)
+		return;
+	free(ts->rules);
+	free(ts->ruletuple);
+	free(ts->links);
+	free(ts->tuples);
+	free(ts->buckets);
+	free(ts);
+}
+
+
+/*
+ * Set match[l] to the index of the first rule of list l matching key, or
+ * -1. Tuples whose best rules cannot beat the matches found so far are
+ * skipped.
+ */
+void lookupTupleSpace(tuplespace_t *ts, const classkey_t *key, int match[TSS_LISTS])
+{
+	tsstuple_t *tp;
+	uint32_t h, prottos, ports;
+	int t, i, best0 = ts->nfirst, best1 = ts->nrules;
+
+	if (ts->linear)
+	{
+		for (i = 0; (i < ts->nfirst) && !matchClassRule(&(ts->rules[i]), key); i++)
+			;
+		best0 = i;
+		for (i = ts->nfirst; (i < ts->nrules) && !matchClassRule(&(ts->rules[i]), key); i++)
+			;
+		best1 = i;
+	}
+	else
+	{
+		prottos = ((uint32_t)key->prot << 8) | key->tos;
+		ports = ((uint32_t)key->sport << 16) | key->dport;
+		for (t = 0; t < ts->ntuples; t++)
+		{
+			tp = &(ts->tuples[t]);
+			if ((tp->bestrule[0] >= best0) && (tp->bestrule[1] >= best1))
+				continue;
+			h = tupleHash(t, key->src & tp->srcmask, key->dst & tp->dstmask,
+				prottos & tp->protmask, ports & tp->portmask);
+			// chains are in index order: the first list, then the second
+			for (i = ts->buckets[h & ts->hashmask]; (i >= 0) && (i < best1); i = ts->links[i].next)
+			{
+				if (((i >= best0) && (i < ts->nfirst)) || (ts->links[i].hash != h) ||
+				    (ts->ruletuple[i] != t) || !matchClassRule(&(ts->rules[i]), key))
+					continue;
+				if (i < ts->nfirst)
+					best0 = i;
+				else
+					best1 = i;
+			}
+		}
+	}
+
+	match[0] = (best0 < ts->nfirst) ? best0 : -1;
+	match[1] = (best1 < ts->nrules) ? best1 : -1;
+}
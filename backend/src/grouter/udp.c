@@ -42,56 +42,37 @@
 #include <stdio.h>
 #include "grouter.h"
 #include "ip.h"
+#include "pktpool.h"
 #include "udp.h"
 #include "err.h"
 #include "debug.h"
 #include "memp.h"
 #include "protocols.h"
 #include "opt.h"
+#include "checksum.h"
 
 /**
  * Calculates the UDP checksum for the specified UDP packet.
  *
  * @param ip_packet The IP packet containing the UDP packet.
  *
- * @return The UDP checksum for the specified UDP packet.
+ * @return The UDP checksum for the specified UDP packet, in network byte
+ *         order, ready to be stored in its header.
  */
 uint16_t udp_checksum(ip_packet_t *ip_packet)
 {
 	// Derive UDP packet from IP packet and reset checksum
 	udp_packet_type *udp_packet = (udp_packet_type *)
-		(ip_packet + (ip_packet->ip_hdr_len * 4));
+		((uint8_t *) ip_packet + ip_packet->ip_hdr_len * 4);
+	uint16_t udp_len = ntohs(udp_packet->length);
+	uint16_t cksum;
 	udp_packet->checksum = 0;
 
-	// Create UDP pseudo-header
-	udp_pseudo_header_type pseudo_header;
-	COPY_IP(&pseudo_header.ip_src, ip_packet->ip_src);
-	COPY_IP(&pseudo_header.ip_dst, ip_packet->ip_dst);
-	pseudo_header.reserved = 0;
-	pseudo_header.ip_prot = ip_packet->ip_prot;
-	pseudo_header.udp_length = udp_packet->length;
-
-	// Calculate sums of pseudo-header and UDP packet (same as taking one's
-	// complement of checksum) and store in temporary buffer
-	uint16_t buf[3];
-	buf[0] = ~checksum((uint8_t *) &pseudo_header,
-					   sizeof(udp_pseudo_header_type) / 2);
-	buf[1] = ~checksum((uint8_t *) &udp_packet, ntohs(udp_packet->length) / 2);
-	// If UDP packet length is odd, store zero-padded last byte in temporary
-	// buffer as well
-	if (udp_packet->length % 2 != 0)
-	{
-		uint8_t *temp = (uint8_t *) (udp_packet +
-			ntohs(udp_packet->length) - 1);
-		buf[2] = *temp << 8;
-	}
-	else
-	{
-		buf[2] = 0;
-	}
-
-	// Find checksum of the sums (plus the last byte, if applicable)
-	return checksum((uint8_t *) &buf, 3);
+	// Sum the UDP packet and add the pseudo-header to it
+	cksum = checksumPseudo(ip_packet->ip_src, ip_packet->ip_dst,
+			       UDP_PROTOCOL, udp_len, checksumSum(udp_packet, udp_len));
+	// a computed UDP checksum of zero is sent as all ones
+	return (cksum == 0) ? 0xffff : cksum;
 }
 
 
@@ -190,7 +171,7 @@ udp_input(struct pbuf *p, gpacket_t *in_pkt, uchar *netmask, uchar *network)
 
   /* is broadcast packet ? */
   //bradcast = ip_addr_isbroadcast(in_pkt->frame.nxth_ip_addr, inp);
-  broadcast = IPProcessBcastPacket(in_pkt); // this is gini's version (not currently implemented)
+  broadcast = IPCheckPacket4Bcast(in_pkt); // this is gini's version
 
   LWIP_DEBUGF(UDP_DEBUG, ("udp_input: received datagram of length %"U16_F"\n", p->tot_len));
 
@@ -464,13 +445,13 @@ udp_sendto_if(struct udp_pcb *pcb, struct pbuf *p, uchar *dst_ip, uint16_t dst_p
     /* output to IP */
 
     // create GINI's gpacket_t
-	gpacket_t *out_pkt = (gpacket_t *) malloc(sizeof(gpacket_t));
+	gpacket_t *out_pkt = allocPacket(sizeof(ip_packet_t) + q->tot_len);
 
     // write all pbuf's payloads (they form a linked list) to GINI's gpacket_t, at the correct offset
     struct pbuf *r = q;
     int offset = sizeof(ip_packet_t);
     while (r) {
-        memcpy(out_pkt->data.data + offset, r->payload, r->len);
+        memcpy(out_pkt->data->data + offset, r->payload, r->len);
         offset += r->len;
         r = r->next;
     }
@@ -5,6 +5,7 @@
  */
 
 #include "grouter.h"
+#include "checksum.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -164,28 +165,12 @@ void redefineSignalHandler(int sigid, void (*my_func)(int signum))
 
 
 /*
- * compute the checksum of a buffer, by adding 2-byte words
- * and returning their one's complement
+ * compute the checksum of a buffer of iwords 2-byte words and return it in
+ * host byte order, using the fastest routine of the checksum library
  */
 ushort checksum(uchar *buf, int iwords)
 {
-	unsigned long cksum = 0;
-	int i;
-
-	for(i = 0; i < iwords; i++)
-	{
-		cksum += buf[0] << 8;
-		cksum += buf[1];
-		buf += 2;
-	}
-
-	// add in all carries
-	while (cksum >> 16)
-		cksum = (cksum & 0xFFFF) + (cksum >> 16);
-
-	verbose(2, "[checksum]:: computed %x ..", ~cksum);
-
-	return (unsigned short) (~cksum);
+	return ntohs(checksumCompute(buf, iwords * 2));
 }
 
 double subTimeVal(struct timeval *v2, struct timeval *v1)
@@ -334,7 +334,6 @@ int vpl_recvfrom(vpl_data_t *vpl, void *buf, int len)
                 return(-errno);
         }
         else if(n == 0) return(-ENOTCONN);
-		copy2Queue(consoleq, buf, n);
         return(n);
 }
 
@@ -343,7 +342,6 @@ int vpl_sendto(vpl_data_t *vpl, void *buf, int len)
 {
 	struct sockaddr_un *data_addr = vpl->data_addr;
 
-	copy2Queue(consoleq, buf, len);
 	return(__vpl_sendto(vpl->data, buf, len, data_addr, sizeof(*data_addr)));
 }
 
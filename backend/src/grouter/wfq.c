@@ -8,158 +8,76 @@
 #include "message.h"
 #include "grouter.h"
 
-// WCWeightedFairScheduler: is one part of the W+FQ scheduler.
-// It picks the appropriate job from the system of queues.
-// If no job in packet core.. the thread waits.
-// If there is job, select a Queue and then the job at the head of the Queue
-// for running. Update the algorithm parameters and store them back on the queue
-// datastructure: start, finish times for the queue and virtual time for the system.
-
-// TODO: Debug this function..
+// weightedFairSchedule: self-clocked weighted fair queuing. The finish tag
+// of the packet at the head of each active queue is
+//     max(vclock, ftime of the queue) + length/weight
+// and the packet with the smallest tag goes first. The virtual clock is the
+// tag of the last packet sent. Picking a packet scans the active queues, so
+// this costs O(#active queues) per packet; use "drr" for O(1) scheduling.
 
 extern router_config rconfig;
 
-void *weightedFairScheduler(void *pc)
+void weightedFairSchedule(pktcore_t *pcore, pktcoreqarray_t *qarray, unsigned int amap)
 {
-	pktcore_t *pcore = (pktcore_t *)pc;
-	List *keylst;
-	simplequeue_t *nxtq, *thisq;
-	char *nxtkey, *savekey;
-	double minftime, minstime, tweight;
-	int pktsize, npktsize;
-	gpacket_t *in_pkt, *nxt_pkt;
-
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);       // die as soon as cancelled
-	while (1)
+	void *pkts[QUEUE_BURST_SIZE];
+	int sizes[QUEUE_BURST_SIZE];
+	simplequeue_t *thisq, *bestq;
+	unsigned int scanmap;
+	double ftag, bestftag, weight;
+	uint64_t now;
+	int qid, npkts, len, bestlen;
+
+	verbose(2, "[weightedFairSchedule]:: Weighted fair queuing scheduler processing..");
+	now = monotonicNanos();
+	npkts = 0;
+	while ((npkts < QUEUE_BURST_SIZE) && (amap != 0))
 	{
-		verbose(2, "[weightedFairScheduler]:: Worst-case weighted fair queuing scheduler processing..");
-
-		pthread_mutex_lock(&(pcore->qlock));
-		if (pcore->packetcnt == 0)
-			pthread_cond_wait(&(pcore->schwaiting), &(pcore->qlock));
-		pthread_mutex_unlock(&(pcore->qlock));
-
-		pthread_testcancel();
-
-		keylst = map_keys(pcore->queues);
-		while (list_has_next(keylst) == 1)
+		bestq = NULL;
+		bestftag = 0.0;
+		scanmap = amap;
+		while (scanmap != 0)
 		{
-			nxtkey = list_next(keylst);
-			nxtq = map_get(pcore->queues, nxtkey);
-			if (nxtq->cursize == 0)
-				continue;
-			if ((nxtq->stime <= pcore->vclock) && (nxtq->ftime < minftime))
-			{
-				savekey = nxtkey;
-				minftime = nxtq->ftime;
-			}
-		}
-		list_release(keylst);
+			qid = __builtin_ctz(scanmap);
+			scanmap &= scanmap - 1;
 
-		// if savekey is NULL then release the lock..
-		if (savekey == NULL)
-			continue;
-		else
-		{
-			thisq = map_get(pcore->queues, savekey);
-			readQueue(thisq, (void **)&in_pkt, &pktsize);
-			writeQueue(pcore->workQ, in_pkt, pktsize);
-			pthread_mutex_lock(&(pcore->qlock));
-			pcore->packetcnt--;
-			pthread_mutex_unlock(&(pcore->qlock));
-
-			peekQueue(thisq, (void **)&nxt_pkt, &npktsize);
-			if (npktsize)
+			thisq = qarray->q[qid];
+			if ((thisq == NULL) || ((len = getPacketLength(pcore, thisq, now)) < 0))
 			{
-				thisq->stime = thisq->ftime;
-				thisq->ftime = thisq->stime + npktsize/thisq->weight;
+				amap &= ~(1u << qid);
+				continue;
 			}
-
-			minstime = thisq->stime;
-			tweight = 0.0;
-		
-			keylst = map_keys(pcore->queues);
-			while (list_has_next(keylst) == 1)
+			weight = (thisq->weight > 0.0) ? thisq->weight : 1.0;
+			ftag = max(pcore->vclock, thisq->ftime) + len/weight;
+			if ((bestq == NULL) || (ftag < bestftag))
 			{
-				nxtkey = list_next(keylst);
-				nxtq = map_get(pcore->queues, nxtkey);
-				tweight += nxtq->weight;
-				if ((nxtq->cursize > 0) && (nxtq->stime < minstime))
-					minstime = nxtq->stime;
+				bestq = thisq;
+				bestftag = ftag;
+				bestlen = len;
 			}
-			list_release(keylst);
-			pcore->vclock = max(minstime, (pcore->vclock + ((double)pktsize)/tweight));
 		}
-	}
-}
-
 
-
-
-// WCWeightFairQueuer: function called by the classifier to enqueue
-// the packets.. 
-// TODO: Debug this function...
-int weightedFairQueuer(pktcore_t *pcore, gpacket_t *in_pkt, int pktsize, char *qkey)
-{
-	simplequeue_t *thisq, *nxtq;
-	double minftime, minstime, tweight;
-	List *keylst;
-	char *nxtkey, *savekey;
-
-	verbose(2, "[weightedFairQueuer]:: Worst-case weighted fair queuing scheduler processing..");
-
-	pthread_mutex_lock(&(pcore->qlock));
-
-	thisq = map_get(pcore->queues, qkey);
-	if (thisq == NULL)
-	{
-		fatal("[weightedFairQueuer]:: Invalid %s key presented for queue addition", qkey);
-		pthread_mutex_unlock(&(pcore->qlock));
-		return EXIT_FAILURE;             // packet dropped..
-	}
-
-	printf("Checking the queue size \n");
-	if (thisq->cursize == 0)
-	{
-		verbose(2, "[weightedFairQueuer]:: inserting the first element.. ");
-		thisq->stime = max(pcore->vclock, thisq->ftime);
-		thisq->ftime = thisq->stime + pktsize/thisq->weight;
-
-		minstime = thisq->stime;
-
-		keylst = map_keys(pcore->queues);
-		
-		while (list_has_next(keylst) == 1)
+		if (bestq == NULL)
+			break;
+		// a queue over its shaping rate sits out until it has tokens
+		if (!shapeQueue(pcore, bestq, bestlen, now))
 		{
-			nxtkey = list_next(keylst);
-
-			nxtq = map_get(pcore->queues, nxtkey);
-			
-			if ((nxtq->cursize > 0) && (nxtq->stime < minstime))
-				minstime = nxtq->stime;
+			amap &= ~(1u << bestq->qid);
+			continue;
 		}
-		list_release(keylst);
-
-		pcore->vclock = max(minstime, pcore->vclock);
-		// insert the packet... and increment variables..
-		writeQueue(thisq, in_pkt, pktsize);
-		pcore->packetcnt++;
+		if (dequeueCorePacket(bestq, &(pkts[npkts]), &(sizes[npkts])) == EXIT_FAILURE)
+			break;
+		bestq->stime = max(pcore->vclock, bestq->ftime);
+		bestq->ftime = bestftag;
+		pcore->vclock = bestftag;
+		npkts++;
+	}
 
-		// wake up scheduler if it was waiting..
-		if (pcore->packetcnt == 1)
-			pthread_cond_signal(&(pcore->schwaiting));
-		pthread_mutex_unlock(&(pcore->qlock));
-		return EXIT_SUCCESS;
-	} else if (thisq->cursize < thisq->maxsize)
+	if (npkts > 0)
 	{
-		// insert packet and setup variables..
-		writeQueue(thisq, in_pkt, pktsize);
-		pcore->packetcnt++;
-		pthread_mutex_unlock(&(pcore->qlock));
-		return EXIT_SUCCESS;
-	} else {
-		verbose(2, "[weightedFairQueuer]:: Packet dropped.. Queue for %s is full ", qkey);
-		pthread_mutex_unlock(&(pcore->qlock));
-		return EXIT_SUCCESS;
+		dispatchPackets(pcore, pkts, sizes, npkts);
+		__atomic_sub_fetch(&(pcore->packetcnt), npkts, __ATOMIC_RELAXED);
 	}
+
+	for (qid = 0; qid < qarray->nslots; qid++)
+		clearQueueActive(pcore, qarray->q[qid], qid);
 }
@@ -0,0 +1,219 @@
+#include "checksum.h"
+#include "mut.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "common_def.h"
+
+// Checksum library: agreement of every routine with a byte-pair sum, and
+// throughput against the routines it replaced on 64 to 9000 byte buffers.
+
+#define MAXBUF (4 << 20)
+
+static const char *impls[] = {CHECKSUM_SCALAR, CHECKSUM_SSE2, CHECKSUM_AVX2};
+static const int sizes[] = {64, 128, 256, 512, 1500, 4096, 9000};
+
+
+// The sum as checksum() in utils.c took it: big endian byte pairs, a last
+// odd byte padded with a zero. Returns it in host byte order.
+static uint16_t bytePairSum(const uint8_t *buf, int len)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (buf[i] << 8) + buf[i + 1];
+	if (len & 1)
+		sum += buf[len - 1] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+
+// lwIP's 32 bit reference routine (LWIP_CHKSUM_ALGORITHM 2) that was in use
+static uint16_t lwipSum(const void *dataptr, int len)
+{
+	const uint8_t *pb = dataptr;
+	const uint16_t *ps;
+	uint16_t t = 0;
+	uint32_t sum = 0, w;
+	int odd = ((uintptr_t)pb & 1);
+
+	if (odd && (len > 0))
+	{
+		((uint8_t *)&t)[1] = *pb++;
+		len--;
+	}
+	ps = (const uint16_t *)pb;
+	while (len > 1)
+	{
+		sum += *ps++;
+		len -= 2;
+	}
+	if (len > 0)
+		((uint8_t *)&t)[0] = *(const uint8_t *)ps;
+	sum += t;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	if (odd)
+	{
+		w = sum;
+		sum = ((w & 0xff) << 8) | ((w & 0xff00) >> 8);
+	}
+	return sum;
+}
+
+
+static double nowNanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// random lengths and alignments; returns the number of disagreements
+static int checkImpl(uint8_t *buf, uint8_t *dst)
+{
+	int i, off, len, bad = 0;
+
+	for (i = 0; i < 20000; i++)
+	{
+		off = rand() % 64;
+		len = (i < 100) ? i : rand() % 9001;
+		if (ntohs(checksumSum(buf + off, len)) != bytePairSum(buf + off, len))
+			bad++;
+		memset(dst, 0, len + 64);
+		if ((checksumCopy(dst + (i % 8), buf + off, len) != checksumSum(buf + off, len)) ||
+		    (memcmp(dst + (i % 8), buf + off, len) != 0) || (dst[(i % 8) + len] != 0))
+			bad++;
+	}
+	// past the point where the vector lanes are flushed
+	if (ntohs(checksumSum(buf, MAXBUF)) != bytePairSum(buf, MAXBUF))
+		bad++;
+	return bad;
+}
+
+
+/*
+ * ns per buffer of each size: the old byte-pair loop, lwIP's routine and
+ * every routine the CPU supports, then copy-and-checksum against a copy
+ * followed by a sum.
+ */
+static void benchImpls(uint8_t *buf, uint8_t *dst, const char *best)
+{
+	double t0, t;
+	int i, j, k, n, rounds;
+	unsigned sink = 0;
+
+	printf("%5s %10s %10s", "bytes", "byte-pair", "lwip");
+	for (k = 0; k < 3; k++)
+		if (checksumSelect(impls[k]) == EXIT_SUCCESS)
+			printf(" %10s", impls[k]);
+	printf(" %12s %12s\n", "memcpy+sum", "copy+sum");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(int); i++)
+	{
+		n = sizes[i];
+		rounds = (64 << 20) / n;
+		printf("%5d", n);
+
+		t0 = nowNanos();
+		for (j = 0; j < rounds; j++)
+			sink += bytePairSum(buf + (j & 63) * 2, n);
+		printf(" %10.1f", (nowNanos() - t0) / rounds);
+
+		t0 = nowNanos();
+		for (j = 0; j < rounds; j++)
+			sink += lwipSum(buf + (j & 63) * 2, n);
+		printf(" %10.1f", (nowNanos() - t0) / rounds);
+
+		for (k = 0; k < 3; k++)
+		{
+			if (checksumSelect(impls[k]) == EXIT_FAILURE)
+				continue;
+			t0 = nowNanos();
+			for (j = 0; j < rounds; j++)
+				sink += checksumSum(buf + (j & 63) * 2, n);
+			printf(" %10.1f", (nowNanos() - t0) / rounds);
+		}
+
+		// the routine picked at startup
+		checksumSelect(best);
+		t0 = nowNanos();
+		for (j = 0; j < rounds; j++)
+		{
+			memcpy(dst, buf + (j & 63) * 2, n);
+			sink += checksumSum(dst, n);
+		}
+		t = nowNanos() - t0;
+		printf(" %12.1f", t / rounds);
+
+		t0 = nowNanos();
+		for (j = 0; j < rounds; j++)
+			sink += checksumCopy(dst, buf + (j & 63) * 2, n);
+		printf(" %12.1f\n", (nowNanos() - t0) / rounds);
+	}
+	printf("(ns per buffer, %s picked at startup, %u)\n", best, sink & 1);
+}
+
+
+TESTSUITE_BEGIN
+
+uint8_t *buf = malloc(MAXBUF + 64);
+uint8_t *dst = malloc(9000 + 128);
+const char *best = checksumImplementation();
+int i;
+
+srand(1);
+for (i = 0; i < MAXBUF + 64; i++)
+	buf[i] = rand();
+
+TEST_BEGIN("Known checksum of an IPv4 header")
+// a UDP packet header from 192.168.0.1 to 192.168.0.199
+uint16_t cksum;
+uint8_t hdr[20] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+		   0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+CHECK(ntohs(checksumCompute(hdr, 20)) == 0xb861);
+cksum = checksumCompute(hdr, 20);
+memcpy(&hdr[10], &cksum, 2);
+CHECK(checksumCompute(hdr, 20) == 0);
+CHECK(checksum(hdr, 10) == 0);
+TEST_END
+
+TEST_BEGIN("A routine is picked at startup and bad names are refused")
+CHECK(best != NULL);
+CHECK(checksumSelect("none") == EXIT_FAILURE);
+CHECK(checksumSelect(CHECKSUM_SCALAR) == EXIT_SUCCESS);
+CHECK(checksumSelect(best) == EXIT_SUCCESS);
+TEST_END
+
+TEST_BEGIN("Every routine agrees with the byte-pair sum")
+int k;
+for (k = 0; k < 3; k++)
+	if (checksumSelect(impls[k]) == EXIT_SUCCESS)
+	{
+		CHECK(checkImpl(buf, dst) == 0);
+	}
+checksumSelect(best);
+TEST_END
+
+TEST_BEGIN("lwIP's routine agrees at odd addresses")
+int j, len;
+for (j = 0; j < 10000; j++)
+{
+	len = rand() % 1500;
+	CHECK(checksumSum(buf + (j & 7), len) == lwipSum(buf + (j & 7), len));
+}
+TEST_END
+
+TEST_BEGIN("Throughput from 64 to 9000 bytes")
+benchImpls(buf, dst, best);
+checksumSelect(best);
+TEST_END
+
+TESTSUITE_END
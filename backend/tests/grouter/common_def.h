@@ -2,6 +2,8 @@
 #include "packetcore.h"
 #include "classifier.h"
 #include "filter.h"
+#include "conntrack.h"
+#include "nat.h"
 #include "openflow_flowtable.h"
 #include "openflow_ctrl_iface.h"
 
@@ -11,8 +13,10 @@ router_config rconfig = {
 	.router_name="Test", .gini_home=NULL, .cli_flag=0, .config_file=NULL,
 	.config_dir=NULL, .openflow=1000, .ghandler=0, .clihandler= 0, .scheduler=0, 
 	.worker=0, .openflow_worker=0, .openflow_controller_iface=0,
-	.schedcycle=10000
+	.schedcycle=10000, .workers=1, .pktbufs=0, .hugepages=0
 };
 pktcore_t *pcore;
 classlist_t *classifier;
 filtertab_t *filter;
+conntrack_t *conntrack;
+nat_t *nat;
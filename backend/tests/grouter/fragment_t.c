@@ -0,0 +1,227 @@
+#include "message.h"
+#include "fragment.h"
+#include "mut.h"
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "common_def.h"
+#include "pktpool.h"
+#include "mtu.h"
+#include "ip.h"
+#include "checksum.h"
+#include "protocols.h"
+
+// IP fragmentation: offsets, lengths, flags, options and checksums of every
+// fragment, the payload put back together, and the buffers when the pool
+// runs dry.
+
+#define OUT_IFACE 1
+#define MAXBUFS 256
+
+static uchar orig[MAX_JUMBO_MTU];
+static uchar reasm[MAX_JUMBO_MTU];
+
+// a copied (loose source route) and a not copied (record route) option
+static const uchar options[] = {0x83, 7, 4, 10, 0, 0, 1, IP_OPT_NOP, 0x07, 7, 4, 0, 0, 0, 0, IP_OPT_EOL};
+static const uchar copied[] = {0x83, 7, 4, 10, 0, 0, 1, IP_OPT_EOL};
+
+
+static void setMTU(int mtu)
+{
+	uchar ip_addr[4] = {1, 0, 0, 10};
+
+	addMTUEntry(MTU_tbl, OUT_IFACE, mtu, ip_addr);
+}
+
+
+/*
+ * A UDP packet of total bytes with a random payload, itself a fragment at
+ * off (in 8 byte units) when off or mf is set. A copy of the IP packet is
+ * kept in orig.
+ */
+static gpacket_t *makePacket(int total, int opts, int off, int mf)
+{
+	gpacket_t *pkt;
+	ip_packet_t *ip_pkt;
+	int hdr_len = sizeof(ip_packet_t) + (opts ? sizeof(options) : 0);
+	int i;
+
+	if ((pkt = allocPacket((total > DEFAULT_MTU) ? MAX_JUMBO_MTU : DEFAULT_MTU)) == NULL)
+		return NULL;
+	pkt->frame.dst_interface = OUT_IFACE;
+	pkt->data->header.prot = htons(IP_PROTOCOL);
+	memset(pkt->data->header.dst, 0xAA, 6);
+	ip_pkt = (ip_packet_t *)pkt->data->data;
+	memset(ip_pkt, 0, sizeof(ip_packet_t));
+	ip_pkt->ip_version = 4;
+	ip_pkt->ip_hdr_len = hdr_len >> 2;
+	ip_pkt->ip_pkt_len = htons(total);
+	ip_pkt->ip_identifier = htons(4242);
+	ip_pkt->ip_frag_off = htons(off | (mf ? IP_MF : 0));
+	ip_pkt->ip_ttl = 64;
+	ip_pkt->ip_prot = UDP_PROTOCOL;
+	if (opts)
+		memcpy((uchar *)ip_pkt + sizeof(ip_packet_t), options, sizeof(options));
+	for (i = hdr_len; i < total; i++)
+		((uchar *)ip_pkt)[i] = rand();
+	ip_pkt->ip_cksum = checksumCompute(ip_pkt, hdr_len);
+	pkt->len = sizeof(pkt->data->header) + total;
+	memcpy(orig, ip_pkt, total);
+	return pkt;
+}
+
+
+/*
+ * Checks every fragment against the packet in orig and puts the payload
+ * back together in reasm. Returns the number of problems found.
+ */
+static int checkFragments(gpacket_t **frags, int num_frags, int mtu, int opts, int off, int mf)
+{
+	ip_packet_t *ip_pkt, *orig_pkt = (ip_packet_t *)orig;
+	int orig_hdr_len = orig_pkt->ip_hdr_len << 2;
+	int data_len = ntohs(orig_pkt->ip_pkt_len) - orig_hdr_len;
+	int i, hdr_len, len, frag_off, covered = 0, bad = 0;
+
+	for (i = 0; i < num_frags; i++)
+	{
+		ip_pkt = (ip_packet_t *)frags[i]->data->data;
+		hdr_len = ip_pkt->ip_hdr_len << 2;
+		len = ntohs(ip_pkt->ip_pkt_len) - hdr_len;
+		frag_off = ntohs(ip_pkt->ip_frag_off);
+
+		bad += (checksumCompute(ip_pkt, hdr_len) != 0);
+		bad += (hdr_len + len > mtu);
+		bad += (packetLength(frags[i]) != (int)sizeof(frags[i]->data->header) + hdr_len + len);
+		// offsets count 8 byte units, from where the packet itself started
+		bad += (((frag_off & IP_OFFMASK) - off) * 8 != covered);
+		bad += ((i < num_frags - 1) && (len & 7));
+		// only the input's MF may carry over to the last piece
+		bad += (TEST_MF_BITS(frag_off) != ((i < num_frags - 1) || mf));
+		bad += (TEST_DF_BITS(frag_off) != 0);
+		// the first fragment keeps every option, the others only copied ones
+		if (i == 0)
+			bad += ((hdr_len != orig_hdr_len) || memcmp(ip_pkt + 1, orig_pkt + 1, hdr_len - sizeof(ip_packet_t)));
+		else if (opts)
+			bad += ((hdr_len != (int)(sizeof(ip_packet_t) + sizeof(copied))) || memcmp(ip_pkt + 1, copied, sizeof(copied)));
+		else
+			bad += (hdr_len != (int)sizeof(ip_packet_t));
+		bad += ((ip_pkt->ip_identifier != orig_pkt->ip_identifier) || (ip_pkt->ip_prot != orig_pkt->ip_prot));
+		bad += ((frags[i]->data->header.prot != htons(IP_PROTOCOL)) || (frags[i]->data->header.dst[0] != 0xAA));
+		if ((len < 0) || (covered + len > data_len))
+			return bad + 1;
+		memcpy(reasm + covered, (uchar *)ip_pkt + hdr_len, len);
+		covered += len;
+	}
+	bad += (covered != data_len);
+	bad += (memcmp(reasm, orig + orig_hdr_len, data_len) != 0);
+	return bad;
+}
+
+
+// fragments a packet for the MTU, checks the pieces and frees them
+static int fragmentAndCheck(int total, int mtu, int opts, int off, int mf, int expected)
+{
+	gpacket_t *pkt, *frags[MAX_FRAGMENTS];
+	int num_frags, bad;
+
+	setMTU(mtu);
+	if ((pkt = makePacket(total, opts, off, mf)) == NULL)
+		return 1;
+	if ((num_frags = fragmentIPPacket(pkt, frags)) == 0)
+	{
+		freePacket(pkt);
+		return 1;
+	}
+	bad = (num_frags != expected) || (frags[0] != pkt);
+	// three or more: the last one shares the buffer of the first
+	bad += (num_frags >= 3) && (frags[num_frags - 1]->owner == NULL);
+	bad += checkFragments(frags, num_frags, mtu, opts, off, mf);
+	deallocateFragments(frags, num_frags);
+	return bad;
+}
+
+
+// standard buffers that can still be allocated, up to max
+static int freeBuffers(int max)
+{
+	gpacket_t *pkts[MAXBUFS];
+	int i, n;
+
+	for (n = 0; n < max; n++)
+		if ((pkts[n] = allocPacket(DEFAULT_MTU)) == NULL)
+			break;
+	for (i = 0; i < n; i++)
+		freePacket(pkts[i]);
+	return n;
+}
+
+
+TESTSUITE_BEGIN
+
+srand(1);
+initPacketPool(MAXBUFS, 0);
+MTUTableInit(MTU_tbl);
+
+TEST_BEGIN("1500 bytes for MTU 576")
+CHECK(fragmentAndCheck(1500, 576, 0, 0, 0, 3) == 0);
+TEST_END
+
+TEST_BEGIN("9000 bytes for MTU 576")
+CHECK(fragmentAndCheck(9000, 576, 0, 0, 0, 17) == 0);
+TEST_END
+
+TEST_BEGIN("Only copied options go into later fragments")
+CHECK(fragmentAndCheck(1500, 576, 1, 0, 0, 3) == 0);
+CHECK(fragmentAndCheck(9000, 576, 1, 0, 0, 17) == 0);
+TEST_END
+
+TEST_BEGIN("A fragment of a fragment")
+// a middle piece keeps MF on its last fragment, the last piece does not
+CHECK(fragmentAndCheck(1500, 576, 0, 185, 1, 3) == 0);
+CHECK(fragmentAndCheck(1500, 576, 1, 185, 0, 3) == 0);
+CHECK(fragmentAndCheck(9000, 576, 1, 370, 1, 17) == 0);
+TEST_END
+
+TEST_BEGIN("Packets that need no fragmenting are refused")
+gpacket_t *pkt, *frags[MAX_FRAGMENTS];
+setMTU(1500);
+pkt = makePacket(1500, 0, 0, 0);
+CHECK(fragmentIPPacket(pkt, frags) == 0);
+CHECK(memcmp(pkt->data->data, orig, 1500) == 0);
+freePacket(pkt);
+TEST_END
+
+TEST_BEGIN("A length past the end of the frame is refused")
+gpacket_t *pkt, *frags[MAX_FRAGMENTS];
+ip_packet_t *ip_pkt;
+setMTU(576);
+pkt = makePacket(1500, 0, 0, 0);
+ip_pkt = (ip_packet_t *)pkt->data->data;
+ip_pkt->ip_pkt_len = htons(9000);
+CHECK(fragmentIPPacket(pkt, frags) == 0);
+CHECK(IPVerifyPacket(ip_pkt, 1500) == EXIT_FAILURE);
+freePacket(pkt);
+TEST_END
+
+TEST_BEGIN("Fragments made are freed when the pool runs dry")
+gpacket_t *pkt, *held[MAXBUFS], *frags[MAX_FRAGMENTS];
+int n, all;
+setMTU(576);
+all = freeBuffers(MAXBUFS);
+CHECK(fragmentAndCheck(9000, 576, 0, 0, 0, 17) == 0);
+CHECK(freeBuffers(MAXBUFS) == all);
+// leave three buffers for the sixteen fragments that need one
+pkt = makePacket(9000, 0, 0, 0);
+for (n = 0; n < all - 3; n++)
+	held[n] = allocPacket(DEFAULT_MTU);
+CHECK(fragmentIPPacket(pkt, frags) == 0);
+CHECK(memcmp(pkt->data->data, orig, 9000) == 0);
+CHECK(freeBuffers(MAXBUFS) == 3);
+for (n = 0; n < all - 3; n++)
+	freePacket(held[n]);
+freePacket(pkt);
+CHECK(freeBuffers(MAXBUFS) == all);
+TEST_END
+
+TESTSUITE_END
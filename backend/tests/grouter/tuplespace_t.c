@@ -0,0 +1,207 @@
+#include "tuplespace.h"
+#include "mut.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "common_def.h"
+
+// Tuple space classifier: agreement with a linear scan of the rules and
+// lookup cost at 10, 1k and 10k rules.
+
+#define NKEYS 4096
+
+static const int preflens[] = {0, 16, 24, 32};
+
+
+static uint32_t prefixMask(int preflen)
+{
+	return (preflen == 0) ? 0 : htonl(0xFFFFFFFFu << (32 - preflen));
+}
+
+
+// 5-tuple ACL style rules in a few common shapes, addresses from 10.0.0.0/8
+static void makeRule(classrule_t *r, int i)
+{
+	memset(r, 0, sizeof(classrule_t));
+	r->srcmask = prefixMask(preflens[rand() % 4]);
+	r->dstmask = prefixMask(preflens[1 + rand() % 3]);
+	r->srcaddr = htonl(0x0a000000 | (rand() & 0xffffff)) & r->srcmask;
+	r->dstaddr = htonl(0x0a000000 | (rand() & 0xffffff)) & r->dstmask;
+	r->prot = (rand() % 2) ? 6 : 17;
+	r->tos = 0;
+	r->sportlo = 0;
+	r->sporthi = 65535;
+	switch (rand() % 3)
+	{
+	case 0:
+		r->dportlo = r->dporthi = rand() % 1024;
+		break;
+	case 1:
+		r->dportlo = rand() % 60000;
+		r->dporthi = r->dportlo + rand() % 1000;
+		break;
+	default:
+		r->dportlo = 0;
+		r->dporthi = 65535;
+	}
+	r->needports = (r->dportlo != 0) || (r->dporthi != 65535);
+	r->classid = i;
+}
+
+
+static void makeKey(classkey_t *k, classrule_t *rules, int nrules)
+{
+	classrule_t *r = &rules[rand() % nrules];
+
+	// half of the keys are built to hit a rule, the rest are random
+	k->src = htonl(0x0a000000 | (rand() & 0xffffff));
+	k->dst = htonl(0x0a000000 | (rand() & 0xffffff));
+	k->prot = (rand() % 2) ? 6 : 17;
+	k->tos = 0;
+	k->sport = 1024 + rand() % 60000;
+	k->dport = rand() % 65536;
+	k->hasports = 1;
+	if (rand() % 2)
+	{
+		k->src = (k->src & ~r->srcmask) | r->srcaddr;
+		k->dst = (k->dst & ~r->dstmask) | r->dstaddr;
+		if (r->prot != 0)
+			k->prot = r->prot;
+		k->dport = r->dportlo + rand() % (r->dporthi - r->dportlo + 1);
+	}
+}
+
+
+static int linearLookup(classrule_t *rules, int from, int to, classkey_t *k)
+{
+	int i;
+
+	for (i = from; i < to; i++)
+		if (matchClassRule(&rules[i], k))
+			return i;
+	return -1;
+}
+
+
+static double nowNanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Checks the results against the linear scan and reports ns/lookup for
+ * both. The first half of the rules forms the first list.
+ */
+static int benchRules(int nrules)
+{
+	classrule_t *rules = malloc(nrules * sizeof(classrule_t));
+	classkey_t *keys = malloc(NKEYS * sizeof(classkey_t));
+	tuplespace_t *ts;
+	double t0, tss, lin;
+	int i, j, rounds, bad = 0, sink = 0, half = nrules / 2, match[TSS_LISTS];
+
+	for (i = 0; i < nrules; i++)
+		makeRule(&rules[i], i);
+	for (i = 0; i < NKEYS; i++)
+		makeKey(&keys[i], rules, nrules);
+	if ((ts = createTupleSpace(rules, nrules, half)) == NULL)
+		return 1;
+
+	for (i = 0; i < NKEYS; i++)
+	{
+		lookupTupleSpace(ts, &keys[i], match);
+		if ((match[0] != linearLookup(rules, 0, half, &keys[i])) ||
+		    (match[1] != linearLookup(rules, half, nrules, &keys[i])))
+			bad++;
+	}
+
+	rounds = max(1, 1000000 / NKEYS);
+	t0 = nowNanos();
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < NKEYS; i++)
+		{
+			lookupTupleSpace(ts, &keys[i], match);
+			sink += match[0] + match[1];
+		}
+	tss = (nowNanos() - t0) / ((double)rounds * NKEYS);
+
+	rounds = max(1, rounds * 10 / nrules);
+	t0 = nowNanos();
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < NKEYS; i++)
+			sink += linearLookup(rules, 0, half, &keys[i]) + linearLookup(rules, half, nrules, &keys[i]);
+	lin = (nowNanos() - t0) / ((double)rounds * NKEYS);
+
+	printf("%6d rules %3d tuples%s: tuple space %8.1f ns/packet, linear %10.1f ns/packet (%d)\n",
+		nrules, ts->ntuples, ts->linear ? " (scanned)" : "", tss, lin, sink & 1);
+	destroyTupleSpace(ts);
+	free(rules);
+	free(keys);
+	return bad;
+}
+
+
+TESTSUITE_BEGIN
+
+srand(1);
+
+TEST_BEGIN("Empty tuple space matches nothing")
+classkey_t k;
+int match[TSS_LISTS];
+tuplespace_t *ts = createTupleSpace(NULL, 0, 0);
+memset(&k, 0, sizeof(k));
+CHECK(ts != NULL);
+lookupTupleSpace(ts, &k, match);
+CHECK((match[0] == -1) && (match[1] == -1));
+destroyTupleSpace(ts);
+TEST_END
+
+TEST_BEGIN("First rule of each list wins across tuples")
+classrule_t r[3];
+classkey_t k;
+int match[TSS_LISTS];
+tuplespace_t *ts;
+makeRule(&r[0], 0);
+r[0].srcmask = r[0].srcaddr = 0;
+r[0].dstmask = prefixMask(16);
+r[0].dstaddr = htonl(0x0a010000);
+r[0].prot = 6;
+r[0].dportlo = 80; r[0].dporthi = 89; r[0].needports = 1;
+r[1] = r[0];
+r[1].dstmask = prefixMask(32);
+r[1].dstaddr = htonl(0x0a010203);
+r[1].dportlo = r[1].dporthi = 80;
+r[2] = r[1];
+ts = createTupleSpace(r, 3, 2);
+k.src = htonl(0x0b000001); k.dst = htonl(0x0a010203);
+k.prot = 6; k.tos = 0; k.sport = 5000; k.dport = 80; k.hasports = 1;
+lookupTupleSpace(ts, &k, match);
+CHECK((match[0] == 0) && (match[1] == 2));
+k.dport = 90;
+lookupTupleSpace(ts, &k, match);
+CHECK((match[0] == -1) && (match[1] == -1));
+k.dport = 85; k.hasports = 0;
+lookupTupleSpace(ts, &k, match);
+CHECK((match[0] == -1) && (match[1] == -1));
+destroyTupleSpace(ts);
+TEST_END
+
+TEST_BEGIN("Agrees with a linear scan at 10 rules")
+CHECK(benchRules(10) == 0);
+TEST_END
+
+TEST_BEGIN("Agrees with a linear scan at 1000 rules")
+CHECK(benchRules(1000) == 0);
+TEST_END
+
+TEST_BEGIN("Agrees with a linear scan at 10000 rules")
+CHECK(benchRules(10000) == 0);
+TEST_END
+
+TESTSUITE_END